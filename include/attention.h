@@ -0,0 +1,285 @@
+#pragma once
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+#include "kv_cache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace musicgen {
+
+//-------------------------------------
+// LayerNorm, fused with the residual add
+//-------------------------------------
+// LayerNorm over the feature dim with its weight and bias packed into one
+// wb [D, 2] F32 tensor (LMStore does this at load time). The arithmetic is
+// ggml_norm's (double sums, float scale) followed by the affine, so results
+// agree with the unfused ggml_norm + mul + add to rounding.
+inline void layer_norm_row(const float* x, const float* wb, int64_t D, float eps, float* out) {
+    double sum = 0.0;
+    for (int64_t d = 0; d < D; ++d) sum += (double)x[d];
+    const float mean = (float)(sum / D);
+    double sum2 = 0.0;
+    for (int64_t d = 0; d < D; ++d) {
+        const float v = x[d] - mean;
+        out[d] = v;
+        sum2  += (double)(v * v);
+    }
+    const float scale = 1.0f / std::sqrt((float)(sum2 / D) + eps);
+    const float* w = wb;
+    const float* b = wb + D;
+    for (int64_t d = 0; d < D; ++d) out[d] = out[d] * scale * w[d] + b[d];
+}
+
+// Custom op: dst = LayerNorm(x), columns split across threads.
+// userdata: the epsilon (const float*)
+inline void layer_norm_op(ggml_tensor* dst, const ggml_tensor* x, const ggml_tensor* wb,
+                          int ith, int nth, void* userdata) {
+    const float   eps = *(const float*)userdata;
+    const int64_t D   = dst->ne[0];
+    for (int64_t i = ith; i < dst->ne[1]; i += nth) {
+        layer_norm_row((const float*)((const char*)x->data + i * x->nb[1]), (const float*)wb->data, D, eps,
+                       (float*)((char*)dst->data + i * dst->nb[1]));
+    }
+}
+
+// Custom op: x += y, then dst = LayerNorm(x), one pass per column. This is
+// the residual add after a block's output GEMM and the next block's input
+// norm as one dispatch: y is read once and the sum is normed while still in
+// cache. x is the residual stream and is updated in place, as
+// ggml_add_inplace would; nothing reads it before the next fused op.
+// userdata: the epsilon (const float*)
+inline void add_layer_norm_op(ggml_tensor* dst, const ggml_tensor* y, const ggml_tensor* x,
+                              const ggml_tensor* wb, int ith, int nth, void* userdata) {
+    const float   eps = *(const float*)userdata;
+    const int64_t D   = dst->ne[0];
+    for (int64_t i = ith; i < dst->ne[1]; i += nth) {
+        float*       xi = (float*)((char*)x->data + i * x->nb[1]);
+        const float* yi = (const float*)((const char*)y->data + i * y->nb[1]);
+        for (int64_t d = 0; d < D; ++d) xi[d] += yi[d];
+        layer_norm_row(xi, (const float*)wb->data, D, eps, (float*)((char*)dst->data + i * dst->nb[1]));
+    }
+}
+
+// LayerNorm of x [D, N] (F32, contiguous rows). `eps` must outlive the
+// graph; the LM passes its config's.
+inline ggml_tensor* layer_norm(ggml_context* ctx, ggml_tensor* x, ggml_tensor* wb, const float* eps) {
+    GGML_ASSERT(x->type == GGML_TYPE_F32 && wb->type == GGML_TYPE_F32 && wb->ne[0] == x->ne[0]);
+    return ggml_map_custom2(ctx, x, wb, layer_norm_op, GGML_N_TASKS_MAX, const_cast<float*>(eps));
+}
+
+// x += y, then LayerNorm(x). y [D, N] is typically a GEMM output.
+inline ggml_tensor* add_layer_norm(ggml_context* ctx, ggml_tensor* x, ggml_tensor* y,
+                                   ggml_tensor* wb, const float* eps) {
+    GGML_ASSERT(x->type == GGML_TYPE_F32 && y->type == GGML_TYPE_F32 && ggml_are_same_shape(x, y));
+    GGML_ASSERT(wb->type == GGML_TYPE_F32 && wb->ne[0] == x->ne[0]);
+    return ggml_map_custom3(ctx, y, x, wb, add_layer_norm_op, GGML_N_TASKS_MAX, const_cast<float*>(eps));
+}
+
+// Rows [r0, r0 + n) of a PyTorch [out, in] weight (ggml ne = {in, out}).
+// Used to address the q / k / v parts of a packed in_proj_weight.
+inline ggml_tensor* weight_rows(ggml_context* ctx, ggml_tensor* w, int64_t r0, int64_t n) {
+    return ggml_view_2d(ctx, w, w->ne[0], n, w->nb[1], r0 * w->nb[1]);
+}
+
+// audiocraft's create_sin_embedding for positions p0 .. p0 + n - 1, written
+// column by column into dst [dim, n]: cos in the first half, sin in the second.
+inline void sin_embedding(float* dst, int64_t dim, int64_t p0, int64_t n, float max_period = 10000.0f) {
+    const int64_t half = dim / 2;
+    for (int64_t i = 0; i < n; ++i) {
+        float* col = dst + i * dim;
+        for (int64_t j = 0; j < half; ++j) {
+            const double phase = (double)(p0 + i) / std::pow((double)max_period, (double)j / (half - 1));
+            col[j]        = (float)std::cos(phase);
+            col[half + j] = (float)std::sin(phase);
+        }
+    }
+}
+
+// [D, n] -> [hd, n, n_head]: one matrix per head, for batched attention GEMMs.
+inline ggml_tensor* split_heads(ggml_context* ctx, ggml_tensor* x, int n_head) {
+    const int64_t hd = x->ne[0] / n_head;
+    ggml_tensor* x3 = ggml_view_3d(ctx, x, hd, n_head, x->ne[1], hd * x->nb[0], x->nb[1], 0);
+    return ggml_permute(ctx, x3, 0, 2, 1, 3);
+}
+
+// [hd, n, n_head] -> [D, n]
+inline ggml_tensor* merge_heads(ggml_context* ctx, ggml_tensor* x) {
+    const int64_t D = x->ne[0] * x->ne[2];
+    const int64_t n = x->ne[1];
+    return ggml_reshape_2d(ctx, ggml_cont(ctx, ggml_permute(ctx, x, 0, 2, 1, 3)), D, n);
+}
+
+//-------------------------------------
+// Flash attention over the paged cache
+//-------------------------------------
+// Causal attention of a sequence's n_tok new queries against every cached
+// position of its slot, reading K / V straight from the pool rows (F16 or
+// F32) without ever forming the [n_kv, n_tok] score matrix:
+//   - work is split into (head, tile of kTileQ queries) tasks;
+//   - keys and values are visited in tiles of kTileK positions, each
+//     converted to F32 once and then used by every query of the task;
+//   - each query keeps a running max m, normalizer l and accumulator acc,
+//     rescaled as larger scores appear (online softmax), so memory traffic
+//     is linear in the context length;
+//   - q.k goes through ggml's F32 vec_dot (its SIMD kernels, several
+//     accumulators), since a plain float reduction is never vectorized
+//     without -ffast-math; the element-wise rescale and p.v loops are.
+//
+// q:    [hd, n_head, n_tok] queries
+// rows: [n_kv] I32 pool rows of positions 0 .. n_kv - 1; the queries are
+//       positions n_kv - n_tok .. n_kv - 1
+// kc:   [D, pool rows] key pool
+// userdata: the value pool (ggml_tensor*), laid out like kc
+// dst:  [hd, n_head, n_tok]
+inline void flash_attention_op(ggml_tensor* dst, const ggml_tensor* q, const ggml_tensor* rows,
+                               const ggml_tensor* kc, int ith, int nth, void* userdata) {
+    constexpr int64_t kTileQ = 16;
+    constexpr int64_t kTileK = 32;
+
+    const ggml_tensor* vc = (const ggml_tensor*)userdata;
+    const int64_t hd     = q->ne[0];
+    const int64_t n_head = q->ne[1];
+    const int64_t n_tok  = q->ne[2];
+    const int64_t n_kv   = rows->ne[0];
+    const int64_t n_past = n_kv - n_tok;
+    const float   scale  = 1.0f / std::sqrt((float)hd);
+    const int32_t* row   = (const int32_t*)rows->data;
+    const ggml_vec_dot_t vec_dot = ggml_get_type_traits_cpu(GGML_TYPE_F32)->vec_dot;
+
+    // head h of pool position p, as F32
+    auto load = [&](const ggml_tensor* pool, int64_t p, int64_t h, float* out) {
+        const char* src = (const char*)pool->data + row[p] * pool->nb[1] + h * hd * ggml_type_size(pool->type);
+        if (pool->type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t*)src, out, hd);
+        } else {
+            std::memcpy(out, src, hd * sizeof(float));
+        }
+    };
+
+    std::vector<float> qs(kTileQ * hd), acc(kTileQ * hd), kt(kTileK * hd), vt(kTileK * hd);
+    std::vector<float> m(kTileQ), l(kTileQ), sc(kTileK);
+
+    const int64_t n_qtiles = (n_tok + kTileQ - 1) / kTileQ;
+    for (int64_t task = ith; task < n_head * n_qtiles; task += nth) {
+        const int64_t h  = task % n_head;
+        const int64_t i0 = task / n_head * kTileQ;
+        const int64_t nq = std::min(kTileQ, n_tok - i0);
+
+        for (int64_t i = 0; i < nq; ++i) {
+            const float* src = (const float*)((const char*)q->data + (i0 + i) * q->nb[2] + h * q->nb[1]);
+            for (int64_t d = 0; d < hd; ++d) qs[i * hd + d] = src[d] * scale;
+        }
+        std::fill(acc.begin(), acc.begin() + nq * hd, 0.0f);
+        std::fill(m.begin(), m.end(), -INFINITY);
+        std::fill(l.begin(), l.end(), 0.0f);
+
+        // the last query of the tile sees positions up to n_past + i0 + nq - 1
+        const int64_t n_seen = n_past + i0 + nq;
+        for (int64_t j0 = 0; j0 < n_seen; j0 += kTileK) {
+            const int64_t nk = std::min(kTileK, n_seen - j0);
+            for (int64_t j = 0; j < nk; ++j) {
+                load(kc, j0 + j, h, kt.data() + j * hd);
+                load(vc, j0 + j, h, vt.data() + j * hd);
+            }
+
+            for (int64_t i = 0; i < nq; ++i) {
+                const int64_t n_vis = std::min(nk, n_past + i0 + i + 1 - j0); // causal mask
+                if (n_vis <= 0) continue;
+                const float* qi = qs.data() + i * hd;
+
+                float m_tile = -INFINITY;
+                for (int64_t j = 0; j < n_vis; ++j) {
+                    const float* kj = kt.data() + j * hd;
+                    float dot;
+                    vec_dot((int)hd, &dot, 0, qi, 0, kj, 0, 1);
+                    sc[j]  = dot;
+                    m_tile = std::max(m_tile, dot);
+                }
+
+                const float m_new = std::max(m[i], m_tile);
+                const float c     = std::exp(m[i] - m_new); // 0 on the first tile
+                float*      ai    = acc.data() + i * hd;
+                float       li    = l[i] * c;
+                for (int64_t d = 0; d < hd; ++d) ai[d] *= c;
+                for (int64_t j = 0; j < n_vis; ++j) {
+                    const float  pj = std::exp(sc[j] - m_new);
+                    const float* vj = vt.data() + j * hd;
+                    li += pj;
+                    for (int64_t d = 0; d < hd; ++d) ai[d] += pj * vj[d];
+                }
+                m[i] = m_new;
+                l[i] = li;
+            }
+        }
+
+        for (int64_t i = 0; i < nq; ++i) {
+            float* out = (float*)((char*)dst->data + (i0 + i) * dst->nb[2] + h * dst->nb[1]);
+            const float inv = 1.0f / l[i];
+            for (int64_t d = 0; d < hd; ++d) out[d] = acc[i * hd + d] * inv;
+        }
+    }
+}
+
+// Causal self-attention of one sequence against its paged cache slot.
+//
+// q, k, v are this step's projections [D, n_tok] (possibly strided views of
+// a packed qkv result). k and v are written to the pool rows in `store`
+// (the slot's positions [n_past, n_past + n_tok)); the stores are expanded
+// into `gf` right away so they run before the attention that reads the slot.
+// `rows` [n_kv] (I32) lists the pool rows of positions 0 .. n_kv - 1, which
+// flash_attention_op reads in place. Returns [D, n_tok].
+inline ggml_tensor* self_attention(ggml_context* ctx, ggml_cgraph* gf,
+                                   const KVCache& cache, int il,
+                                   ggml_tensor* q, ggml_tensor* k, ggml_tensor* v,
+                                   int n_head, const std::vector<CacheRun>& store, ggml_tensor* rows) {
+    const int64_t D     = q->ne[0];
+    const int64_t hd    = D / n_head;
+    const int64_t n_tok = q->ne[1];
+
+    ggml_tensor* kc = cache.k(il); // [D, pool rows]
+    ggml_tensor* vc = cache.v(il); // [D, pool rows]
+
+    int64_t col = 0;
+    for (const CacheRun& run : store) {
+        for (auto [src, dst] : {std::pair{k, kc}, std::pair{v, vc}}) {
+            ggml_tensor* from = ggml_view_2d(ctx, src, D, run.n, src->nb[1], col * src->nb[1]);
+            ggml_tensor* to   = ggml_view_2d(ctx, dst, D, run.n, dst->nb[1], run.row * dst->nb[1]);
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, from, to));
+        }
+        col += run.n;
+    }
+
+    ggml_tensor* Q = ggml_view_3d(ctx, q, hd, n_head, n_tok, hd * q->nb[0], q->nb[1], 0);
+    ggml_tensor* out = ggml_map_custom3(ctx, Q, rows, kc, flash_attention_op, GGML_N_TASKS_MAX, vc);
+    return ggml_reshape_2d(ctx, out, D, n_tok);
+}
+
+// Attention of one sequence's q [D, n_tok] over the conditioning K / V its
+// slot holds in the cache (see LM::set_condition). n_src is the number of
+// conditioning tokens to read. Returns [D, n_tok].
+inline ggml_tensor* cross_attention(ggml_context* ctx, const KVCache& cache, int il, int slot,
+                                    ggml_tensor* q, int n_head, int n_src) {
+    const int64_t hd = q->ne[0] / n_head;
+
+    ggml_tensor* xk = cache.xk(il); // [D, n_cond, n_seq]
+    ggml_tensor* xv = cache.xv(il); // [n_cond, D, n_seq]
+
+    ggml_tensor* Q = split_heads(ctx, q, n_head);                       // [hd, n_tok, n_head]
+    ggml_tensor* K = ggml_view_3d(ctx, xk, hd, n_src, n_head,
+                                  xk->nb[1], hd * xk->nb[0], slot * xk->nb[2]); // [hd, n_src, n_head]
+    ggml_tensor* V = ggml_view_3d(ctx, xv, n_src, hd, n_head,
+                                  xv->nb[1], hd * xv->nb[1], slot * xv->nb[2]); // [n_src, hd, n_head]
+
+    ggml_tensor* kq = ggml_mul_mat(ctx, K, Q);                          // [n_src, n_tok, n_head]
+    kq = ggml_soft_max_ext(ctx, kq, nullptr, 1.0f / std::sqrt((float)hd), 0.0f);
+
+    return merge_heads(ctx, ggml_mul_mat(ctx, V, kq));                  // [D, n_tok]
+}
+
+}
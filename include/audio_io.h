@@ -0,0 +1,398 @@
+#pragma once
+
+#include "ggml.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace encodec {
+
+//-------------------------------------
+// Audio front-end
+//-------------------------------------
+// Turns WAV files into what the Encoder takes: mono float samples at the
+// model rate, written straight into its (T, 1, 1) input tensor. The file is
+// memory-mapped and converted a chunk at a time (deinterleave, downmix and
+// integer-to-float in one pass), then resampled by a polyphase FIR.
+
+enum class SampleFormat { PCM16, PCM24, F32 };
+
+struct WavInfo {
+    int          sample_rate = 0;
+    int          n_channels  = 0;
+    SampleFormat format      = SampleFormat::PCM16;
+    int64_t      n_frames    = 0; // samples per channel
+};
+
+// Average the channels of n interleaved frames into out, scaled to [-1, 1).
+inline void downmix(const uint8_t* src, SampleFormat fmt, int n_channels, int64_t n, float* out) {
+    int64_t i = 0;
+    switch (fmt) {
+    case SampleFormat::PCM16: {
+        const float scale = 1.0f / (32768.0f * n_channels);
+#if defined(__AVX2__)
+        if (n_channels == 1) {
+            for (; i + 16 <= n; i += 16) {
+                const __m256i v = _mm256_loadu_si256((const __m256i*)(src + i * 2));
+                const __m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(v));
+                const __m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(v, 1));
+                _mm256_storeu_ps(out + i,     _mm256_mul_ps(_mm256_cvtepi32_ps(lo), _mm256_set1_ps(scale)));
+                _mm256_storeu_ps(out + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(hi), _mm256_set1_ps(scale)));
+            }
+        } else if (n_channels == 2) {
+            // madd against ones sums each L/R pair into one int32, in order
+            for (; i + 8 <= n; i += 8) {
+                const __m256i v = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+                const __m256i s = _mm256_madd_epi16(v, _mm256_set1_epi16(1));
+                _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(s), _mm256_set1_ps(scale)));
+            }
+        }
+#endif
+        for (; i < n; ++i) {
+            int32_t acc = 0;
+            for (int c = 0; c < n_channels; ++c) {
+                int16_t s;
+                std::memcpy(&s, src + (i * n_channels + c) * 2, 2);
+                acc += s;
+            }
+            out[i] = (float)acc * scale;
+        }
+        break;
+    }
+    case SampleFormat::PCM24: {
+        const float scale = 1.0f / (8388608.0f * n_channels);
+        for (; i < n; ++i) {
+            int32_t acc = 0;
+            for (int c = 0; c < n_channels; ++c) {
+                const uint8_t* p = src + (i * n_channels + c) * 3;
+                const uint32_t u = (uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24;
+                acc += (int32_t)u >> 8;
+            }
+            out[i] = (float)acc * scale;
+        }
+        break;
+    }
+    case SampleFormat::F32: {
+        if (n_channels == 1) {
+            std::memcpy(out, src, (std::size_t)n * sizeof(float));
+            return;
+        }
+        const float scale = 1.0f / n_channels;
+#if defined(__AVX2__)
+        if (n_channels == 2) {
+            // hadd leaves the frames as 0 1 4 5 | 2 3 6 7; permute restores them
+            for (; i + 8 <= n; i += 8) {
+                const __m256 a = _mm256_loadu_ps((const float*)src + i * 2);
+                const __m256 b = _mm256_loadu_ps((const float*)src + i * 2 + 8);
+                const __m256 s = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_hadd_ps(a, b)), 0xD8));
+                _mm256_storeu_ps(out + i, _mm256_mul_ps(s, _mm256_set1_ps(scale)));
+            }
+        }
+#endif
+        for (; i < n; ++i) {
+            float acc = 0.0f;
+            for (int c = 0; c < n_channels; ++c) {
+                float s;
+                std::memcpy(&s, src + (i * n_channels + c) * 4, 4);
+                acc += s;
+            }
+            out[i] = acc * scale;
+        }
+        break;
+    }
+    }
+}
+
+//-------------------------------------
+// Memory-mapped WAV file
+//-------------------------------------
+// RIFF/WAVE with PCM16, PCM24 or float32 samples (WAVE_FORMAT_EXTENSIBLE
+// included). Nothing is read up front beyond the headers; pages are
+// faulted in as frames are converted.
+class WavFile {
+public:
+    // nullptr (with a message on stderr) if the file cannot be used.
+    static std::unique_ptr<WavFile> open(const std::string& path) {
+        std::unique_ptr<MappedFile> file = MappedFile::open(path);
+        if (!file) return nullptr;
+        std::unique_ptr<WavFile> wav{new WavFile(std::move(file))};
+        if (!wav->parse()) {
+            std::fprintf(stderr, "%s: '%s' is not a PCM16, PCM24 or float WAV file\n", __func__, path.c_str());
+            return nullptr;
+        }
+        wav->file_->advise(MADV_SEQUENTIAL);
+        return wav;
+    }
+
+    const WavInfo& info() const noexcept { return info_; }
+
+    // Have the kernel start reading the file in the background, e.g. while
+    // the previous one is being encoded.
+    void prefetch() const { file_->advise(MADV_WILLNEED); }
+
+    // Downmix frames [f0, f0 + n) to mono floats.
+    void read_mono(int64_t f0, int64_t n, float* out) const {
+        downmix(data_ + f0 * frame_bytes_, info_.format, info_.n_channels, n, out);
+    }
+
+private:
+    explicit WavFile(std::unique_ptr<MappedFile> file) : file_{std::move(file)} {}
+
+    bool parse() {
+        const uint8_t* p   = file_->data();
+        const uint8_t* end = p + file_->size();
+        auto u16 = [](const uint8_t* q) { return (uint32_t)q[0] | (uint32_t)q[1] << 8; };
+        auto u32 = [&](const uint8_t* q) { return u16(q) | u16(q + 2) << 16; };
+        if (file_->size() < 12 || std::memcmp(p, "RIFF", 4) != 0 || std::memcmp(p + 8, "WAVE", 4) != 0) return false;
+
+        int bits = 0, tag = 0;
+        for (p += 12; p + 8 <= end;) {
+            const uint32_t n    = u32(p + 4);
+            const uint8_t* body = p + 8;
+            if (std::memcmp(p, "fmt ", 4) == 0 && n >= 16 && body + 16 <= end) {
+                tag                = (int)u16(body);
+                info_.n_channels   = (int)u16(body + 2);
+                info_.sample_rate  = (int)u32(body + 4);
+                bits               = (int)u16(body + 14);
+                if (tag == 0xFFFE && n >= 26 && body + 26 <= end) tag = (int)u16(body + 24); // sub-format GUID
+            } else if (std::memcmp(p, "data", 4) == 0) {
+                data_ = body;
+                // streaming writers leave the size at 0 or 0xFFFFFFFF
+                const std::size_t avail = (std::size_t)(end - body);
+                data_bytes_ = n == 0 || n > avail ? avail : n;
+                break;
+            }
+            if ((std::size_t)(end - body) < n) return false;
+            p = body + n + (n & 1);
+        }
+
+        if (!data_ || info_.n_channels <= 0 || info_.sample_rate <= 0) return false;
+        if (tag == 1 && bits == 16)      info_.format = SampleFormat::PCM16;
+        else if (tag == 1 && bits == 24) info_.format = SampleFormat::PCM24;
+        else if (tag == 3 && bits == 32) info_.format = SampleFormat::F32;
+        else return false;
+        frame_bytes_    = (std::size_t)info_.n_channels * bits / 8;
+        info_.n_frames  = (int64_t)(data_bytes_ / frame_bytes_);
+        return true;
+    }
+
+    std::unique_ptr<MappedFile> file_;
+    WavInfo                     info_;
+    const uint8_t*              data_        = nullptr;
+    std::size_t                 data_bytes_  = 0;
+    std::size_t                 frame_bytes_ = 0;
+};
+
+//-------------------------------------
+// Polyphase resampler
+//-------------------------------------
+// Rational in_rate -> out_rate conversion: conceptually upsample by L,
+// low-pass, keep every M-th sample, with L / M the reduced rate ratio. Only
+// the kept samples are computed, each as one 2 * half_taps dot product
+// with the filter phase it falls on. The Blackman-windowed sinc cuts off
+// at the lower of the two Nyquist rates, and every phase is normalised to
+// unit DC gain. Output is aligned with the input (no group delay) and
+// totals ceil(n_in * out_rate / in_rate) samples once flushed.
+class Resampler {
+public:
+    Resampler(int in_rate, int out_rate, int half_taps = 16)
+        : K_{2 * half_taps} {
+        const int g = std::gcd(in_rate, out_rate);
+        L_ = out_rate / g;
+        M_ = in_rate / g;
+        C_ = (int64_t)K_ * L_ / 2;
+
+        const double r = std::min(1.0, (double)L_ / M_);
+        coefs_.resize((std::size_t)L_ * K_);
+        for (int p = 0; p < L_; ++p) {
+            float* h = coefs_.data() + (std::size_t)p * K_;
+            double sum = 0.0;
+            for (int k = 0; k < K_; ++k) {
+                // tap k of phase p weighs input i - k; store reversed so the
+                // dot product runs over ascending input
+                const double u = ((double)p + (double)k * L_ - C_) / L_; // offset in input samples
+                const double x = M_PI * r * u;
+                const double w = 0.42 + 0.5 * std::cos(2.0 * M_PI * u / K_) + 0.08 * std::cos(4.0 * M_PI * u / K_);
+                const double v = (x == 0.0 ? 1.0 : std::sin(x) / x) * w;
+                h[K_ - 1 - k] = (float)v;
+                sum += v;
+            }
+            for (int k = 0; k < K_; ++k) h[k] = (float)(h[k] / sum);
+        }
+        buf_.assign(K_, 0.0f); // inputs -K .. -1 are silence
+    }
+
+    // Output samples for n_in input samples, once flushed.
+    static int64_t output_length(int64_t n_in, int in_rate, int out_rate) {
+        return (n_in * out_rate + in_rate - 1) / in_rate;
+    }
+
+    // Upper bound on what one process(n) or flush() call writes.
+    int64_t max_output(int64_t n) const { return (n + K_) * L_ / M_ + 1; }
+
+    // Feed n input samples; writes the outputs they complete and returns
+    // how many.
+    int64_t process(const float* in, int64_t n, float* out) {
+        buf_.insert(buf_.end(), in, in + n);
+        n_in_ += n;
+        return run(out, INT64_MAX);
+    }
+
+    // End of input: pad with silence and write the remaining outputs.
+    int64_t flush(float* out) {
+        buf_.insert(buf_.end(), (std::size_t)K_, 0.0f);
+        return run(out, (n_in_ * L_ + M_ - 1) / M_);
+    }
+
+private:
+    int64_t run(float* out, int64_t limit) {
+        const int64_t end = base_ + (int64_t)buf_.size();
+        int64_t n = 0;
+        for (; n_out_ < limit; ++n_out_, ++n) {
+            const int64_t t = n_out_ * M_ + C_;
+            const int64_t i = t / L_;
+            if (i >= end) break;
+            out[n] = dot(coefs_.data() + (t % L_) * K_, buf_.data() + (i - K_ + 1 - base_));
+        }
+        // keep what the next output still reads
+        const int64_t keep_from = (n_out_ * M_ + C_) / L_ - K_ + 1;
+        const int64_t drop = std::min<int64_t>(keep_from - base_, (int64_t)buf_.size());
+        if (drop > 0) {
+            buf_.erase(buf_.begin(), buf_.begin() + drop);
+            base_ += drop;
+        }
+        return n;
+    }
+
+    float dot(const float* h, const float* x) const {
+        int   k   = 0;
+        float acc = 0.0f;
+#if defined(__AVX2__) && defined(__FMA__)
+        __m256 s = _mm256_setzero_ps();
+        for (; k + 8 <= K_; k += 8) s = _mm256_fmadd_ps(_mm256_loadu_ps(h + k), _mm256_loadu_ps(x + k), s);
+        const __m128 q = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+        const __m128 d = _mm_add_ps(q, _mm_movehl_ps(q, q));
+        acc = _mm_cvtss_f32(_mm_add_ss(d, _mm_shuffle_ps(d, d, 1)));
+#else
+        // independent partial sums, so the compiler can keep them in
+        // vector lanes without reassociating a single chain
+        float a[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        for (; k + 4 <= K_; k += 4) {
+            for (int j = 0; j < 4; ++j) a[j] += h[k + j] * x[k + j];
+        }
+        acc = (a[0] + a[1]) + (a[2] + a[3]);
+#endif
+        for (; k < K_; ++k) acc += h[k] * x[k];
+        return acc;
+    }
+
+    int                K_;
+    int                L_ = 1;
+    int                M_ = 1;
+    int64_t            C_ = 0;      // filter centre, in upsampled samples
+    std::vector<float> coefs_;      // [L][K]
+    std::vector<float> buf_;        // inputs base_ .. base_ + size - 1
+    int64_t            base_  = -K_;
+    int64_t            n_in_  = 0;
+    int64_t            n_out_ = 0;
+};
+
+//-------------------------------------
+// Chunked reader
+//-------------------------------------
+// Streams a WavFile as mono samples at `sample_rate`, chunk_frames input
+// frames per read(). Without a rate change the chunk is converted straight
+// into the caller's buffer.
+class AudioReader {
+public:
+    AudioReader(const WavFile& wav, int sample_rate, int64_t chunk_frames = 8192)
+        : wav_{wav}, rate_{sample_rate}, chunk_{chunk_frames} {
+        if (wav.info().sample_rate != sample_rate) {
+            resampler_ = std::make_unique<Resampler>(wav.info().sample_rate, sample_rate);
+            scratch_.resize((std::size_t)chunk_frames);
+        }
+    }
+
+    // Samples all reads together produce.
+    int64_t n_samples() const {
+        return Resampler::output_length(wav_.info().n_frames, wav_.info().sample_rate, rate_);
+    }
+
+    // Buffer size read() needs.
+    int64_t max_chunk() const { return resampler_ ? resampler_->max_output(chunk_) : chunk_; }
+
+    // Write the next samples to out (room for max_chunk()); 0 at the end.
+    int64_t read(float* out) {
+        const int64_t n = std::min(chunk_, wav_.info().n_frames - pos_);
+        if (!resampler_) {
+            wav_.read_mono(pos_, n, out);
+            pos_ += n;
+            return n;
+        }
+        if (n == 0) {
+            if (flushed_) return 0;
+            flushed_ = true;
+            return resampler_->flush(out);
+        }
+        wav_.read_mono(pos_, n, scratch_.data());
+        pos_ += n;
+        return resampler_->process(scratch_.data(), n, out);
+    }
+
+private:
+    const WavFile&             wav_;
+    int                        rate_;
+    int64_t                    chunk_;
+    int64_t                    pos_     = 0;
+    bool                       flushed_ = false;
+    std::unique_ptr<Resampler> resampler_;
+    std::vector<float>         scratch_;
+};
+
+/**
+ * Load a whole WAV file as an Encoder input.
+ * @param ctx          Context the (T, 1, 1) F32 tensor is allocated in, e.g.
+ *                     the request's ExecState (size it with
+ *                     Encoder::arena_size(wav_samples(...))).
+ * @param sample_rate  Model rate to resample to.
+ * @return             The filled input tensor.
+ */
+inline ggml_tensor* load_wav(ggml_context* ctx, const WavFile& wav, int sample_rate) {
+    AudioReader reader{wav, sample_rate};
+    const int64_t n = reader.n_samples();
+    ggml_tensor* input = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n, 1, 1);
+    float* dst = (float*)input->data;
+
+    // reads land in the tensor; only the last may overrun its end
+    std::vector<float> tail;
+    int64_t done = 0;
+    for (;;) {
+        const bool room = n - done >= reader.max_chunk();
+        if (!room) tail.resize((std::size_t)reader.max_chunk());
+        const int64_t got = reader.read(room ? dst + done : tail.data());
+        if (got == 0) break;
+        if (!room) std::memcpy(dst + done, tail.data(), (std::size_t)std::min(got, n - done) * sizeof(float));
+        done += got;
+    }
+    GGML_ASSERT(done == n);
+    return input;
+}
+
+// Samples load_wav() produces for a file at `sample_rate`.
+inline int64_t wav_samples(const WavFile& wav, int sample_rate) {
+    return Resampler::output_length(wav.info().n_frames, wav.info().sample_rate, sample_rate);
+}
+
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace encodec {
+
+using Clock = std::chrono::steady_clock;
+
+struct BatcherConfig {
+    std::size_t               max_batch = 8;     // requests per batch
+    std::chrono::microseconds max_wait{2000};    // latency budget of the oldest request
+};
+
+//-------------------------------------
+// Serving counters
+//-------------------------------------
+// Batch-size histogram plus a window of recent request latencies for
+// p50/p99. Thread-safe; snapshot() is cheap enough to serve on request.
+class BatchStats {
+public:
+    struct Snapshot {
+        uint64_t              n_requests = 0;
+        uint64_t              n_batches  = 0;
+        std::vector<uint64_t> batch_hist;        // batch_hist[n] = batches of size n
+        double                p50_ms = 0.0;
+        double                p99_ms = 0.0;
+    };
+
+    explicit BatchStats(std::size_t max_batch, std::size_t window = 4096)
+        : hist_(max_batch + 1, 0), window_(window) {
+        latencies_us_.reserve(window_);
+    }
+
+    void record_batch(std::size_t n) {
+        std::lock_guard<std::mutex> lk(mu_);
+        ++n_batches_;
+        hist_[std::min(n, hist_.size() - 1)]++;
+    }
+
+    void record_latency(Clock::duration d) {
+        const auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        std::lock_guard<std::mutex> lk(mu_);
+        ++n_requests_;
+        if (latencies_us_.size() < window_) {
+            latencies_us_.push_back(us);
+        } else {
+            latencies_us_[next_++ % window_] = us;
+        }
+    }
+
+    Snapshot snapshot() const {
+        Snapshot s;
+        std::vector<int64_t> lat;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            s.n_requests = n_requests_;
+            s.n_batches  = n_batches_;
+            s.batch_hist = hist_;
+            lat          = latencies_us_;
+        }
+        s.p50_ms = percentile(lat, 0.50);
+        s.p99_ms = percentile(lat, 0.99);
+        return s;
+    }
+
+private:
+    static double percentile(std::vector<int64_t>& v, double q) {
+        if (v.empty()) return 0.0;
+        const auto k = static_cast<std::size_t>(q * (v.size() - 1));
+        std::nth_element(v.begin(), v.begin() + k, v.end());
+        return v[k] / 1000.0;
+    }
+
+    mutable std::mutex    mu_;
+    uint64_t              n_requests_ = 0;
+    uint64_t              n_batches_  = 0;
+    std::vector<uint64_t> hist_;
+    std::vector<int64_t>  latencies_us_;
+    std::size_t           window_;
+    std::size_t           next_ = 0;
+};
+
+//-------------------------------------
+// Dynamic request batcher
+//-------------------------------------
+// Requests are pushed with a key; only requests with the same key are put in
+// one batch (e.g. same op and input length, so a batch is one dense tensor).
+// A batch is released once `max_batch` compatible requests are queued or the
+// oldest request has waited `max_wait`, whichever comes first.
+template <typename Request>
+class DynamicBatcher {
+public:
+    using Key = uint64_t;
+
+    explicit DynamicBatcher(BatcherConfig cfg) : cfg_{cfg} {}
+
+    void push(Request req, Key key) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            queue_.push_back({std::move(req), key, Clock::now(), next_seq_++});
+        }
+        cv_.notify_all();
+    }
+
+    // Blocks until a batch is ready. Returns an empty batch once the batcher
+    // is closed and drained.
+    std::vector<Request> next_batch() {
+        std::unique_lock<std::mutex> lk(mu_);
+        for (;;) {
+            cv_.wait(lk, [&] { return closed_ || !queue_.empty(); });
+            if (queue_.empty()) return {};
+
+            const Key      key      = queue_.front().key;
+            const uint64_t head     = queue_.front().seq;
+            const auto     deadline = queue_.front().enqueued + cfg_.max_wait;
+            while (!closed_ && count(key) < cfg_.max_batch && Clock::now() < deadline) {
+                cv_.wait_until(lk, deadline);
+                if (queue_.empty() || queue_.front().seq != head) break;
+            }
+            // Another worker took the head while we waited: start over.
+            if (queue_.empty() || queue_.front().seq != head) continue;
+
+            std::vector<Request> batch;
+            for (auto it = queue_.begin(); it != queue_.end() && batch.size() < cfg_.max_batch;) {
+                if (it->key == key) {
+                    batch.push_back(std::move(it->req));
+                    it = queue_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            return batch;
+        }
+    }
+
+    // Wakes every waiting worker; queued requests are still handed out.
+    void close() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            closed_ = true;
+        }
+        cv_.notify_all();
+    }
+
+    std::size_t depth() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return queue_.size();
+    }
+
+    const BatcherConfig& config() const noexcept { return cfg_; }
+
+private:
+    struct Item {
+        Request           req;
+        Key               key;
+        Clock::time_point enqueued;
+        uint64_t          seq;
+    };
+
+    std::size_t count(Key key) const {
+        return static_cast<std::size_t>(std::count_if(
+            queue_.begin(), queue_.end(), [&](const Item& i) { return i.key == key; }));
+    }
+
+    BatcherConfig           cfg_;
+    mutable std::mutex      mu_;
+    std::condition_variable cv_;
+    std::deque<Item>        queue_;
+    uint64_t                next_seq_ = 0;
+    bool                    closed_   = false;
+};
+
+}
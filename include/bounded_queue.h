@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace encodec {
+
+//-------------------------------------
+// Bounded blocking queue
+//-------------------------------------
+// push() waits while the queue is full, which is how a slow consumer slows
+// its producer down. After close(), push() fails and pop() drains what is
+// left, then returns nullopt.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(std::size_t capacity) : capacity_{std::max<std::size_t>(capacity, 1)} {}
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lk(mu_);
+        not_full_.wait(lk, [&] { return closed_ || items_.size() < capacity_; });
+        if (closed_) return false;
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lk(mu_);
+        not_empty_.wait(lk, [&] { return closed_ || !items_.empty(); });
+        if (items_.empty()) return std::nullopt;
+        T item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return item;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lk(mu_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+    std::size_t size() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return items_.size();
+    }
+
+private:
+    std::size_t             capacity_;
+    mutable std::mutex      mu_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T>           items_;
+    bool                    closed_ = false;
+};
+
+}
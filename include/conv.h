@@ -13,7 +13,7 @@ struct ggml_tensor * streamable_conv1d(
     int                   padding,
     int                   dilation) {
 
-    struct ggml_tensor * weights_f16;
+    struct ggml_tensor * weights_f16 = weights;
     // If weights are not FP16, convert to FP16
     if (weights->type != GGML_TYPE_F16) {
         int64_t ne0 = weights->ne[0]; // kernel_size
@@ -27,77 +27,76 @@ struct ggml_tensor * streamable_conv1d(
         for (int64_t i = 0; i < ne0 * ne1 * ne2; ++i) {
             dst[i] = ggml_fp32_to_fp16(src[i]);
         }
-
-        // weights = weights_f16;
     }
 
     struct ggml_tensor * conv_output = ggml_conv_1d(ctx, weights_f16, input, stride, padding, dilation);
 
     if (bias != NULL) {
     // Make bias a 3-D tensor [1, out_ch, 1] so its only non-unit dim
-    // lines up with conv_output->ne1
+    // lines up with conv_output->ne1; ggml_add broadcasts it, so no
+    // repeated copy of the bias is materialized.
         struct ggml_tensor * b3 =
             ggml_reshape_3d(ctx, bias, 1, bias->ne[0], 1);   // cheap: header only
 
-        struct ggml_tensor * b_rep = ggml_repeat(ctx, b3, conv_output);
-
-        conv_output = ggml_add(ctx, b_rep, conv_output);     // FP32 + FP32 → FP32
+        conv_output = ggml_add(ctx, conv_output, b3);        // FP32 + FP32 → FP32
     }
 
     return conv_output;
 }
 
 
-// weight normed conv1d
-struct ggml_tensor * streamable_conv1d_wn(
+// Fold weight norm into a plain FP16 conv weight: w = g * v / ||v||, with the
+// norm taken per output channel. Reads g and v eagerly, so call it once at
+// load time and keep the result next to the other weights.
+struct ggml_tensor * weight_norm_fold(
     struct ggml_context * ctx,
-    struct ggml_tensor  * input,      // [batch, in_ch, seq_len]
     struct ggml_tensor  * weight_g,   // [out_ch]
-    struct ggml_tensor  * weight_v,   // [ks, in_ch, out_ch]
-    struct ggml_tensor  * bias,       // [out_ch] or NULL
-    int                   stride,
-    int                   padding,
-    int                   dilation) {
+    struct ggml_tensor  * weight_v) { // [ks, in_ch, out_ch]
 
-    // dims
-    int64_t ks  = weight_v->ne[0];
-    int64_t ic  = weight_v->ne[1];
-    int64_t oc  = weight_v->ne[2];
+    const int64_t ks = weight_v->ne[0];
+    const int64_t ic = weight_v->ne[1];
+    const int64_t oc = weight_v->ne[2];
+    const int64_t n  = ks * ic;        // elements per output channel
 
-    // Allocate a float buffer for norm and w
-    float * gv = (float*) weight_g->data;      // length oc
-    float * vv = (float*) weight_v->data;      // length ks*ic*oc
+    const float * gv = (const float *) weight_g->data;
+    const float * vv = (const float *) weight_v->data;
 
-    float * norm = (float *)malloc(sizeof(float)*oc);
-    float * wdata = (float *)malloc(sizeof(float)*ks*ic*oc);
+    struct ggml_tensor * w = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, ks, ic, oc);
+    ggml_fp16_t * dst = (ggml_fp16_t *) w->data;
 
-    // Compute per‐channel norm
     for (int64_t j = 0; j < oc; ++j) {
+        const float * vj = vv + j * n;
         double sum2 = 0.0;
-        int64_t base = j;
-        for (int64_t i = 0; i < ks*ic; ++i) {
-            float v_ijk = vv[ i*oc + base ];
-            sum2 += (double)v_ijk * v_ijk;
+        for (int64_t i = 0; i < n; ++i) {
+            sum2 += (double)vj[i] * vj[i];
+        }
+        const float scale = gv[j] / (float)(sqrt(sum2) + 1e-6f);
+        for (int64_t i = 0; i < n; ++i) {
+            dst[j * n + i] = ggml_fp32_to_fp16(vj[i] * scale);
         }
-        norm[j] = sqrt(sum2) + 1e-6f;  // eps to avoid div0
     }
 
-    // Build normalized weight w = g * v / norm
-    for (int64_t idx = 0; idx < ks*ic*oc; ++idx) {
-        int64_t j = idx % oc;
-        wdata[idx] = gv[j] * ( vv[idx] / norm[j] );
-    }
+    return w;
+}
 
-    struct ggml_tensor * w_fp32 = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, ks, ic, oc);
-    memcpy(w_fp32->data, wdata, sizeof(float)*ks*ic*oc);
+// weight normed conv1d
+struct ggml_tensor * streamable_conv1d_wn(
+    struct ggml_context * ctx,
+    struct ggml_tensor  * input,      // [batch, in_ch, seq_len]
+    struct ggml_tensor  * weight_g,   // [out_ch]
+    struct ggml_tensor  * weight_v,   // [ks, in_ch, out_ch]
+    struct ggml_tensor  * bias,       // [out_ch] or NULL
+    int                   stride,
+    int                   padding,
+    int                   dilation) {
 
-    free(norm);
-    free(wdata);
+    // Fold the norm straight into an FP16 weight, no FP32 temporaries
+    struct ggml_tensor * w_f16 = weight_norm_fold(ctx, weight_g, weight_v);
 
     struct ggml_tensor * out = streamable_conv1d(
         ctx,
         input,
-        w_fp32,
+        w_f16,
         bias,
         stride,
         padding,
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace musicgen {
+
+//-------------------------------------
+// MusicGen delay pattern
+//-------------------------------------
+// Codebook k runs k steps behind codebook 0, so T frames take
+// T + n_q - 1 LM steps. At step s the LM is fed, for every codebook k, the
+// token of frame s - 1 - k, or the special token `card` where that frame
+// does not exist (yet); its output for codebook k is frame s - k.
+//
+// DelayPattern keeps the de-interleaved codes [frame][n_q] and does this
+// bookkeeping, so callers only see one n_q-wide token row per step.
+class DelayPattern {
+public:
+    DelayPattern(int n_q, int card, int n_frames)
+        : n_q_{n_q}, card_{card}, n_frames_{n_frames},
+          codes_((std::size_t)n_frames * n_q, card) {}
+
+    int n_q()      const noexcept { return n_q_; }
+    int n_frames() const noexcept { return n_frames_; }
+    int n_steps()  const noexcept { return n_frames_ + n_q_ - 1; }
+
+    // Fill `ids` (n_q entries) with the LM input of step s.
+    void input(int s, int32_t* ids) const {
+        for (int k = 0; k < n_q_; ++k) {
+            const int t = s - 1 - k;
+            ids[k] = valid(t) ? code(t, k) : card_;
+        }
+    }
+
+    // Whether codebook k's output at step s belongs to a frame.
+    bool produces(int s, int k) const { return valid(s - k); }
+
+    // Store the tokens sampled at step s (n_q entries); those outside the
+    // pattern or in prefilled frames are dropped.
+    void commit(int s, const int32_t* sampled) {
+        for (int k = 0; k < n_q_; ++k) {
+            if (produces(s, k) && s - k >= n_fixed_) codes_[(std::size_t)(s - k) * n_q_ + k] = sampled[k];
+        }
+    }
+
+    // Set frames [0, n) from existing codes (n x n_q), e.g. an audio prompt.
+    // The inputs of steps 0 .. n are then known and can be prefilled at once;
+    // step n is the first whose output has a frame left to generate.
+    void prefill(const int32_t* codes, int n) {
+        for (int i = 0; i < n * n_q_; ++i) codes_[i] = codes[i];
+        n_fixed_ = n;
+    }
+
+    int n_prefilled() const noexcept { return n_fixed_; }
+
+    // Frames whose every codebook has been generated after step s.
+    int frames_done(int s) const {
+        const int t = s - (n_q_ - 1) + 1;
+        return t < 0 ? 0 : (t > n_frames_ ? n_frames_ : t);
+    }
+
+    int32_t code(int t, int k) const { return codes_[(std::size_t)t * n_q_ + k]; }
+
+    // De-interleaved codes, n_frames x n_q.
+    const std::vector<int32_t>& codes() const noexcept { return codes_; }
+
+private:
+    bool valid(int t) const { return t >= 0 && t < n_frames_; }
+
+    int                  n_q_;
+    int                  card_;
+    int                  n_frames_;
+    int                  n_fixed_ = 0;
+    std::vector<int32_t> codes_;
+};
+
+}
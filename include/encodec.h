@@ -13,4 +13,5 @@ struct encodec_model {
 
     struct ggml_context *ctx;
     std::map<std::string, struct ggml_tensor *> tensors;
+    std::map<std::string, std::string> metadata;
 };
\ No newline at end of file
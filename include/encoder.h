@@ -5,12 +5,19 @@
 #include "seanet.h"
 #include "lstm.h"
 #include "quantizer.h"
+#include "rvq_search.h"
+#include "exec_state.h"
 #include "utils.h"
 
 #include <vector>
 #include <cassert>
+#include <memory>
 #include <utility>
 
+struct encodec_encoder_params {
+
+};
+
 namespace encodec {
 
 using Tensor = ggml_tensor;
@@ -20,6 +27,7 @@ struct Conv1dWeights {
     Tensor* g;      // g   ‑ [C]
     Tensor* v;      // v   ‑ [ks, in, out]
     Tensor* bias{}; // optional ‑ [C]
+    Tensor* w{};    // g * v / ||v|| folded to FP16, filled in by WeightStore
 };
 
 struct ResNetBlockWeights {
@@ -52,94 +60,306 @@ struct Weights {
     std::vector<QuantizerCodebook>  codebooks;
 };
 
+//-------------------------------------
+// Immutable weight store, shared by every worker
+//-------------------------------------
+class WeightStore {
+public:
+    // Takes ownership of `ctx`, the context the weight tensors live in.
+    // Weight norm is folded into FP16 conv weights once, here, so graph
+    // builds neither read weight data nor allocate per-request copies.
+    WeightStore(ggml_context* ctx, Weights w)
+        : ctx_{ctx}, w_{std::move(w)} {
+        std::vector<Conv1dWeights*> convs{&w_.first_conv};
+        for (auto& res : w_.resnet_blocks) {
+            convs.push_back(&res.bottleneck);
+            convs.push_back(&res.conv1x1);
+        }
+        for (auto& down : w_.downsample) convs.push_back(&down);
+
+        std::size_t fold_size = 0;
+        for (auto* c : convs) {
+            fold_size += ggml_tensor_overhead() + GGML_PAD(ggml_nelements(c->v) * sizeof(ggml_fp16_t), GGML_MEM_ALIGN);
+        }
+        ggml_init_params params{
+            .mem_size   = fold_size,
+            .mem_buffer = nullptr,
+            .no_alloc   = false
+        };
+        fold_ctx_ = ggml_init(params);
+        for (auto* c : convs) {
+            c->w = weight_norm_fold(fold_ctx_, c->g, c->v);
+        }
+
+        // Building a graph names unnamed leaf tensors in place. Name every
+        // weight up front so concurrent graph builds never write to them.
+        int i = 0;
+        for (ggml_context* c : {ctx_, fold_ctx_}) {
+            for (auto* t = ggml_get_first_tensor(c); t; t = ggml_get_next_tensor(c, t), ++i) {
+                if (ggml_get_name(t)[0] == '\0') ggml_format_name(t, "weight_%d", i);
+            }
+        }
+    }
+
+    ~WeightStore() {
+        if (ctx_) ggml_free(ctx_);
+        if (fold_ctx_) ggml_free(fold_ctx_);
+    }
+
+    WeightStore(const WeightStore&)            = delete;
+    WeightStore& operator=(const WeightStore&) = delete;
+
+    const Weights& weights() const noexcept { return w_; }
+
+    // Memory held by the weights (never grows after construction).
+    ContextUsage usage() const {
+        const std::size_t used = ggml_used_mem(ctx_) + ggml_used_mem(fold_ctx_);
+        return {ggml_get_mem_size(ctx_) + ggml_get_mem_size(fold_ctx_), used, used};
+    }
+
+private:
+    ggml_context* ctx_;          // owned
+    ggml_context* fold_ctx_{};   // owned, folded conv weights
+    Weights       w_;
+};
+
+//-------------------------------------
+// Codebooks without the encoder, for decode-only services
+//-------------------------------------
+class QuantizerStore {
+public:
+    // Takes ownership of `ctx`, the context the codebooks live in.
+    QuantizerStore(ggml_context* ctx, std::vector<QuantizerCodebook> codebooks)
+        : ctx_{ctx}, codebooks_{std::move(codebooks)} {
+        for (const auto& cb : codebooks_) quant_.blocks.push_back({cb.embed});
+    }
+
+    ~QuantizerStore() {
+        if (ctx_) ggml_free(ctx_);
+    }
+
+    QuantizerStore(const QuantizerStore&)            = delete;
+    QuantizerStore& operator=(const QuantizerStore&) = delete;
+
+    const std::vector<QuantizerCodebook>& codebooks() const noexcept { return codebooks_; }
+    const quantizer&                      quant()     const noexcept { return quant_; }
+
+    ContextUsage usage() const {
+        const std::size_t used = ggml_used_mem(ctx_);
+        return {ggml_get_mem_size(ctx_), used, used};
+    }
+
+private:
+    ggml_context*                  ctx_; // owned
+    std::vector<QuantizerCodebook> codebooks_;
+    quantizer                      quant_;
+};
+
 //-------------------------------------
 // The actual encoder
 //-------------------------------------
+// Stateless apart from the shared weights: every call builds its graph in the
+// caller's ExecState, so one Encoder can serve many threads at once.
+//
+// With an RvqIndex (built from the same codebooks) the residual VQ runs its
+// approximate search (rvq_search.h) instead of quantizer_encode.
 class Encoder {
 public:
-    Encoder(ggml_context* ctx, Weights w) noexcept
-        : ctx_{ctx}, w_{std::move(w)} {}
+    explicit Encoder(std::shared_ptr<const WeightStore> store,
+                     std::shared_ptr<const RvqIndex>    rvq = nullptr) noexcept
+        : store_{std::move(store)}, rvq_{std::move(rvq)} {}
 
     /**
-     * Encode a 3‑D input tensor (B, C=1, T).
+     * Encode a 3‑D input tensor (B, C=1, T). All B items must share T.
+     * @param state      Per-request execution state the graph is built in.
      * @param input      Input tensor (ownership not taken).
      * @param n_threads  How many CPU threads to use.
-     * @return           Pointer to the last node of the GGML graph (codes).
+     * @return           Codes tensor [T', n_q, B], valid until `state` is
+     *                   reset.
+     */
+    [[nodiscard]] Tensor* operator()(ExecState& state, Tensor* input, int n_threads = 4) const {
+        Tensor* codes = build_graph(state, input);
+        state.compute(n_threads);
+        return codes;
+    }
+
+    /**
+     * Encode into caller memory, e.g. a slot of an output ring: the graph's
+     * last op writes the codes to `out` (T' x n_q x B int32, time fastest)
+     * directly, with no copy out of the arena afterwards.
+     */
+    void operator()(ExecState& state, Tensor* input, int32_t* out, int n_threads = 4) const {
+        Tensor* codes = build_graph(state, input);
+        write_to(state, codes, out);
+        state.compute(n_threads);
+    }
+
+    /**
+     * The two halves of operator(), for timing the residual VQ on its own
+     * (tools/rvq_bench.cpp): hidden_states() runs SEANet and the LSTM and
+     * returns the hidden states [H, T', B]; quantize() turns them into codes
+     * [T', n_q, B], by quantizer_encode or, with an RvqIndex, its search.
+     * `hs` may live in another state than the codes.
      */
-    [[nodiscard]] Tensor* operator()(Tensor* input, int n_threads = 4) const {
-        auto* graph = build_graph(input);
-        ggml_graph_compute_with_ctx(ctx_, graph, n_threads);
-        return ggml_graph_node(graph, -1);
+    [[nodiscard]] Tensor* hidden_states(ExecState& state, Tensor* input, int n_threads = 4) const {
+        Tensor* hs = build_hidden(state, input);
+        state.compute(n_threads);
+        return hs;
+    }
+
+    [[nodiscard]] Tensor* quantize(ExecState& state, Tensor* hs, int n_threads = 4) const {
+        state.new_graph(GGML_DEFAULT_GRAPH_SIZE + (std::size_t)hs->ne[2] * store_->weights().codebooks.size() * 16);
+        Tensor* codes = build_codes(state, hs);
+        state.compute(n_threads);
+        return codes;
+    }
+
+    /**
+     * Exact arena an ExecState needs to encode a (B, C, T) input, including
+     * the input tensor itself when it is allocated in the same state.
+     * Measured by building the graph without allocating any data.
+     */
+    [[nodiscard]] std::size_t arena_size(int64_t n_samples, int64_t batch = 1, int n_threads = 4) const {
+        const int64_t channels = store_->weights().first_conv.v->ne[1];
+        ExecState m = ExecState::measuring(graph_size(n_samples, batch) * 2);
+        Tensor* input = ggml_new_tensor_3d(m.ctx(), GGML_TYPE_F32, n_samples, channels, batch);
+        write_to(m, build_graph(m, input), nullptr); // the caller-memory variant's extra op
+        return m.required_size(n_threads);
     }
 
 private:
-    ggml_context* ctx_; // not owned
-    Weights       w_;   // lightweight: just raw pointers
+    std::shared_ptr<const WeightStore> store_;
+    std::shared_ptr<const RvqIndex>    rvq_;
 
-    ggml_cgraph* build_graph(Tensor* x) const {
-        auto* gf = ggml_new_graph(ctx_);
+    // Upper bound on graph nodes: the LSTM is unrolled once per frame and
+    // every down-sampling stage halves the length.
+    std::size_t graph_size(int64_t n_samples, int64_t batch) const {
+        const Weights&    w      = store_->weights();
+        const std::size_t frames = ((std::size_t)n_samples >> w.downsample.size()) + 1;
+        return GGML_DEFAULT_GRAPH_SIZE + frames * 32 + (std::size_t)batch * w.codebooks.size() * 16;
+    }
 
-        // Initial 1‑D conv (weight‑norm)
-        x = streamable_conv1d_wn(ctx_, x,
-                                 w_.first_conv.g,
-                                 w_.first_conv.v,
-                                 w_.first_conv.bias,
-                                 /*stride*/1,
-                                 /*pad*/0,
-                                 /*dilation*/1);
+    static void write_to(ExecState& state, Tensor* codes, int32_t* out) {
+        Tensor* dst = state.external(GGML_TYPE_I32, codes->ne[0], codes->ne[1], codes->ne[2], out);
+        ggml_build_forward_expand(state.graph(), ggml_cpy(state.ctx(), codes, dst));
+    }
+
+    // Builds the graph in `state` and returns its output codes tensor.
+    // Reads no tensor data, so it also runs in a measuring state.
+    Tensor* build_graph(ExecState& state, Tensor* x) const {
+        return build_codes(state, build_hidden(state, x));
+    }
+
+    // SEANet and LSTM: the hidden states [H, T', B] the residual VQ reads.
+    Tensor* build_hidden(ExecState& state, Tensor* x) const {
+        ggml_context*  ctx = state.ctx();
+        const Weights& w   = store_->weights();
+        auto* gf = state.new_graph(graph_size(x->ne[0], x->ne[2]));
+
+        // Initial 1‑D conv (weight norm folded at load)
+        x = streamable_conv1d(ctx, x,
+                              w.first_conv.w,
+                              w.first_conv.bias,
+                              /*stride*/1,
+                              /*pad*/0,
+                              /*dilation*/1);
 
         // ResNet + down‑sampling stages
-        assert(w_.resnet_blocks.size() == w_.downsample.size());
-        for (std::size_t i = 0; i < w_.resnet_blocks.size(); ++i) {
-            const auto& res  = w_.resnet_blocks[i];
-            const auto& down = w_.downsample[i];
-
-            x = seanet_resnet_block(ctx_, x,
-                                    res.bottleneck.g,
-                                    res.bottleneck.v,
+        assert(w.resnet_blocks.size() == w.downsample.size());
+        for (std::size_t i = 0; i < w.resnet_blocks.size(); ++i) {
+            const auto& res  = w.resnet_blocks[i];
+            const auto& down = w.downsample[i];
+
+            x = seanet_resnet_block(ctx, x,
+                                    res.bottleneck.w,
                                     res.bottleneck.bias,
-                                    res.conv1x1.g,
-                                    res.conv1x1.v,
+                                    res.conv1x1.w,
                                     res.conv1x1.bias);
 
-            const int ks  = down.v->ne[0];
+            const int ks  = down.w->ne[0];
             const int pad = ks / 2;
-            x = streamable_conv1d_wn(ctx_, x,
-                                     down.g,
-                                     down.v,
-                                     down.bias,
-                                     /*stride*/2,
-                                     pad,
-                                     /*dilation*/1);
+            x = streamable_conv1d(ctx, x,
+                                  down.w,
+                                  down.bias,
+                                  /*stride*/2,
+                                  pad,
+                                  /*dilation*/1);
         }
 
         // --- LSTM unroll --------------------------------------
-        const int seq_len = x->ne[2];
-        Tensor* h_t = ggml_new_tensor_2d(ctx_, GGML_TYPE_F32, x->ne[1], 1);
-        Tensor* c_t = ggml_new_tensor_2d(ctx_, GGML_TYPE_F32, x->ne[1], 1);
+        // (T, C, B) -> (C, B, T): each step reads one [C, B] slab, so all B
+        // sequences advance with a single GEMM per LSTM weight.
+        const int64_t seq_len = x->ne[0];
+        const int64_t batch   = x->ne[2];
+        const int64_t hidden  = w.lstm.weight_hh->ne[0];
+        Tensor* xs = ggml_cont(ctx, ggml_permute(ctx, x, 2, 0, 1, 3));
 
-        for (int t = 0; t < seq_len; ++t) {
-            Tensor* x_t = ggml_view_1d(ctx_, x, x->ne[1], static_cast<size_t>(t) * x->ne[1]);
-            auto st = lstm_step(ctx_,
+        Tensor* h_t = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, hidden, batch);
+        Tensor* c_t = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, hidden, batch);
+        if (!state.is_measuring()) {
+            ggml_set_zero(h_t); // arenas are reused, so never rely on fresh memory
+            ggml_set_zero(c_t);
+        }
+
+        // Hidden state of every step, laid out (H, T, B) for the quantizer
+        Tensor* hs = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, hidden, seq_len, batch);
+
+        for (int64_t t = 0; t < seq_len; ++t) {
+            Tensor* x_t = ggml_view_2d(ctx, xs, xs->ne[0], batch, xs->nb[1], t * xs->nb[2]);
+            auto st = lstm_step(ctx,
                                 x_t, h_t, c_t,
-                                w_.lstm.weight_ih,
-                                w_.lstm.weight_hh,
-                                w_.lstm.bias_ih,
-                                w_.lstm.bias_hh);
+                                w.lstm.weight_ih,
+                                w.lstm.weight_hh,
+                                w.lstm.bias_ih,
+                                w.lstm.bias_hh);
             h_t = st.h_t;
             c_t = st.c_t;
+
+            Tensor* dst = ggml_view_2d(ctx, hs, hidden, batch, hs->nb[2], t * hs->nb[1]);
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, h_t, dst));
+        }
+
+        return hs;
+    }
+
+    // Residual VQ of hidden states [H, T', B], one [H, T'] sequence per
+    // batch item, into codes [T', n_q, B].
+    Tensor* build_codes(ExecState& state, Tensor* hs) const {
+        ggml_context*  ctx = state.ctx();
+        const Weights& w   = store_->weights();
+        ggml_cgraph*   gf  = state.graph();
+        const int64_t hidden  = hs->ne[0];
+        const int64_t seq_len = hs->ne[1];
+        const int64_t batch   = hs->ne[2];
+
+        if (rvq_) {
+            Tensor* tmpl = ggml_new_tensor_3d(ctx, GGML_TYPE_I32, seq_len, (int64_t)w.codebooks.size(), batch);
+            Tensor* out  = ggml_map_custom2(ctx, tmpl, hs, RvqIndex::encode_op, GGML_N_TASKS_MAX,
+                                            const_cast<RvqIndex*>(rvq_.get()));
+            ggml_build_forward_expand(gf, out);
+            return out;
         }
 
-        // rvq
         quantizer q;
-        q.blocks.reserve(w_.codebooks.size());
-        for (const auto& cb : w_.codebooks) {
+        q.blocks.reserve(w.codebooks.size());
+        for (const auto& cb : w.codebooks) {
             q.blocks.push_back({cb.embed});
         }
-        Tensor* out = quantizer_encode(&q, ctx_, h_t);
 
-        ggml_build_forward_expand(gf, out);
-        return gf;
+        if (batch == 1) {
+            Tensor* out = quantizer_encode(&q, ctx, ggml_view_2d(ctx, hs, hidden, seq_len, hs->nb[1], 0));
+            ggml_build_forward_expand(gf, out);
+            return out;
+        }
+
+        Tensor* out = ggml_new_tensor_3d(ctx, GGML_TYPE_I32, seq_len, (int64_t)q.blocks.size(), batch);
+        for (int64_t b = 0; b < batch; ++b) {
+            Tensor* h_b   = ggml_view_2d(ctx, hs, hidden, seq_len, hs->nb[1], b * hs->nb[2]);
+            Tensor* codes = quantizer_encode(&q, ctx, h_b);
+            Tensor* dst   = ggml_view_2d(ctx, out, out->ne[0], out->ne[1], out->nb[1], b * out->nb[2]);
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, codes, dst));
+        }
+        return out;
     }
 };
 
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+#include "mem_usage.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace encodec {
+
+//-------------------------------------
+// Per-request execution state
+//-------------------------------------
+// Owns the arena that every intermediate tensor and the graph of one request
+// are allocated from. Weights are never written here, so any number of
+// ExecStates can run against the same weight store at once. An ExecState
+// itself is not thread-safe: give each worker its own.
+//
+// A *measuring* state (see measuring()) allocates tensor metadata only. Build
+// the same graph in it that a real request would, then required_size() gives
+// the exact arena that request needs.
+class ExecState {
+public:
+    explicit ExecState(std::size_t arena_size) {
+        allocate(arena_size);
+    }
+
+    static ExecState measuring(std::size_t max_tensors = 16384) {
+        return ExecState{max_tensors * ggml_tensor_overhead() + ggml_graph_overhead_custom(max_tensors, false),
+                         /*no_alloc=*/true};
+    }
+
+    ~ExecState() {
+        if (ctx_) ggml_free(ctx_);
+        if (ext_ctx_) ggml_free(ext_ctx_);
+    }
+
+    ExecState(const ExecState&)            = delete;
+    ExecState& operator=(const ExecState&) = delete;
+
+    ExecState(ExecState&& o) noexcept
+        : arena_{std::move(o.arena_)}, arena_size_{o.arena_size_},
+          ctx_{std::exchange(o.ctx_, nullptr)},
+          graph_{std::exchange(o.graph_, nullptr)},
+          ext_ctx_{std::exchange(o.ext_ctx_, nullptr)},
+          peak_{o.peak_}, no_alloc_{o.no_alloc_} {}
+
+    ggml_context* ctx()   const noexcept { return ctx_; }
+    ggml_cgraph*  graph() const noexcept { return graph_; }
+
+    std::size_t arena_size() const noexcept { return arena_size_; }
+    bool        is_measuring() const noexcept { return no_alloc_; }
+
+    ContextUsage usage() const {
+        const std::size_t used = ggml_used_mem(ctx_);
+        return {arena_size_, used, std::max(peak_, used)};
+    }
+
+    // Start a new graph in this state's arena. Long unrolled graphs (e.g.
+    // one LSTM step per frame) need more than the default node count.
+    ggml_cgraph* new_graph(std::size_t size = GGML_DEFAULT_GRAPH_SIZE) {
+        graph_ = ggml_new_graph_custom(ctx_, size, false);
+        return graph_;
+    }
+
+    // Run the current graph, returning its last node.
+    ggml_tensor* compute(int n_threads) {
+        ggml_graph_compute_with_ctx(ctx_, graph_, n_threads);
+        peak_ = std::max(peak_, ggml_used_mem(ctx_));
+        return ggml_graph_node(graph_, -1);
+    }
+
+    // A tensor over caller memory, e.g. a slot of an output ring, for the
+    // last op of a graph to write its result into (ggml_cpy). Takes nothing
+    // from the arena; valid until reset().
+    ggml_tensor* external(ggml_type type, int64_t ne0, int64_t ne1, int64_t ne2, void* data) {
+        if (!ext_ctx_) {
+            ggml_init_params params{
+                .mem_size   = kMaxExternal * ggml_tensor_overhead(),
+                .mem_buffer = nullptr,
+                .no_alloc   = true
+            };
+            ext_ctx_ = ggml_init(params);
+        }
+        ggml_tensor* t = ggml_new_tensor_3d(ext_ctx_, type, ne0, ne1, ne2);
+        t->data = data;
+        return t;
+    }
+
+    // Arena a real state needs for everything built here so far, including
+    // the compute work buffer of the current graph. Measuring states only.
+    std::size_t required_size(int n_threads) const {
+        std::size_t size = context_required_size(ctx_);
+        if (graph_) size += graph_work_size(graph_, n_threads);
+        return size;
+    }
+
+    // Drop every tensor of the previous request; the arena is kept.
+    void reset() {
+        peak_ = std::max(peak_, ggml_used_mem(ctx_));
+        ggml_reset(ctx_);
+        if (ext_ctx_) ggml_reset(ext_ctx_);
+        graph_ = nullptr;
+    }
+
+    // Make sure the arena holds at least `size` bytes. Growing drops every
+    // tensor in the state, so call it between requests.
+    void reserve(std::size_t size) {
+        if (size <= arena_size_) return;
+        ggml_free(ctx_);
+        if (ext_ctx_) ggml_reset(ext_ctx_);
+        allocate(size);
+    }
+
+private:
+    static constexpr std::size_t kMaxExternal = 64; // per request
+
+    ExecState(std::size_t size, bool no_alloc) : no_alloc_{no_alloc} {
+        allocate(size);
+    }
+
+    void allocate(std::size_t size) {
+        // measuring states let ggml own their (metadata-only) buffer
+        arena_.reset(no_alloc_ ? nullptr : new uint8_t[size]);
+        arena_size_ = size;
+        graph_      = nullptr;
+        ggml_init_params params{
+            .mem_size   = arena_size_,
+            .mem_buffer = arena_.get(),
+            .no_alloc   = no_alloc_
+        };
+        ctx_ = ggml_init(params);
+    }
+
+    std::unique_ptr<uint8_t[]> arena_;
+    std::size_t                arena_size_ = 0;
+    ggml_context*              ctx_{};
+    ggml_cgraph*               graph_{};
+    ggml_context*              ext_ctx_{}; // metadata of external() tensors
+    std::size_t                peak_     = 0;
+    bool                       no_alloc_ = false;
+};
+
+}
@@ -0,0 +1,286 @@
+#pragma once
+
+#include "ggml.h"
+#include "mem_usage.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace musicgen {
+
+// A run of n consecutive positions stored at consecutive pool rows.
+struct CacheRun {
+    int64_t row;
+    int64_t n;
+};
+
+// Host copy of a slot's first n_pos cached positions and its conditioning,
+// taken with KVCache::save_prefix. Loading it into a slot of a cache with
+// the same shape resumes from exactly that state without recomputing it.
+struct KVPrefix {
+    int                  n_pos  = 0;
+    int                  n_cond = 0;
+    std::vector<uint8_t> data; // per layer: k rows, v rows, xk slab, xv slab
+
+    std::size_t bytes() const noexcept { return data.size(); }
+};
+
+//-------------------------------------
+// Paged self-attention KV cache
+//-------------------------------------
+// Keys and values of every layer live in one pool of fixed-size blocks of
+// `block_size` positions, allocated up front. Each sequence ("slot") maps its
+// positions onto blocks through a block table, taking blocks only as it
+// grows, so short generations hold little memory. Each decode step only
+// appends its new positions; earlier ones are never recomputed.
+//
+// Blocks are reference counted: fork() lets another slot share a prefix
+// (e.g. several samples of one prompt), and the first write to a shared block
+// copies it (copy-on-write).
+//
+// The cross-attention K / V of each slot's conditioning (up to n_cond
+// tokens) are kept alongside, unpaged: they are projected once per request
+// and read by every step after that.
+//
+// Per layer:
+//   k:  [D, n_blocks * block_size]  one key row per physical position
+//   v:  [D, n_blocks * block_size]  one value row per physical position
+//   xk: [D, n_cond, n_seq]          cross-attention keys
+//   xv: [n_cond, D, n_seq]          cross-attention values, transposed
+class KVCache {
+public:
+    // n_ctx bounds the length of one slot; n_blocks (0: enough for every
+    // slot at n_ctx) sizes the shared pool.
+    KVCache(int n_layer, int64_t d_model, int n_ctx, int n_seq, int n_cond = 0,
+            ggml_type type = GGML_TYPE_F16, int block_size = 16, int n_blocks = 0)
+        : n_ctx_{n_ctx}, n_seq_{n_seq}, n_cond_max_{n_cond}, block_size_{block_size},
+          n_past_(n_seq, 0), n_cond_(n_seq, 0), tables_(n_seq) {
+        const int per_slot = (n_ctx + block_size - 1) / block_size;
+        if (n_blocks <= 0) n_blocks = per_slot * n_seq;
+        refs_.assign(n_blocks, 0);
+        for (int b = n_blocks - 1; b >= 0; --b) free_.push_back(b);
+
+        const int64_t     rows      = (int64_t)n_blocks * block_size;
+        const std::size_t pool_size = ggml_tensor_overhead() +
+            GGML_PAD(ggml_row_size(type, d_model) * rows, GGML_MEM_ALIGN);
+        const std::size_t cross_size = ggml_tensor_overhead() +
+            GGML_PAD(ggml_row_size(type, d_model) * std::max(n_cond, 1) * n_seq, GGML_MEM_ALIGN);
+        ggml_init_params params{
+            .mem_size   = 2 * n_layer * (pool_size + cross_size),
+            .mem_buffer = nullptr,
+            .no_alloc   = false
+        };
+        ctx_ = ggml_init(params);
+        for (int il = 0; il < n_layer; ++il) {
+            k_.push_back(ggml_new_tensor_2d(ctx_, type, d_model, rows));
+            v_.push_back(ggml_new_tensor_2d(ctx_, type, d_model, rows));
+            xk_.push_back(ggml_new_tensor_3d(ctx_, type, d_model, std::max(n_cond, 1), n_seq));
+            xv_.push_back(ggml_new_tensor_3d(ctx_, type, std::max(n_cond, 1), d_model, n_seq));
+            ggml_format_name(k_.back(), "cache_k_l%d", il);
+            ggml_format_name(v_.back(), "cache_v_l%d", il);
+            ggml_format_name(xk_.back(), "cache_xk_l%d", il);
+            ggml_format_name(xv_.back(), "cache_xv_l%d", il);
+        }
+    }
+
+    ~KVCache() {
+        if (ctx_) ggml_free(ctx_);
+    }
+
+    KVCache(const KVCache&)            = delete;
+    KVCache& operator=(const KVCache&) = delete;
+
+    KVCache(KVCache&& o) noexcept
+        : ctx_{std::exchange(o.ctx_, nullptr)},
+          k_{std::move(o.k_)}, v_{std::move(o.v_)}, xk_{std::move(o.xk_)}, xv_{std::move(o.xv_)},
+          n_ctx_{o.n_ctx_}, n_seq_{o.n_seq_}, n_cond_max_{o.n_cond_max_}, block_size_{o.block_size_},
+          n_past_{std::move(o.n_past_)}, n_cond_{std::move(o.n_cond_)},
+          tables_{std::move(o.tables_)}, refs_{std::move(o.refs_)}, free_{std::move(o.free_)} {}
+
+    ggml_tensor* k(int il)  const { return k_[il]; }
+    ggml_tensor* v(int il)  const { return v_[il]; }
+    ggml_tensor* xk(int il) const { return xk_[il]; }
+    ggml_tensor* xv(int il) const { return xv_[il]; }
+
+    int n_layer()    const noexcept { return (int)k_.size(); }
+    int n_ctx()      const noexcept { return n_ctx_; }
+    int n_seq()      const noexcept { return n_seq_; }
+    int n_cond_max() const noexcept { return n_cond_max_; }
+    int block_size() const noexcept { return block_size_; }
+    int n_blocks()   const noexcept { return (int)refs_.size(); }
+    int n_free()     const noexcept { return (int)free_.size(); }
+
+    // Blocks needed to hold n positions.
+    int blocks_for(int n) const { return (n + block_size_ - 1) / block_size_; }
+
+    // Positions already cached for a slot.
+    int  n_past(int slot) const { return n_past_[slot]; }
+    void advance(int slot, int n) { n_past_[slot] += n; }
+
+    // Physical pool row holding position p of a slot.
+    int64_t row(int slot, int p) const {
+        return (int64_t)tables_[slot][p / block_size_] * block_size_ + p % block_size_;
+    }
+
+    // Where positions [p0, p0 + n) of a slot live, split at block borders.
+    std::vector<CacheRun> runs(int slot, int p0, int n) const {
+        std::vector<CacheRun> out;
+        for (int p = p0; p < p0 + n;) {
+            const int len = std::min(p0 + n - p, block_size_ - p % block_size_);
+            out.push_back({row(slot, p), len});
+            p += len;
+        }
+        return out;
+    }
+
+    /**
+     * Back positions [n_past, n_past + n) of a slot with blocks it owns
+     * alone: allocates missing blocks and copies shared ones. Call before a
+     * forward writes them. Returns false if the pool runs out.
+     */
+    bool prepare(int slot, int n) {
+        const int first = n_past_[slot] / block_size_;
+        const int last  = blocks_for(n_past_[slot] + n);
+        auto& table = tables_[slot];
+        for (int b = first; b < last; ++b) {
+            if (b < (int)table.size() && refs_[table[b]] == 1) continue;
+            if (free_.empty()) {
+                std::fprintf(stderr, "%s: slot %d: KV cache pool exhausted (%d blocks)\n",
+                             __func__, slot, n_blocks());
+                return false;
+            }
+            const int fresh = free_.back();
+            free_.pop_back();
+            refs_[fresh] = 1;
+            if (b < (int)table.size()) {
+                copy_block(table[b], fresh); // copy-on-write
+                release(table[b]);
+                table[b] = fresh;
+            } else {
+                table.push_back(fresh);
+            }
+        }
+        return true;
+    }
+
+    // Make `dst` a fork of `src`: same cached prefix and conditioning, with
+    // the prefix blocks shared until either side writes to them.
+    void fork(int src, int dst) {
+        if (src == dst) return;
+        clear(dst);
+        tables_[dst] = tables_[src];
+        for (int b : tables_[dst]) ++refs_[b];
+        n_past_[dst] = n_past_[src];
+        n_cond_[dst] = n_cond_[src];
+        for (std::size_t il = 0; il < xk_.size(); ++il) {
+            for (ggml_tensor* t : {xk_[il], xv_[il]}) {
+                std::memcpy((char*)t->data + dst * t->nb[2], (const char*)t->data + src * t->nb[2], t->nb[2]);
+            }
+        }
+    }
+
+    // Copy positions [0, n) of a slot, and its cross K / V, to host memory.
+    KVPrefix save_prefix(int slot, int n) const {
+        KVPrefix p{n, n_cond_[slot], {}};
+        p.data.resize(prefix_bytes(n));
+        uint8_t* dst = p.data.data();
+        const std::vector<CacheRun> rs = runs(slot, 0, n);
+        for (std::size_t il = 0; il < k_.size(); ++il) {
+            for (const ggml_tensor* t : {k_[il], v_[il]}) {
+                for (const CacheRun& r : rs) {
+                    std::memcpy(dst, (const char*)t->data + r.row * t->nb[1], r.n * t->nb[1]);
+                    dst += r.n * t->nb[1];
+                }
+            }
+            for (const ggml_tensor* t : {xk_[il], xv_[il]}) {
+                std::memcpy(dst, (const char*)t->data + slot * t->nb[2], t->nb[2]);
+                dst += t->nb[2];
+            }
+        }
+        return p;
+    }
+
+    // Replace a slot's contents with a saved prefix. Returns false (and
+    // leaves the slot empty) if the pool runs out.
+    bool load_prefix(int slot, const KVPrefix& p) {
+        GGML_ASSERT(p.bytes() == prefix_bytes(p.n_pos) && p.n_pos <= n_ctx_);
+        clear(slot);
+        if (!prepare(slot, p.n_pos)) return false;
+        const uint8_t* src = p.data.data();
+        const std::vector<CacheRun> rs = runs(slot, 0, p.n_pos);
+        for (std::size_t il = 0; il < k_.size(); ++il) {
+            for (ggml_tensor* t : {k_[il], v_[il]}) {
+                for (const CacheRun& r : rs) {
+                    std::memcpy((char*)t->data + r.row * t->nb[1], src, r.n * t->nb[1]);
+                    src += r.n * t->nb[1];
+                }
+            }
+            for (ggml_tensor* t : {xk_[il], xv_[il]}) {
+                std::memcpy((char*)t->data + slot * t->nb[2], src, t->nb[2]);
+                src += t->nb[2];
+            }
+        }
+        n_past_[slot] = p.n_pos;
+        n_cond_[slot] = p.n_cond;
+        return true;
+    }
+
+    // Size of a saved prefix of n positions.
+    std::size_t prefix_bytes(int n) const {
+        if (k_.empty()) return 0;
+        return k_.size() * (2 * (std::size_t)n * k_[0]->nb[1] + xk_[0]->nb[2] + xv_[0]->nb[2]);
+    }
+
+    // Conditioning tokens whose cross K / V are cached for a slot (0: none,
+    // the slot skips cross-attention).
+    int  n_cond(int slot) const { return n_cond_[slot]; }
+    void set_n_cond(int slot, int n) { n_cond_[slot] = n; }
+
+    // Forget a slot and return its blocks to the pool.
+    void clear(int slot) {
+        for (int b : tables_[slot]) release(b);
+        tables_[slot].clear();
+        n_past_[slot] = 0;
+        n_cond_[slot] = 0;
+    }
+
+    encodec::ContextUsage usage() const {
+        const std::size_t used = ggml_used_mem(ctx_);
+        return {ggml_get_mem_size(ctx_), used, used};
+    }
+
+private:
+    void release(int b) {
+        if (--refs_[b] == 0) free_.push_back(b);
+    }
+
+    void copy_block(int from, int to) {
+        for (std::size_t il = 0; il < k_.size(); ++il) {
+            for (ggml_tensor* t : {k_[il], v_[il]}) {
+                const std::size_t bytes = block_size_ * t->nb[1];
+                std::memcpy((char*)t->data + to * bytes, (const char*)t->data + from * bytes, bytes);
+            }
+        }
+    }
+
+    ggml_context*                 ctx_{};
+    std::vector<ggml_tensor*>     k_;
+    std::vector<ggml_tensor*>     v_;
+    std::vector<ggml_tensor*>     xk_;
+    std::vector<ggml_tensor*>     xv_;
+    int                           n_ctx_;
+    int                           n_seq_;
+    int                           n_cond_max_;
+    int                           block_size_;
+    std::vector<int>              n_past_;
+    std::vector<int>              n_cond_;
+    std::vector<std::vector<int>> tables_; // per slot: block of each block_size positions
+    std::vector<int>              refs_;   // per block: slots using it
+    std::vector<int>              free_;
+};
+
+}
@@ -0,0 +1,547 @@
+#pragma once
+
+#include "ggml.h"
+#include "attention.h"
+#include "exec_state.h"
+#include "kv_cache.h"
+#include "mem_usage.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace musicgen {
+
+using encodec::ContextUsage;
+using encodec::ExecState;
+
+//-------------------------------------
+// MusicGen LM (see docs/lm_structure.txt)
+//-------------------------------------
+struct LMConfig {
+    int     n_q      = 4;     // parallel codebook streams
+    int     card     = 2048;  // codebook size; embeddings hold one extra "masked" token
+    int64_t d_model  = 1024;
+    int     n_head   = 16;
+    int     n_layer  = 24;
+    int64_t d_ff     = 4096;
+    float   norm_eps = 1e-5f;
+    float   max_period = 10000.0f;
+};
+
+// Weight shapes are given PyTorch-style; ggml ne is the reverse.
+struct LMLayerWeights {
+    ggml_tensor* norm1_w{};
+    ggml_tensor* norm1_b{};
+    ggml_tensor* self_attn_in{};   // [3D, D] packed q / k / v
+    ggml_tensor* self_attn_out{};  // [D, D]
+    ggml_tensor* norm_cross_w{};
+    ggml_tensor* norm_cross_b{};
+    ggml_tensor* cross_attn_in{};  // [3D, D]: q from x, k / v from the conditioning
+    ggml_tensor* cross_attn_out{}; // [D, D]
+    ggml_tensor* norm2_w{};
+    ggml_tensor* norm2_b{};
+    ggml_tensor* linear1{};        // [d_ff, D]
+    ggml_tensor* linear2{};        // [D, d_ff]
+
+    // Filled in by LMStore: each norm's weight and bias as one [2, D] F32
+    ggml_tensor* norm1_wb{};
+    ggml_tensor* norm_cross_wb{};
+    ggml_tensor* norm2_wb{};
+};
+
+struct LMWeights {
+    std::vector<ggml_tensor*>   emb;     // n_q x [card + 1, D]
+    std::vector<LMLayerWeights> layers;
+    ggml_tensor*                out_norm_w{};
+    ggml_tensor*                out_norm_b{};
+    std::vector<ggml_tensor*>   linears; // n_q x [card, D]
+
+    // Filled in by LMStore
+    ggml_tensor* emb_packed{};   // [n_q * (card + 1), D], emb.0 .. emb.{n_q-1} stacked
+    ggml_tensor* heads_packed{}; // [n_q * card, D], linears stacked
+    ggml_tensor* out_norm_wb{};  // [2, D] F32, out_norm weight and bias
+};
+
+// Custom op: dst[:, i] = pos[:, i] + sum_k table[k * rows + ids[i, k]], with
+// `rows` = table rows per codebook. Gathers and sums the n_q embeddings of a
+// step in one pass instead of n_q get_rows and n_q adds. The table may be
+// F32, F16 or a block-quantized type (lm_quant.h).
+inline void embed_sum_op(ggml_tensor* dst, const ggml_tensor* pos, const ggml_tensor* ids,
+                         const ggml_tensor* table, int ith, int nth, void* /*userdata*/) {
+    const int64_t D    = dst->ne[0];
+    const int64_t N    = dst->ne[1];
+    const int64_t n_q  = ids->ne[1];
+    const int64_t rows = table->ne[1] / n_q;
+
+    const ggml_to_float_t to_float = table->type == GGML_TYPE_F32 ? nullptr : ggml_get_type_traits(table->type)->to_float;
+    std::vector<float> tmp(to_float ? D : 0);
+    for (int64_t i = ith; i < N; i += nth) {
+        float* out = (float*)((char*)dst->data + i * dst->nb[1]);
+        std::memcpy(out, (const char*)pos->data + i * pos->nb[1], D * sizeof(float));
+        for (int64_t k = 0; k < n_q; ++k) {
+            const int32_t id  = ((const int32_t*)((const char*)ids->data + k * ids->nb[1]))[i];
+            const char*   row = (const char*)table->data + (k * rows + id) * table->nb[1];
+            const float*  r   = (const float*)row;
+            if (to_float) {
+                to_float(row, tmp.data(), D);
+                r = tmp.data();
+            }
+            for (int64_t d = 0; d < D; ++d) out[d] += r[d];
+        }
+    }
+}
+
+// Immutable LM weights, shared by every worker (cf. encodec::WeightStore).
+class LMStore {
+public:
+    // Takes ownership of `ctx`, the context the weight tensors live in.
+    // The per-codebook embeddings and heads are stacked once, here, so a
+    // step reads them with one gather and one GEMM, and each LayerNorm's
+    // weight and bias are packed for the fused norm ops (attention.h).
+    LMStore(ggml_context* ctx, LMConfig cfg, LMWeights w)
+        : ctx_{ctx}, cfg_{cfg}, w_{std::move(w)} {
+        const ggml_type emb_type  = w_.emb[0]->type;
+        const ggml_type head_type = w_.linears[0]->type;
+        const int64_t   D         = cfg_.d_model;
+        const int64_t   n_norms   = 3 * (int64_t)w_.layers.size() + 1;
+        ggml_init_params params{
+            .mem_size   = 2 * ggml_tensor_overhead() +
+                          GGML_PAD(ggml_row_size(emb_type, D) * cfg_.n_q * (cfg_.card + 1), GGML_MEM_ALIGN) +
+                          GGML_PAD(ggml_row_size(head_type, D) * cfg_.n_q * cfg_.card, GGML_MEM_ALIGN) +
+                          n_norms * (ggml_tensor_overhead() + GGML_PAD(ggml_row_size(GGML_TYPE_F32, D) * 2, GGML_MEM_ALIGN)),
+            .mem_buffer = nullptr,
+            .no_alloc   = false
+        };
+        pack_ctx_ = ggml_init(params);
+        w_.emb_packed   = stack_rows(w_.emb, emb_type, "lm_emb_packed");
+        w_.heads_packed = stack_rows(w_.linears, head_type, "lm_heads_packed");
+        for (std::size_t il = 0; il < w_.layers.size(); ++il) {
+            LMLayerWeights& L = w_.layers[il];
+            L.norm1_wb      = pack_norm(L.norm1_w, L.norm1_b, "lm_norm1_wb", (int)il);
+            L.norm_cross_wb = pack_norm(L.norm_cross_w, L.norm_cross_b, "lm_norm_cross_wb", (int)il);
+            L.norm2_wb      = pack_norm(L.norm2_w, L.norm2_b, "lm_norm2_wb", (int)il);
+        }
+        w_.out_norm_wb = pack_norm(w_.out_norm_w, w_.out_norm_b, "lm_out_norm_wb", 0);
+
+        // Building a graph names unnamed leaf tensors in place. Name every
+        // weight up front so concurrent graph builds never write to them.
+        int i = 0;
+        for (auto* t = ggml_get_first_tensor(ctx_); t; t = ggml_get_next_tensor(ctx_, t), ++i) {
+            if (ggml_get_name(t)[0] == '\0') ggml_format_name(t, "lm_weight_%d", i);
+        }
+    }
+
+    ~LMStore() {
+        if (ctx_) ggml_free(ctx_);
+        if (pack_ctx_) ggml_free(pack_ctx_);
+    }
+
+    LMStore(const LMStore&)            = delete;
+    LMStore& operator=(const LMStore&) = delete;
+
+    const LMConfig&  config()  const noexcept { return cfg_; }
+    const LMWeights& weights() const noexcept { return w_; }
+
+    ContextUsage usage() const {
+        const std::size_t used = ggml_used_mem(ctx_) + ggml_used_mem(pack_ctx_);
+        return {ggml_get_mem_size(ctx_) + ggml_get_mem_size(pack_ctx_), used, used};
+    }
+
+private:
+    // Copies 2-D tensors of one type into a single tensor, one after another
+    // along the row dim.
+    ggml_tensor* stack_rows(const std::vector<ggml_tensor*>& parts, ggml_type type, const char* name) {
+        int64_t rows = 0;
+        for (auto* t : parts) rows += t->ne[1];
+        ggml_tensor* out = ggml_new_tensor_2d(pack_ctx_, type, parts[0]->ne[0], rows);
+        ggml_set_name(out, name);
+        char* dst = (char*)out->data;
+        for (auto* t : parts) {
+            GGML_ASSERT(t->type == type && t->ne[0] == out->ne[0] && ggml_is_contiguous(t));
+            std::memcpy(dst, t->data, ggml_nbytes(t));
+            dst += ggml_nbytes(t);
+        }
+        return out;
+    }
+
+    // A norm's weight and (optional) bias, converted to F32, as rows 0 and 1
+    // of one [2, D] tensor.
+    ggml_tensor* pack_norm(const ggml_tensor* w, const ggml_tensor* b, const char* name, int il) {
+        if (!w) return nullptr;
+        const int64_t D   = w->ne[0];
+        ggml_tensor*  out = ggml_new_tensor_2d(pack_ctx_, GGML_TYPE_F32, D, 2);
+        ggml_format_name(out, "%s_%d", name, il);
+        float* dst = (float*)out->data;
+        std::memset(dst + D, 0, D * sizeof(float));
+        for (const ggml_tensor* t : {w, b}) {
+            if (t) {
+                GGML_ASSERT(ggml_nelements(t) == D && ggml_is_contiguous(t));
+                if (t->type == GGML_TYPE_F32) std::memcpy(dst, t->data, D * sizeof(float));
+                else ggml_get_type_traits(t->type)->to_float(t->data, dst, D);
+            }
+            dst += D;
+        }
+        return out;
+    }
+
+    ggml_context* ctx_;          // owned
+    ggml_context* pack_ctx_{};   // owned, stacked embeddings and heads, packed norms
+    LMConfig      cfg_;
+    LMWeights     w_;
+};
+
+// One sequence's share of a forward call.
+struct LMSeq {
+    int            slot     = 0;       // KV-cache slot the sequence lives in
+    int            n_tokens = 0;       // new steps: a prompt chunk, or 1 when decoding
+    const int32_t* codes    = nullptr; // n_tokens x n_q token ids, step-major
+};
+
+// A sequence sampled with classifier-free guidance: the same tokens run in a
+// conditional slot and in an unconditional (null-condition) slot.
+struct LMGuidedSeq {
+    int            slot_cond   = 0;
+    int            slot_uncond = 1;
+    int            n_tokens    = 0;
+    const int32_t* codes       = nullptr;
+};
+
+//-------------------------------------
+// Incremental LM forward pass
+//-------------------------------------
+// Each call runs only the new steps of every sequence in the batch: their
+// Q / K / V are computed, K / V appended to the cache slot, and attention runs
+// over the cached prefix. A prompt is prefilled by passing all of its steps
+// at once; decoding then passes one step per call. The conditioning is
+// projected into per-layer cross-attention K / V once, by set_condition().
+//
+// Projections and the feed-forward run as one GEMM over the tokens of every
+// sequence; only attention is per sequence. Stateless apart from the shared
+// weights, like encodec::Encoder.
+class LM {
+public:
+    explicit LM(std::shared_ptr<const LMStore> store) noexcept
+        : store_{std::move(store)} {}
+
+    const LMConfig& config() const noexcept { return store_->config(); }
+
+    // A cache with `n_seq` slots of up to `n_ctx` steps, and room for
+    // `n_cond` conditioning tokens each, for this model. See KVCache for
+    // block_size and n_blocks.
+    KVCache make_cache(int n_ctx, int n_seq = 1, int n_cond = 0, ggml_type type = GGML_TYPE_F16,
+                       int block_size = 16, int n_blocks = 0) const {
+        const LMConfig& cfg = config();
+        return KVCache{cfg.n_layer, cfg.d_model, n_ctx, n_seq, n_cond, type, block_size, n_blocks};
+    }
+
+    /**
+     * Project a slot's conditioning (n_cond x D, already through the
+     * conditioner's output_proj) into the cross-attention K / V of every
+     * layer and keep them in the cache for the rest of the request.
+     * Passing n_cond = 0 clears it. Returns false if it does not fit.
+     */
+    bool set_condition(ExecState& state, KVCache& cache, int slot,
+                       const float* cond, int n_cond, int n_threads = 4) const {
+        if (slot < 0 || slot >= cache.n_seq() || n_cond < 0 || n_cond > cache.n_cond_max()) {
+            std::fprintf(stderr, "%s: slot %d: %d conditioning tokens do not fit (max %d)\n",
+                         __func__, slot, n_cond, cache.n_cond_max());
+            return false;
+        }
+        cache.set_n_cond(slot, n_cond);
+        if (n_cond == 0) return true;
+
+        (void)build_condition_graph(state, cache, slot, cond, n_cond);
+        state.compute(n_threads);
+        return true;
+    }
+
+    [[nodiscard]] std::size_t condition_arena_size(const KVCache& cache, int n_cond, int n_threads = 4) const {
+        ExecState m = ExecState::measuring(GGML_DEFAULT_GRAPH_SIZE);
+        (void)build_condition_graph(m, cache, 0, nullptr, n_cond);
+        return m.required_size(n_threads);
+    }
+
+    /**
+     * Run the batch and advance each sequence's cache slot by its n_tokens.
+     * @return Logits [card, n_q, N] with N = sum of n_tokens, sequences in
+     *         batch order; valid until `state` is reset. Null on a bad batch
+     *         or when the cache has no blocks left for it.
+     */
+    [[nodiscard]] ggml_tensor* forward(ExecState& state, KVCache& cache,
+                                       const std::vector<LMSeq>& batch, int n_threads = 4) const {
+        if (!prepare_batch(cache, batch)) return nullptr;
+        ggml_tensor* logits = build_graph(state, cache, batch, /*worst_case*/false);
+        state.compute(n_threads);
+        for (const auto& s : batch) cache.advance(s.slot, s.n_tokens);
+        return logits;
+    }
+
+    /**
+     * Classifier-free guidance in one forward pass: the conditional and the
+     * unconditional slot of every sequence run as one batch of 2N tokens, so
+     * each weight is read once per step for both. The guidance mix
+     *     uncond + cfg_coef * (cond - uncond)
+     * is applied to the out_norm hidden states; the heads are linear, so the
+     * head GEMM then runs on N mixed columns instead of 2N.
+     * @return Guided logits [card, n_q, N], sequences in batch order.
+     */
+    [[nodiscard]] ggml_tensor* forward_guided(ExecState& state, KVCache& cache,
+                                              const std::vector<LMGuidedSeq>& batch,
+                                              float cfg_coef, int n_threads = 4) const {
+        const std::vector<LMSeq> both = unguided(batch);
+        if (!prepare_batch(cache, both)) return nullptr;
+        ggml_tensor* logits = build_graph(state, cache, both, /*worst_case*/false, /*guided*/true, cfg_coef);
+        state.compute(n_threads);
+        for (const auto& s : both) cache.advance(s.slot, s.n_tokens);
+        return logits;
+    }
+
+    /**
+     * Arena an ExecState needs to run a batch of this shape at any point of
+     * the cache (attention is measured over the full context).
+     */
+    [[nodiscard]] std::size_t arena_size(const KVCache& cache, const std::vector<LMSeq>& batch,
+                                         int n_threads = 4) const {
+        ExecState m = ExecState::measuring(graph_size(batch) * 2);
+        (void)build_graph(m, cache, batch, /*worst_case*/true);
+        return m.required_size(n_threads);
+    }
+
+    [[nodiscard]] std::size_t arena_size(const KVCache& cache, const std::vector<LMGuidedSeq>& batch,
+                                         int n_threads = 4) const {
+        const std::vector<LMSeq> both = unguided(batch);
+        ExecState m = ExecState::measuring(graph_size(both) * 2);
+        (void)build_graph(m, cache, both, /*worst_case*/true, /*guided*/true, 1.0f);
+        return m.required_size(n_threads);
+    }
+
+private:
+    std::shared_ptr<const LMStore> store_;
+
+    // Validates the batch and backs every new position with a private block.
+    bool prepare_batch(KVCache& cache, const std::vector<LMSeq>& batch) const {
+        std::vector<bool> used(cache.n_seq(), false);
+        for (const auto& s : batch) {
+            if (s.slot < 0 || s.slot >= cache.n_seq() || used[s.slot]) {
+                std::fprintf(stderr, "%s: bad or repeated cache slot %d\n", __func__, s.slot);
+                return false;
+            }
+            used[s.slot] = true;
+            if (s.n_tokens <= 0 || !s.codes || cache.n_past(s.slot) + s.n_tokens > cache.n_ctx()) {
+                std::fprintf(stderr, "%s: slot %d: %d new steps do not fit (%d / %d cached)\n",
+                             __func__, s.slot, s.n_tokens, cache.n_past(s.slot), cache.n_ctx());
+                return false;
+            }
+        }
+        if (batch.empty()) return false;
+        for (const auto& s : batch) {
+            if (!cache.prepare(s.slot, s.n_tokens)) return false;
+        }
+        return true;
+    }
+
+    // Conditional halves first, then the unconditional ones, so the two
+    // halves of the hidden state line up column for column.
+    static std::vector<LMSeq> unguided(const std::vector<LMGuidedSeq>& batch) {
+        std::vector<LMSeq> both;
+        both.reserve(2 * batch.size());
+        for (const auto& g : batch) both.push_back({g.slot_cond, g.n_tokens, g.codes});
+        for (const auto& g : batch) both.push_back({g.slot_uncond, g.n_tokens, g.codes});
+        return both;
+    }
+
+    std::size_t graph_size(const std::vector<LMSeq>& batch) const {
+        const LMConfig& cfg = config();
+        return GGML_DEFAULT_GRAPH_SIZE + (std::size_t)cfg.n_layer * (32 + batch.size() * 48);
+    }
+
+    // Per-sequence [D, n_tok] results gathered into one [D, N] tensor.
+    // Sequences without a part (null) get zeros.
+    static ggml_tensor* gather_cols(ExecState& state, ggml_cgraph* gf,
+                                    const std::vector<LMSeq>& batch,
+                                    const std::vector<ggml_tensor*>& parts, int64_t D, int64_t N) {
+        ggml_context* ctx = state.ctx();
+        if (parts.size() == 1 && parts[0]) return parts[0];
+
+        ggml_tensor* out = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, D, N);
+        bool holes = false;
+        for (auto* p : parts) holes = holes || !p;
+        if (holes && !state.is_measuring()) ggml_set_zero(out);
+
+        int64_t col = 0;
+        for (std::size_t s = 0; s < batch.size(); ++s) {
+            if (parts[s]) {
+                ggml_tensor* dst = ggml_view_2d(ctx, out, D, batch[s].n_tokens, out->nb[1], col * out->nb[1]);
+                ggml_build_forward_expand(gf, ggml_cpy(ctx, parts[s], dst));
+            }
+            col += batch[s].n_tokens;
+        }
+        return out;
+    }
+
+    // Cross K / V of every layer for one slot, copied into the cache.
+    ggml_cgraph* build_condition_graph(ExecState& state, const KVCache& cache, int slot,
+                                       const float* cond, int n_cond) const {
+        ggml_context*    ctx = state.ctx();
+        const LMConfig&  cfg = config();
+        const LMWeights& w   = store_->weights();
+        const int64_t    D   = cfg.d_model;
+        auto* gf = state.new_graph();
+
+        ggml_tensor* c = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, D, n_cond);
+        if (!state.is_measuring()) std::memcpy(c->data, cond, ggml_nbytes(c));
+
+        for (int il = 0; il < cfg.n_layer; ++il) {
+            const LMLayerWeights& L = w.layers[il];
+            ggml_tensor* xk = cache.xk(il);
+            ggml_tensor* xv = cache.xv(il);
+            ggml_tensor* k = ggml_mul_mat(ctx, weight_rows(ctx, L.cross_attn_in, D, D), c);     // [D, n_cond]
+            ggml_tensor* v = ggml_mul_mat(ctx, weight_rows(ctx, L.cross_attn_in, 2 * D, D), c); // [D, n_cond]
+            ggml_tensor* k_dst = ggml_view_2d(ctx, xk, D, n_cond, xk->nb[1], slot * xk->nb[2]);
+            ggml_tensor* v_dst = ggml_view_2d(ctx, xv, n_cond, D, xv->nb[1], slot * xv->nb[2]);
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, k, k_dst));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, ggml_transpose(ctx, v), v_dst));
+        }
+        return gf;
+    }
+
+    // Builds the graph in `state` and returns the logits tensor. Reads no
+    // tensor data when `state` is measuring; `worst_case` then sizes every
+    // sequence's attention for a full cache. `guided` batches come from
+    // unguided() and yield logits for their first half only.
+    ggml_tensor* build_graph(ExecState& state, const KVCache& cache,
+                             const std::vector<LMSeq>& batch, bool worst_case,
+                             bool guided = false, float cfg_coef = 1.0f) const {
+        ggml_context*    ctx = state.ctx();
+        const LMConfig&  cfg = config();
+        const LMWeights& w   = store_->weights();
+        const int64_t    D   = cfg.d_model;
+        auto* gf = state.new_graph(graph_size(batch));
+
+        int64_t N = 0;
+        bool any_cond = false;
+        std::vector<int> n_past(batch.size()), n_cond(batch.size());
+        for (std::size_t s = 0; s < batch.size(); ++s) {
+            n_past[s] = worst_case ? cache.n_ctx() - batch[s].n_tokens : cache.n_past(batch[s].slot);
+            n_cond[s] = worst_case ? cache.n_cond_max() : cache.n_cond(batch[s].slot);
+            any_cond  = any_cond || n_cond[s] > 0;
+            N += batch[s].n_tokens;
+        }
+
+        // --- inputs ------------------------------------------
+        ggml_tensor* tokens = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, N, cfg.n_q);
+        ggml_tensor* pos    = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, D, N);
+
+        // Pool rows each sequence reads (all its positions) and writes (the
+        // new ones). Measuring assumes the most block borders a write can
+        // cross; the rows themselves are not needed then.
+        std::vector<ggml_tensor*>          rows(batch.size());
+        std::vector<std::vector<CacheRun>> store(batch.size());
+        for (std::size_t s = 0; s < batch.size(); ++s) {
+            const int n_tok = batch[s].n_tokens;
+            rows[s] = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_past[s] + n_tok);
+            if (worst_case) {
+                const int bs = cache.block_size();
+                for (int p = 0, len = std::min(1, n_tok); p < n_tok; p += len, len = std::min(bs, n_tok - p)) {
+                    store[s].push_back({0, len});
+                }
+            } else {
+                store[s] = cache.runs(batch[s].slot, n_past[s], n_tok);
+            }
+        }
+
+        if (!state.is_measuring()) {
+            int64_t col = 0;
+            for (std::size_t s = 0; s < batch.size(); ++s) {
+                const LMSeq& seq = batch[s];
+                for (int i = 0; i < seq.n_tokens; ++i) {
+                    for (int k = 0; k < cfg.n_q; ++k) {
+                        ((int32_t*)tokens->data)[k * N + col + i] = seq.codes[i * cfg.n_q + k];
+                    }
+                }
+                sin_embedding((float*)pos->data + col * D, D, n_past[s], seq.n_tokens, cfg.max_period);
+                for (int p = 0; p < rows[s]->ne[0]; ++p) {
+                    ((int32_t*)rows[s]->data)[p] = (int32_t)cache.row(seq.slot, p);
+                }
+                col += seq.n_tokens;
+            }
+        }
+
+        // --- embeddings: sum over codebooks, plus position ---------
+        ggml_tensor* x = ggml_map_custom3(ctx, pos, tokens, w.emb_packed, embed_sum_op, GGML_N_TASKS_MAX, nullptr);
+
+        // --- transformer (norm_first) ----------------------------
+        // Each block's output GEMM result is added to the residual stream x
+        // by the op that also computes the next block's input norm
+        // (add_layer_norm), so per block there is one element-wise pass
+        // between GEMMs; GELU runs in place on the linear1 output. Only the
+        // first layer's norm1 has no pending residual before it.
+        const float* eps = &cfg.norm_eps;
+        ggml_tensor* h   = layer_norm(ctx, x, w.layers[0].norm1_wb, eps);
+        for (int il = 0; il < cfg.n_layer; ++il) {
+            const LMLayerWeights& L = w.layers[il];
+
+            // self-attention over the cache
+            ggml_tensor* qkv = ggml_mul_mat(ctx, L.self_attn_in, h); // [3D, N]
+
+            std::vector<ggml_tensor*> parts(batch.size());
+            int64_t col = 0;
+            for (std::size_t s = 0; s < batch.size(); ++s) {
+                const int64_t n   = batch[s].n_tokens;
+                const size_t  off = col * qkv->nb[1];
+                ggml_tensor* q = ggml_view_2d(ctx, qkv, D, n, qkv->nb[1], off);
+                ggml_tensor* k = ggml_view_2d(ctx, qkv, D, n, qkv->nb[1], off + D * qkv->nb[0]);
+                ggml_tensor* v = ggml_view_2d(ctx, qkv, D, n, qkv->nb[1], off + 2 * D * qkv->nb[0]);
+                parts[s] = self_attention(ctx, gf, cache, il, q, k, v, cfg.n_head, store[s], rows[s]);
+                col += n;
+            }
+            ggml_tensor* attn = gather_cols(state, gf, batch, parts, D, N);
+            ggml_tensor* out  = ggml_mul_mat(ctx, L.self_attn_out, attn);
+
+            // cross-attention over each sequence's cached conditioning K / V
+            if (any_cond) {
+                h = add_layer_norm(ctx, x, out, L.norm_cross_wb, eps);
+                ggml_tensor* q_all = ggml_mul_mat(ctx, weight_rows(ctx, L.cross_attn_in, 0, D), h);
+
+                col = 0;
+                for (std::size_t s = 0; s < batch.size(); ++s) {
+                    const int64_t n = batch[s].n_tokens;
+                    parts[s] = nullptr;
+                    if (n_cond[s] > 0) {
+                        ggml_tensor* q = ggml_view_2d(ctx, q_all, D, n, q_all->nb[1], col * q_all->nb[1]);
+                        parts[s] = cross_attention(ctx, cache, il, batch[s].slot, q, cfg.n_head, n_cond[s]);
+                    }
+                    col += n;
+                }
+                attn = gather_cols(state, gf, batch, parts, D, N);
+                out = ggml_mul_mat(ctx, L.cross_attn_out, attn);
+            }
+
+            // feed-forward; its residual add goes with the next layer's norm1
+            h   = add_layer_norm(ctx, x, out, L.norm2_wb, eps);
+            h   = ggml_gelu_inplace(ctx, ggml_mul_mat(ctx, L.linear1, h));
+            out = ggml_mul_mat(ctx, L.linear2, h);
+            h   = add_layer_norm(ctx, x, out, il + 1 < cfg.n_layer ? w.layers[il + 1].norm1_wb : w.out_norm_wb, eps);
+        }
+        x = h;
+
+        // --- guidance mix, ahead of the (linear) heads --------------
+        if (guided) {
+            N /= 2;
+            ggml_tensor* x_c = ggml_view_2d(ctx, x, D, N, x->nb[1], 0);
+            ggml_tensor* x_u = ggml_view_2d(ctx, x, D, N, x->nb[1], N * x->nb[1]);
+            x = ggml_add(ctx, x_u, ggml_scale(ctx, ggml_sub(ctx, x_c, x_u), cfg_coef));
+        }
+
+        // --- all codebook heads as one [n_q * card, D] GEMM --------
+        ggml_tensor* logits = ggml_reshape_3d(ctx, ggml_mul_mat(ctx, w.heads_packed, x), cfg.card, cfg.n_q, N);
+        ggml_build_forward_expand(gf, logits);
+        return logits;
+    }
+};
+
+}
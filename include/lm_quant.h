@@ -0,0 +1,263 @@
+#pragma once
+
+#include "ggml.h"
+#include "lm.h"
+
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace musicgen {
+
+//-------------------------------------
+// Quantized LM weights
+//-------------------------------------
+// A batch-1 decode step reads every linear weight of every layer once, so
+// its speed is the weight bytes over memory bandwidth. Stored as ggml block
+// types (Q8_0: 8.5 bits per weight, Q5_0: 5.5, Q4_0: 4.5, against F16's 16)
+// the linears take that many fewer bytes per step. ggml_mul_mat runs them
+// through ggml-cpu's SIMD block dot kernels (AVX2 / AVX-512 / NEON), the
+// activations quantized to Q8 on the fly, so nothing else in the graph
+// changes.
+//
+// A profile picks a type per tensor class, optionally for a layer range:
+//   "emb=f16,heads=f16,attn=q8_0,ffn=q4_0,ffn@0-1=q8_0"
+// Later rules win. An item may also name a preset (lm_quant_presets()),
+// which expands in place: "mixed,ffn@23=q8_0". Norms always stay F32.
+
+enum LMTensorClass {
+    LM_CLASS_EMB,        // emb.*
+    LM_CLASS_HEADS,      // linears.*
+    LM_CLASS_SELF_ATTN,  // self_attn in / out projections
+    LM_CLASS_CROSS_ATTN, // cross_attention in / out projections
+    LM_CLASS_FFN,        // linear1, linear2
+    LM_CLASS_COUNT,
+};
+
+struct LMQuantRule {
+    LMTensorClass cls;
+    int           il0  = 0;       // layers il0 .. il1, inclusive
+    int           il1  = INT_MAX;
+    ggml_type     type = GGML_TYPE_F16;
+};
+
+struct LMQuantProfile {
+    std::string              name;
+    std::vector<LMQuantRule> rules;
+
+    // Type for a tensor of class `cls` in layer `il` (emb and heads: -1),
+    // or `src` when no rule covers it.
+    ggml_type type_for(LMTensorClass cls, int il, ggml_type src) const {
+        ggml_type t = src;
+        for (const auto& r : rules) {
+            if (r.cls == cls && (il < 0 || (il >= r.il0 && il <= r.il1))) t = r.type;
+        }
+        return t;
+    }
+};
+
+// Named profiles: {name, spec}.
+inline const std::vector<std::pair<std::string, std::string>>& lm_quant_presets() {
+    static const std::vector<std::pair<std::string, std::string>> presets = {
+        {"source", ""},
+        {"f32",    "all=f32"},
+        {"f16",    "all=f16"},
+        {"q8_0",   "emb=f16,heads=f16,attn=q8_0,ffn=q8_0"},
+        {"mixed",  "emb=f16,heads=f16,attn=q8_0,ffn=q4_0"},
+        {"q5_0",   "emb=f16,heads=f16,attn=q5_0,ffn=q5_0"},
+        {"q4_0",   "emb=f16,heads=f16,attn=q4_0,ffn=q4_0"},
+    };
+    return presets;
+}
+
+inline bool lm_quant_parse_type(const std::string& s, ggml_type& type) {
+    static const std::pair<const char*, ggml_type> types[] = {
+        {"f32",  GGML_TYPE_F32},
+        {"f16",  GGML_TYPE_F16},
+        {"q8_0", GGML_TYPE_Q8_0},
+        {"q5_0", GGML_TYPE_Q5_0},
+        {"q4_0", GGML_TYPE_Q4_0},
+    };
+    for (const auto& t : types) {
+        if (s == t.first) {
+            type = t.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses a profile spec (see above) into `profile`. Returns false, with a
+// message on stderr, on anything it does not understand.
+inline bool lm_quant_parse_profile(const std::string& spec, LMQuantProfile& profile) {
+    static const std::pair<const char*, std::vector<LMTensorClass>> classes[] = {
+        {"emb",        {LM_CLASS_EMB}},
+        {"heads",      {LM_CLASS_HEADS}},
+        {"linears",    {LM_CLASS_HEADS}},
+        {"self_attn",  {LM_CLASS_SELF_ATTN}},
+        {"cross_attn", {LM_CLASS_CROSS_ATTN}},
+        {"attn",       {LM_CLASS_SELF_ATTN, LM_CLASS_CROSS_ATTN}},
+        {"ffn",        {LM_CLASS_FFN}},
+        {"all",        {LM_CLASS_EMB, LM_CLASS_HEADS, LM_CLASS_SELF_ATTN, LM_CLASS_CROSS_ATTN, LM_CLASS_FFN}},
+    };
+
+    LMQuantProfile out;
+    out.name = spec;
+    std::size_t pos = 0;
+    while (pos <= spec.size()) {
+        std::size_t end = spec.find(',', pos);
+        if (end == std::string::npos) end = spec.size();
+        const std::string item = spec.substr(pos, end - pos);
+        pos = end + 1;
+        if (item.empty()) continue;
+
+        const std::size_t eq = item.find('=');
+        if (eq == std::string::npos) {
+            bool found = false;
+            for (const auto& p : lm_quant_presets()) {
+                LMQuantProfile sub;
+                if (p.first == item && lm_quant_parse_profile(p.second, sub)) {
+                    out.rules.insert(out.rules.end(), sub.rules.begin(), sub.rules.end());
+                    found = true;
+                }
+            }
+            if (!found) {
+                std::fprintf(stderr, "%s: unknown profile '%s'\n", __func__, item.c_str());
+                return false;
+            }
+            continue;
+        }
+
+        std::string cls = item.substr(0, eq);
+        int il0 = 0, il1 = INT_MAX;
+        const std::size_t at = cls.find('@');
+        if (at != std::string::npos) {
+            const std::string range = cls.substr(at + 1);
+            const std::size_t dash  = range.find('-');
+            char* rest = nullptr;
+            il0 = (int)std::strtol(range.c_str(), &rest, 10);
+            il1 = dash == std::string::npos ? il0 : (int)std::strtol(range.c_str() + dash + 1, &rest, 10);
+            if (range.empty() || *rest != '\0' || il0 < 0 || il1 < il0) {
+                std::fprintf(stderr, "%s: bad layer range in '%s'\n", __func__, item.c_str());
+                return false;
+            }
+            cls.resize(at);
+        }
+        ggml_type type;
+        if (!lm_quant_parse_type(item.substr(eq + 1), type)) {
+            std::fprintf(stderr, "%s: unknown type in '%s'\n", __func__, item.c_str());
+            return false;
+        }
+        bool found = false;
+        for (const auto& c : classes) {
+            if (cls != c.first) continue;
+            for (LMTensorClass k : c.second) out.rules.push_back({k, il0, il1, type});
+            found = true;
+        }
+        if (!found) {
+            std::fprintf(stderr, "%s: unknown tensor class in '%s'\n", __func__, item.c_str());
+            return false;
+        }
+    }
+    profile = std::move(out);
+    return true;
+}
+
+// Every weight of `w` with its class (-1: a norm, kept as is) and layer.
+struct LMWeightSlot {
+    ggml_tensor** t;
+    int           cls;
+    int           il;
+};
+
+inline std::vector<LMWeightSlot> lm_weight_slots(LMWeights& w) {
+    std::vector<LMWeightSlot> out;
+    for (auto& t : w.emb) out.push_back({&t, LM_CLASS_EMB, -1});
+    for (auto& t : w.linears) out.push_back({&t, LM_CLASS_HEADS, -1});
+    for (int il = 0; il < (int)w.layers.size(); ++il) {
+        LMLayerWeights& L = w.layers[il];
+        for (ggml_tensor** t : {&L.norm1_w, &L.norm1_b, &L.norm_cross_w, &L.norm_cross_b, &L.norm2_w, &L.norm2_b}) {
+            out.push_back({t, -1, il});
+        }
+        out.push_back({&L.self_attn_in, LM_CLASS_SELF_ATTN, il});
+        out.push_back({&L.self_attn_out, LM_CLASS_SELF_ATTN, il});
+        out.push_back({&L.cross_attn_in, LM_CLASS_CROSS_ATTN, il});
+        out.push_back({&L.cross_attn_out, LM_CLASS_CROSS_ATTN, il});
+        out.push_back({&L.linear1, LM_CLASS_FFN, il});
+        out.push_back({&L.linear2, LM_CLASS_FFN, il});
+    }
+    out.push_back({&w.out_norm_w, -1, -1});
+    out.push_back({&w.out_norm_b, -1, -1});
+    return out;
+}
+
+// Bytes of weights a decode step reads: every layer's linears, the packed
+// heads and one embedding row per codebook.
+inline std::size_t lm_step_bytes(const LMStore& store) {
+    const LMWeights& w = store.weights();
+    std::size_t n = ggml_nbytes(w.heads_packed) + store.config().n_q * w.emb_packed->nb[1];
+    for (const auto& L : w.layers) {
+        for (const ggml_tensor* t : {L.self_attn_in, L.self_attn_out, L.cross_attn_in, L.cross_attn_out, L.linear1, L.linear2}) {
+            n += ggml_nbytes(t);
+        }
+    }
+    return n;
+}
+
+// A new store holding `src`'s weights converted as `profile` says, for
+// trying profiles on one loaded checkpoint (scripts/convert_lm_to_gguf.py
+// writes them to disk instead). A tensor whose rows do not split into
+// whole blocks of its new type keeps its type.
+inline std::shared_ptr<const LMStore> lm_quantize(const LMStore& src, const LMQuantProfile& profile) {
+    LMWeights w = src.weights();
+    w.emb_packed   = nullptr;
+    w.heads_packed = nullptr;
+    std::vector<LMWeightSlot> slots = lm_weight_slots(w);
+
+    std::vector<ggml_type> types;
+    std::size_t ctx_size = 0;
+    for (const auto& s : slots) {
+        const ggml_tensor* t = *s.t;
+        ggml_type type = s.cls < 0 ? t->type : profile.type_for((LMTensorClass)s.cls, s.il, t->type);
+        if (t->ne[0] % ggml_blck_size(type) != 0) {
+            std::fprintf(stderr, "%s: '%s': rows of %lld do not split into %s blocks, kept as %s\n", __func__,
+                         ggml_get_name(t), (long long)t->ne[0], ggml_type_name(type), ggml_type_name(t->type));
+            type = t->type;
+        }
+        types.push_back(type);
+        ctx_size += ggml_tensor_overhead() + GGML_PAD(ggml_row_size(type, t->ne[0]) * ggml_nrows(t), GGML_MEM_ALIGN);
+    }
+    ggml_init_params params{
+        .mem_size   = ctx_size,
+        .mem_buffer = nullptr,
+        .no_alloc   = false
+    };
+    ggml_context* ctx = ggml_init(params);
+    if (!ctx) return nullptr;
+
+    std::vector<float> row;
+    for (std::size_t i = 0; i < slots.size(); ++i) {
+        const ggml_tensor* t   = *slots[i].t;
+        ggml_tensor*       dst = ggml_new_tensor(ctx, types[i], ggml_n_dims(t), t->ne);
+        ggml_set_name(dst, ggml_get_name(t));
+        if (t->type == types[i]) {
+            std::memcpy(dst->data, t->data, ggml_nbytes(t));
+        } else {
+            const int64_t n_per_row = t->ne[0], n_rows = ggml_nrows(t);
+            row.resize((std::size_t)(n_per_row * n_rows));
+            if (t->type == GGML_TYPE_F32) std::memcpy(row.data(), t->data, ggml_nbytes(t));
+            else                          ggml_get_type_traits(t->type)->to_float(t->data, row.data(), n_per_row * n_rows);
+            ggml_quantize_chunk(types[i], row.data(), dst->data, 0, n_rows, n_per_row, nullptr);
+        }
+        *slots[i].t = dst;
+    }
+    return std::make_shared<const LMStore>(ctx, src.config(), std::move(w));
+}
+
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "ggml.h"
+#include "lm.h"
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <utility>
+
+namespace musicgen {
+
+//-------------------------------------
+// Random LM weights
+//-------------------------------------
+// An LMStore of the given shape filled with N(0, 0.02) F16 matrices and
+// unit / zero F32 norms, for timing without a checkpoint. The context is
+// sized the way the loader sizes it: every tensor's bytes padded to
+// GGML_MEM_ALIGN plus one tensor overhead each.
+inline std::shared_ptr<const LMStore> random_lm_weights(const LMConfig& cfg, uint64_t seed) {
+    const int64_t D = cfg.d_model;
+
+    // Both passes create the same tensors in the same order: the first
+    // only adds up their size, the second fills a context of that size.
+    auto layout = [&](auto&& mat, auto&& vec) {
+        LMWeights w;
+        for (int k = 0; k < cfg.n_q; ++k) {
+            w.emb.push_back(mat(D, cfg.card + 1));
+            w.linears.push_back(mat(D, cfg.card));
+        }
+        for (int il = 0; il < cfg.n_layer; ++il) {
+            LMLayerWeights L;
+            L.norm1_w        = vec(D, 1.0f);
+            L.norm1_b        = vec(D, 0.0f);
+            L.self_attn_in   = mat(D, 3 * D);
+            L.self_attn_out  = mat(D, D);
+            L.norm_cross_w   = vec(D, 1.0f);
+            L.norm_cross_b   = vec(D, 0.0f);
+            L.cross_attn_in  = mat(D, 3 * D);
+            L.cross_attn_out = mat(D, D);
+            L.norm2_w        = vec(D, 1.0f);
+            L.norm2_b        = vec(D, 0.0f);
+            L.linear1        = mat(D, cfg.d_ff);
+            L.linear2        = mat(cfg.d_ff, D);
+            w.layers.push_back(L);
+        }
+        w.out_norm_w = vec(D, 1.0f);
+        w.out_norm_b = vec(D, 0.0f);
+        return w;
+    };
+
+    size_t ctx_size = 0;
+    auto count = [&](ggml_type type, int64_t ne0, int64_t ne1) -> ggml_tensor* {
+        ctx_size += ggml_tensor_overhead() + GGML_PAD(ggml_row_size(type, ne0) * ne1, GGML_MEM_ALIGN);
+        return nullptr;
+    };
+    layout([&](int64_t ne0, int64_t ne1) { return count(GGML_TYPE_F16, ne0, ne1); },
+           [&](int64_t n, float) { return count(GGML_TYPE_F32, n, 1); });
+
+    ggml_init_params params{
+        .mem_size   = ctx_size + GGML_MEM_ALIGN,
+        .mem_buffer = nullptr,
+        .no_alloc   = false
+    };
+    ggml_context* ctx = ggml_init(params);
+    if (!ctx) return nullptr;
+
+    std::mt19937 rng{(uint32_t)seed};
+    std::normal_distribution<float> dist{0.0f, 0.02f};
+    LMWeights w = layout(
+        [&](int64_t ne0, int64_t ne1) {
+            ggml_tensor* t = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, ne0, ne1);
+            for (int64_t i = 0; i < ggml_nelements(t); ++i) ((ggml_fp16_t*)t->data)[i] = ggml_fp32_to_fp16(dist(rng));
+            return t;
+        },
+        [&](int64_t n, float value) {
+            ggml_tensor* t = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n);
+            for (int64_t i = 0; i < n; ++i) ((float*)t->data)[i] = value;
+            return t;
+        });
+    return std::make_shared<const LMStore>(ctx, cfg, std::move(w));
+}
+
+}
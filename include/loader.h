@@ -0,0 +1,524 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ggml.h"
+#include "encodec.h"
+#include "lm.h"
+#include "t5.h"
+
+// Loads a checkpoint written by scripts/convert_state_dict_to_gguf.py (or
+// convert_lm_to_gguf.py / convert_t5_to_gguf.py).
+//
+// Layout (all little-endian):
+//   "GGUF" | u32 version (3) | u64 n_tensors | u64 n_metadata
+//   n_metadata x { str key | str value }         str = u32 len + bytes
+//   n_tensors  x { str name | u32 n_dims | u64 dims[n_dims] | u32 dtype | u64 offset }
+//   raw tensor data at the given offsets
+//
+// dtype is the ggml type: 0 = F32, 1 = F16, or a block type the LM
+// converter writes (2 = Q4_0, 6 = Q5_0, 8 = Q8_0), stored as ggml does.
+//
+// Shapes are PyTorch (row-major), so dims are reversed into ggml order:
+// a conv weight (out, in, k) becomes ne = {k, in, out}.
+
+static bool encodec_read_string(std::ifstream &f, std::string &s) {
+    uint32_t len = 0;
+    if (!f.read(reinterpret_cast<char *>(&len), sizeof(len))) return false;
+    s.assign(len, '\0');
+    return (bool)f.read(&s[0], len);
+}
+
+// Checkpoint tensors group into subsystems by name prefix, so a service can
+// load only the parts its role runs: a decode-only worker needs the
+// quantizer codebooks, not the encoder and its LSTM.
+enum encodec_subsystem : uint32_t {
+    ENCODEC_SUB_ENCODER   = 1u << 0, // encoder.*
+    ENCODEC_SUB_DECODER   = 1u << 1, // decoder.*
+    ENCODEC_SUB_QUANTIZER = 1u << 2, // quantizer.*
+    ENCODEC_SUB_LM        = 1u << 3, // emb.*, transformer.*, linears.*, out_norm.*
+    ENCODEC_SUB_TEXT      = 1u << 4, // t5.*, condition_provider.*
+    ENCODEC_SUB_OTHER     = 1u << 5,
+    ENCODEC_SUB_ALL       = (1u << 6) - 1,
+};
+
+static uint32_t encodec_tensor_subsystem(const std::string &name) {
+    static const std::pair<const char *, uint32_t> prefixes[] = {
+        {"encoder.",            ENCODEC_SUB_ENCODER},
+        {"decoder.",            ENCODEC_SUB_DECODER},
+        {"quantizer.",          ENCODEC_SUB_QUANTIZER},
+        {"emb.",                ENCODEC_SUB_LM},
+        {"transformer.",        ENCODEC_SUB_LM},
+        {"linears.",            ENCODEC_SUB_LM},
+        {"out_norm.",           ENCODEC_SUB_LM},
+        {"t5.",                 ENCODEC_SUB_TEXT},
+        {"condition_provider.", ENCODEC_SUB_TEXT},
+    };
+    for (const auto &p : prefixes) {
+        if (name.compare(0, std::strlen(p.first), p.first) == 0) return p.second;
+    }
+    return ENCODEC_SUB_OTHER;
+}
+
+struct encodec_tensor_info {
+    std::string name;
+    int         n_dims;
+    int64_t     ne[GGML_MAX_DIMS];
+    ggml_type   type;
+    uint64_t    offset;
+    uint32_t    subsystem;
+
+    size_t nbytes() const { return ggml_row_size(type, ne[0]) * ne[1] * ne[2] * ne[3]; }
+};
+
+// The header of a checkpoint: its metadata and where each tensor lives,
+// without any tensor data.
+struct encodec_model_index {
+    std::string                        path;
+    std::map<std::string, std::string> metadata;
+    std::vector<encodec_tensor_info>   tensors;
+
+    // Subsystems with at least one tensor in the file.
+    uint32_t subsystems() const {
+        uint32_t mask = 0;
+        for (const auto &t : tensors) mask |= t.subsystem;
+        return mask;
+    }
+
+    // Tensor data bytes of the given subsystems.
+    size_t bytes(uint32_t subsystems) const {
+        size_t n = 0;
+        for (const auto &t : tensors) {
+            if (t.subsystem & subsystems) n += t.nbytes();
+        }
+        return n;
+    }
+};
+
+// Reads the metadata and the tensor table of `path`. Returns false on any
+// error.
+static bool encodec_model_read_index(const std::string &path, encodec_model_index &index) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) {
+        std::fprintf(stderr, "%s: failed to open '%s'\n", __func__, path.c_str());
+        return false;
+    }
+
+    char magic[4];
+    uint32_t version = 0;
+    uint64_t n_tensors = 0, n_metadata = 0;
+    f.read(magic, 4);
+    f.read(reinterpret_cast<char *>(&version), sizeof(version));
+    f.read(reinterpret_cast<char *>(&n_tensors), sizeof(n_tensors));
+    f.read(reinterpret_cast<char *>(&n_metadata), sizeof(n_metadata));
+    if (!f || std::string(magic, 4) != "GGUF" || version != 3) {
+        std::fprintf(stderr, "%s: '%s' is not a version 3 checkpoint\n", __func__, path.c_str());
+        return false;
+    }
+
+    std::map<std::string, std::string> metadata;
+    for (uint64_t i = 0; i < n_metadata; ++i) {
+        std::string key, value;
+        if (!encodec_read_string(f, key) || !encodec_read_string(f, value)) {
+            std::fprintf(stderr, "%s: truncated metadata\n", __func__);
+            return false;
+        }
+        metadata[key] = value;
+    }
+
+    std::vector<encodec_tensor_info> metas(n_tensors);
+    for (auto &m : metas) {
+        uint32_t n_dims = 0, dtype = 0;
+        if (!encodec_read_string(f, m.name) ||
+            !f.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims)) ||
+            n_dims == 0 || n_dims > GGML_MAX_DIMS) {
+            std::fprintf(stderr, "%s: bad tensor header\n", __func__);
+            return false;
+        }
+        m.n_dims = (int)n_dims;
+        for (int d = 0; d < GGML_MAX_DIMS; ++d) m.ne[d] = 1;
+        for (uint32_t d = 0; d < n_dims; ++d) {
+            uint64_t dim = 0;
+            f.read(reinterpret_cast<char *>(&dim), sizeof(dim));
+            m.ne[n_dims - 1 - d] = (int64_t)dim;
+        }
+        f.read(reinterpret_cast<char *>(&dtype), sizeof(dtype));
+        f.read(reinterpret_cast<char *>(&m.offset), sizeof(m.offset));
+        const bool known = dtype == GGML_TYPE_F32 || dtype == GGML_TYPE_F16 || dtype == GGML_TYPE_Q4_0 ||
+                           dtype == GGML_TYPE_Q5_0 || dtype == GGML_TYPE_Q8_0;
+        if (!f || !known || m.ne[0] % ggml_blck_size((ggml_type)dtype) != 0) {
+            std::fprintf(stderr, "%s: tensor '%s': unsupported dtype %u\n", __func__, m.name.c_str(), dtype);
+            return false;
+        }
+        m.type      = (ggml_type)dtype;
+        m.subsystem = encodec_tensor_subsystem(m.name);
+    }
+
+    index.path     = path;
+    index.metadata = std::move(metadata);
+    index.tensors  = std::move(metas);
+    return true;
+}
+
+// Fills `model.ctx`, `model.tensors` and `model.metadata` with the tensors
+// of the given subsystems; the data of the others is never read. The
+// context is sized to hold exactly those tensors. Returns false (and leaves
+// `model` untouched) on any error.
+static bool encodec_model_load(const encodec_model_index &index, encodec_model &model,
+                               uint32_t subsystems = ENCODEC_SUB_ALL) {
+    std::ifstream f(index.path, std::ios::binary);
+    if (!f) {
+        std::fprintf(stderr, "%s: failed to open '%s'\n", __func__, index.path.c_str());
+        return false;
+    }
+
+    size_t ctx_size = 0;
+    for (const auto &m : index.tensors) {
+        if (m.subsystem & subsystems) ctx_size += ggml_tensor_overhead() + GGML_PAD(m.nbytes(), GGML_MEM_ALIGN);
+    }
+
+    ggml_init_params params{
+        .mem_size   = ctx_size + GGML_MEM_ALIGN,
+        .mem_buffer = nullptr,
+        .no_alloc   = false
+    };
+    ggml_context *ctx = ggml_init(params);
+
+    std::map<std::string, ggml_tensor *> tensors;
+    for (const auto &m : index.tensors) {
+        if (!(m.subsystem & subsystems)) continue;
+        ggml_tensor *t = ggml_new_tensor(ctx, m.type, m.n_dims, m.ne);
+        ggml_set_name(t, m.name.c_str());
+        f.seekg((std::streamoff)m.offset, std::ios::beg);
+        if (!f.read(reinterpret_cast<char *>(t->data), ggml_nbytes(t))) {
+            std::fprintf(stderr, "%s: tensor '%s': truncated data\n", __func__, m.name.c_str());
+            ggml_free(ctx);
+            return false;
+        }
+        tensors[m.name] = t;
+    }
+
+    model.ctx      = ctx;
+    model.tensors  = std::move(tensors);
+    model.metadata = index.metadata;
+    return true;
+}
+
+static bool encodec_model_load(const std::string &path, encodec_model &model,
+                               uint32_t subsystems = ENCODEC_SUB_ALL) {
+    encodec_model_index index;
+    return encodec_model_read_index(path, index) && encodec_model_load(index, model, subsystems);
+}
+
+static ggml_tensor *encodec_get_tensor(const encodec_model &model, const std::string &name) {
+    auto it = model.tensors.find(name);
+    if (it == model.tensors.end()) {
+        std::fprintf(stderr, "%s: missing tensor '%s'\n", __func__, name.c_str());
+        return nullptr;
+    }
+    return it->second;
+}
+
+// Maps the `quantizer.*` codebooks of a loaded checkpoint, in RVQ order.
+static bool encodec_quantizer_weights(const encodec_model &model, std::vector<encodec::QuantizerCodebook> &codebooks) {
+    codebooks.clear();
+    for (int i = 0;; ++i) {
+        const std::string name = "quantizer.vq.layers." + std::to_string(i) + "._codebook.embed";
+        if (!model.tensors.count(name)) break;
+        codebooks.push_back({model.tensors.at(name)});
+    }
+    if (codebooks.empty()) {
+        std::fprintf(stderr, "%s: no quantizer codebooks\n", __func__);
+        return false;
+    }
+    return true;
+}
+
+// Maps the `encoder.*` / `quantizer.*` tensors of a loaded checkpoint onto
+// encodec::Weights (see docs/compression_model.txt for the module layout).
+static bool encodec_encoder_weights(const encodec_model &model, encodec::Weights &w) {
+    bool ok = true;
+    auto get = [&](const std::string &name) {
+        ggml_tensor *t = encodec_get_tensor(model, name);
+        ok = ok && t != nullptr;
+        return t;
+    };
+    auto conv = [&](const std::string &prefix) {
+        return encodec::Conv1dWeights{
+            get(prefix + ".conv.conv.weight_g"),
+            get(prefix + ".conv.conv.weight_v"),
+            get(prefix + ".conv.conv.bias"),
+        };
+    };
+
+    w.first_conv = conv("encoder.model.0");
+
+    // SEANet stages: resnet block at 1 + 3i, down-sampling conv at 3 + 3i
+    w.resnet_blocks.clear();
+    w.downsample.clear();
+    for (int i = 0; i < 4; ++i) {
+        const std::string res = "encoder.model." + std::to_string(1 + 3 * i);
+        w.resnet_blocks.push_back({conv(res + ".block.1"), conv(res + ".block.3")});
+        w.downsample.push_back(conv("encoder.model." + std::to_string(3 + 3 * i)));
+    }
+
+    w.lstm = {
+        get("encoder.model.13.lstm.weight_ih_l0"),
+        get("encoder.model.13.lstm.weight_hh_l0"),
+        get("encoder.model.13.lstm.bias_ih_l0"),
+        get("encoder.model.13.lstm.bias_hh_l0"),
+    };
+
+    return encodec_quantizer_weights(model, w.codebooks) && ok;
+}
+
+// Maps the `emb.*` / `transformer.*` / `linears.*` tensors of a loaded LM
+// checkpoint onto musicgen::LMWeights (see docs/lm_structure.txt). Sizes come
+// from the tensor shapes; the head count from the "n_heads" metadata key,
+// defaulting to MusicGen's 64-wide heads.
+static bool musicgen_lm_weights(const encodec_model &model, musicgen::LMConfig &cfg, musicgen::LMWeights &w) {
+    bool ok = true;
+    auto get = [&](const std::string &name) {
+        ggml_tensor *t = encodec_get_tensor(model, name);
+        ok = ok && t != nullptr;
+        return t;
+    };
+
+    w.emb.clear();
+    w.linears.clear();
+    for (int k = 0; model.tensors.count("emb." + std::to_string(k) + ".weight"); ++k) {
+        w.emb.push_back(model.tensors.at("emb." + std::to_string(k) + ".weight"));
+        w.linears.push_back(get("linears." + std::to_string(k) + ".weight"));
+    }
+    if (w.emb.empty() || !ok) {
+        std::fprintf(stderr, "%s: no codebook embeddings / heads\n", __func__);
+        return false;
+    }
+
+    w.layers.clear();
+    for (int il = 0;; ++il) {
+        const std::string p = "transformer.layers." + std::to_string(il) + ".";
+        if (!model.tensors.count(p + "norm1.weight")) break;
+        musicgen::LMLayerWeights L;
+        L.norm1_w        = get(p + "norm1.weight");
+        L.norm1_b        = get(p + "norm1.bias");
+        L.self_attn_in   = get(p + "self_attn.in_proj_weight");
+        L.self_attn_out  = get(p + "self_attn.out_proj.weight");
+        L.norm_cross_w   = get(p + "norm_cross.weight");
+        L.norm_cross_b   = get(p + "norm_cross.bias");
+        L.cross_attn_in  = get(p + "cross_attention.in_proj_weight");
+        L.cross_attn_out = get(p + "cross_attention.out_proj.weight");
+        L.norm2_w        = get(p + "norm2.weight");
+        L.norm2_b        = get(p + "norm2.bias");
+        L.linear1        = get(p + "linear1.weight");
+        L.linear2        = get(p + "linear2.weight");
+        w.layers.push_back(L);
+    }
+    w.out_norm_w = get("out_norm.weight");
+    w.out_norm_b = get("out_norm.bias");
+    if (!ok || w.layers.empty()) return false;
+
+    cfg.n_q     = (int)w.emb.size();
+    cfg.card    = (int)w.linears[0]->ne[1];
+    cfg.d_model = w.emb[0]->ne[0];
+    cfg.n_layer = (int)w.layers.size();
+    cfg.d_ff    = w.layers[0].linear1->ne[1];
+    auto heads  = model.metadata.find("n_heads");
+    cfg.n_head  = heads != model.metadata.end() ? std::stoi(heads->second) : (int)(cfg.d_model / 64);
+    return true;
+}
+
+// Maps a T5 text conditioner checkpoint (scripts/convert_t5_to_gguf.py) onto
+// musicgen::T5Weights: the HF T5 encoder under `t5.`, the LM's
+// `condition_provider.conditioners.description.output_proj`, and the
+// SentencePiece vocabulary as "t5.vocab" metadata (pieces separated by
+// '\n') plus a `t5.vocab_scores` tensor. Sizes come from the tensor shapes.
+static bool musicgen_t5_weights(const encodec_model &model, musicgen::T5Config &cfg,
+                                musicgen::T5Weights &w, musicgen::T5Tokenizer &tok) {
+    bool ok = true;
+    auto get = [&](const std::string &name) {
+        ggml_tensor *t = encodec_get_tensor(model, name);
+        ok = ok && t != nullptr;
+        return t;
+    };
+
+    w.shared     = get("t5.shared.weight");
+    w.rel_bias   = get("t5.encoder.block.0.layer.0.SelfAttention.relative_attention_bias.weight");
+    w.final_norm = get("t5.encoder.final_layer_norm.weight");
+    w.proj_w     = get("condition_provider.conditioners.description.output_proj.weight");
+    w.proj_b     = get("condition_provider.conditioners.description.output_proj.bias");
+    ggml_tensor *scores = get("t5.vocab_scores");
+    if (!ok) return false;
+
+    w.layers.clear();
+    for (int il = 0;; ++il) {
+        const std::string p = "t5.encoder.block." + std::to_string(il) + ".layer.";
+        if (!model.tensors.count(p + "0.layer_norm.weight")) break;
+        const bool gated = model.tensors.count(p + "1.DenseReluDense.wi_0.weight") > 0;
+        musicgen::T5LayerWeights L;
+        L.attn_norm = get(p + "0.layer_norm.weight");
+        L.q         = get(p + "0.SelfAttention.q.weight");
+        L.k         = get(p + "0.SelfAttention.k.weight");
+        L.v         = get(p + "0.SelfAttention.v.weight");
+        L.o         = get(p + "0.SelfAttention.o.weight");
+        L.ff_norm   = get(p + "1.layer_norm.weight");
+        L.wi        = get(p + (gated ? "1.DenseReluDense.wi_0.weight" : "1.DenseReluDense.wi.weight"));
+        L.wi_1      = gated ? get(p + "1.DenseReluDense.wi_1.weight") : nullptr;
+        L.wo        = get(p + "1.DenseReluDense.wo.weight");
+        w.layers.push_back(L);
+    }
+    if (!ok || w.layers.empty()) return false;
+
+    auto vocab = model.metadata.find("t5.vocab");
+    if (vocab == model.metadata.end() || scores->type != GGML_TYPE_F32) {
+        std::fprintf(stderr, "%s: missing T5 vocabulary\n", __func__);
+        return false;
+    }
+    std::vector<std::string> pieces;
+    for (std::size_t pos = 0;;) {
+        const std::size_t end = vocab->second.find('\n', pos);
+        pieces.push_back(vocab->second.substr(pos, end - pos));
+        if (end == std::string::npos) break;
+        pos = end + 1;
+    }
+    if ((int64_t)pieces.size() != scores->ne[0]) {
+        std::fprintf(stderr, "%s: %zu vocabulary pieces, %lld scores\n", __func__,
+                     pieces.size(), (long long)scores->ne[0]);
+        return false;
+    }
+    const float *s = (const float *)scores->data;
+    tok = musicgen::T5Tokenizer{std::move(pieces), std::vector<float>(s, s + scores->ne[0])};
+
+    cfg.n_vocab   = (int)w.shared->ne[1];
+    cfg.d_model   = w.shared->ne[0];
+    cfg.n_head    = (int)w.rel_bias->ne[0];
+    cfg.n_buckets = (int)w.rel_bias->ne[1];
+    cfg.d_kv      = w.layers[0].q->ne[1] / cfg.n_head;
+    cfg.d_ff      = w.layers[0].wi->ne[1];
+    cfg.n_layer   = (int)w.layers.size();
+    cfg.d_out     = w.proj_w->ne[1];
+    return true;
+}
+
+namespace encodec {
+
+//-------------------------------------
+// Lazy per-subsystem loading
+//-------------------------------------
+// Reads only the tensor table up front. Each store is materialized from its
+// subsystems on first request, into a context of its own, so a process pays
+// startup time and memory only for the parts its role uses. Thread-safe;
+// a failed load returns nullptr and is not retried.
+class ModelLoader {
+public:
+    // nullptr (with a message on stderr) if the checkpoint cannot be indexed.
+    static std::unique_ptr<ModelLoader> open(const std::string& path) {
+        std::unique_ptr<ModelLoader> loader{new ModelLoader};
+        if (!encodec_model_read_index(path, loader->index_)) return nullptr;
+        return loader;
+    }
+
+    ModelLoader(const ModelLoader&)            = delete;
+    ModelLoader& operator=(const ModelLoader&) = delete;
+
+    const encodec_model_index& index() const noexcept { return index_; }
+
+    // Encoder and quantizer, for encode.
+    std::shared_ptr<const WeightStore>       encoder()   { return get(encoder_,   [this] { return load_encoder(); }); }
+    // Codebooks alone, for decode.
+    std::shared_ptr<const QuantizerStore>    quantizer() { return get(quantizer_, [this] { return load_quantizer(); }); }
+    std::shared_ptr<const musicgen::LMStore> lm()        { return get(lm_,        [this] { return load_lm(); }); }
+    // T5 text conditioner.
+    std::shared_ptr<const musicgen::T5Store> text()      { return get(text_,      [this] { return load_text(); }); }
+
+    // Fresh, uncached copies of the stores above, for callers that keep
+    // more than one (such as a replica per NUMA node).
+    std::shared_ptr<const WeightStore> load_encoder() const {
+        return load<WeightStore>(ENCODEC_SUB_ENCODER | ENCODEC_SUB_QUANTIZER, [](encodec_model& m) {
+            Weights w;
+            if (!encodec_encoder_weights(m, w)) return std::shared_ptr<const WeightStore>{};
+            return std::make_shared<const WeightStore>(m.ctx, std::move(w));
+        });
+    }
+
+    std::shared_ptr<const QuantizerStore> load_quantizer() const {
+        return load<QuantizerStore>(ENCODEC_SUB_QUANTIZER, [](encodec_model& m) {
+            std::vector<QuantizerCodebook> codebooks;
+            if (!encodec_quantizer_weights(m, codebooks)) return std::shared_ptr<const QuantizerStore>{};
+            return std::make_shared<const QuantizerStore>(m.ctx, std::move(codebooks));
+        });
+    }
+
+    std::shared_ptr<const musicgen::LMStore> load_lm() const {
+        return load<musicgen::LMStore>(ENCODEC_SUB_LM, [](encodec_model& m) {
+            musicgen::LMConfig  cfg;
+            musicgen::LMWeights w;
+            if (!musicgen_lm_weights(m, cfg, w)) return std::shared_ptr<const musicgen::LMStore>{};
+            return std::make_shared<const musicgen::LMStore>(m.ctx, cfg, std::move(w));
+        });
+    }
+
+    std::shared_ptr<const musicgen::T5Store> load_text() const {
+        return load<musicgen::T5Store>(ENCODEC_SUB_TEXT, [](encodec_model& m) {
+            musicgen::T5Config    cfg;
+            musicgen::T5Weights   w;
+            musicgen::T5Tokenizer tok;
+            if (!musicgen_t5_weights(m, cfg, w, tok)) return std::shared_ptr<const musicgen::T5Store>{};
+            return std::make_shared<const musicgen::T5Store>(m.ctx, cfg, std::move(w), std::move(tok));
+        });
+    }
+
+    // Tensor data bytes read from the checkpoint so far.
+    std::size_t loaded_bytes() const noexcept { return loaded_bytes_.load(); }
+
+private:
+    template <typename Store>
+    struct Slot {
+        std::shared_ptr<const Store> store;
+        bool                         tried = false;
+    };
+
+    ModelLoader() = default;
+
+    template <typename Store, typename Load>
+    std::shared_ptr<const Store> get(Slot<Store>& slot, Load load) {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (!slot.tried) {
+            slot.tried = true;
+            slot.store = load();
+        }
+        return slot.store;
+    }
+
+    template <typename Store, typename Build>
+    std::shared_ptr<const Store> load(uint32_t subsystems, Build build) const {
+        encodec_model model{};
+        if (!encodec_model_load(index_, model, subsystems)) return nullptr;
+        std::shared_ptr<const Store> store = build(model);
+        if (!store) {
+            ggml_free(model.ctx);
+            return nullptr;
+        }
+        loaded_bytes_ += index_.bytes(subsystems);
+        return store;
+    }
+
+    encodec_model_index              index_;
+    std::mutex                       mu_;
+    Slot<WeightStore>                encoder_;
+    Slot<QuantizerStore>             quantizer_;
+    Slot<musicgen::LMStore>          lm_;
+    Slot<musicgen::T5Store>          text_;
+    mutable std::atomic<std::size_t> loaded_bytes_{0};
+};
+
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "batcher.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace musicgen {
+
+struct LongFormConfig {
+    int             window  = 1500; // frames per LM window (30 s at 50 Hz, the trained context)
+    int             overlap = 600;  // frames of generated tail re-primed into the next window
+    SchedulerConfig sched;          // n_ctx is derived from window
+};
+
+struct LongFormWindow {
+    int    n_new   = 0;    // frames this window added
+    int    n_steps = 0;    // LM steps it ran
+    double seconds = 0.0;
+};
+
+//-------------------------------------
+// Long-form generation
+//-------------------------------------
+// Generates any number of frames with a fixed-size KV cache by sliding a
+// window over the output, as audiocraft does for tracks longer than the
+// trained context: each window is a fresh generation whose audio prompt is
+// the last `overlap` frames produced so far. The prompt is prefilled in one
+// batched forward (its KV recomputed at positions 0 ..), the oldest frames
+// are dropped, and the window adds `window - overlap` new frames.
+//
+// Cache memory and the attention cost of a step are therefore bounded by
+// `window` however long the output; the price is one prefill of `overlap`
+// frames per window.
+class LongFormGenerator {
+public:
+    using OnFrames = std::function<void(const int32_t* codes, int n_frames)>;
+
+    LongFormGenerator(std::shared_ptr<const LMStore> store, LongFormConfig cfg)
+        : cfg_{clamp(cfg, store->config())}, n_q_{store->config().n_q},
+          sched_{std::move(store), cfg_.sched} {}
+
+    /**
+     * Generate req.n_frames frames (audio prompt included) for `req`.
+     * Window w samples with seed req.seed + w. `on_frames` (may be null)
+     * receives each window's new frames, n_frames x n_q, as soon as the
+     * window ends.
+     */
+    GenResult generate(const GenRequest& req, const OnFrames& on_frames = nullptr) {
+        GenResult out;
+        out.codes    = req.prompt;
+        out.n_frames = (int)(req.prompt.size() / n_q_);
+        windows_.clear();
+
+        for (uint64_t w = 0; out.n_frames < req.n_frames; ++w) {
+            const int n_tail = std::min(out.n_frames, cfg_.overlap);
+            const int n_win  = std::min(cfg_.window, n_tail + (req.n_frames - out.n_frames));
+
+            GenRequest win;
+            win.cond     = req.cond;
+            win.prompt.assign(out.codes.end() - (std::ptrdiff_t)n_tail * n_q_, out.codes.end());
+            win.n_frames = n_win;
+            win.seed     = req.seed + w;
+            win.sampling = req.sampling;
+
+            const auto t0 = encodec::Clock::now();
+            std::future<GenResult> f = sched_.submit(std::move(win));
+            int n_steps = 0;
+            while (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                sched_.step();
+                ++n_steps;
+            }
+            GenResult r = f.get();
+            if (!r.ok) return GenResult{};
+
+            const int32_t* fresh = r.codes.data() + (std::size_t)n_tail * n_q_;
+            const int      n_new = n_win - n_tail;
+            out.codes.insert(out.codes.end(), fresh, fresh + (std::size_t)n_new * n_q_);
+            out.n_frames += n_new;
+            windows_.push_back({n_new, n_steps,
+                                std::chrono::duration<double>(encodec::Clock::now() - t0).count()});
+            if (on_frames) on_frames(fresh, n_new);
+        }
+        out.ok = true;
+        return out;
+    }
+
+    // Per-window timings of the last generate().
+    const std::vector<LongFormWindow>& windows() const noexcept { return windows_; }
+
+    const LongFormConfig& config() const noexcept { return cfg_; }
+
+private:
+    // One generation at a time, sized for one window; the overlap must
+    // leave each window at least one new frame.
+    static LongFormConfig clamp(LongFormConfig cfg, const LMConfig& lmc) {
+        cfg.window         = std::max(cfg.window, 2);
+        cfg.overlap        = std::clamp(cfg.overlap, 0, cfg.window - 1);
+        cfg.sched.max_seqs = 1;
+        cfg.sched.n_ctx    = cfg.window + lmc.n_q - 1;
+        return cfg;
+    }
+
+    LongFormConfig              cfg_;
+    int                         n_q_;
+    Scheduler                   sched_;
+    std::vector<LongFormWindow> windows_;
+};
+
+}
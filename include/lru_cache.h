@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace musicgen {
+
+// 64-bit hash of a buffer's contents, for fingerprints of large inputs.
+// Pass a previous result as `seed` to hash several buffers as one. Not a
+// cache key by itself: two inputs can share a hash (see append_key).
+inline uint64_t hash_bytes(const void* data, std::size_t n, uint64_t seed = 0x9E3779B97F4A7C15ull) {
+    const auto* p = static_cast<const unsigned char*>(data);
+    uint64_t h = seed ^ (n * 0xC2B2AE3D27D4EB4Full);
+    auto mix = [&h](uint64_t w) {
+        h ^= w * 0x87C37B91114253D5ull;
+        h  = (h << 31 | h >> 33) * 0x9E3779B97F4A7C15ull;
+    };
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        std::memcpy(&w, p, 8);
+        mix(w);
+    }
+    uint64_t tail = 0;
+    if (n) std::memcpy(&tail, p, n);
+    mix(tail);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    return h ^ (h >> 33);
+}
+
+// Append a buffer's size and bytes to a content key. Keys built this way
+// are equal only if every buffer is, so a cache hit is always the same
+// input (audio, codes) and never another one that hashes alike.
+inline void append_key(std::string& key, const void* data, std::size_t n) {
+    key.append(reinterpret_cast<const char*>(&n), sizeof(n));
+    key.append(static_cast<const char*>(data), n);
+}
+
+//-------------------------------------
+// Thread-safe LRU cache
+//-------------------------------------
+// Maps keys to immutable, shared values, each with a caller-given cost
+// (usually bytes). Inserting past `capacity` evicts the least recently used
+// entries; a value larger than the whole capacity is not kept. Values are
+// handed out as shared_ptr, so an evicted entry stays alive for whoever is
+// still using it.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class LruCache {
+public:
+    struct Stats {
+        uint64_t    hits      = 0;
+        uint64_t    misses    = 0;
+        uint64_t    evictions = 0;
+        std::size_t entries   = 0;
+        std::size_t cost      = 0;
+    };
+
+    explicit LruCache(std::size_t capacity) : capacity_{capacity} {}
+
+    LruCache(const LruCache&)            = delete;
+    LruCache& operator=(const LruCache&) = delete;
+
+    // The cached value, now most recently used; null on a miss.
+    std::shared_ptr<const Value> get(const Key& key) {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            ++stats_.misses;
+            return nullptr;
+        }
+        ++stats_.hits;
+        order_.splice(order_.begin(), order_, it->second);
+        return it->second->value;
+    }
+
+    // Insert or replace `key`, then evict down to capacity.
+    void put(const Key& key, std::shared_ptr<const Value> value, std::size_t cost) {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (auto it = index_.find(key); it != index_.end()) erase(it);
+        if (cost > capacity_) return;
+        auto slot = index_.emplace(key, typename Order::iterator{}).first;
+        order_.push_front({&slot->first, std::move(value), cost});
+        slot->second = order_.begin();
+        stats_.cost += cost;
+        while (stats_.cost > capacity_) {
+            erase(index_.find(*order_.back().key));
+            ++stats_.evictions;
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lk(mu_);
+        order_.clear();
+        index_.clear();
+        stats_.cost = 0;
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        Stats s   = stats_;
+        s.entries = index_.size();
+        return s;
+    }
+
+    std::size_t capacity() const noexcept { return capacity_; }
+
+private:
+    // The key lives in the index only (its nodes do not move), so a large
+    // content key is held once.
+    struct Entry {
+        const Key*                   key;
+        std::shared_ptr<const Value> value;
+        std::size_t                  cost;
+    };
+    using Order = std::list<Entry>;
+
+    void erase(typename std::unordered_map<Key, typename Order::iterator, Hash>::iterator it) {
+        stats_.cost -= it->second->cost;
+        order_.erase(it->second);
+        index_.erase(it);
+    }
+
+    std::size_t                                             capacity_;
+    Order                                                   order_; // most recent first
+    std::unordered_map<Key, typename Order::iterator, Hash> index_;
+    Stats                                                   stats_;
+    mutable std::mutex                                      mu_;
+};
+
+}
@@ -6,11 +6,13 @@ struct lstm_state {
     struct ggml_tensor * c_t;  // Cell state
 };
 
+// One LSTM step. Every column of x_t / h_prev / c_prev is an independent
+// sequence, so B streams advance with one GEMM per weight matrix.
 struct lstm_state lstm_step(
     struct ggml_context * ctx,
-    struct ggml_tensor  * x_t,             // [D]
-    struct ggml_tensor  * h_prev,          // [H]
-    struct ggml_tensor  * c_prev,          // [H]
+    struct ggml_tensor  * x_t,             // [D] or [D, B]
+    struct ggml_tensor  * h_prev,          // [H] or [H, B]
+    struct ggml_tensor  * c_prev,          // [H] or [H, B]
     struct ggml_tensor  * weight_ih_l0,    // [4H, D]
     struct ggml_tensor  * weight_hh_l0,    // [4H, H]
     struct ggml_tensor  * bias_ih_l0,      // [4H]
@@ -26,12 +28,13 @@ struct lstm_state lstm_step(
     const int total = bias_ih_l0->ne[0];   // = 4*H
     const int H     = total / 4;
     
-    // carve out each gate pre-activation with view_1d
-    const size_t stride = gates->nb[0];    // byte-stride per element
-    struct ggml_tensor * i_p = ggml_view_1d(ctx, gates, H, (size_t)0 * H * stride);
-    struct ggml_tensor * f_p = ggml_view_1d(ctx, gates, H, (size_t)1 * H * stride);
-    struct ggml_tensor * g_p = ggml_view_1d(ctx, gates, H, (size_t)2 * H * stride);
-    struct ggml_tensor * o_p = ggml_view_1d(ctx, gates, H, (size_t)3 * H * stride);
+    // carve out each gate pre-activation with view_2d ([H, n_seq] per gate)
+    const int64_t n_seq  = gates->ne[1];
+    const size_t  stride = gates->nb[0];   // byte-stride per element
+    struct ggml_tensor * i_p = ggml_view_2d(ctx, gates, H, n_seq, gates->nb[1], (size_t)0 * H * stride);
+    struct ggml_tensor * f_p = ggml_view_2d(ctx, gates, H, n_seq, gates->nb[1], (size_t)1 * H * stride);
+    struct ggml_tensor * g_p = ggml_view_2d(ctx, gates, H, n_seq, gates->nb[1], (size_t)2 * H * stride);
+    struct ggml_tensor * o_p = ggml_view_2d(ctx, gates, H, n_seq, gates->nb[1], (size_t)3 * H * stride);
     
     // activations
     struct ggml_tensor * i_t = ggml_sigmoid(ctx, i_p);
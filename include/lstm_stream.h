@@ -0,0 +1,160 @@
+#pragma once
+
+#include "ggml.h"
+#include "lstm.h"
+#include "encoder.h"
+#include "exec_state.h"
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+namespace encodec {
+
+//-------------------------------------
+// Session-multiplexed LSTM stepping
+//-------------------------------------
+// Each live streaming session owns its (h, c) state on the host. step()
+// gathers the pending frame of every session into one [D, n] slab and runs a
+// single lstm_step over it, so weight_ih / weight_hh are read from memory once
+// per step for all sessions instead of once per session. Updated states are
+// scattered back afterwards.
+//
+// open/close/push may be called from any thread; step() is meant to be driven
+// by one thread (it does not hold the lock while computing).
+class MultiStreamLSTM {
+public:
+    struct SessionId {
+        uint32_t slot;
+        uint32_t gen;
+    };
+
+    explicit MultiStreamLSTM(const LSTMWeights& w)
+        : w_{w},
+          D_{w.weight_ih->ne[0]},
+          H_{w.weight_hh->ne[0]} {}
+
+    int64_t input_dim()  const noexcept { return D_; }
+    int64_t hidden_dim() const noexcept { return H_; }
+
+    // New session with zeroed state.
+    SessionId open() {
+        std::lock_guard<std::mutex> lk(mu_);
+        uint32_t slot = 0;
+        while (slot < sessions_.size() && sessions_[slot].live) ++slot;
+        if (slot == sessions_.size()) sessions_.emplace_back();
+
+        Session& s = sessions_[slot];
+        s.live    = true;
+        s.pending = false;
+        s.h.assign(H_, 0.0f);
+        s.c.assign(H_, 0.0f);
+        s.x.assign(D_, 0.0f);
+        return {slot, ++s.gen};
+    }
+
+    void close(SessionId id) {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (Session* s = find(id)) {
+            s->live = false;
+            ++s->gen;
+        }
+    }
+
+    // Queue the next input frame (D floats) of a session. A frame pushed
+    // twice before step() overwrites the first. Returns false if the session
+    // is closed.
+    bool push(SessionId id, const float* x) {
+        std::lock_guard<std::mutex> lk(mu_);
+        Session* s = find(id);
+        if (!s) return false;
+        std::memcpy(s->x.data(), x, D_ * sizeof(float));
+        s->pending = true;
+        return true;
+    }
+
+    // Copies the session's hidden state after its last step into h (H floats).
+    bool hidden(SessionId id, float* h) const {
+        std::lock_guard<std::mutex> lk(mu_);
+        const Session* s = find(id);
+        if (!s) return false;
+        std::memcpy(h, s->h.data(), H_ * sizeof(float));
+        return true;
+    }
+
+    // Advance every session with a pending frame by one step. Returns the
+    // number of sessions stepped.
+    int step(ExecState& state, int n_threads) {
+        state.reset();
+        ggml_context* ctx = state.ctx();
+
+        // --- gather ------------------------------------------
+        std::vector<SessionId> ids;
+        ggml_tensor *x = nullptr, *h = nullptr, *c = nullptr;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            for (uint32_t i = 0; i < sessions_.size(); ++i) {
+                if (sessions_[i].live && sessions_[i].pending) ids.push_back({i, sessions_[i].gen});
+            }
+            if (ids.empty()) return 0;
+
+            const int64_t n = (int64_t)ids.size();
+            x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, D_, n);
+            h = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, H_, n);
+            c = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, H_, n);
+            for (int64_t j = 0; j < n; ++j) {
+                Session& s = sessions_[ids[j].slot];
+                std::memcpy((char*)x->data + j * x->nb[1], s.x.data(), D_ * sizeof(float));
+                std::memcpy((char*)h->data + j * h->nb[1], s.h.data(), H_ * sizeof(float));
+                std::memcpy((char*)c->data + j * c->nb[1], s.c.data(), H_ * sizeof(float));
+                s.pending = false;
+            }
+        }
+
+        // --- one [4H, D] x [D, n] and one [4H, H] x [H, n] GEMM -----
+        lstm_state st = lstm_step(ctx, x, h, c,
+                                  w_.weight_ih, w_.weight_hh,
+                                  w_.bias_ih,   w_.bias_hh);
+        ggml_cgraph* gf = state.new_graph();
+        ggml_build_forward_expand(gf, st.c_t);
+        ggml_build_forward_expand(gf, st.h_t);
+        state.compute(n_threads);
+
+        // --- scatter -----------------------------------------
+        std::lock_guard<std::mutex> lk(mu_);
+        for (std::size_t j = 0; j < ids.size(); ++j) {
+            Session* s = find(ids[j]);
+            if (!s) continue; // closed while we were computing
+            std::memcpy(s->h.data(), (char*)st.h_t->data + j * st.h_t->nb[1], H_ * sizeof(float));
+            std::memcpy(s->c.data(), (char*)st.c_t->data + j * st.c_t->nb[1], H_ * sizeof(float));
+        }
+        return (int)ids.size();
+    }
+
+private:
+    struct Session {
+        std::vector<float> h, c, x;
+        uint32_t           gen     = 0;
+        bool               live    = false;
+        bool               pending = false;
+    };
+
+    Session* find(SessionId id) {
+        if (id.slot >= sessions_.size()) return nullptr;
+        Session& s = sessions_[id.slot];
+        return s.live && s.gen == id.gen ? &s : nullptr;
+    }
+
+    const Session* find(SessionId id) const {
+        return const_cast<MultiStreamLSTM*>(this)->find(id);
+    }
+
+    LSTMWeights          w_; // not owned
+    int64_t              D_;
+    int64_t              H_;
+    mutable std::mutex   mu_;
+    std::vector<Session> sessions_;
+};
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+namespace encodec {
+
+//-------------------------------------
+// Read-only memory-mapped file
+//-------------------------------------
+// Pages are faulted in on first touch and shared with the page cache, so
+// several readers of one file cost its size once.
+class MappedFile {
+public:
+    // nullptr (with a message on stderr) if the file cannot be mapped.
+    static std::unique_ptr<MappedFile> open(const std::string& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::fprintf(stderr, "%s: failed to open '%s'\n", __func__, path.c_str());
+            return nullptr;
+        }
+        struct stat st{};
+        void* map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            map = mmap(nullptr, (std::size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (map == MAP_FAILED) {
+            std::fprintf(stderr, "%s: failed to map '%s'\n", __func__, path.c_str());
+            return nullptr;
+        }
+        return std::unique_ptr<MappedFile>{new MappedFile(map, (std::size_t)st.st_size)};
+    }
+
+    ~MappedFile() { munmap(map_, size_); }
+
+    MappedFile(const MappedFile&)            = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const noexcept { return (const uint8_t*)map_; }
+    std::size_t    size() const noexcept { return size_; }
+
+    // Access-pattern hint, e.g. MADV_SEQUENTIAL for a front-to-back scan or
+    // MADV_RANDOM for seeks.
+    void advise(int advice) const { madvise(map_, size_, advice); }
+
+private:
+    MappedFile(void* map, std::size_t size) : map_{map}, size_{size} {}
+
+    void*       map_;
+    std::size_t size_;
+};
+
+}
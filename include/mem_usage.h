@@ -0,0 +1,42 @@
+#pragma once
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <cstddef>
+
+namespace encodec {
+
+// Live and peak usage of one ggml context.
+struct ContextUsage {
+    std::size_t capacity = 0; // bytes reserved for the context
+    std::size_t used     = 0; // bytes currently allocated from it
+    std::size_t peak     = 0; // high-water mark of `used`
+};
+
+// Bytes a tensor takes in an allocating context: object header plus its data
+// padded to GGML_MEM_ALIGN. Views share their source's data.
+inline std::size_t tensor_alloc_size(const ggml_tensor* t) {
+    const std::size_t data = t->view_src ? 0 : GGML_PAD(ggml_nbytes(t), GGML_MEM_ALIGN);
+    return ggml_tensor_overhead() + data;
+}
+
+// Exact size an allocating context needs to hold the tensors (and graphs)
+// that were created in `measured`, a no_alloc context. No-alloc tensors carry
+// no data, so their data size is added on top of what the context has used.
+inline std::size_t context_required_size(const ggml_context* measured) {
+    std::size_t size = ggml_used_mem(measured);
+    for (auto* t = ggml_get_first_tensor(measured); t; t = ggml_get_next_tensor(measured, t)) {
+        size += tensor_alloc_size(t) - ggml_tensor_overhead();
+    }
+    return size;
+}
+
+// Bytes ggml_graph_compute_with_ctx allocates for its work buffer (always a
+// tensor, even when the plan needs no scratch).
+inline std::size_t graph_work_size(const ggml_cgraph* gf, int n_threads) {
+    const ggml_cplan plan = ggml_graph_plan(gf, n_threads, nullptr);
+    return ggml_tensor_overhead() + GGML_PAD(plan.work_size, GGML_MEM_ALIGN);
+}
+
+}
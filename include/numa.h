@@ -0,0 +1,199 @@
+#pragma once
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace encodec {
+
+//-------------------------------------
+// NUMA topology
+//-------------------------------------
+// Read-only weights are read on every step: a worker on one socket reading
+// weights on the other runs its GEMVs at remote-memory bandwidth. Workers
+// are grouped per node, pinned to the node's CPUs, and read weights placed
+// on that node (or interleaved over all nodes).
+
+struct NumaNode {
+    int              id;   // kernel node id
+    std::vector<int> cpus;
+};
+
+// Parses a sysfs CPU or node list such as "0-3,8,10-11".
+inline std::vector<int> parse_cpulist(const std::string& s) {
+    std::vector<int> out;
+    std::size_t pos = 0;
+    while (pos < s.size()) {
+        std::size_t end = s.find(',', pos);
+        if (end == std::string::npos) end = s.size();
+        const std::string item = s.substr(pos, end - pos);
+        const std::size_t dash = item.find('-');
+        try {
+            const int lo = std::stoi(item.substr(0, dash));
+            const int hi = dash == std::string::npos ? lo : std::stoi(item.substr(dash + 1));
+            for (int c = lo; c <= hi; ++c) out.push_back(c);
+        } catch (...) {
+            // blank or trailing newline
+        }
+        pos = end + 1;
+    }
+    return out;
+}
+
+class NumaTopology {
+public:
+    // The host's nodes from sysfs; one node with every CPU if that is not
+    // available.
+    static NumaTopology detect() {
+        NumaTopology topo;
+        std::string online;
+        std::ifstream f("/sys/devices/system/node/online");
+        if (std::getline(f, online)) {
+            for (int id : parse_cpulist(online)) {
+                std::ifstream c("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+                std::string cpus;
+                std::getline(c, cpus);
+                NumaNode node{id, parse_cpulist(cpus)};
+                if (!node.cpus.empty()) topo.nodes_.push_back(std::move(node));
+            }
+        }
+        if (topo.nodes_.empty()) return simulated(1);
+        return topo;
+    }
+
+    // `n_nodes` nodes splitting the CPUs this process may run on into
+    // contiguous groups, to exercise per-node pools on a single-node host.
+    // Threads are still pinned; memory placement is skipped, the kernel
+    // having no such nodes.
+    static NumaTopology simulated(int n_nodes) {
+        NumaTopology topo;
+        topo.simulated_ = true;
+        const std::vector<int> cpus = allowed_cpus();
+        const int n_cpus = (int)cpus.size();
+        n_nodes = std::max(std::min(n_nodes, n_cpus), 1);
+        for (int i = 0; i < n_nodes; ++i) {
+            NumaNode node{i, {}};
+            for (int c = i * n_cpus / n_nodes; c < (i + 1) * n_cpus / n_nodes; ++c) node.cpus.push_back(cpus[c]);
+            topo.nodes_.push_back(std::move(node));
+        }
+        return topo;
+    }
+
+    // The calling thread's CPU affinity, in order.
+    static std::vector<int> allowed_cpus() {
+        std::vector<int> cpus;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int c = 0; c < CPU_SETSIZE; ++c) {
+                if (CPU_ISSET(c, &set)) cpus.push_back(c);
+            }
+        }
+        if (cpus.empty()) cpus.push_back(0);
+        return cpus;
+    }
+
+    int             n_nodes()   const noexcept { return (int)nodes_.size(); }
+    const NumaNode& node(int i) const          { return nodes_[i]; }
+    bool            simulated() const noexcept { return simulated_; }
+
+private:
+    std::vector<NumaNode> nodes_;
+    bool                  simulated_ = false;
+};
+
+//-------------------------------------
+// Thread placement
+//-------------------------------------
+// Restricts the calling thread, and the threads it creates afterwards (such
+// as ggml's compute threads), to the CPUs of `node`.
+inline bool numa_pin_thread(const NumaNode& node) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : node.cpus) {
+        if (c < CPU_SETSIZE) CPU_SET(c, &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+enum class NumaMode {
+    Off,        // one copy, wherever the loading thread touched it first
+    Replicate,  // one copy per node, on that node
+    Interleave, // one copy, pages spread over all nodes
+};
+
+namespace detail {
+
+// Memory policy of the calling thread, set_mempolicy(2) without libnuma.
+// Pages allocated afterwards follow it; modes as in <numaif.h>.
+inline bool numa_set_policy(int mode, const std::vector<int>& node_ids) {
+    std::vector<unsigned long> mask;
+    const int bits = 8 * sizeof(unsigned long);
+    for (int id : node_ids) {
+        if ((int)mask.size() <= id / bits) mask.resize(id / bits + 1, 0);
+        mask[id / bits] |= 1ul << (id % bits);
+    }
+    const long r = syscall(SYS_set_mempolicy, mode, mask.empty() ? nullptr : mask.data(),
+                           (unsigned long)(mask.size() * bits + 1));
+    return r == 0;
+}
+
+constexpr int kMpolDefault    = 0;
+constexpr int kMpolPreferred  = 1;
+constexpr int kMpolInterleave = 3;
+
+}
+
+// Runs `fn` on a thread pinned to `node` (or, with node < 0, unpinned) with
+// the memory policy of `mode`, and waits for it. Weight stores built by `fn`
+// read their data on that thread, so their pages land by that policy.
+inline void numa_run_on(const NumaTopology& topo, NumaMode mode, int node, const std::function<void()>& fn) {
+    std::thread t([&] {
+        if (node >= 0) numa_pin_thread(topo.node(node));
+        const bool place = !topo.simulated() && mode != NumaMode::Off;
+        if (place) {
+            std::vector<int> ids;
+            if (mode == NumaMode::Replicate) ids.push_back(topo.node(node).id);
+            else for (int i = 0; i < topo.n_nodes(); ++i) ids.push_back(topo.node(i).id);
+            if (!detail::numa_set_policy(mode == NumaMode::Replicate ? detail::kMpolPreferred : detail::kMpolInterleave, ids)) {
+                std::fprintf(stderr, "%s: set_mempolicy failed, weights stay where first touched\n", __func__);
+            }
+        }
+        fn();
+        if (place) detail::numa_set_policy(detail::kMpolDefault, {});
+    });
+    t.join();
+}
+
+// The store each node's workers read: a replica per node with Replicate,
+// else one store shared by all. `load` builds a fresh store on each call.
+// Empty if any load fails.
+template <typename Store>
+std::vector<std::shared_ptr<const Store>> numa_place_stores(
+        const NumaTopology& topo, NumaMode mode, const std::function<std::shared_ptr<const Store>()>& load) {
+    std::vector<std::shared_ptr<const Store>> stores(topo.n_nodes());
+    if (mode == NumaMode::Replicate) {
+        for (int i = 0; i < topo.n_nodes(); ++i) {
+            numa_run_on(topo, mode, i, [&] { stores[i] = load(); });
+            if (!stores[i]) return {};
+        }
+    } else {
+        std::shared_ptr<const Store> shared;
+        numa_run_on(topo, mode, -1, [&] { shared = load(); });
+        if (!shared) return {};
+        std::fill(stores.begin(), stores.end(), shared);
+    }
+    return stores;
+}
+
+}
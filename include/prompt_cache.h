@@ -0,0 +1,76 @@
+#pragma once
+
+#include "ggml.h"
+#include "encoder.h"
+#include "exec_state.h"
+#include "lru_cache.h"
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace musicgen {
+
+//-------------------------------------
+// Cached audio-prompt encoding
+//-------------------------------------
+// Continuations tend to reuse a few reference clips. PromptEncoder runs the
+// codec encoder once per distinct clip (keyed by its samples) and
+// hands out the codes in GenRequest::prompt layout; a Scheduler with
+// prefix_cache_bytes set then skips the prefill of those codes as well.
+class PromptEncoder {
+public:
+    using Codes = std::vector<int32_t>; // n_frames x n_q
+
+    explicit PromptEncoder(std::shared_ptr<const encodec::WeightStore> store,
+                           std::size_t cache_bytes = 16u << 20, int n_threads = 4)
+        : encoder_{std::move(store)}, cache_{cache_bytes}, n_threads_{n_threads}, state_{1 << 20} {}
+
+    // Codes of a mono clip at the model rate.
+    std::shared_ptr<const Codes> encode(const float* samples, int64_t n_samples) {
+        std::string key;
+        append_key(key, samples, (std::size_t)n_samples * sizeof(float));
+        if (auto hit = cache_.get(key)) return hit;
+
+        std::shared_ptr<const Codes> codes;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            auto it = arena_sizes_.find(n_samples);
+            if (it == arena_sizes_.end()) {
+                it = arena_sizes_.emplace(n_samples, encoder_.arena_size(n_samples, 1, n_threads_)).first;
+            }
+            state_.reset();
+            state_.reserve(it->second);
+            ggml_tensor* input = ggml_new_tensor_3d(state_.ctx(), GGML_TYPE_F32, n_samples, 1, 1);
+            std::memcpy(input->data, samples, (std::size_t)n_samples * sizeof(float));
+            ggml_tensor* out = encoder_(state_, input, n_threads_); // [T, n_q]
+
+            const int64_t T = out->ne[0], n_q = out->ne[1];
+            auto c = std::make_shared<Codes>((std::size_t)(T * n_q));
+            for (int64_t k = 0; k < n_q; ++k) {
+                for (int64_t t = 0; t < T; ++t) (*c)[t * n_q + k] = ((const int32_t*)out->data)[k * T + t];
+            }
+            codes = std::move(c);
+        }
+        cache_.put(key, codes, key.size() + codes->size() * sizeof(int32_t));
+        return codes;
+    }
+
+    LruCache<std::string, Codes>::Stats cache_stats() const { return cache_.stats(); }
+
+private:
+    encodec::Encoder               encoder_;
+    LruCache<std::string, Codes>   cache_;
+    int                            n_threads_;
+
+    std::mutex                     mu_; // guards the encoder state
+    encodec::ExecState             state_;
+    std::map<int64_t, std::size_t> arena_sizes_;
+};
+
+}
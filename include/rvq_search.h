@@ -0,0 +1,343 @@
+#pragma once
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+#include "quantizer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+namespace encodec {
+
+//-------------------------------------
+// Approximate residual VQ search
+//-------------------------------------
+// quantizer_encode scores every frame against all K codewords at each of
+// the n_q stages: an [K, T] GEMM, an argmax and a gather per stage. For
+// bulk tokenization that search rivals the rest of the encoder.
+//
+// Here each codebook is clustered once, at load, into about sqrt(K) groups
+// around k-means centroids. A frame is compared with the centroids, then
+// only with the codewords of its n_probe nearest groups. Any other group
+// that could still hold a closer codeword (by the triangle inequality,
+// ||x - e|| >= ||x - c|| - radius) is searched too unless it is clearly
+// out of reach; `margin` sets how clear. With margin = 1 the bound is
+// strict and the result is exactly that of the full search; lower values
+// skip groups that are unlikely, not impossible, to win.
+//
+// Dot products go through ggml's F32 vec_dot, the SIMD kernel its GEMM
+// uses, since a plain float reduction is never vectorized without
+// -ffast-math.
+
+struct RvqSearchConfig {
+    int   n_clusters = 0;    // per codebook; 0: about sqrt(K)
+    int   n_probe    = 4;    // groups always searched
+    float margin     = 0.5f; // in [0, 1]; 1: always exact
+    int   n_iter     = 8;    // k-means iterations at load
+};
+
+// Totals since construction; a frame "falls back" when any group beyond
+// the n_probe nearest had to be searched.
+struct RvqSearchStats {
+    uint64_t n_searches = 0; // frames x stages
+    uint64_t n_fallback = 0;
+    uint64_t n_scanned  = 0; // codewords compared
+    uint64_t n_total    = 0; // codewords an exact search compares
+};
+
+// One codebook, regrouped by cluster.
+class CodebookIndex {
+public:
+    // `embed` holds `size` codewords of `dim` floats each.
+    CodebookIndex(const float* embed, int64_t dim, int64_t size, const RvqSearchConfig& cfg)
+        : dim_{dim}, size_{size}, n_probe_{std::max(cfg.n_probe, 1)},
+          margin_{std::min(std::max(cfg.margin, 0.0f), 1.0f)} {
+        n_clusters_ = cfg.n_clusters > 0 ? cfg.n_clusters : (int)std::lround(std::sqrt((double)size));
+        n_clusters_ = (int)std::min<int64_t>(std::max(n_clusters_, 1), size);
+        cluster(embed, cfg.n_iter);
+    }
+
+    int64_t dim()        const noexcept { return dim_; }
+    int64_t size()       const noexcept { return size_; }
+    int     n_clusters() const noexcept { return n_clusters_; }
+
+    // Codeword `k` (original numbering).
+    const float* codeword(int32_t k) const { return &codes_[(std::size_t)pos_[k] * dim_]; }
+
+    // Nearest codeword to `x` over the whole codebook.
+    int32_t search_exact(const float* x, RvqSearchStats* st = nullptr) const {
+        Best best;
+        scan(x, 0, (int)size_, best);
+        if (st) {
+            st->n_searches += 1;
+            st->n_scanned  += size_;
+            st->n_total    += size_;
+        }
+        return ids_[best.pos];
+    }
+
+    // Buffers search() needs, kept by the caller to reuse between calls.
+    struct Scratch {
+        std::vector<float> dist;
+        std::vector<float> diff;
+        std::vector<int>   order;
+    };
+
+    // Nearest codeword to `x`, probing as described above.
+    int32_t search(const float* x, Scratch& s, RvqSearchStats* st = nullptr) const {
+        const int C = n_clusters_;
+        std::vector<float>& dist  = s.dist;
+        std::vector<int>&   order = s.order;
+        dist.resize(C);
+        order.resize(C);
+        s.diff.resize((std::size_t)dim_);
+        for (int c = 0; c < C; ++c) dist[c] = sqdist(x, &centroids_[(std::size_t)c * dim_], s.diff.data(), dim_);
+        std::iota(order.begin(), order.end(), 0);
+        const int n_probe = std::min(n_probe_, C);
+        std::partial_sort(order.begin(), order.begin() + n_probe, order.end(),
+                          [&](int a, int b) { return dist[a] < dist[b]; });
+
+        Best    best;
+        int64_t scanned = 0;
+        for (int i = 0; i < n_probe; ++i) {
+            const int c = order[i];
+            scan(x, offsets_[c], offsets_[c + 1], best);
+            scanned += offsets_[c + 1] - offsets_[c];
+        }
+
+        // Distances so far are ||e||^2 - 2 x.e; add ||x||^2 for the bound.
+        const float xx    = dot(x, x, dim_);
+        const float reach = margin_ * std::max(best.score + xx, 0.0f);
+        bool fallback = false;
+        for (int i = n_probe; i < C; ++i) {
+            const int   c  = order[i];
+            const float lo = std::max(std::sqrt(dist[c]) - radius_[c], 0.0f);
+            if (lo * lo >= reach) continue;
+            scan(x, offsets_[c], offsets_[c + 1], best);
+            scanned += offsets_[c + 1] - offsets_[c];
+            fallback = true;
+        }
+        if (st) {
+            st->n_searches += 1;
+            st->n_fallback += fallback;
+            st->n_scanned  += scanned + C;
+            st->n_total    += size_;
+        }
+        return ids_[best.pos];
+    }
+
+private:
+    struct Best {
+        float score = std::numeric_limits<float>::infinity();
+        int   pos   = 0;
+    };
+
+    int64_t dim_;
+    int64_t size_;
+    int     n_clusters_;
+    int     n_probe_;
+    float   margin_;
+
+    std::vector<float>   codes_;     // size x dim, grouped by cluster
+    std::vector<float>   norms_;     // ||e||^2, same order
+    std::vector<int32_t> ids_;       // original index, same order
+    std::vector<int32_t> pos_;       // inverse of ids_
+    std::vector<float>   centroids_; // n_clusters x dim
+    std::vector<float>   radius_;    // max ||e - c|| per cluster
+    std::vector<int>     offsets_;   // n_clusters + 1, into the grouped order
+
+    static float dot(const float* a, const float* b, int64_t n) {
+        static const ggml_vec_dot_t vec_dot = ggml_get_type_traits_cpu(GGML_TYPE_F32)->vec_dot;
+        float s;
+        vec_dot((int)n, &s, 0, a, 0, b, 0, 1);
+        return s;
+    }
+
+    // ||a - b||^2, with `tmp` (n floats) for the difference
+    static float sqdist(const float* a, const float* b, float* tmp, int64_t n) {
+        for (int64_t d = 0; d < n; ++d) tmp[d] = a[d] - b[d];
+        return dot(tmp, tmp, n);
+    }
+
+    // argmin ||e||^2 - 2 x.e over grouped positions [from, to)
+    void scan(const float* x, int from, int to, Best& best) const {
+        for (int p = from; p < to; ++p) {
+            const float s = norms_[p] - 2.0f * dot(x, &codes_[(std::size_t)p * dim_], dim_);
+            if (s < best.score || (s == best.score && ids_[p] < ids_[best.pos])) {
+                best.score = s;
+                best.pos   = p;
+            }
+        }
+    }
+
+    // Lloyd's k-means from evenly spaced codewords (deterministic), then
+    // the codewords are stored cluster by cluster.
+    void cluster(const float* embed, int n_iter) {
+        const int C = n_clusters_;
+        centroids_.resize((std::size_t)C * dim_);
+        for (int c = 0; c < C; ++c) {
+            const float* e = embed + (std::size_t)(c * size_ / C) * dim_;
+            std::copy(e, e + dim_, &centroids_[(std::size_t)c * dim_]);
+        }
+
+        std::vector<float>  tmp((std::size_t)dim_);
+        std::vector<int>    assign((std::size_t)size_, 0);
+        std::vector<double> sum((std::size_t)C * dim_);
+        std::vector<int>    count(C);
+        auto assign_all = [&] {
+            for (int64_t k = 0; k < size_; ++k) {
+                const float* e = embed + (std::size_t)k * dim_;
+                float best = std::numeric_limits<float>::infinity();
+                for (int c = 0; c < C; ++c) {
+                    const float d = sqdist(e, &centroids_[(std::size_t)c * dim_], tmp.data(), dim_);
+                    if (d < best) {
+                        best      = d;
+                        assign[k] = c;
+                    }
+                }
+            }
+        };
+        for (int it = 0; it < n_iter; ++it) {
+            assign_all();
+            std::fill(sum.begin(), sum.end(), 0.0);
+            std::fill(count.begin(), count.end(), 0);
+            for (int64_t k = 0; k < size_; ++k) {
+                const float* e = embed + (std::size_t)k * dim_;
+                double*      s = &sum[(std::size_t)assign[k] * dim_];
+                for (int64_t d = 0; d < dim_; ++d) s[d] += e[d];
+                ++count[assign[k]];
+            }
+            for (int c = 0; c < C; ++c) {
+                if (count[c] == 0) continue; // empty: keep the old centroid
+                for (int64_t d = 0; d < dim_; ++d) {
+                    centroids_[(std::size_t)c * dim_ + d] = (float)(sum[(std::size_t)c * dim_ + d] / count[c]);
+                }
+            }
+        }
+        assign_all();
+
+        offsets_.assign(C + 1, 0);
+        for (int64_t k = 0; k < size_; ++k) ++offsets_[assign[k] + 1];
+        for (int c = 0; c < C; ++c) offsets_[c + 1] += offsets_[c];
+
+        codes_.resize((std::size_t)size_ * dim_);
+        norms_.resize((std::size_t)size_);
+        ids_.resize((std::size_t)size_);
+        pos_.resize((std::size_t)size_);
+        radius_.assign(C, 0.0f);
+        std::vector<int> fill(offsets_.begin(), offsets_.end() - 1);
+        for (int64_t k = 0; k < size_; ++k) {
+            const int    c = assign[k];
+            const int    p = fill[c]++;
+            const float* e = embed + (std::size_t)k * dim_;
+            std::copy(e, e + dim_, &codes_[(std::size_t)p * dim_]);
+            norms_[p]  = dot(e, e, dim_);
+            ids_[p]    = (int32_t)k;
+            pos_[k]    = p;
+            radius_[c] = std::max(radius_[c], std::sqrt(sqdist(e, &centroids_[(std::size_t)c * dim_], tmp.data(), dim_)));
+        }
+    }
+};
+
+//-------------------------------------
+// All stages
+//-------------------------------------
+class RvqIndex {
+public:
+    explicit RvqIndex(std::vector<CodebookIndex> stages) : stages_{std::move(stages)} {}
+
+    // Indexes the codebooks of a quantizer, [D, K] each (F32 or F16).
+    static std::shared_ptr<const RvqIndex> build(const quantizer& quant, const RvqSearchConfig& cfg = {}) {
+        std::vector<CodebookIndex> stages;
+        std::vector<float> data;
+        for (const auto& block : quant.blocks) {
+            const ggml_tensor* embed = block.embed;
+            const int64_t dim = embed->ne[0], size = embed->ne[1];
+            data.resize((std::size_t)(dim * size));
+            if (embed->type == GGML_TYPE_F16) {
+                ggml_fp16_to_fp32_row((const ggml_fp16_t*)embed->data, data.data(), dim * size);
+            } else {
+                std::copy((const float*)embed->data, (const float*)embed->data + dim * size, data.begin());
+            }
+            stages.emplace_back(data.data(), dim, size, cfg);
+        }
+        return std::make_shared<const RvqIndex>(std::move(stages));
+    }
+
+    int                  n_q()          const noexcept { return (int)stages_.size(); }
+    int64_t              dim()          const noexcept { return stages_.empty() ? 0 : stages_[0].dim(); }
+    const CodebookIndex& stage(int i)   const          { return stages_[i]; }
+
+    // Residual-quantizes the frame `x` into codes[0], codes[stride], ...
+    // `approx` false runs the full search, for reference.
+    void encode(const float* x, int32_t* codes, int64_t stride, bool approx = true) const {
+        RvqSearchStats st;
+        Scratch        s;
+        encode(x, codes, stride, approx, s, st);
+        add_stats(st);
+    }
+
+    RvqSearchStats stats() const {
+        return {n_searches_.load(std::memory_order_relaxed), n_fallback_.load(std::memory_order_relaxed),
+                n_scanned_.load(std::memory_order_relaxed), n_total_.load(std::memory_order_relaxed)};
+    }
+
+    // ggml_map_custom2 op: dst and `tmpl` are codes [T, n_q, B] (I32), hs
+    // the hidden states [D, T, B]. Frames are split over the op's threads.
+    static void encode_op(ggml_tensor* dst, const ggml_tensor* /*tmpl*/, const ggml_tensor* hs,
+                          int ith, int nth, void* userdata) {
+        const RvqIndex& index = *(const RvqIndex*)userdata;
+        const int64_t   T     = dst->ne[0];
+        const int64_t   B     = dst->ne[2];
+        RvqSearchStats  st;
+        Scratch         s;
+        for (int64_t i = ith; i < T * B; i += nth) {
+            const int64_t t = i % T, b = i / T;
+            const float* x   = (const float*)((const char*)hs->data + t * hs->nb[1] + b * hs->nb[2]);
+            int32_t*     out = (int32_t*)((char*)dst->data + t * dst->nb[0] + b * dst->nb[2]);
+            index.encode(x, out, (int64_t)(dst->nb[1] / sizeof(int32_t)), true, s, st);
+        }
+        index.add_stats(st);
+    }
+
+private:
+    struct Scratch {
+        std::vector<float>     residual;
+        CodebookIndex::Scratch search;
+    };
+
+    std::vector<CodebookIndex> stages_;
+
+    mutable std::atomic<uint64_t> n_searches_{0};
+    mutable std::atomic<uint64_t> n_fallback_{0};
+    mutable std::atomic<uint64_t> n_scanned_{0};
+    mutable std::atomic<uint64_t> n_total_{0};
+
+    void encode(const float* x, int32_t* codes, int64_t stride, bool approx, Scratch& s, RvqSearchStats& st) const {
+        const int64_t D = dim();
+        s.residual.assign(x, x + D);
+        for (int i = 0; i < n_q(); ++i) {
+            const CodebookIndex& cb = stages_[i];
+            const int32_t k = approx ? cb.search(s.residual.data(), s.search, &st)
+                                     : cb.search_exact(s.residual.data(), &st);
+            codes[i * stride] = k;
+            const float* e = cb.codeword(k);
+            for (int64_t d = 0; d < D; ++d) s.residual[d] -= e[d];
+        }
+    }
+
+    void add_stats(const RvqSearchStats& st) const {
+        n_searches_.fetch_add(st.n_searches, std::memory_order_relaxed);
+        n_fallback_.fetch_add(st.n_fallback, std::memory_order_relaxed);
+        n_scanned_.fetch_add(st.n_scanned, std::memory_order_relaxed);
+        n_total_.fetch_add(st.n_total, std::memory_order_relaxed);
+    }
+};
+
+}
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace musicgen {
+
+struct SamplingParams {
+    float temperature = 1.0f; // <= 0: greedy
+    int   top_k       = 250;  // <= 0 or >= card: no top-k cut
+    float top_p       = 0.0f; // <= 0 or >= 1: no nucleus cut
+    float cfg_coef    = 3.0f; // used only when unconditional logits are given
+};
+
+//-------------------------------------
+// Per-stream RNG
+//-------------------------------------
+// mt19937_64 seeded from (seed, stream) through splitmix64, so every stream
+// of a request gets an independent, reproducible sequence. Uniforms are made
+// from the raw bits rather than std distributions, whose output differs
+// between standard libraries.
+class StreamRng {
+public:
+    explicit StreamRng(uint64_t seed = 0, uint64_t stream = 0)
+        : gen_{splitmix64(seed ^ splitmix64(stream + 0x9e3779b97f4a7c15ull))} {}
+
+    // Uniform in [0, 1).
+    double uniform() { return (double)(gen_() >> 11) * (1.0 / 9007199254740992.0); }
+
+private:
+    static uint64_t splitmix64(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ull;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    std::mt19937_64 gen_;
+};
+
+//-------------------------------------
+// One head
+//-------------------------------------
+// Samples a token from `card` logits with a pre-drawn uniform `u`:
+//   1. one pass applying the CFG mix and temperature, tracking the max;
+//   2. top-k by partial selection (nth_element), no full sort;
+//   3. softmax over the candidates only, and when top-p is on, a sort of
+//      just those candidates and a cumulative cut at top_p;
+//   4. inverse-CDF draw.
+// `scratch` is reused between calls to avoid allocating per head.
+inline int32_t sample_head(const float* logits, const float* uncond, int card,
+                           const SamplingParams& p, double u,
+                           std::vector<std::pair<float, int32_t>>& scratch) {
+    scratch.resize(card);
+    const float inv_t = p.temperature > 0.0f ? 1.0f / p.temperature : 1.0f;
+    int32_t best = 0;
+    for (int i = 0; i < card; ++i) {
+        float l = logits[i];
+        if (uncond) l = uncond[i] + p.cfg_coef * (l - uncond[i]);
+        scratch[i] = {l * inv_t, i};
+        if (scratch[i].first > scratch[best].first) best = i;
+    }
+    if (p.temperature <= 0.0f) return best;
+
+    const float max_l = scratch[best].first;
+    auto greater = [](const std::pair<float, int32_t>& a, const std::pair<float, int32_t>& b) {
+        return a.first > b.first;
+    };
+
+    int n = card;
+    if (p.top_k > 0 && p.top_k < card) {
+        n = p.top_k;
+        std::nth_element(scratch.begin(), scratch.begin() + (n - 1), scratch.end(), greater);
+    }
+
+    const bool nucleus = p.top_p > 0.0f && p.top_p < 1.0f;
+    if (nucleus) std::sort(scratch.begin(), scratch.begin() + n, greater);
+
+    double total = 0.0;
+    for (int i = 0; i < n; ++i) {
+        scratch[i].first = std::exp(scratch[i].first - max_l);
+        total += scratch[i].first;
+    }
+
+    if (nucleus) {
+        // smallest prefix of the sorted candidates holding top_p of the mass
+        const double limit = p.top_p * total;
+        double cum = 0.0;
+        int    m   = 0;
+        while (m < n && cum < limit) cum += scratch[m++].first;
+        n     = std::max(m, 1);
+        total = cum > 0.0 ? cum : scratch[0].first;
+    }
+
+    const double target = u * total;
+    double cum = 0.0;
+    for (int i = 0; i < n; ++i) {
+        cum += scratch[i].first;
+        if (target < cum) return scratch[i].second;
+    }
+    return scratch[n - 1].second;
+}
+
+//-------------------------------------
+// Every head of every batch row
+//-------------------------------------
+// One batch row: its n_q heads' logits ([card, n_q], codebook k at
+// k * card), the unconditional logits in the same layout or null, and where
+// its n_q tokens go.
+struct SampleRow {
+    const float*          logits;
+    const float*          uncond;
+    const SamplingParams* params;
+    StreamRng*            rng;
+    int32_t*              out;
+};
+
+// Samples every head of a batch in one call, on a pool of threads kept for
+// the sampler's lifetime. Each row draws its n_q uniforms in codebook order
+// before any head is sampled, so results do not depend on n_threads. Only
+// batches of at least kMinHeads heads per thread are split: below that,
+// waking the pool costs more than sampling. sample() is not reentrant.
+class Sampler {
+public:
+    static constexpr int kMinHeads = 8;
+
+    explicit Sampler(int n_threads = 1) : scratch_(std::max(n_threads, 1)) {
+        for (int t = 1; t < n_threads; ++t) workers_.emplace_back([this, t] { loop(t); });
+    }
+
+    ~Sampler() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            quit_ = true;
+        }
+        start_.notify_all();
+        for (auto& w : workers_) w.join();
+    }
+
+    Sampler(const Sampler&)            = delete;
+    Sampler& operator=(const Sampler&) = delete;
+
+    int n_threads() const noexcept { return (int)workers_.size() + 1; }
+
+    void sample(const SampleRow* rows, int n_rows, int card, int n_q) {
+        const int n_heads = n_rows * n_q;
+        u_.resize(n_heads);
+        for (int i = 0; i < n_rows; ++i) {
+            for (int k = 0; k < n_q; ++k) u_[i * n_q + k] = rows[i].rng->uniform();
+        }
+        rows_    = rows;
+        card_    = card;
+        n_q_     = n_q;
+        n_heads_ = n_heads;
+
+        const int nth = std::max(1, std::min(n_heads / kMinHeads, n_threads()));
+        if (nth == 1) {
+            run(0, 1);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            nth_     = nth;
+            pending_ = nth - 1;
+            ++job_;
+        }
+        start_.notify_all();
+        run(0, nth);
+        std::unique_lock<std::mutex> lk(mu_);
+        done_.wait(lk, [&] { return pending_ == 0; });
+    }
+
+private:
+    void run(int ith, int nth) {
+        auto& scratch = scratch_[ith];
+        for (int h = ith; h < n_heads_; h += nth) {
+            const SampleRow& r   = rows_[h / n_q_];
+            const int        k   = h % n_q_;
+            const std::size_t off = (std::size_t)k * card_;
+            r.out[k] = sample_head(r.logits + off, r.uncond ? r.uncond + off : nullptr, card_, *r.params,
+                                   u_[h], scratch);
+        }
+    }
+
+    void loop(int ith) {
+        uint64_t seen = 0;
+        for (;;) {
+            int nth;
+            {
+                std::unique_lock<std::mutex> lk(mu_);
+                start_.wait(lk, [&] { return quit_ || job_ != seen; });
+                if (quit_) return;
+                seen = job_;
+                nth  = nth_;
+            }
+            if (ith >= nth) continue;
+            run(ith, nth);
+            {
+                std::lock_guard<std::mutex> lk(mu_);
+                --pending_;
+            }
+            done_.notify_one();
+        }
+    }
+
+    // the current batch, set by sample() before the pool is woken
+    const SampleRow*    rows_    = nullptr;
+    int                 card_    = 0;
+    int                 n_q_     = 0;
+    int                 n_heads_ = 0;
+    std::vector<double> u_;
+
+    std::vector<std::vector<std::pair<float, int32_t>>> scratch_; // per thread
+    std::vector<std::thread> workers_;
+    std::mutex               mu_;
+    std::condition_variable  start_;
+    std::condition_variable  done_;
+    uint64_t                 job_     = 0;
+    int                      nth_     = 1;
+    int                      pending_ = 0;
+    bool                     quit_    = false;
+};
+
+// Samples one token per (row, codebook) from logits in the LM's output
+// layout [card, n_q, n_rows] (ggml order: row i, codebook k starts at
+// (i * n_q + k) * card). `uncond` is null or the unconditional logits in the
+// same layout, mixed in with cfg_coef; pass null when LM::forward_guided
+// already mixed them. `rngs` holds one stream per row. Runs on `sampler`'s
+// pool, or on the calling thread without one. Writes n_rows x n_q tokens to
+// `out`.
+inline void sample_tokens(const float* logits, const float* uncond, int card, int n_q, int n_rows,
+                          const SamplingParams& p, std::vector<StreamRng>& rngs, int32_t* out,
+                          Sampler* sampler = nullptr) {
+    std::vector<SampleRow> rows(n_rows);
+    for (int i = 0; i < n_rows; ++i) {
+        const std::size_t off = (std::size_t)i * n_q * card;
+        rows[i] = {logits + off, uncond ? uncond + off : nullptr, &p, &rngs[i], out + (std::size_t)i * n_q};
+    }
+    if (sampler) {
+        sampler->sample(rows.data(), n_rows, card, n_q);
+    } else {
+        Sampler{}.sample(rows.data(), n_rows, card, n_q);
+    }
+}
+
+}
@@ -0,0 +1,501 @@
+#pragma once
+
+#include "batcher.h"
+#include "delay_pattern.h"
+#include "exec_state.h"
+#include "kv_cache.h"
+#include "lm.h"
+#include "lru_cache.h"
+#include "sampling.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace musicgen {
+
+struct GenRequest {
+    std::vector<float>   cond;         // n_cond x D projected conditioning; empty: none
+    std::vector<int32_t> prompt;       // audio-prompt codes, n_prompt x n_q; may be empty
+    int                  n_frames = 0; // frames to return, prompt included
+    uint64_t             seed     = 0;
+    SamplingParams       sampling;
+
+    // Called with each run of frames once every codebook of them is sampled
+    // (n x n_q codes, in order, prompt included), e.g. StreamDecoder::push,
+    // on a thread of this generation's own. May block to apply
+    // backpressure: frames wait in this generation's buffer meanwhile, and
+    // the other generations carry on. Must return eventually; ~Scheduler
+    // waits for it. Optional.
+    std::function<void(const int32_t* codes, int n_frames)> on_frames;
+};
+
+struct GenResult {
+    bool                 ok       = false;
+    int                  n_frames = 0;
+    std::vector<int32_t> codes;        // n_frames x n_q
+};
+
+struct SchedulerConfig {
+    int   max_seqs  = 8;     // concurrent generations
+    int   n_ctx     = 1536;  // LM steps per generation: frames + n_q - 1
+    int   n_cond    = 64;    // conditioning tokens per generation
+    bool  guided    = true;  // classifier-free guidance, two cache slots per generation
+    float cfg_coef  = 3.0f;
+    int   n_threads = 4;
+    int   block_size = 16;   // KV cache positions per block
+    int   n_blocks   = 0;    // KV cache pool size; 0: every slot at n_ctx
+    std::size_t prefix_cache_bytes = 0; // prefilled audio prompts kept for reuse; 0: off
+};
+
+//-------------------------------------
+// Frame delivery
+//-------------------------------------
+// Carries one generation's frames to its on_frames on a thread of its own,
+// so a consumer that blocks never holds up the shared step loop. append()
+// only copies into the buffer, which holds no more than the result does.
+// The result is handed over once the last frame has been delivered, so
+// on_frames has seen every frame when the future becomes ready.
+class FrameStream {
+public:
+    using OnFrames = std::function<void(const int32_t* codes, int n_frames)>;
+
+    FrameStream(OnFrames on_frames, int n_q)
+        : on_frames_{std::move(on_frames)}, n_q_{n_q}, thread_{[this] { run(); }} {}
+
+    ~FrameStream() { thread_.join(); }
+
+    FrameStream(const FrameStream&)            = delete;
+    FrameStream& operator=(const FrameStream&) = delete;
+
+    void append(const int32_t* codes, int n_frames) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            buffer_.insert(buffer_.end(), codes, codes + (std::size_t)n_frames * n_q_);
+        }
+        cv_.notify_one();
+    }
+
+    // No more frames; `done` gets `result` after the last delivery.
+    void finish(std::promise<GenResult> done, GenResult result) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            done_     = std::move(done);
+            result_   = std::move(result);
+            finished_ = true;
+        }
+        cv_.notify_one();
+    }
+
+    // Everything delivered and the result handed over.
+    bool drained() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return drained_;
+    }
+
+private:
+    void run() {
+        std::vector<int32_t> codes;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lk(mu_);
+                cv_.wait(lk, [&] { return finished_ || !buffer_.empty(); });
+                if (buffer_.empty()) break;
+                codes.swap(buffer_);
+            }
+            on_frames_(codes.data(), (int)(codes.size() / n_q_));
+            codes.clear();
+        }
+        done_.set_value(std::move(result_));
+        std::lock_guard<std::mutex> lk(mu_);
+        drained_ = true;
+    }
+
+    OnFrames                 on_frames_;
+    int                      n_q_;
+    mutable std::mutex       mu_;
+    std::condition_variable  cv_;
+    std::vector<int32_t>     buffer_;
+    std::promise<GenResult>  done_;
+    GenResult                result_;
+    bool                     finished_ = false;
+    bool                     drained_  = false;
+    std::thread              thread_;  // last: starts once the rest is built
+};
+
+//-------------------------------------
+// Continuous-batching generation
+//-------------------------------------
+// Keeps up to max_seqs generations live in one paged KV cache, one slot each
+// (two with guidance). A request is admitted only when the pool can hold all
+// of its steps, so a smaller pool than max_seqs x n_ctx bounds memory by
+// the work actually in flight instead of failing mid-generation. Every step() runs a single batched LM forward over all of
+// them: running generations contribute one step, newly admitted ones their
+// whole audio prompt. Requests join and leave only at step boundaries, so a
+// long generation never holds back a short one behind it.
+//
+// With prefix_cache_bytes set, the KV cache state after prefilling an audio
+// prompt is kept (keyed by the prompt codes and conditioning), and a later
+// request with the same prompt loads it and starts sampling at once.
+//
+// submit() may be called from any thread; step() from one thread at a time,
+// either directly or through start()'s background loop.
+class Scheduler {
+public:
+    Scheduler(std::shared_ptr<const LMStore> store, SchedulerConfig cfg)
+        : lm_{std::move(store)}, cfg_{cfg},
+          cache_{lm_.make_cache(cfg.n_ctx, cfg.max_seqs * (cfg.guided ? 2 : 1), cfg.n_cond,
+                                GGML_TYPE_F16, cfg.block_size, cfg.n_blocks)},
+          state_{1 << 20},
+          sampler_{cfg.n_threads},
+          prefixes_{cfg.prefix_cache_bytes},
+          stats_{(std::size_t)cfg.max_seqs} {
+        for (int g = cfg.max_seqs - 1; g >= 0; --g) free_.push_back(g);
+    }
+
+    ~Scheduler() {
+        stop();
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            for (auto& w : waiting_) w.done.set_value(GenResult{});
+        }
+        for (auto& a : active_) {
+            if (a.stream) {
+                a.stream->finish(std::move(a.done), GenResult{});
+            } else {
+                a.done.set_value(GenResult{});
+            }
+        }
+        streams_.clear(); // waits for each stream's last delivery
+    }
+
+    Scheduler(const Scheduler&)            = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // Queue a request; the future is ready once its last frame is sampled.
+    // Requests that can never fit resolve immediately with ok = false.
+    std::future<GenResult> submit(GenRequest req) {
+        Pending p{std::move(req), {}, Clock::now()};
+        std::future<GenResult> f = p.done.get_future();
+        if (!valid(p.req)) {
+            p.done.set_value(GenResult{});
+            return f;
+        }
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            waiting_.push_back(std::move(p));
+        }
+        cv_.notify_one();
+        return f;
+    }
+
+    /**
+     * Admit waiting requests into free slots, advance every live generation
+     * by one batched forward, and retire the ones that finished.
+     * @return Generations stepped (0 when idle).
+     */
+    int step() {
+        admit();
+        if (active_.empty()) return 0;
+
+        const LMConfig& lmc  = lm_.config();
+        const int       n_q  = lmc.n_q;
+        const int       card = lmc.card;
+
+        // --- this step's tokens ---------------------------------
+        // A new generation feeds steps 0 .. n_prompt at once (prefill); a
+        // running one its next step.
+        std::vector<int> n_tok(active_.size());
+        std::vector<std::vector<int32_t>> inputs(active_.size());
+        for (std::size_t i = 0; i < active_.size(); ++i) {
+            Active& a = active_[i];
+            n_tok[i] = a.next == 0 ? a.pattern.n_prefilled() + 1 : 1;
+            inputs[i].resize((std::size_t)n_tok[i] * n_q);
+            for (int j = 0; j < n_tok[i]; ++j) a.pattern.input(a.next + j, inputs[i].data() + j * n_q);
+        }
+
+        ggml_tensor* logits = nullptr;
+        if (cfg_.guided) {
+            std::vector<LMGuidedSeq> batch;
+            for (std::size_t i = 0; i < active_.size(); ++i) {
+                batch.push_back({2 * active_[i].gen, 2 * active_[i].gen + 1, n_tok[i], inputs[i].data()});
+            }
+            prepare(n_tok, [&] { return lm_.arena_size(cache_, batch, cfg_.n_threads); });
+            logits = lm_.forward_guided(state_, cache_, batch, cfg_.cfg_coef, cfg_.n_threads);
+        } else {
+            std::vector<LMSeq> batch;
+            for (std::size_t i = 0; i < active_.size(); ++i) {
+                batch.push_back({active_[i].gen, n_tok[i], inputs[i].data()});
+            }
+            prepare(n_tok, [&] { return lm_.arena_size(cache_, batch, cfg_.n_threads); });
+            logits = lm_.forward(state_, cache_, batch, cfg_.n_threads);
+        }
+        GGML_ASSERT(logits);
+
+        // --- sample the last column of each generation --------------
+        const int n_live = (int)active_.size();
+        std::vector<int32_t>   sampled((std::size_t)n_live * n_q);
+        std::vector<SampleRow> rows(n_live);
+        int64_t col = 0;
+        for (int i = 0; i < n_live; ++i) {
+            Active& a = active_[i];
+            col += n_tok[i];
+            rows[i] = {(const float*)logits->data + (std::size_t)(col - 1) * n_q * card, nullptr,
+                       &a.req.sampling, &a.rng[0], &sampled[(std::size_t)i * n_q]};
+        }
+        sampler_.sample(rows.data(), n_live, card, n_q);
+
+        for (std::size_t i = 0; i < active_.size(); ++i) {
+            Active& a = active_[i];
+            a.next += n_tok[i];
+            a.pattern.commit(a.next - 1, &sampled[i * n_q]);
+            if (a.save_prefix) {
+                save_prefix(a);
+                a.save_prefix = false;
+            }
+
+            const int done = a.pattern.frames_done(a.next - 1);
+            if (a.stream && done > a.n_emitted) {
+                a.stream->append(a.pattern.codes().data() + (std::size_t)a.n_emitted * n_q, done - a.n_emitted);
+                a.n_emitted = done;
+            }
+        }
+
+        // --- retire finished generations ---------------------------
+        for (std::size_t i = 0; i < active_.size();) {
+            if (active_[i].next < active_[i].pattern.n_steps()) {
+                ++i;
+                continue;
+            }
+            finish(active_[i]);
+            active_.erase(active_.begin() + i);
+        }
+        streams_.erase(std::remove_if(streams_.begin(), streams_.end(),
+                                      [](const std::unique_ptr<FrameStream>& f) { return f->drained(); }),
+                       streams_.end());
+
+        stats_.record_batch((std::size_t)n_live);
+        return n_live;
+    }
+
+    // Run step() on a background thread until stop().
+    void start() {
+        if (loop_.joinable()) return;
+        running_ = true;
+        loop_ = std::thread([this] {
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> lk(mu_);
+                    cv_.wait(lk, [&] { return !running_ || !waiting_.empty() || !active_.empty(); });
+                    if (!running_) return;
+                }
+                step();
+            }
+        });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            running_ = false;
+        }
+        cv_.notify_all();
+        if (loop_.joinable()) loop_.join();
+    }
+
+    std::size_t queue_depth() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return waiting_.size();
+    }
+
+    // Batch-size histogram (live generations per step) and request latency.
+    encodec::BatchStats::Snapshot stats() const { return stats_.snapshot(); }
+
+    // Hits, misses and size of the prompt prefix cache.
+    LruCache<std::string, std::vector<KVPrefix>>::Stats prefix_stats() const { return prefixes_.stats(); }
+
+private:
+    using Clock = encodec::Clock;
+
+    struct Pending {
+        GenRequest               req;
+        std::promise<GenResult>  done;
+        Clock::time_point        arrival;
+    };
+
+    struct Active {
+        GenRequest               req;
+        std::promise<GenResult>  done;
+        Clock::time_point        arrival;
+        DelayPattern             pattern;
+        std::vector<StreamRng>   rng;      // one stream: this generation's row
+        int                      gen       = 0; // generation index; cache slots derive from it
+        int                      next      = 0; // next LM step to run
+        int                      n_blocks  = 0; // cache blocks reserved for all its steps
+        int                      n_emitted = 0; // frames passed to on_frames
+        std::string              prefix_key;          // prompt prefix cache key: prompt and cond
+        bool                     save_prefix = false; // store the prefix after prefill
+        FrameStream*             stream      = nullptr; // with on_frames; owned by streams_
+    };
+
+    bool valid(const GenRequest& r) const {
+        const LMConfig& lmc = lm_.config();
+        const int n_prompt = (int)(r.prompt.size() / lmc.n_q);
+        return r.n_frames > 0 &&
+               r.n_frames + lmc.n_q - 1 <= cfg_.n_ctx &&
+               blocks_needed(r) <= cache_.n_blocks() &&
+               r.prompt.size() % lmc.n_q == 0 && n_prompt < r.n_frames &&
+               std::all_of(r.prompt.begin(), r.prompt.end(), [&](int32_t c) { return c >= 0 && c < lmc.card; }) &&
+               r.cond.size() % lmc.d_model == 0 &&
+               (int64_t)r.cond.size() <= cfg_.n_cond * lmc.d_model;
+    }
+
+    // Cache blocks a request holds by its last step, over all its slots.
+    int blocks_needed(const GenRequest& r) const {
+        return cache_.blocks_for(r.n_frames + lm_.config().n_q - 1) * (cfg_.guided ? 2 : 1);
+    }
+
+    // Move waiting requests, in arrival order, into free generation slots
+    // while the cache pool can hold them, and project their conditioning.
+    void admit() {
+        std::vector<Pending> joined;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            while (!waiting_.empty() && !free_.empty() &&
+                   reserved_ + blocks_needed(waiting_.front().req) <= cache_.n_blocks()) {
+                reserved_ += blocks_needed(waiting_.front().req);
+                joined.push_back(std::move(waiting_.front()));
+                waiting_.pop_front();
+            }
+        }
+
+        const LMConfig& lmc = lm_.config();
+        for (auto& p : joined) {
+            const int gen = free_.back();
+            free_.pop_back();
+
+            const int n_frames = p.req.n_frames;
+            Active a{std::move(p.req), std::move(p.done), p.arrival,
+                     DelayPattern{lmc.n_q, lmc.card, n_frames}, {}, gen, 0, 0, 0, {}, false, nullptr};
+            a.n_blocks = blocks_needed(a.req);
+            a.pattern.prefill(a.req.prompt.data(), (int)(a.req.prompt.size() / lmc.n_q));
+            a.rng.emplace_back(a.req.seed, 0);
+            if (a.req.on_frames) {
+                streams_.push_back(std::make_unique<FrameStream>(std::move(a.req.on_frames), lmc.n_q));
+                a.stream = streams_.back().get();
+            }
+
+            // the unconditional slot (odd, when guided) keeps no conditioning
+            const int slot   = cfg_.guided ? 2 * gen : gen;
+            const int n_cond = (int)(a.req.cond.size() / lmc.d_model);
+            cache_.clear(slot);
+            if (cfg_.guided) cache_.clear(slot + 1);
+            if (a.pattern.n_prefilled() > 0 && cfg_.prefix_cache_bytes > 0 && load_prefix(a, slot)) {
+                active_.push_back(std::move(a));
+                continue;
+            }
+            if (n_cond > 0) {
+                state_.reset();
+                state_.reserve(lm_.condition_arena_size(cache_, n_cond, cfg_.n_threads));
+                lm_.set_condition(state_, cache_, slot, a.req.cond.data(), n_cond, cfg_.n_threads);
+            }
+            active_.push_back(std::move(a));
+        }
+    }
+
+    // Resume from a cached prompt prefix: positions 0 .. n_prompt - 1 of
+    // both slots, so the request goes straight to step n_prompt. On a miss,
+    // mark it to store its prefix once prefilled.
+    bool load_prefix(Active& a, int slot) {
+        const auto& cond = a.req.cond;
+        append_key(a.prefix_key, a.req.prompt.data(), a.req.prompt.size() * sizeof(int32_t));
+        append_key(a.prefix_key, cond.data(), cond.size() * sizeof(float));
+        auto hit = prefixes_.get(a.prefix_key);
+        if (!hit) {
+            a.save_prefix = true;
+            return false;
+        }
+        for (std::size_t i = 0; i < hit->size(); ++i) {
+            GGML_ASSERT(cache_.load_prefix(slot + (int)i, (*hit)[i])); // within a's reservation
+        }
+        a.next = a.pattern.n_prefilled();
+        return true;
+    }
+
+    void save_prefix(const Active& a) {
+        const int slot = cfg_.guided ? 2 * a.gen : a.gen;
+        auto prefix = std::make_shared<std::vector<KVPrefix>>();
+        std::size_t bytes = a.prefix_key.size();
+        for (int i = 0; i < (cfg_.guided ? 2 : 1); ++i) {
+            prefix->push_back(cache_.save_prefix(slot + i, a.pattern.n_prefilled()));
+            bytes += prefix->back().bytes();
+        }
+        prefixes_.put(a.prefix_key, std::move(prefix), bytes);
+    }
+
+    // Size the arena for a batch shape (measured once per distinct shape;
+    // steady-state decode is always n_live x 1 token) and clear it. Every
+    // prompt length and admission mix is a new shape, so the sizes are
+    // forgotten past kMaxArenaShapes; the arena itself never shrinks, and
+    // the few decode shapes are measured again on their next step.
+    template <typename Measure>
+    void prepare(const std::vector<int>& shape, Measure measure) {
+        auto it = arena_sizes_.find(shape);
+        if (it == arena_sizes_.end()) {
+            if (arena_sizes_.size() >= kMaxArenaShapes) arena_sizes_.clear();
+            it = arena_sizes_.emplace(shape, measure()).first;
+        }
+        state_.reset();
+        state_.reserve(it->second);
+    }
+
+    void finish(Active& a) {
+        GenResult r;
+        r.ok       = true;
+        r.n_frames = a.pattern.n_frames();
+        r.codes    = a.pattern.codes();
+        stats_.record_latency(Clock::now() - a.arrival);
+        if (a.stream) {
+            a.stream->finish(std::move(a.done), std::move(r));
+        } else {
+            a.done.set_value(std::move(r));
+        }
+        free_.push_back(a.gen);
+        reserved_ -= a.n_blocks;
+        const int slot = cfg_.guided ? 2 * a.gen : a.gen;
+        cache_.clear(slot);
+        if (cfg_.guided) cache_.clear(slot + 1);
+    }
+
+    LM                                   lm_;
+    SchedulerConfig                      cfg_;
+    KVCache                              cache_;
+    ExecState                            state_;
+    Sampler                              sampler_;  // every live generation's heads at once
+    static constexpr std::size_t         kMaxArenaShapes = 256;
+    std::map<std::vector<int>, size_t>   arena_sizes_; // by tokens per generation
+    std::vector<Active>                  active_;   // step() thread only
+    std::vector<int>                     free_;     // step() thread only
+    std::vector<std::unique_ptr<FrameStream>> streams_; // step() thread only; until drained
+    int                                  reserved_ = 0; // cache blocks held by active_
+    LruCache<std::string, std::vector<KVPrefix>> prefixes_; // per prompt: one prefix per slot
+
+    mutable std::mutex                   mu_;
+    std::condition_variable              cv_;
+    std::deque<Pending>                  waiting_;
+    bool                                 running_ = false;
+    std::thread                          loop_;
+    encodec::BatchStats                  stats_;
+};
+
+}
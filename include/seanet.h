@@ -47,3 +47,25 @@ struct ggml_tensor * seanet_resnet_block(
     struct ggml_tensor * output = ggml_add(ctx, input, conv2);
     return output;
 }
+
+
+// Same block with weight norm already folded into FP16 conv weights
+// (see weight_norm_fold), so building the graph reads no weight data.
+struct ggml_tensor * seanet_resnet_block(
+    struct ggml_context * ctx,
+    struct ggml_tensor  * input,        // [B, in_ch, T]
+    struct ggml_tensor  * weight1,      // [3, in_ch, bottleneck_ch] FP16
+    struct ggml_tensor  * bias1,        // [bottleneck_ch] or NULL
+    struct ggml_tensor  * weight2,      // [1, bottleneck_ch, out_ch] FP16
+    struct ggml_tensor  * bias2         // [out_ch] or NULL
+) {
+    struct ggml_tensor * act1  = ggml_elu(ctx, input);
+    struct ggml_tensor * conv1 = streamable_conv1d(ctx, act1, weight1, bias1,
+                                                   /*stride=*/1, /*padding=*/1, /*dilation=*/1);
+
+    struct ggml_tensor * act2  = ggml_elu(ctx, conv1);
+    struct ggml_tensor * conv2 = streamable_conv1d(ctx, act2, weight2, bias2,
+                                                   /*stride=*/1, /*padding=*/0, /*dilation=*/1);
+
+    return ggml_add(ctx, input, conv2);
+}
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string>
+#include <thread>
+
+namespace encodec {
+
+//-------------------------------------
+// Shared-memory output ring
+//-------------------------------------
+// A single-producer / single-consumer ring of fixed-size slots in POSIX
+// shared memory, for handing decoded PCM or codes to another process
+// without a pipe. The producer's graph writes its result straight into a
+// slot (see ExecState::external); the consumer reads it in place. A chunk
+// costs no copy and no syscall on either side.
+//
+// Chunk s lives in slot s % n_slots. `head` counts chunks published,
+// `tail` chunks released; each is written by one side only, so the ring
+// needs no lock, only acquire/release ordering. Both are lock-free atomics
+// and therefore valid across processes.
+//
+// Layout:
+//   ShmRingHeader                       (cache-line aligned fields)
+//   n_slots x { ShmChunk | payload }    each padded to 64 bytes
+
+enum ShmRingKind : uint32_t {
+    SHM_RING_CODES   = 1, // int32 codes, dim x n_frames as the encoder writes them (dim = n_q)
+    SHM_RING_LATENTS = 2, // f32 quantized latents, n_frames x dim
+    SHM_RING_PCM     = 3, // f32 samples, n_frames x dim (dim = channels)
+};
+
+// Describes the payload of one slot.
+struct ShmChunk {
+    uint64_t seq      = 0;
+    uint64_t frame0   = 0; // first frame of the stream in this chunk
+    uint32_t n_frames = 0;
+    uint32_t dim      = 0;
+    uint32_t n_bytes  = 0;
+    uint32_t reserved = 0;
+};
+
+struct ShmRingHeader {
+    uint32_t magic      = 0x52534345; // "ECSR"
+    uint32_t version    = 1;
+    uint32_t kind       = 0;
+    uint32_t n_slots    = 0;
+    uint64_t slot_bytes = 0;          // payload capacity of a slot
+
+    alignas(64) std::atomic<uint64_t> head{0};   // written by the producer
+    alignas(64) std::atomic<uint64_t> tail{0};   // written by the consumer
+    alignas(64) std::atomic<uint32_t> closed{0}; // bit 0: producer done, bit 1: consumer gone
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring needs address-free 64-bit atomics");
+
+namespace detail {
+
+inline std::size_t shm_slot_stride(uint64_t slot_bytes) {
+    return (sizeof(ShmChunk) + (std::size_t)slot_bytes + 63) / 64 * 64;
+}
+
+inline std::size_t shm_ring_size(uint32_t n_slots, uint64_t slot_bytes) {
+    return (sizeof(ShmRingHeader) + 63) / 64 * 64 + (std::size_t)n_slots * shm_slot_stride(slot_bytes);
+}
+
+// Spin briefly, then sleep in growing steps: chunks arrive every few tens
+// of milliseconds, so a waiting side costs next to no CPU.
+class Backoff {
+public:
+    void wait() {
+        if (n_++ < 64) return;
+        std::this_thread::sleep_for(std::chrono::microseconds(std::min(20 << std::min(n_ / 64, 5), 500)));
+    }
+
+private:
+    int n_ = 0;
+};
+
+}
+
+// Common mapping of a ring; see ShmRingWriter / ShmRingReader.
+class ShmRing {
+public:
+    ~ShmRing() {
+        if (map_) munmap(map_, size_);
+    }
+
+    ShmRing(const ShmRing&)            = delete;
+    ShmRing& operator=(const ShmRing&) = delete;
+
+    ShmRingKind kind()       const noexcept { return (ShmRingKind)hdr()->kind; }
+    uint32_t    n_slots()    const noexcept { return hdr()->n_slots; }
+    uint64_t    slot_bytes() const noexcept { return hdr()->slot_bytes; }
+
+protected:
+    ShmRing(void* map, std::size_t size) : map_{map}, size_{size} {}
+
+    ShmRingHeader* hdr() const noexcept { return (ShmRingHeader*)map_; }
+
+    ShmChunk* chunk(uint64_t seq) const noexcept {
+        uint8_t* base = (uint8_t*)map_ + (sizeof(ShmRingHeader) + 63) / 64 * 64;
+        return (ShmChunk*)(base + (seq % hdr()->n_slots) * detail::shm_slot_stride(hdr()->slot_bytes));
+    }
+
+    static uint8_t* payload(ShmChunk* c) noexcept { return (uint8_t*)(c + 1); }
+
+    static void* map(int fd, std::size_t size) {
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    void*       map_;
+    std::size_t size_;
+};
+
+//-------------------------------------
+// Producer
+//-------------------------------------
+// Chunks are published strictly in sequence, but several workers may fill
+// their slots at once: slot(s) hands out the memory of chunk s, and
+// publish(s) (called in order, from one thread at a time) makes it visible.
+class ShmRingWriter : public ShmRing {
+public:
+    // Creates the segment `name` ("/something"), replacing a stale one.
+    // nullptr (with a message on stderr) on failure.
+    static std::unique_ptr<ShmRingWriter> create(const std::string& name, ShmRingKind kind,
+                                                 uint32_t n_slots, uint64_t slot_bytes) {
+        shm_unlink(name.c_str());
+        const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        const std::size_t size = detail::shm_ring_size(n_slots, slot_bytes);
+        void* p = nullptr;
+        if (fd >= 0 && n_slots > 0 && ftruncate(fd, (off_t)size) == 0) p = map(fd, size);
+        if (fd >= 0) ::close(fd);
+        if (!p) {
+            std::fprintf(stderr, "%s: failed to create shared memory '%s'\n", __func__, name.c_str());
+            if (fd >= 0) shm_unlink(name.c_str());
+            return nullptr;
+        }
+        ShmRingHeader* h = new (p) ShmRingHeader;
+        h->kind       = kind;
+        h->n_slots    = n_slots;
+        h->slot_bytes = slot_bytes;
+        return std::unique_ptr<ShmRingWriter>{new ShmRingWriter(p, size, name)};
+    }
+
+    // Marks the stream finished and removes the name; an attached reader
+    // keeps its mapping and drains what was published.
+    ~ShmRingWriter() {
+        close();
+        shm_unlink(name_.c_str());
+    }
+
+    // Payload memory of chunk `seq`, waiting while the reader still holds
+    // the chunk n_slots before it. nullptr if the reader has detached or the
+    // writer was cancel()ed.
+    uint8_t* slot(uint64_t seq) {
+        detail::Backoff backoff;
+        while (seq >= hdr()->tail.load(std::memory_order_acquire) + hdr()->n_slots) {
+            if (hdr()->closed.load(std::memory_order_acquire) & 2) return nullptr;
+            if (cancelled_.load(std::memory_order_acquire)) return nullptr;
+            backoff.wait();
+        }
+        return payload(chunk(seq));
+    }
+
+    // Makes chunk `seq` (filled through slot(seq)) visible to the reader.
+    // Chunks must be published in order, starting at 0.
+    void publish(uint64_t seq, uint64_t frame0, uint32_t n_frames, uint32_t dim, uint32_t n_bytes) {
+        ShmChunk* c = chunk(seq);
+        c->seq      = seq;
+        c->frame0   = frame0;
+        c->n_frames = n_frames;
+        c->dim      = dim;
+        c->n_bytes  = n_bytes;
+        hdr()->head.store(seq + 1, std::memory_order_release);
+    }
+
+    // Chunks published so far: the sequence number of the next one.
+    uint64_t published() const noexcept { return hdr()->head.load(std::memory_order_relaxed); }
+
+    bool reader_gone() const noexcept { return hdr()->closed.load(std::memory_order_acquire) & 2; }
+
+    // No more chunks. The reader sees end-of-stream once drained.
+    void close() { hdr()->closed.fetch_or(1, std::memory_order_release); }
+
+    // Stops waiting for the reader: slot() returns nullptr from now on, in
+    // this process only. For tearing down a writer whose reader stalled.
+    void cancel() { cancelled_.store(true, std::memory_order_release); }
+
+private:
+    ShmRingWriter(void* map, std::size_t size, std::string name)
+        : ShmRing{map, size}, name_{std::move(name)} {}
+
+    std::string       name_;
+    std::atomic<bool> cancelled_{false};
+};
+
+//-------------------------------------
+// Consumer
+//-------------------------------------
+// A chunk as the reader sees it: a view into the ring, valid until
+// release().
+struct ShmChunkView {
+    ShmChunk       info;
+    const uint8_t* data;
+};
+
+class ShmRingReader : public ShmRing {
+public:
+    // Attaches to the segment a writer created. nullptr (with a message on
+    // stderr) if it does not exist or is not a ring.
+    static std::unique_ptr<ShmRingReader> attach(const std::string& name) {
+        const int fd = shm_open(name.c_str(), O_RDWR, 0);
+        struct stat st{};
+        void* p = nullptr;
+        if (fd >= 0 && fstat(fd, &st) == 0 && (std::size_t)st.st_size >= sizeof(ShmRingHeader)) {
+            p = map(fd, (std::size_t)st.st_size);
+        }
+        if (fd >= 0) ::close(fd);
+        const ShmRingHeader expect;
+        const ShmRingHeader* h = (const ShmRingHeader*)p;
+        if (!p || h->magic != expect.magic || h->version != expect.version || h->n_slots == 0 ||
+            detail::shm_ring_size(h->n_slots, h->slot_bytes) > (std::size_t)st.st_size) {
+            std::fprintf(stderr, "%s: '%s' is not an output ring\n", __func__, name.c_str());
+            if (p) munmap(p, (std::size_t)st.st_size);
+            return nullptr;
+        }
+        return std::unique_ptr<ShmRingReader>{new ShmRingReader(p, (std::size_t)st.st_size)};
+    }
+
+    // Detaching tells the writer to stop waiting for slots.
+    ~ShmRingReader() { hdr()->closed.fetch_or(2, std::memory_order_release); }
+
+    // The next chunk, waiting up to `timeout` for it. nullopt on timeout or
+    // at end of stream (see finished()). Call release() when done with it.
+    std::optional<ShmChunkView> next(std::chrono::milliseconds timeout = std::chrono::milliseconds::max()) {
+        const uint64_t seq = hdr()->tail.load(std::memory_order_relaxed);
+        const auto deadline = timeout == std::chrono::milliseconds::max()
+            ? std::chrono::steady_clock::time_point::max()
+            : std::chrono::steady_clock::now() + timeout;
+        detail::Backoff backoff;
+        while (hdr()->head.load(std::memory_order_acquire) <= seq) {
+            // re-check head after seeing `closed`: the last publish may race it
+            if ((hdr()->closed.load(std::memory_order_acquire) & 1) &&
+                hdr()->head.load(std::memory_order_acquire) <= seq) {
+                finished_ = true;
+                return std::nullopt;
+            }
+            if (std::chrono::steady_clock::now() >= deadline) return std::nullopt;
+            backoff.wait();
+        }
+        ShmChunk* c = chunk(seq);
+        return ShmChunkView{*c, payload(c)};
+    }
+
+    // Hands the slot of the chunk returned by next() back to the writer.
+    void release() { hdr()->tail.fetch_add(1, std::memory_order_release); }
+
+    // The writer closed the ring and every chunk has been read.
+    bool finished() const noexcept { return finished_; }
+
+private:
+    ShmRingReader(void* map, std::size_t size) : ShmRing{map, size} {}
+
+    bool finished_ = false;
+};
+
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include "ggml.h"
+#include "bounded_queue.h"
+#include "exec_state.h"
+#include "quantizer.h"
+#include "shm_ring.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace musicgen {
+
+using encodec::BoundedQueue;
+
+// Decoded output of frames [frame0, frame0 + n_frames), n_frames x dim.
+struct AudioChunk {
+    int                frame0   = 0;
+    int                n_frames = 0;
+    int64_t            dim      = 0;
+    std::vector<float> data;
+};
+
+// Decodes n_frames frames of codes (n_frames x n_q, frame-major) into
+// n_frames x dim floats at `out`, using `state` as its arena.
+using FrameDecoder = std::function<void(encodec::ExecState& state, const int32_t* codes,
+                                        int n_frames, int n_q, float* out)>;
+
+// The codec's quantizer_decode as a FrameDecoder: codes to the quantized
+// latents the SEANet decoder consumes, dim = quantizer_dim(quant). The
+// graph's last op writes the latents to `out` itself, so `out` may be an
+// output ring slot. `quant` must outlive the decoder.
+inline FrameDecoder quantizer_frame_decoder(const quantizer* quant, int n_threads = 1) {
+    return [quant, n_threads](encodec::ExecState& state, const int32_t* codes, int n_frames, int n_q,
+                              float* out) {
+        {
+            encodec::ExecState m = encodec::ExecState::measuring();
+            ggml_tensor* c = ggml_new_tensor_2d(m.ctx(), GGML_TYPE_I32, n_frames, n_q);
+            ggml_build_forward_expand(m.new_graph(), quantizer_decode(quant, m.ctx(), c));
+            state.reset();
+            state.reserve(m.required_size(n_threads));
+        }
+        ggml_tensor* c = ggml_new_tensor_2d(state.ctx(), GGML_TYPE_I32, n_frames, n_q);
+        for (int t = 0; t < n_frames; ++t) {
+            for (int k = 0; k < n_q; ++k) ((int32_t*)c->data)[k * n_frames + t] = codes[t * n_q + k];
+        }
+        ggml_tensor* latents = quantizer_decode(quant, state.ctx(), c); // [D, n_frames]
+        ggml_tensor* dst     = state.external(GGML_TYPE_F32, latents->ne[0], n_frames, 1, out);
+        ggml_build_forward_expand(state.new_graph(), ggml_cpy(state.ctx(), latents, dst));
+        state.compute(n_threads);
+    };
+}
+
+// Floats per frame quantizer_frame_decoder writes.
+inline int64_t quantizer_dim(const quantizer* quant) { return quant->blocks[0].embed->ne[0]; }
+
+struct StreamDecoderConfig {
+    int         n_workers    = 2;  // decode threads
+    int         chunk_frames = 10; // frames per decode call (200 ms at 50 Hz)
+    std::size_t max_inflight = 4;  // chunks queued for decoding before push() blocks
+    std::size_t max_output   = 8;  // decoded chunks waiting for pop() before decoding blocks
+    std::size_t arena_size   = 1 << 20;
+
+    // If set, chunks are decoded straight into this ring's slots and
+    // published there in order instead of coming out of pop(). Not owned;
+    // slots must hold chunk_frames x dim floats.
+    encodec::ShmRingWriter* ring = nullptr;
+};
+
+//-------------------------------------
+// Streaming decode stage
+//-------------------------------------
+// Sits between LM sampling and audio output: push() takes frames as soon
+// as they are complete (see GenRequest::on_frames), cuts them into chunks
+// of chunk_frames, and a pool of n_workers threads decodes the chunks
+// concurrently. Decoded chunks come out of pop() in frame order through a
+// bounded queue, so time to first audio is one chunk plus the codebook
+// delay, whatever the track length.
+//
+// Both queues are bounded: a consumer that stops popping stalls the
+// workers, which in turn makes push() wait. Fed from GenRequest::on_frames,
+// that holds back the delivery of this generation's frames only.
+//
+// With an output ring, the ring takes the place of the output queue: a
+// worker waits for its chunk's slot, the decoder writes into it, and the
+// chunk is published once every earlier one is. A reader that lags stalls
+// the workers the same way.
+//
+// push() and finish() are for one producer thread, pop() for one consumer.
+class StreamDecoder {
+public:
+    // `dim`: floats per decoded frame.
+    StreamDecoder(FrameDecoder decode, int n_q, int64_t dim, StreamDecoderConfig cfg = {})
+        : decode_{std::move(decode)}, n_q_{n_q}, dim_{dim}, cfg_{cfg},
+          input_{cfg.max_inflight}, output_{cfg.max_output} {
+        cfg_.chunk_frames = std::max(cfg_.chunk_frames, 1);
+        GGML_ASSERT(!cfg_.ring || cfg_.ring->slot_bytes() >= cfg_.chunk_frames * dim_ * sizeof(float));
+        live_workers_ = std::max(cfg_.n_workers, 1);
+        for (int i = 0; i < live_workers_; ++i) workers_.emplace_back([this] { worker_loop(); });
+    }
+
+    // Does not wait for the consumer: chunks it has not taken are dropped.
+    // The output (and ring) is released first, so a worker blocked on it
+    // returns and the workers drain the input without decoding, which the
+    // final flush would otherwise block on.
+    ~StreamDecoder() {
+        stopping_ = true;
+        output_.close();
+        if (cfg_.ring) cfg_.ring->cancel();
+        finish();
+        for (auto& w : workers_) w.join();
+    }
+
+    StreamDecoder(const StreamDecoder&)            = delete;
+    StreamDecoder& operator=(const StreamDecoder&) = delete;
+
+    // Queue the next n_frames complete frames (n_frames x n_q codes). Blocks
+    // while max_inflight chunks wait for a worker.
+    void push(const int32_t* codes, int n_frames) {
+        pending_.insert(pending_.end(), codes, codes + (std::size_t)n_frames * n_q_);
+        while ((int)(pending_.size() / n_q_) >= cfg_.chunk_frames) flush(cfg_.chunk_frames);
+    }
+
+    // No more frames: decode what is buffered and end the output once every
+    // chunk has been popped.
+    void finish() {
+        if (finished_) return;
+        finished_ = true;
+        if (!pending_.empty()) flush((int)(pending_.size() / n_q_));
+        input_.close();
+    }
+
+    // Next decoded chunk in frame order; nullopt once finished and drained.
+    // Always nullopt with an output ring.
+    std::optional<AudioChunk> pop() { return output_.pop(); }
+
+private:
+    struct Job {
+        uint64_t             seq;
+        int                  frame0;
+        int                  n_frames;
+        std::vector<int32_t> codes;
+    };
+
+    void flush(int n_frames) {
+        const std::size_t n = (std::size_t)n_frames * n_q_;
+        Job job{next_seq_++, next_frame_, n_frames, std::vector<int32_t>(pending_.begin(), pending_.begin() + n)};
+        pending_.erase(pending_.begin(), pending_.begin() + n);
+        next_frame_ += n_frames;
+        input_.push(std::move(job));
+    }
+
+    void worker_loop() {
+        encodec::ExecState state{cfg_.arena_size};
+        while (auto job = input_.pop()) {
+            if (stopping_) continue;
+            std::optional<AudioChunk> chunk = AudioChunk{job->frame0, job->n_frames, dim_, {}};
+            float* out = nullptr;
+            if (cfg_.ring) {
+                out = (float*)cfg_.ring->slot(job->seq); // null once the reader is gone
+            } else {
+                chunk->data.resize((std::size_t)job->n_frames * dim_);
+                out = chunk->data.data();
+            }
+            if (out) {
+                decode_(state, job->codes.data(), job->n_frames, n_q_, out);
+            } else {
+                chunk.reset();
+            }
+            {
+                std::lock_guard<std::mutex> lk(ready_mu_);
+                ready_.emplace(job->seq, std::move(chunk));
+            }
+            emit();
+        }
+        emit();
+        if (--live_workers_ == 0) {
+            if (cfg_.ring) cfg_.ring->close();
+            output_.close();
+        }
+    }
+
+    // Move finished chunks to the output while the next one in order is
+    // ready. One emitter at a time keeps the output ordered. A chunk that
+    // got no ring slot was never written; nothing after it is published.
+    void emit() {
+        std::lock_guard<std::mutex> order(emit_mu_);
+        for (;;) {
+            std::optional<AudioChunk> chunk;
+            {
+                std::lock_guard<std::mutex> lk(ready_mu_);
+                auto it = ready_.find(next_emit_);
+                if (it == ready_.end()) return;
+                chunk = std::move(it->second);
+                ready_.erase(it);
+            }
+            if (cfg_.ring) {
+                gap_ = gap_ || !chunk;
+                if (!gap_) {
+                    cfg_.ring->publish(next_emit_, chunk->frame0, chunk->n_frames, (uint32_t)dim_,
+                                       (uint32_t)(chunk->n_frames * dim_ * sizeof(float)));
+                }
+                ++next_emit_;
+                continue;
+            }
+            ++next_emit_;
+            if (!output_.push(std::move(*chunk))) return;
+        }
+    }
+
+    FrameDecoder                   decode_;
+    int                            n_q_;
+    int64_t                        dim_;
+    StreamDecoderConfig            cfg_;
+
+    // producer side
+    std::vector<int32_t>           pending_;
+    uint64_t                       next_seq_   = 0;
+    int                            next_frame_ = 0;
+    bool                           finished_   = false;
+
+    BoundedQueue<Job>              input_;
+    BoundedQueue<AudioChunk>       output_;
+    std::mutex                     ready_mu_;
+    std::map<uint64_t, std::optional<AudioChunk>> ready_; // decoded, waiting for earlier chunks; nullopt: not written
+    std::mutex                     emit_mu_;
+    uint64_t                       next_emit_ = 0;     // guarded by emit_mu_
+    bool                           gap_       = false; // guarded by emit_mu_
+    std::atomic<bool>              stopping_{false};   // tearing down: decode nothing more
+    std::atomic<int>               live_workers_{0};
+    std::vector<std::thread>       workers_;
+};
+
+}
@@ -0,0 +1,369 @@
+#pragma once
+
+#include "ggml.h"
+#include "attention.h"
+#include "exec_state.h"
+#include "lru_cache.h"
+#include "mem_usage.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace musicgen {
+
+using encodec::ContextUsage;
+using encodec::ExecState;
+
+//-------------------------------------
+// T5 tokenizer
+//-------------------------------------
+// SentencePiece unigram segmentation over the T5 vocabulary: spaces become
+// "▁" (with one in front), and the piece sequence of highest total score is
+// found by Viterbi over byte offsets. Characters no piece covers map to
+// <unk>. NFKC normalization is not applied; prompts are expected to be
+// plain text.
+class T5Tokenizer {
+public:
+    static constexpr int32_t kPad = 0;
+    static constexpr int32_t kEos = 1;
+    static constexpr int32_t kUnk = 2;
+
+    T5Tokenizer() = default;
+
+    T5Tokenizer(std::vector<std::string> pieces, std::vector<float> scores)
+        : scores_{std::move(scores)} {
+        float min_score = 0.0f;
+        for (std::size_t i = 0; i < pieces.size(); ++i) {
+            max_len_  = std::max(max_len_, pieces[i].size());
+            min_score = std::min(min_score, scores_[i]);
+            ids_.emplace(std::move(pieces[i]), (int32_t)i);
+        }
+        unk_score_ = min_score - 10.0f;
+    }
+
+    std::size_t size() const noexcept { return scores_.size(); }
+
+    // Trim and collapse whitespace runs to single spaces. Prompts that
+    // normalize alike tokenize alike, so this is also their cache key.
+    static std::string normalize(const std::string& text) {
+        std::string out;
+        bool space = false;
+        for (char c : text) {
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v') {
+                space = !out.empty();
+                continue;
+            }
+            if (space) out += ' ';
+            space = false;
+            out += c;
+        }
+        return out;
+    }
+
+    // Token ids of `text` followed by </s>, at most max_tokens in total.
+    std::vector<int32_t> encode(const std::string& text, int max_tokens = 512) const {
+        const std::string norm = normalize(text);
+        std::vector<int32_t> ids;
+        if (!norm.empty()) {
+            std::string s = "\xE2\x96\x81"; // "▁"
+            for (char c : norm) {
+                if (c == ' ') s += "\xE2\x96\x81";
+                else          s += c;
+            }
+            ids = segment(s);
+        }
+        if ((int)ids.size() > max_tokens - 1) ids.resize(std::max(max_tokens - 1, 0));
+        ids.push_back(kEos);
+        return ids;
+    }
+
+private:
+    static std::size_t utf8_len(unsigned char c) {
+        if ((c & 0x80) == 0x00) return 1;
+        if ((c & 0xE0) == 0xC0) return 2;
+        if ((c & 0xF0) == 0xE0) return 3;
+        if ((c & 0xF8) == 0xF0) return 4;
+        return 1;
+    }
+
+    std::vector<int32_t> segment(const std::string& s) const {
+        const std::size_t n = s.size();
+        struct Node {
+            double      score = -std::numeric_limits<double>::infinity();
+            std::size_t from  = 0;
+            int32_t     id    = kUnk;
+        };
+        std::vector<Node> best(n + 1);
+        best[0].score = 0.0;
+        for (std::size_t i = 0; i < n; ++i) {
+            if (std::isinf(best[i].score)) continue;
+            auto relax = [&](std::size_t end, double score, int32_t id) {
+                if (score > best[end].score) best[end] = {score, i, id};
+            };
+            for (std::size_t len = 1; len <= std::min(max_len_, n - i); ++len) {
+                auto it = ids_.find(s.substr(i, len));
+                if (it != ids_.end()) relax(i + len, best[i].score + scores_[it->second], it->second);
+            }
+            relax(std::min(i + utf8_len((unsigned char)s[i]), n), best[i].score + unk_score_, kUnk);
+        }
+
+        std::vector<int32_t> ids;
+        for (std::size_t end = n; end > 0; end = best[end].from) ids.push_back(best[end].id);
+        std::reverse(ids.begin(), ids.end());
+        return ids;
+    }
+
+    std::unordered_map<std::string, int32_t> ids_;
+    std::vector<float>                       scores_;
+    std::size_t                              max_len_   = 0;
+    float                                    unk_score_ = -10.0f;
+};
+
+//-------------------------------------
+// T5 encoder + MusicGen output_proj
+//-------------------------------------
+// The text conditioner of MusicGen (T5Conditioner): a T5 encoder stack
+// (pre-RMSNorm layers, unscaled attention with a relative position bias
+// from layer 0 shared by every layer, ReLU or gated-GELU feed-forward)
+// followed by the LM's `output_proj` Linear into d_model of the LM.
+struct T5Config {
+    int     n_vocab      = 32128;
+    int64_t d_model      = 768;
+    int     n_head       = 12;
+    int64_t d_kv         = 64;
+    int64_t d_ff         = 3072;
+    int     n_layer      = 12;
+    int     n_buckets    = 32;  // relative position buckets
+    int     max_distance = 128;
+    float   norm_eps     = 1e-6f;
+    int64_t d_out        = 1024; // output_proj features (LM d_model)
+    int     max_tokens   = 512;
+};
+
+// Weight shapes are given PyTorch-style; ggml ne is the reverse.
+struct T5LayerWeights {
+    ggml_tensor* attn_norm{}; // [d_model]
+    ggml_tensor* q{};         // [n_head * d_kv, d_model]
+    ggml_tensor* k{};
+    ggml_tensor* v{};
+    ggml_tensor* o{};         // [d_model, n_head * d_kv]
+    ggml_tensor* ff_norm{};   // [d_model]
+    ggml_tensor* wi{};        // [d_ff, d_model]; wi_0 when gated
+    ggml_tensor* wi_1{};      // [d_ff, d_model]; null unless gated
+    ggml_tensor* wo{};        // [d_model, d_ff]
+};
+
+struct T5Weights {
+    ggml_tensor*                shared{};     // [n_vocab, d_model] token embedding
+    ggml_tensor*                rel_bias{};   // [n_buckets, n_head]
+    std::vector<T5LayerWeights> layers;
+    ggml_tensor*                final_norm{}; // [d_model]
+    ggml_tensor*                proj_w{};     // [d_out, d_model]
+    ggml_tensor*                proj_b{};     // [d_out]
+};
+
+// Immutable T5 weights and vocabulary, shared by every worker (cf. LMStore).
+class T5Store {
+public:
+    // Takes ownership of `ctx`, the context the weight tensors live in.
+    T5Store(ggml_context* ctx, T5Config cfg, T5Weights w, T5Tokenizer tok)
+        : ctx_{ctx}, cfg_{cfg}, w_{std::move(w)}, tok_{std::move(tok)} {
+        int i = 0;
+        for (auto* t = ggml_get_first_tensor(ctx_); t; t = ggml_get_next_tensor(ctx_, t), ++i) {
+            if (ggml_get_name(t)[0] == '\0') ggml_format_name(t, "t5_weight_%d", i);
+        }
+    }
+
+    ~T5Store() {
+        if (ctx_) ggml_free(ctx_);
+    }
+
+    T5Store(const T5Store&)            = delete;
+    T5Store& operator=(const T5Store&) = delete;
+
+    const T5Config&    config()    const noexcept { return cfg_; }
+    const T5Weights&   weights()   const noexcept { return w_; }
+    const T5Tokenizer& tokenizer() const noexcept { return tok_; }
+
+    ContextUsage usage() const {
+        const std::size_t used = ggml_used_mem(ctx_);
+        return {ggml_get_mem_size(ctx_), used, used};
+    }
+
+private:
+    ggml_context* ctx_; // owned
+    T5Config      cfg_;
+    T5Weights     w_;
+    T5Tokenizer   tok_;
+};
+
+// Stateless apart from the shared weights, like LM.
+class T5Encoder {
+public:
+    explicit T5Encoder(std::shared_ptr<const T5Store> store) noexcept
+        : store_{std::move(store)} {}
+
+    const T5Config& config() const noexcept { return store_->config(); }
+
+    // HF T5's bidirectional relative_position_bucket for key - query = rel.
+    static int relative_bucket(int rel, int n_buckets, int max_distance) {
+        const int half      = n_buckets / 2;
+        const int max_exact = half / 2;
+        int bucket = rel > 0 ? half : 0;
+        const int n = std::abs(rel);
+        if (n < max_exact) return bucket + n;
+        const int large = max_exact + (int)(std::log((float)n / max_exact) /
+                                            std::log((float)max_distance / max_exact) * (half - max_exact));
+        return bucket + std::min(large, half - 1);
+    }
+
+    /**
+     * Encode `n` token ids into the LM conditioning.
+     * @return [d_out, n] F32 (n x d_out row-major), valid until `state` is
+     *         reset.
+     */
+    ggml_tensor* encode(ExecState& state, const int32_t* ids, int n, int n_threads = 4) const {
+        (void)build_graph(state, ids, n);
+        return state.compute(n_threads);
+    }
+
+    [[nodiscard]] std::size_t arena_size(int n_tokens, int n_threads = 4) const {
+        ExecState m = ExecState::measuring(GGML_DEFAULT_GRAPH_SIZE);
+        (void)build_graph(m, nullptr, n_tokens);
+        return m.required_size(n_threads);
+    }
+
+private:
+    ggml_cgraph* build_graph(ExecState& state, const int32_t* ids, int n) const {
+        ggml_context*    ctx = state.ctx();
+        const T5Config&  cfg = config();
+        const T5Weights& w   = store_->weights();
+        const int64_t    hd  = cfg.d_kv;
+        const int        H   = cfg.n_head;
+        auto* gf = state.new_graph();
+
+        ggml_tensor* tokens = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n);
+        ggml_tensor* bias   = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n, n, H); // [key, query, head]
+        if (!state.is_measuring()) {
+            std::memcpy(tokens->data, ids, n * sizeof(int32_t));
+            fill_position_bias(bias, n);
+        }
+
+        ggml_tensor* x = ggml_get_rows(ctx, w.shared, tokens); // [d_model, n]
+        for (const T5LayerWeights& L : w.layers) {
+            // self-attention; T5 folds the 1/sqrt(d_kv) scale into its weights
+            ggml_tensor* h = ggml_mul(ctx, ggml_rms_norm(ctx, x, cfg.norm_eps), L.attn_norm);
+            ggml_tensor* Q  = split_heads(ctx, ggml_mul_mat(ctx, L.q, h), H); // [hd, n, H]
+            ggml_tensor* K  = split_heads(ctx, ggml_mul_mat(ctx, L.k, h), H);
+            ggml_tensor* Vt = ggml_cont(ctx, ggml_transpose(ctx, ggml_mul_mat(ctx, L.v, h))); // [n, H * hd]
+            ggml_tensor* V  = ggml_view_3d(ctx, Vt, n, hd, H, Vt->nb[1], hd * Vt->nb[1], 0);   // [n, hd, H]
+
+            ggml_tensor* kq = ggml_add(ctx, ggml_mul_mat(ctx, K, Q), bias); // [n, n, H]
+            kq = ggml_soft_max(ctx, kq);
+            ggml_tensor* attn = merge_heads(ctx, ggml_mul_mat(ctx, V, kq)); // [H * hd, n]
+            x = ggml_add(ctx, x, ggml_mul_mat(ctx, L.o, attn));
+
+            // feed-forward
+            h = ggml_mul(ctx, ggml_rms_norm(ctx, x, cfg.norm_eps), L.ff_norm);
+            ggml_tensor* f = L.wi_1
+                ? ggml_mul(ctx, ggml_gelu(ctx, ggml_mul_mat(ctx, L.wi, h)), ggml_mul_mat(ctx, L.wi_1, h))
+                : ggml_relu(ctx, ggml_mul_mat(ctx, L.wi, h));
+            x = ggml_add(ctx, x, ggml_mul_mat(ctx, L.wo, f));
+        }
+        x = ggml_mul(ctx, ggml_rms_norm(ctx, x, cfg.norm_eps), w.final_norm);
+
+        ggml_tensor* out = ggml_add(ctx, ggml_mul_mat(ctx, w.proj_w, x), w.proj_b); // [d_out, n]
+        ggml_build_forward_expand(gf, out);
+        return gf;
+    }
+
+    // bias[j, i, h] = rel_bias[bucket(j - i), h]
+    void fill_position_bias(ggml_tensor* bias, int n) const {
+        const T5Config&    cfg = config();
+        const ggml_tensor* rb  = store_->weights().rel_bias; // ne = {n_head, n_buckets}
+        auto weight = [&](int b, int h) {
+            const char* p = (const char*)rb->data + b * rb->nb[1] + h * rb->nb[0];
+            return rb->type == GGML_TYPE_F16 ? ggml_fp16_to_fp32(*(const ggml_fp16_t*)p) : *(const float*)p;
+        };
+        float* dst = (float*)bias->data;
+        for (int h = 0; h < cfg.n_head; ++h) {
+            for (int i = 0; i < n; ++i) {
+                for (int j = 0; j < n; ++j) {
+                    *dst++ = weight(relative_bucket(j - i, cfg.n_buckets, cfg.max_distance), h);
+                }
+            }
+        }
+    }
+
+    std::shared_ptr<const T5Store> store_;
+};
+
+//-------------------------------------
+// Text conditioner with a prompt cache
+//-------------------------------------
+// Turns a text prompt into LM conditioning (n_tokens x d_out floats, the
+// layout GenRequest::cond takes). Results are kept in an LRU cache keyed by
+// the normalized prompt, so repeated prompts skip the encoder entirely.
+// Thread-safe; cache misses are encoded one at a time on a single arena.
+//
+// An empty (or all-whitespace) prompt is no description at all: as in
+// audiocraft, whose attention mask zeroes it, it conditions as nothing, and
+// the result is the empty conditioning the scheduler's unconditional slot
+// runs with.
+class T5Conditioner {
+public:
+    using Cond = std::vector<float>;
+
+    explicit T5Conditioner(std::shared_ptr<const T5Store> store,
+                           std::size_t cache_bytes = 64u << 20, int n_threads = 4)
+        : encoder_{store}, store_{std::move(store)}, cache_{cache_bytes},
+          n_threads_{n_threads}, state_{1 << 20} {}
+
+    std::shared_ptr<const Cond> condition(const std::string& text) {
+        const std::string key = T5Tokenizer::normalize(text);
+        if (key.empty()) return std::make_shared<const Cond>();
+        if (auto hit = cache_.get(key)) return hit;
+
+        std::vector<int32_t> ids = store_->tokenizer().encode(key, config().max_tokens);
+        std::shared_ptr<const Cond> cond;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            const int n = (int)ids.size();
+            auto it = arena_sizes_.find(n);
+            if (it == arena_sizes_.end()) it = arena_sizes_.emplace(n, encoder_.arena_size(n, n_threads_)).first;
+            state_.reset();
+            state_.reserve(it->second);
+            ggml_tensor* out = encoder_.encode(state_, ids.data(), n, n_threads_);
+            cond = std::make_shared<const Cond>((const float*)out->data, (const float*)out->data + ggml_nelements(out));
+        }
+        cache_.put(key, cond, cond->size() * sizeof(float));
+        return cond;
+    }
+
+    const T5Config& config() const noexcept { return store_->config(); }
+
+    LruCache<std::string, Cond>::Stats cache_stats() const { return cache_.stats(); }
+
+private:
+    T5Encoder                      encoder_;
+    std::shared_ptr<const T5Store> store_;
+    LruCache<std::string, Cond>    cache_;
+    int                            n_threads_;
+
+    std::mutex                     mu_; // guards the encoder state
+    ExecState                      state_;
+    std::map<int, std::size_t>     arena_sizes_;
+};
+
+}
@@ -0,0 +1,254 @@
+#pragma once
+
+#include "ggml.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace encodec {
+
+//-------------------------------------
+// Bit-packed token files
+//-------------------------------------
+// A container for many clips of RVQ codes. Codes take ceil(log2 card) bits
+// each (11 for card 2048, against 32 as int32), frame-major and packed
+// back to back, so frame t of the file starts at bit t * n_q * bits and
+// any frame range is one contiguous bit run: seeking is arithmetic, no
+// scan. The clip index maps each clip to its first frame.
+//
+// Layout (little-endian):
+//   TokenFileHeader                     64 bytes
+//   packed codes                        padded to 8 bytes, plus 8 zero bytes
+//   index: n_items x {u64 first_frame, u64 n_frames}
+struct TokenFileHeader {
+    uint32_t magic       = 0x4B544345; // "ECTK"
+    uint32_t version     = 1;
+    uint32_t n_q         = 0;
+    uint32_t bits        = 0;          // per code
+    uint32_t card        = 0;
+    uint32_t sample_rate = 0;
+    float    frame_rate  = 0.0f;
+    uint32_t reserved    = 0;
+    uint64_t model_hash  = 0;          // identifies the codec that produced the codes
+    uint64_t n_frames    = 0;
+    uint64_t n_items     = 0;
+    uint64_t index_offset = 0;
+};
+static_assert(sizeof(TokenFileHeader) == 64, "token file header must be 64 bytes");
+
+struct TokenFileMeta {
+    int      n_q         = 0;
+    int      card        = 0;
+    int      sample_rate = 0;
+    float    frame_rate  = 0.0f;
+    uint64_t model_hash  = 0;
+};
+
+// One clip: frames [first_frame, first_frame + n_frames) of the file.
+struct TokenItem {
+    uint64_t first_frame = 0;
+    uint64_t n_frames    = 0;
+};
+
+// Bits one code takes for a codebook of `card` entries.
+inline int code_bits(int card) {
+    int bits = 1;
+    while ((1ll << bits) < card) ++bits;
+    return bits;
+}
+
+//-------------------------------------
+// Writer
+//-------------------------------------
+class TokenWriter {
+public:
+    TokenWriter(const std::string& path, const TokenFileMeta& meta) : path_{path} {
+        hdr_.n_q         = (uint32_t)meta.n_q;
+        hdr_.card        = (uint32_t)meta.card;
+        hdr_.bits        = (uint32_t)code_bits(meta.card);
+        hdr_.sample_rate = (uint32_t)meta.sample_rate;
+        hdr_.frame_rate  = meta.frame_rate;
+        hdr_.model_hash  = meta.model_hash;
+        f_ = std::fopen(path.c_str(), "wb");
+        if (!f_) {
+            std::fprintf(stderr, "%s: failed to create '%s'\n", __func__, path.c_str());
+            return;
+        }
+        std::fwrite(&hdr_, sizeof(hdr_), 1, f_);
+    }
+
+    ~TokenWriter() { close(); }
+
+    TokenWriter(const TokenWriter&)            = delete;
+    TokenWriter& operator=(const TokenWriter&) = delete;
+
+    bool ok() const noexcept { return f_ != nullptr; }
+
+    // Append a clip, codes n_frames x n_q (frame-major, as GenResult).
+    void add(const int32_t* codes, int64_t n_frames) {
+        for (int64_t i = 0; i < n_frames * hdr_.n_q; ++i) put(codes[i]);
+        end_item(n_frames);
+    }
+
+    // Append a clip from an encoder output, I32 [T, n_q] (codebook-major).
+    void add(const ggml_tensor* codes) {
+        GGML_ASSERT(codes->type == GGML_TYPE_I32 && codes->ne[1] == hdr_.n_q);
+        const int64_t T = codes->ne[0];
+        const char*   data = (const char*)codes->data;
+        for (int64_t t = 0; t < T; ++t) {
+            for (int64_t k = 0; k < codes->ne[1]; ++k) put(*(const int32_t*)(data + t * codes->nb[0] + k * codes->nb[1]));
+        }
+        end_item(T);
+    }
+
+    // Flush the codes, write the index and the final header. Returns false
+    // on any write error.
+    bool close() {
+        if (!f_) return false;
+        if (n_acc_ > 0) out_.push_back((uint8_t)acc_);
+        acc_ = n_acc_ = 0;
+        const std::size_t payload = written_ + out_.size();
+        out_.resize(out_.size() + (8 - payload % 8) % 8 + 8, 0); // align, and slack for 64-bit loads
+        flush_bytes();
+
+        hdr_.n_items      = items_.size();
+        hdr_.index_offset = sizeof(hdr_) + written_;
+        bool ok = std::fwrite(items_.data(), sizeof(TokenItem), items_.size(), f_) == items_.size() &&
+                  std::fseek(f_, 0, SEEK_SET) == 0 &&
+                  std::fwrite(&hdr_, sizeof(hdr_), 1, f_) == 1 && !failed_;
+        ok = std::fclose(f_) == 0 && ok;
+        f_ = nullptr;
+        if (!ok) std::fprintf(stderr, "%s: failed to write '%s'\n", __func__, path_.c_str());
+        return ok;
+    }
+
+private:
+    void put(int32_t code) {
+        GGML_ASSERT(code >= 0 && (uint32_t)code < hdr_.card);
+        acc_ |= (uint64_t)(uint32_t)code << n_acc_;
+        n_acc_ += hdr_.bits;
+        while (n_acc_ >= 8) {
+            out_.push_back((uint8_t)acc_);
+            acc_ >>= 8;
+            n_acc_ -= 8;
+        }
+        if (out_.size() >= (1u << 20)) flush_bytes();
+    }
+
+    void end_item(int64_t n_frames) {
+        items_.push_back({hdr_.n_frames, (uint64_t)n_frames});
+        hdr_.n_frames += (uint64_t)n_frames;
+    }
+
+    void flush_bytes() {
+        if (f_ && !out_.empty() && std::fwrite(out_.data(), 1, out_.size(), f_) != out_.size()) failed_ = true;
+        written_ += out_.size();
+        out_.clear();
+    }
+
+    std::string            path_;
+    std::FILE*             f_ = nullptr;
+    TokenFileHeader        hdr_;
+    std::vector<TokenItem> items_;
+    std::vector<uint8_t>   out_;        // packed bytes not yet written
+    std::size_t            written_ = 0;
+    uint64_t               acc_     = 0;
+    uint32_t               n_acc_   = 0; // bits pending in acc_
+    bool                   failed_  = false;
+};
+
+//-------------------------------------
+// Reader
+//-------------------------------------
+// Memory-mapped; reads decode only the bits of the frames asked for.
+class TokenFile {
+public:
+    // nullptr (with a message on stderr) if the file is not a token file.
+    static std::unique_ptr<TokenFile> open(const std::string& path) {
+        std::unique_ptr<MappedFile> file = MappedFile::open(path);
+        if (!file) return nullptr;
+        TokenFileHeader hdr;
+        const TokenFileHeader expect;
+        bool ok = file->size() >= sizeof(hdr);
+        if (ok) {
+            std::memcpy(&hdr, file->data(), sizeof(hdr));
+            // bounded by the file size before any product is formed, so a
+            // crafted header cannot wrap the sizes around
+            const uint64_t size = file->size();
+            ok = hdr.magic == expect.magic && hdr.version == expect.version &&
+                 hdr.bits >= 1 && hdr.bits <= 32 && hdr.n_q > 0 && hdr.n_q <= INT32_MAX &&
+                 hdr.n_frames <= size * 8 / ((uint64_t)hdr.n_q * hdr.bits) &&
+                 hdr.index_offset <= size &&
+                 hdr.n_items <= (size - hdr.index_offset) / sizeof(TokenItem);
+            if (ok) {
+                const uint64_t payload = (hdr.n_frames * hdr.n_q * hdr.bits + 7) / 8 + 8;
+                ok = hdr.index_offset >= sizeof(hdr) + payload;
+            }
+        }
+        if (!ok) {
+            std::fprintf(stderr, "%s: '%s' is not a token file\n", __func__, path.c_str());
+            return nullptr;
+        }
+        file->advise(MADV_RANDOM);
+        return std::unique_ptr<TokenFile>{new TokenFile(std::move(file), hdr)};
+    }
+
+    TokenFileMeta meta() const {
+        return {(int)hdr_.n_q, (int)hdr_.card, (int)hdr_.sample_rate, hdr_.frame_rate, hdr_.model_hash};
+    }
+
+    int      n_q()      const noexcept { return (int)hdr_.n_q; }
+    int      bits()     const noexcept { return (int)hdr_.bits; }
+    uint64_t n_frames() const noexcept { return hdr_.n_frames; }
+    uint64_t n_items()  const noexcept { return hdr_.n_items; }
+
+    TokenItem item(uint64_t i) const {
+        GGML_ASSERT(i < hdr_.n_items);
+        TokenItem it;
+        std::memcpy(&it, file_->data() + hdr_.index_offset + i * sizeof(TokenItem), sizeof(it));
+        return it;
+    }
+
+    // Frames [frame0, frame0 + n) as n x n_q codes (frame-major), or, with
+    // a stride, codebook k of frame t at out[k * stride + t].
+    void read(uint64_t frame0, int64_t n, int32_t* out, int64_t stride = 0) const {
+        GGML_ASSERT(frame0 + (uint64_t)n <= hdr_.n_frames);
+        const uint8_t* base  = file_->data() + sizeof(TokenFileHeader);
+        const uint32_t bits  = hdr_.bits;
+        const uint64_t mask  = (1ull << bits) - 1;
+        const int      n_q   = (int)hdr_.n_q;
+        uint64_t       bit   = frame0 * n_q * bits;
+        for (int64_t t = 0; t < n; ++t) {
+            for (int k = 0; k < n_q; ++k, bit += bits) {
+                uint64_t w;
+                std::memcpy(&w, base + (bit >> 3), 8); // the slack after the codes keeps this in bounds
+                const int32_t code = (int32_t)((w >> (bit & 7)) & mask);
+                if (stride) out[k * stride + t] = code;
+                else        out[t * n_q + k]    = code;
+            }
+        }
+    }
+
+    // Frames [frame0, frame0 + n) as a quantizer_decode input, I32 [n, n_q].
+    ggml_tensor* read_tensor(ggml_context* ctx, uint64_t frame0, int64_t n) const {
+        ggml_tensor* codes = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, n, hdr_.n_q);
+        read(frame0, n, (int32_t*)codes->data, n);
+        return codes;
+    }
+
+private:
+    TokenFile(std::unique_ptr<MappedFile> file, const TokenFileHeader& hdr)
+        : file_{std::move(file)}, hdr_{hdr} {}
+
+    std::unique_ptr<MappedFile> file_;
+    TokenFileHeader             hdr_;
+};
+
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace encodec {
+
+//-------------------------------------
+// Work-stealing task queues
+//-------------------------------------
+// One deque per worker. A worker takes its own tasks oldest first; once
+// its deque is empty it steals the newest task of the busiest other worker,
+// so a worker stuck on one long task no longer holds back the ones queued
+// behind it. push() blocks while `capacity` tasks are pending in total.
+// After close(), pop() drains what is left, then returns nullopt.
+template <typename T>
+class WorkStealingQueues {
+public:
+    WorkStealingQueues(int n_workers, std::size_t capacity)
+        : capacity_{std::max<std::size_t>(capacity, 1)} {
+        for (int i = 0; i < std::max(n_workers, 1); ++i) queues_.push_back(std::make_unique<Queue>());
+    }
+
+    int n_workers() const noexcept { return (int)queues_.size(); }
+
+    // Queue a task for `worker`. Returns false once closed.
+    bool push(int worker, T item) {
+        {
+            std::unique_lock<std::mutex> lk(mu_);
+            not_full_.wait(lk, [&] { return closed_ || pending_ < capacity_; });
+            if (closed_) return false;
+            ++pending_;
+        }
+        {
+            // lock order, here and in claim(): deque, then mu_
+            Queue& q = *queues_[worker % queues_.size()];
+            std::lock_guard<std::mutex> lk(q.mu);
+            q.items.push_back(std::move(item));
+            std::lock_guard<std::mutex> lk2(mu_);
+            ++available_;
+        }
+        not_empty_.notify_all();
+        return true;
+    }
+
+    // Next task for `worker`, its own or stolen; waits while none is pending.
+    std::optional<T> pop(int worker) {
+        for (;;) {
+            if (auto item = take(worker)) return item;
+            std::unique_lock<std::mutex> lk(mu_);
+            not_empty_.wait(lk, [&] { return closed_ || available_ > 0; });
+            if (closed_ && available_ == 0) return std::nullopt;
+        }
+    }
+
+    // A copy of the task pop(worker) would take next from its own deque,
+    // without claiming it: the task stays stealable. For prefetching; by
+    // the time the worker pops, it may be gone or another task's turn.
+    std::optional<T> peek(int worker) const {
+        const Queue& q = *queues_[worker % queues_.size()];
+        std::lock_guard<std::mutex> lk(q.mu);
+        if (q.items.empty()) return std::nullopt;
+        return q.items.front();
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lk(mu_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+    // Tasks taken from another worker's deque so far.
+    uint64_t n_steals() const noexcept { return steals_.load(); }
+
+private:
+    struct Queue {
+        mutable std::mutex mu;
+        std::deque<T>      items;
+    };
+
+    std::optional<T> take(int worker) {
+        const std::size_t n   = queues_.size();
+        const std::size_t own = worker % n;
+        {
+            Queue& q = *queues_[own];
+            std::lock_guard<std::mutex> lk(q.mu);
+            if (!q.items.empty()) return claim(q.items.front(), q.items, true);
+        }
+        // the victim with the most work left
+        std::size_t victim = own, most = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            if (i == own) continue;
+            std::lock_guard<std::mutex> lk(queues_[i]->mu);
+            if (queues_[i]->items.size() > most) {
+                most   = queues_[i]->items.size();
+                victim = i;
+            }
+        }
+        if (victim == own) return std::nullopt;
+        Queue& q = *queues_[victim];
+        std::lock_guard<std::mutex> lk(q.mu);
+        if (q.items.empty()) return std::nullopt; // drained meanwhile; look again
+        ++steals_;
+        return claim(q.items.back(), q.items, false);
+    }
+
+    // Called with the deque locked.
+    std::optional<T> claim(T& slot, std::deque<T>& items, bool front) {
+        std::optional<T> item{std::move(slot)};
+        if (front) items.pop_front();
+        else       items.pop_back();
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            --pending_;
+            --available_;
+        }
+        not_full_.notify_one();
+        return item;
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::size_t                         capacity_;
+
+    std::mutex                          mu_;
+    std::condition_variable             not_full_;
+    std::condition_variable             not_empty_;
+    std::size_t                         pending_   = 0; // pushed or being pushed, not taken
+    std::size_t                         available_ = 0; // in a deque, ready to take
+    bool                                closed_    = false;
+    std::atomic<uint64_t>               steals_{0};
+};
+
+}
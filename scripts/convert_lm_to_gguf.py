@@ -0,0 +1,213 @@
+import argparse
+import re
+import struct
+
+import numpy as np
+import torch
+
+# usage: convert_lm_to_gguf.py [LM state dict] [output] [--profile SPEC]
+# Writes the MusicGen LM (emb.*, transformer.*, linears.*, out_norm.*) in
+# the format read by include/loader.h (musicgen_lm_weights), with linears
+# stored as the profile says. SPEC is the one include/lm_quant.h parses:
+# comma-separated presets and class[@layers]=type rules, later ones winning,
+# e.g. "mixed" or "emb=f16,heads=f16,attn=q8_0,ffn=q4_0,ffn@0-1=q8_0".
+# Block types are laid out exactly as ggml stores them.
+
+GGUF_MAGIC = b'GGUF'
+GGUF_VERSION = 3
+
+# ggml type ids, written as the tensor dtype
+TYPES = {'f32': 0, 'f16': 1, 'q4_0': 2, 'q5_0': 6, 'q8_0': 8}
+QK = 32  # block size of every quantized type here
+
+PRESETS = {
+    'source': '',
+    'f32':    'all=f32',
+    'f16':    'all=f16',
+    'q8_0':   'emb=f16,heads=f16,attn=q8_0,ffn=q8_0',
+    'mixed':  'emb=f16,heads=f16,attn=q8_0,ffn=q4_0',
+    'q5_0':   'emb=f16,heads=f16,attn=q5_0,ffn=q5_0',
+    'q4_0':   'emb=f16,heads=f16,attn=q4_0,ffn=q4_0',
+}
+
+CLASSES = {
+    'emb':        ['emb'],
+    'heads':      ['heads'],
+    'linears':    ['heads'],
+    'self_attn':  ['self_attn'],
+    'cross_attn': ['cross_attn'],
+    'attn':       ['self_attn', 'cross_attn'],
+    'ffn':        ['ffn'],
+    'all':        ['emb', 'heads', 'self_attn', 'cross_attn', 'ffn'],
+}
+
+
+def parse_profile(spec):
+    rules = []
+    for item in filter(None, spec.split(',')):
+        if '=' not in item:
+            if item not in PRESETS:
+                raise SystemExit(f'unknown profile {item!r}')
+            rules += parse_profile(PRESETS[item])
+            continue
+        cls, typ = item.split('=', 1)
+        lo, hi = 0, 1 << 30
+        if '@' in cls:
+            cls, rng = cls.split('@', 1)
+            m = re.fullmatch(r'(\d+)(?:-(\d+))?', rng)
+            if not m:
+                raise SystemExit(f'bad layer range in {item!r}')
+            lo = int(m.group(1))
+            hi = int(m.group(2)) if m.group(2) else lo
+        if cls not in CLASSES or typ not in TYPES:
+            raise SystemExit(f'bad rule {item!r}')
+        rules += [(c, lo, hi, typ) for c in CLASSES[cls]]
+    return rules
+
+
+def tensor_class(name):
+    """(class, layer) of a tensor the profile applies to, else (None, -1)."""
+    if re.fullmatch(r'emb\.\d+\.weight', name):
+        return 'emb', -1
+    if re.fullmatch(r'linears\.\d+\.weight', name):
+        return 'heads', -1
+    m = re.fullmatch(r'transformer\.layers\.(\d+)\.(.*)', name)
+    if m:
+        il, rest = int(m.group(1)), m.group(2)
+        if rest in ('self_attn.in_proj_weight', 'self_attn.out_proj.weight'):
+            return 'self_attn', il
+        if rest in ('cross_attention.in_proj_weight', 'cross_attention.out_proj.weight'):
+            return 'cross_attn', il
+        if rest in ('linear1.weight', 'linear2.weight'):
+            return 'ffn', il
+    return None, -1
+
+
+def type_for(rules, name, ndim, n_per_row):
+    cls, il = tensor_class(name)
+    typ = 'f32'
+    if cls is None or ndim != 2:
+        return typ
+    for c, lo, hi, t in rules:
+        if c == cls and (il < 0 or lo <= il <= hi):
+            typ = t
+    if typ not in ('f32', 'f16') and n_per_row % QK:
+        print(f'{name}: rows of {n_per_row} do not split into {typ} blocks, kept as f32')
+        typ = 'f32'
+    return typ
+
+
+# Reference quantizers of ggml (quantize_row_*_ref), vectorized over blocks.
+def blocks_absmax(x):
+    b = x.reshape(-1, QK)
+    i = np.argmax(np.abs(b), axis=1)
+    return b, b[np.arange(len(b)), i]
+
+
+def quantize_q8_0(x):
+    b = x.reshape(-1, QK)
+    d = np.abs(b).max(axis=1) / 127.0
+    inv = np.divide(1.0, d, out=np.zeros_like(d), where=d != 0)
+    v = b * inv[:, None]
+    q = np.trunc(v + np.copysign(0.5, v)).astype(np.int8)  # roundf
+    out = np.empty(len(b), dtype=[('d', '<f2'), ('qs', 'i1', QK)])
+    out['d'], out['qs'] = d, q
+    return out.tobytes()
+
+
+def quantize_q4_0(x):
+    b, mx = blocks_absmax(x)
+    d = mx / -8.0
+    inv = np.divide(1.0, d, out=np.zeros_like(d), where=d != 0)
+    q = np.minimum(15, np.trunc(b * inv[:, None] + 8.5)).astype(np.uint8)
+    out = np.empty(len(b), dtype=[('d', '<f2'), ('qs', 'u1', QK // 2)])
+    out['d'], out['qs'] = d, q[:, :QK // 2] | (q[:, QK // 2:] << 4)
+    return out.tobytes()
+
+
+def quantize_q5_0(x):
+    b, mx = blocks_absmax(x)
+    d = mx / -16.0
+    inv = np.divide(1.0, d, out=np.zeros_like(d), where=d != 0)
+    q = np.minimum(31, np.trunc(b * inv[:, None] + 16.5)).astype(np.uint32)
+    lo, hi = q[:, :QK // 2], q[:, QK // 2:]
+    bits = np.arange(QK // 2, dtype=np.uint32)
+    qh = (((lo >> 4) & 1) << bits).sum(axis=1) | (((hi >> 4) & 1) << (bits + QK // 2)).sum(axis=1)
+    out = np.empty(len(b), dtype=[('d', '<f2'), ('qh', '<u4'), ('qs', 'u1', QK // 2)])
+    out['d'], out['qh'], out['qs'] = d, qh, ((lo & 0x0F) | ((hi & 0x0F) << 4)).astype(np.uint8)
+    return out.tobytes()
+
+
+def encode(tensor, typ):
+    x = tensor.to(torch.float32).contiguous().cpu().numpy().astype(np.float32)
+    if typ == 'f32':
+        return x.tobytes()
+    if typ == 'f16':
+        return x.astype(np.float16).tobytes()
+    return {'q8_0': quantize_q8_0, 'q5_0': quantize_q5_0, 'q4_0': quantize_q4_0}[typ](x)
+
+
+parser = argparse.ArgumentParser()
+parser.add_argument('lm_path', nargs='?', default='model_dicts/state_dict.bin')
+parser.add_argument('out_path', nargs='?', default='model_dicts/lm.gguf')
+parser.add_argument('--profile', default='source')
+parser.add_argument('--n-heads', type=int, default=0, help='default: d_model / 64, as in MusicGen')
+args = parser.parse_args()
+rules = parse_profile(args.profile)
+
+lm_state = torch.load(args.lm_path, map_location='cpu')
+lm_params = lm_state.get('best_state', lm_state)
+params = {k: v for k, v in lm_params.items()
+          if k.split('.')[0] in ('emb', 'transformer', 'linears', 'out_norm')}
+
+tensor_items = []
+for name, tensor in params.items():
+    typ = type_for(rules, name, tensor.dim(), tensor.shape[-1])
+    tensor_items.append((name, tensor, typ, encode(tensor, typ)))
+
+d_model = params['emb.0.weight'].shape[1]
+metadata = {
+    'n_heads': args.n_heads or d_model // 64,
+    'lm.quant_profile': args.profile,
+}
+
+with open(args.out_path, "wb") as f:
+    f.write(GGUF_MAGIC)
+    f.write(struct.pack('<I', GGUF_VERSION))
+    f.write(struct.pack('<Q', len(tensor_items)))
+    f.write(struct.pack('<Q', len(metadata)))
+
+    for k, v in metadata.items():
+        k_enc = k.encode('utf-8')
+        f.write(struct.pack('<I', len(k_enc)))
+        f.write(k_enc)
+
+        v_str = str(v).encode('utf-8')
+        f.write(struct.pack('<I', len(v_str)))
+        f.write(v_str)
+
+    tensor_data_offset = f.tell() + sum(
+        4 + len(name.encode('utf-8')) + 4 + len(tensor.shape) * 8 + 4 + 8
+        for name, tensor, _, _ in tensor_items
+    )
+
+    for name, tensor, typ, data in tensor_items:
+        name_bytes = name.encode('utf-8')
+        f.write(struct.pack('<I', len(name_bytes)))
+        f.write(name_bytes)
+
+        f.write(struct.pack('<I', len(tensor.shape)))
+        for dim in tensor.shape:
+            f.write(struct.pack('<Q', dim))
+
+        f.write(struct.pack('<I', TYPES[typ]))
+
+        f.write(struct.pack('<Q', tensor_data_offset))
+        tensor_data_offset += len(data)
+
+    total = 0
+    for _, _, _, data in tensor_items:
+        f.write(data)
+        total += len(data)
+
+print(f'{args.out_path}: {len(tensor_items)} tensors, {total / 2**20:.1f} MiB, profile {args.profile!r}')
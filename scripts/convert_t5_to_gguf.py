@@ -0,0 +1,78 @@
+import sys
+import struct
+
+import numpy as np
+import torch
+from transformers import T5EncoderModel, T5Tokenizer
+
+# usage: convert_t5_to_gguf.py [t5 name] [LM state dict] [output]
+# Writes the T5 encoder of MusicGen's text conditioner, the LM's
+# description output_proj and the SentencePiece vocabulary in the format
+# read by include/loader.h (musicgen_t5_weights).
+
+GGUF_MAGIC = b'GGUF'
+GGUF_VERSION = 3
+
+t5_name = sys.argv[1] if len(sys.argv) > 1 else 't5-base'
+lm_path = sys.argv[2] if len(sys.argv) > 2 else 'model_dicts/state_dict.bin'
+out_path = sys.argv[3] if len(sys.argv) > 3 else 'model_dicts/t5_conditioner.gguf'
+
+encoder = T5EncoderModel.from_pretrained(t5_name)
+tokenizer = T5Tokenizer.from_pretrained(t5_name)
+
+params = {'t5.' + k: v for k, v in encoder.state_dict().items() if k != 'encoder.embed_tokens.weight'}
+
+lm_state = torch.load(lm_path, map_location='cpu')
+lm_params = lm_state.get('best_state', lm_state)
+for k in ('weight', 'bias'):
+    name = 'condition_provider.conditioners.description.output_proj.' + k
+    params[name] = lm_params[name]
+
+sp = tokenizer.sp_model
+pieces = [sp.id_to_piece(i) for i in range(sp.get_piece_size())]
+params['t5.vocab_scores'] = torch.tensor([sp.get_score(i) for i in range(sp.get_piece_size())])
+
+metadata = {
+    't5.vocab': '\n'.join(pieces),
+    'n_heads': encoder.config.num_heads,
+}
+
+with open(out_path, "wb") as f:
+    f.write(GGUF_MAGIC)
+    f.write(struct.pack('<I', GGUF_VERSION))
+
+    tensor_items = list(params.items())
+    f.write(struct.pack('<Q', len(tensor_items)))
+    f.write(struct.pack('<Q', len(metadata)))
+
+    for k, v in metadata.items():
+        k_enc = k.encode('utf-8')
+        f.write(struct.pack('<I', len(k_enc)))
+        f.write(k_enc)
+
+        v_str = str(v).encode('utf-8')
+        f.write(struct.pack('<I', len(v_str)))
+        f.write(v_str)
+
+    tensor_data_offset = f.tell() + sum(
+        4 + len(k.encode('utf-8')) + 4 + len(v.shape) * 8 + 4 + 8
+        for k, v in tensor_items
+    )
+
+    for name, tensor in tensor_items:
+        name_bytes = name.encode('utf-8')
+        f.write(struct.pack('<I', len(name_bytes)))
+        f.write(name_bytes)
+
+        f.write(struct.pack('<I', len(tensor.shape)))
+        for dim in tensor.shape:
+            f.write(struct.pack('<Q', dim))
+
+        # Data type (0 for float32)
+        f.write(struct.pack('<I', 0))
+
+        f.write(struct.pack('<Q', tensor_data_offset))
+        tensor_data_offset += tensor.numel() * 4
+
+    for _, tensor in tensor_items:
+        f.write(tensor.to(torch.float32).contiguous().cpu().numpy().astype(np.float32).tobytes())
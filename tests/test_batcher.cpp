@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <cassert>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "batcher.h"
+
+using namespace encodec;
+using namespace std::chrono_literals;
+
+// A full batch is released at once, long before max_wait, in arrival order.
+static void test_max_batch() {
+    DynamicBatcher<int> b{{3, std::chrono::microseconds(10s)}};
+    for (int i = 0; i < 4; ++i) b.push(i, 7);
+
+    const auto t0 = Clock::now();
+    const std::vector<int> batch = b.next_batch();
+    assert(Clock::now() - t0 < 1s);
+    assert((batch == std::vector<int>{0, 1, 2}) && b.depth() == 1);
+    printf("%s: ok\n", __func__);
+}
+
+// A lone request waits out max_wait and then goes alone.
+static void test_max_wait() {
+    DynamicBatcher<int> b{{8, std::chrono::microseconds(20ms)}};
+    b.push(1, 0);
+
+    const auto t0 = Clock::now();
+    const std::vector<int> batch = b.next_batch();
+    const auto waited = Clock::now() - t0;
+    assert(batch.size() == 1 && waited >= 15ms && waited < 1s);
+    printf("%s: released after %.1f ms\n", __func__,
+           std::chrono::duration<double, std::milli>(waited).count());
+}
+
+// Only requests with the head's key share its batch; the others keep
+// their order for the next one.
+static void test_keys() {
+    DynamicBatcher<int> b{{2, std::chrono::microseconds(50ms)}};
+    b.push(10, 1);
+    b.push(20, 2);
+    b.push(11, 1);
+    b.push(21, 2);
+    b.push(12, 1);
+
+    assert((b.next_batch() == std::vector<int>{10, 11}));
+    assert((b.next_batch() == std::vector<int>{20, 21}));
+    assert((b.next_batch() == std::vector<int>{12})); // after max_wait
+    printf("%s: ok\n", __func__);
+}
+
+// close() wakes a waiting worker; what was queued is still handed out.
+static void test_close() {
+    DynamicBatcher<int> b{{4, std::chrono::microseconds(10s)}};
+    std::vector<int> got;
+    bool             ended = false;
+    std::thread worker([&] {
+        for (std::vector<int> batch; !(batch = b.next_batch()).empty();) got.insert(got.end(), batch.begin(), batch.end());
+        ended = true;
+    });
+    b.push(5, 0);
+    std::this_thread::sleep_for(20ms);
+    b.close();
+    worker.join();
+    assert(ended && (got == std::vector<int>{5}));
+    printf("%s: ok\n", __func__);
+}
+
+// Batch sizes past max_batch land in the last bin; percentiles come from
+// the most recent `window` latencies only.
+static void test_stats() {
+    BatchStats st{4, 100};
+    for (std::size_t n : {1, 3, 3, 4, 9}) st.record_batch(n);
+    for (int i = 0; i < 50; ++i) st.record_latency(1000ms); // pushed out of the window
+    for (int ms = 1; ms <= 100; ++ms) st.record_latency(std::chrono::milliseconds(ms));
+
+    const BatchStats::Snapshot s = st.snapshot();
+    assert(s.n_batches == 5 && s.n_requests == 150);
+    assert((s.batch_hist == std::vector<uint64_t>{0, 1, 0, 2, 2}));
+    assert(s.p50_ms == 50.0 && s.p99_ms == 99.0);
+    printf("%s: p50 %.1f ms, p99 %.1f ms\n", __func__, s.p50_ms, s.p99_ms);
+}
+
+int main() {
+    test_max_batch();
+    test_max_wait();
+    test_keys();
+    test_close();
+    test_stats();
+    return 0;
+}
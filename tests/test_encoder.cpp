@@ -8,6 +8,7 @@
 #include <chrono>
 #include <cassert>
 #include <iostream>
+#include <thread>
 #include <utility>
 #include "ggml.h"
 #include "utils.h"
@@ -42,6 +43,7 @@ public:
 
 private:
     void fill(float* data, int64_t n) {
+        if (!data) return; // no_alloc context: shapes only
         for (int64_t i = 0; i < n; ++i) data[i] = dist_(rng_);
     }
 
@@ -66,7 +68,6 @@ struct RandomModelConfig {
 
 struct RandomModel {
     Weights weights;
-    Tensor* input;
 };
 
 inline RandomModel make_random_model(ggml_context* ctx, const RandomModelConfig& cfg = {}) {
@@ -119,29 +120,90 @@ inline RandomModel make_random_model(ggml_context* ctx, const RandomModelConfig&
         model.weights.codebooks[i] = { rnd.tensor_2d(cfg.codebook_size, cfg.out_ch) };
     }
 
-    // Random input (B=1)
-    model.input = rnd.tensor_3d(1, cfg.input_channels, cfg.input_len);
-
     return model;
 }
 
 
 int main() {
+    RandomModelConfig cfg;
+
+    // Size the weight context exactly: build the model once without data
+    ggml_context* measure = ggml_init({
+        .mem_size   = 1024 * ggml_tensor_overhead(),
+        .mem_buffer = nullptr,
+        .no_alloc   = true
+    });
+    make_random_model(measure, cfg);
+    const size_t weights_size = context_required_size(measure);
+    ggml_free(measure);
+
     ggml_init_params params{
-        .mem_size   = 512 * 1024 * 1024ULL, // 512 MiB
+        .mem_size   = weights_size,
         .mem_buffer = nullptr,
         .no_alloc   = false
     };
     ggml_context* ctx = ggml_init(params);
-
-    RandomModelConfig cfg;
     auto model = make_random_model(ctx, cfg);
 
-    encodec::Encoder encoder{ctx, std::move(model.weights)};
-    auto* codes = encoder(model.input, /*threads*/1);
+    // One copy of the weights, shared by every worker
+    auto store = std::make_shared<const WeightStore>(ctx, std::move(model.weights));
+    const encodec::Encoder encoder{store};
 
-    print_ggml_3d_tensor(codes);
+    const int n_workers = 4;
+    std::vector<ExecState> states;
+    states.reserve(n_workers);
+    for (int i = 0; i < n_workers; ++i) {
+        states.emplace_back(encoder.arena_size(cfg.input_len, 1 + i % 2, /*threads*/1));
+    }
+
+    std::vector<Tensor*> codes(n_workers);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < n_workers; ++i) {
+        workers.emplace_back([&, i] {
+            // Random input (B=1 or B=2), allocated in the worker's own arena
+            RandomTensorFactory rnd{states[i].ctx()};
+            Tensor* input = rnd.tensor_3d(1 + i % 2, cfg.input_channels, cfg.input_len);
+            codes[i] = encoder(states[i], input, /*threads*/1);
+        });
+    }
+    for (auto& t : workers) t.join();
+
+    const auto wu = store->usage();
+    printf("weights: %zu / %zu bytes\n", wu.used, wu.capacity);
+    for (int i = 0; i < n_workers; ++i) {
+        const auto u = states[i].usage();
+        printf("worker %d: arena %zu / %zu bytes (peak %zu)\n", i, u.used, u.capacity, u.peak);
+        assert(u.peak <= u.capacity);
+        print_ggml_3d_tensor(codes[i]);
+    }
+
+    // The approximate RVQ search with margin 1 gives the exact codes
+    {
+        quantizer q;
+        for (const auto& cb : store->weights().codebooks) q.blocks.push_back({cb.embed});
+        RvqSearchConfig rcfg;
+        rcfg.n_probe = 1;
+        rcfg.margin  = 1.0f;
+        const encodec::Encoder approx{store, RvqIndex::build(q, rcfg)};
+
+        ExecState a{encoder.arena_size(cfg.input_len, 2, 1)};
+        ExecState b{approx.arena_size(cfg.input_len, 2, 1)};
+        RandomTensorFactory rnd{a.ctx()};
+        Tensor* in_a = rnd.tensor_3d(2, cfg.input_channels, cfg.input_len);
+        Tensor* in_b = ggml_new_tensor_3d(b.ctx(), GGML_TYPE_F32, in_a->ne[0], in_a->ne[1], in_a->ne[2]);
+        memcpy(in_b->data, in_a->data, ggml_nbytes(in_a));
+        Tensor* ca = encoder(a, in_a, 1);
+        Tensor* cb = approx(b, in_b, 1);
+        assert(ca->ne[0] == cb->ne[0] && ca->ne[1] == cb->ne[1] && ca->ne[2] == cb->ne[2]);
+        for (int64_t k = 0; k < ca->ne[2]; ++k)
+            for (int64_t j = 0; j < ca->ne[1]; ++j)
+                for (int64_t i = 0; i < ca->ne[0]; ++i)
+                    assert(*(int32_t*)((char*)ca->data + i * ca->nb[0] + j * ca->nb[1] + k * ca->nb[2]) ==
+                           *(int32_t*)((char*)cb->data + i * cb->nb[0] + j * cb->nb[1] + k * cb->nb[2]));
+        printf("approximate rvq: codes match\n");
+    }
 
-    ggml_free(ctx);
+    states.clear();
+    store.reset(); // frees ctx
     return 0;
 }
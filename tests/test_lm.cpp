@@ -0,0 +1,668 @@
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "ggml.h"
+#include "attention.h"
+#include "lm.h"
+#include "lm_quant.h"
+#include "long_form.h"
+#include "delay_pattern.h"
+#include "scheduler.h"
+
+using namespace musicgen;
+
+static LMConfig tiny_config() {
+    LMConfig cfg;
+    cfg.n_q     = 4;
+    cfg.card    = 16;
+    cfg.d_model = 32;
+    cfg.n_head  = 4;
+    cfg.n_layer = 2;
+    cfg.d_ff    = 64;
+    return cfg;
+}
+
+// Random weights in their own context; ownership goes to the returned store.
+static std::shared_ptr<const LMStore> make_random_lm(const LMConfig& cfg, std::mt19937& rng) {
+    const int64_t D = cfg.d_model;
+    ggml_init_params params{
+        .mem_size   = 64 * 1024 * 1024,
+        .mem_buffer = nullptr,
+        .no_alloc   = false
+    };
+    ggml_context* ctx = ggml_init(params);
+
+    std::uniform_real_distribution<float> dist{-0.3f, 0.3f};
+    auto rnd = [&](int64_t ne0, int64_t ne1) {
+        ggml_tensor* t = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) ((float*)t->data)[i] = dist(rng);
+        return t;
+    };
+    auto ones = [&](int64_t n) {
+        ggml_tensor* t = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n);
+        for (int64_t i = 0; i < n; ++i) ((float*)t->data)[i] = 1.0f + dist(rng);
+        return t;
+    };
+    auto bias = [&](int64_t n) {
+        ggml_tensor* t = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n);
+        for (int64_t i = 0; i < n; ++i) ((float*)t->data)[i] = dist(rng);
+        return t;
+    };
+
+    LMWeights w;
+    for (int k = 0; k < cfg.n_q; ++k) {
+        w.emb.push_back(rnd(D, cfg.card + 1));
+        w.linears.push_back(rnd(D, cfg.card));
+    }
+    for (int il = 0; il < cfg.n_layer; ++il) {
+        LMLayerWeights L;
+        L.norm1_w        = ones(D);
+        L.norm1_b        = bias(D);
+        L.self_attn_in   = rnd(D, 3 * D);
+        L.self_attn_out  = rnd(D, D);
+        L.norm_cross_w   = ones(D);
+        L.norm_cross_b   = bias(D);
+        L.cross_attn_in  = rnd(D, 3 * D);
+        L.cross_attn_out = rnd(D, D);
+        L.norm2_w        = ones(D);
+        L.norm2_b        = bias(D);
+        L.linear1        = rnd(D, cfg.d_ff);
+        L.linear2        = rnd(cfg.d_ff, D);
+        w.layers.push_back(L);
+    }
+    w.out_norm_w = ones(D);
+    w.out_norm_b = bias(D);
+    return std::make_shared<const LMStore>(ctx, cfg, std::move(w));
+}
+
+static float max_abs_diff(const float* a, const float* b, size_t n) {
+    float m = 0.0f;
+    for (size_t i = 0; i < n; ++i) m = std::fmax(m, std::fabs(a[i] - b[i]));
+    return m;
+}
+
+// layer_norm, and add_layer_norm's residual add and norm, against the
+// textbook formula.
+static void test_layer_norm(std::mt19937& rng) {
+    const int D = 48, N = 5;
+    const float eps = 1e-5f;
+    ggml_init_params params{
+        .mem_size   = 1024 * 1024,
+        .mem_buffer = nullptr,
+        .no_alloc   = false
+    };
+    ggml_context* ctx = ggml_init(params);
+    ggml_tensor* x  = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, D, N);
+    ggml_tensor* y  = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, D, N);
+    ggml_tensor* wb = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, D, 2);
+    std::uniform_real_distribution<float> dist{-2.f, 2.f};
+    for (int i = 0; i < D * N; ++i) {
+        ((float*)x->data)[i] = 3.0f + dist(rng);
+        ((float*)y->data)[i] = dist(rng);
+    }
+    for (int i = 0; i < 2 * D; ++i) ((float*)wb->data)[i] = dist(rng);
+    const std::vector<float> x0((float*)x->data, (float*)x->data + D * N);
+
+    ggml_tensor* plain = layer_norm(ctx, x, wb, &eps);
+    ggml_cgraph* gf    = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, plain);
+    ggml_graph_compute_with_ctx(ctx, gf, 2);
+
+    ggml_tensor* fused = add_layer_norm(ctx, x, y, wb, &eps);
+    gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, fused);
+    ggml_graph_compute_with_ctx(ctx, gf, 2);
+
+    // LayerNorm of each column of `in` against `out`
+    auto check = [&](const float* in, const float* out) {
+        float err = 0.0f;
+        for (int i = 0; i < N; ++i) {
+            const float* xi = in + i * D;
+            double mean = 0.0, var = 0.0;
+            for (int d = 0; d < D; ++d) mean += xi[d] / D;
+            for (int d = 0; d < D; ++d) var += (xi[d] - mean) * (xi[d] - mean) / D;
+            for (int d = 0; d < D; ++d) {
+                const double ref = (xi[d] - mean) / std::sqrt(var + eps) * ((float*)wb->data)[d] + ((float*)wb->data)[D + d];
+                err = std::fmax(err, std::fabs((float)ref - out[i * D + d]));
+            }
+        }
+        return err;
+    };
+    std::vector<float> sum(D * N);
+    for (int i = 0; i < D * N; ++i) sum[i] = x0[i] + ((float*)y->data)[i];
+    const float err_plain = check(x0.data(), (float*)plain->data);
+    const float err_fused = check(sum.data(), (float*)fused->data);
+    const bool  residual  = std::memcmp(sum.data(), x->data, sum.size() * sizeof(float)) == 0;
+    ggml_free(ctx);
+    printf("%s: max |layer_norm - reference| = %g, max |add_layer_norm - reference| = %g\n",
+           __func__, err_plain, err_fused);
+    assert(err_plain < 1e-5f && err_fused < 1e-5f && residual);
+}
+
+// The tiled online-softmax kernel against plain softmax(q k^T) v over an F16
+// pool whose rows are scattered, with queries and keys spanning several tiles.
+static void test_flash_attention(std::mt19937& rng) {
+    const int hd = 8, n_head = 2, D = hd * n_head, n_tok = 20, n_kv = 70, n_rows = 96;
+    const int n_past = n_kv - n_tok;
+
+    ggml_init_params params{
+        .mem_size   = 1024 * 1024,
+        .mem_buffer = nullptr,
+        .no_alloc   = false
+    };
+    ggml_context* ctx = ggml_init(params);
+    ggml_tensor* q    = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, hd, n_head, n_tok);
+    ggml_tensor* rows = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_kv);
+    ggml_tensor* kc   = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, D, n_rows);
+    ggml_tensor* vc   = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, D, n_rows);
+    ggml_tensor* out  = ggml_dup_tensor(ctx, q);
+
+    std::uniform_real_distribution<float> dist{-1.f, 1.f};
+    for (int i = 0; i < n_tok * D; ++i) ((float*)q->data)[i] = 2.0f * dist(rng);
+    for (int i = 0; i < n_rows * D; ++i) {
+        ((ggml_fp16_t*)kc->data)[i] = ggml_fp32_to_fp16(dist(rng));
+        ((ggml_fp16_t*)vc->data)[i] = ggml_fp32_to_fp16(dist(rng));
+    }
+    std::vector<int32_t> perm(n_rows);
+    for (int i = 0; i < n_rows; ++i) perm[i] = i;
+    std::shuffle(perm.begin(), perm.end(), rng);
+    std::copy(perm.begin(), perm.begin() + n_kv, (int32_t*)rows->data);
+
+    const int nth = 3;
+    for (int ith = 0; ith < nth; ++ith) flash_attention_op(out, q, rows, kc, ith, nth, vc);
+
+    auto at = [&](ggml_tensor* pool, int p, int h, int d) {
+        return ggml_fp16_to_fp32(((ggml_fp16_t*)pool->data)[perm[p] * D + h * hd + d]);
+    };
+    float err = 0.0f;
+    for (int i = 0; i < n_tok; ++i) {
+        for (int h = 0; h < n_head; ++h) {
+            const float* qi = (float*)q->data + (i * n_head + h) * hd;
+            const int n_vis = n_past + i + 1;
+            std::vector<double> w(n_vis);
+            double mx = -1e30, sum = 0.0;
+            for (int p = 0; p < n_vis; ++p) {
+                double dot = 0.0;
+                for (int d = 0; d < hd; ++d) dot += qi[d] * at(kc, p, h, d);
+                w[p] = dot / std::sqrt((double)hd);
+                mx   = std::max(mx, w[p]);
+            }
+            for (auto& x : w) sum += (x = std::exp(x - mx));
+            for (int d = 0; d < hd; ++d) {
+                double ref = 0.0;
+                for (int p = 0; p < n_vis; ++p) ref += w[p] / sum * at(vc, p, h, d);
+                err = std::fmax(err, std::fabs((float)ref - ((float*)out->data)[(i * n_head + h) * hd + d]));
+            }
+        }
+    }
+    ggml_free(ctx);
+    printf("%s: max |flash - reference| = %g\n", __func__, err);
+    assert(err < 1e-4f);
+}
+
+// Logits of one prefill over the whole prompt must match those of decoding
+// the same prompt one step at a time against the cache.
+static void test_lm_incremental_matches_prefill(const LM& lm, std::mt19937& rng) {
+    const LMConfig& cfg = lm.config();
+    const int T = 6, n_cond = 3;
+    const size_t step = (size_t)cfg.card * cfg.n_q;
+
+    std::vector<int32_t> codes(T * cfg.n_q);
+    std::uniform_int_distribution<int32_t> tok{0, cfg.card};
+    for (auto& c : codes) c = tok(rng);
+    std::vector<float> cond(n_cond * cfg.d_model);
+    std::uniform_real_distribution<float> dist{-1.f, 1.f};
+    for (auto& c : cond) c = dist(rng);
+
+    // prefill
+    KVCache full = lm.make_cache(T, 1, n_cond, GGML_TYPE_F32, /*block_size*/4);
+    std::vector<LMSeq> batch{{0, T, codes.data()}};
+    ExecState s_full{std::max(lm.arena_size(full, batch, 1), lm.condition_arena_size(full, n_cond, 1))};
+    assert(lm.set_condition(s_full, full, 0, cond.data(), n_cond, 1));
+    s_full.reset();
+    ggml_tensor* logits = lm.forward(s_full, full, batch, 1);
+    assert(logits && full.n_past(0) == T);
+    std::vector<float> ref((float*)logits->data, (float*)logits->data + T * step);
+
+    // incremental decode; the conditioning is projected once, up front
+    KVCache inc = lm.make_cache(T, 1, n_cond, GGML_TYPE_F32, /*block_size*/2);
+    std::vector<LMSeq> one{{0, 1, nullptr}};
+    ExecState s_inc{std::max(lm.arena_size(inc, one, 1), lm.condition_arena_size(inc, n_cond, 1))};
+    assert(lm.set_condition(s_inc, inc, 0, cond.data(), n_cond, 1));
+    float err = 0.0f;
+    for (int t = 0; t < T; ++t) {
+        s_inc.reset();
+        one[0].codes = codes.data() + t * cfg.n_q;
+        ggml_tensor* out = lm.forward(s_inc, inc, one, 1);
+        assert(out);
+        err = std::fmax(err, max_abs_diff((float*)out->data, ref.data() + t * step, step));
+    }
+    printf("%s: max |prefill - incremental| = %g\n", __func__, err);
+    assert(err < 1e-3f);
+
+    // the cache is full now
+    s_inc.reset();
+    assert(lm.forward(s_inc, inc, one, 1) == nullptr);
+}
+
+// Two sequences at different positions in one batch must produce the same
+// logits as running each alone.
+static void test_lm_batched_slots(const LM& lm, std::mt19937& rng) {
+    const LMConfig& cfg = lm.config();
+    const int n_ctx = 8;
+    const size_t step = (size_t)cfg.card * cfg.n_q;
+
+    std::uniform_int_distribution<int32_t> tok{0, cfg.card - 1};
+    std::vector<int32_t> a(5 * cfg.n_q), b(2 * cfg.n_q);
+    for (auto& c : a) c = tok(rng);
+    for (auto& c : b) c = tok(rng);
+
+    // alone: a = 4 prompt steps then 1, b = 2 prompt steps
+    KVCache solo = lm.make_cache(n_ctx, 2, 0, GGML_TYPE_F32);
+    ExecState s{1 << 20};
+    std::vector<LMSeq> pa{{0, 4, a.data()}}, pb{{1, 2, b.data()}}, da{{0, 1, a.data() + 4 * cfg.n_q}};
+    s.reserve(lm.arena_size(solo, pa, 1));
+    (void)lm.forward(s, solo, pa, 1);
+    s.reset();
+    s.reserve(lm.arena_size(solo, pb, 1));
+    ggml_tensor* out_b = lm.forward(s, solo, pb, 1);
+    std::vector<float> ref_b((float*)out_b->data, (float*)out_b->data + 2 * step);
+    s.reset();
+    s.reserve(lm.arena_size(solo, da, 1));
+    ggml_tensor* out_a = lm.forward(s, solo, da, 1);
+    std::vector<float> ref_a((float*)out_a->data, (float*)out_a->data + step);
+
+    // batched: prefill a, then a's decode step and b's prompt together
+    KVCache both = lm.make_cache(n_ctx, 2, 0, GGML_TYPE_F32);
+    s.reset();
+    s.reserve(lm.arena_size(both, pa, 1));
+    (void)lm.forward(s, both, pa, 1);
+    std::vector<LMSeq> mixed{da[0], pb[0]};
+    s.reset();
+    s.reserve(lm.arena_size(both, mixed, 1));
+    ggml_tensor* out = lm.forward(s, both, mixed, 1);
+    assert(out && both.n_past(0) == 5 && both.n_past(1) == 2);
+
+    const float err = std::fmax(max_abs_diff((float*)out->data, ref_a.data(), step),
+                                max_abs_diff((float*)out->data + step, ref_b.data(), 2 * step));
+    printf("%s: max |batched - alone| = %g\n", __func__, err);
+    assert(err < 1e-3f);
+}
+
+// A forked slot shares its parent's prefix blocks; once the two diverge,
+// each must decode exactly as an unshared copy would, and the shared blocks
+// must be copied only where written.
+static void test_lm_fork(const LM& lm, std::mt19937& rng) {
+    const LMConfig& cfg = lm.config();
+    const int n_ctx = 8, n_prompt = 5, bs = 2;
+    const size_t step = (size_t)cfg.card * cfg.n_q;
+
+    std::uniform_int_distribution<int32_t> tok{0, cfg.card - 1};
+    std::vector<int32_t> prompt(n_prompt * cfg.n_q), x(cfg.n_q), y(cfg.n_q);
+    for (auto& c : prompt) c = tok(rng);
+    for (auto& c : x) c = tok(rng);
+    for (auto& c : y) c = tok(rng);
+
+    ExecState s{1 << 20};
+    auto run = [&](KVCache& cache, std::vector<LMSeq> batch) {
+        s.reset();
+        s.reserve(lm.arena_size(cache, batch, 1));
+        ggml_tensor* out = lm.forward(s, cache, batch, 1);
+        assert(out);
+        return std::vector<float>((float*)out->data, (float*)out->data + batch.size() * step);
+    };
+
+    // reference: the prompt run twice, continued with x and y
+    KVCache ref = lm.make_cache(n_ctx, 2, 0, GGML_TYPE_F32, bs);
+    (void)run(ref, {{0, n_prompt, prompt.data()}, {1, n_prompt, prompt.data()}});
+    const std::vector<float> ref_xy = run(ref, {{0, 1, x.data()}, {1, 1, y.data()}});
+
+    // shared: the prompt run once, then forked
+    KVCache cache = lm.make_cache(n_ctx, 2, 0, GGML_TYPE_F32, bs);
+    (void)run(cache, {{0, n_prompt, prompt.data()}});
+    const int used = cache.n_blocks() - cache.n_free();
+    assert(used == cache.blocks_for(n_prompt));
+    cache.fork(0, 1);
+    assert(cache.n_free() == cache.n_blocks() - used && cache.n_past(1) == n_prompt);
+
+    // both write into the shared, half-full last block: one copy is made
+    const std::vector<float> xy = run(cache, {{0, 1, x.data()}, {1, 1, y.data()}});
+    assert(cache.n_blocks() - cache.n_free() == used + 1);
+
+    const float err = max_abs_diff(xy.data(), ref_xy.data(), 2 * step);
+    printf("%s: max |forked - unshared| = %g\n", __func__, err);
+    assert(err < 1e-3f);
+
+    cache.clear(0);
+    cache.clear(1);
+    assert(cache.n_free() == cache.n_blocks());
+}
+
+// One guided forward over the cond / uncond slot pair must match mixing
+// the logits of two separate passes.
+static void test_lm_guided(const LM& lm, std::mt19937& rng) {
+    const LMConfig& cfg = lm.config();
+    const int T = 3, n_cond = 2;
+    const float coef = 3.0f;
+    const size_t n = (size_t)cfg.card * cfg.n_q * T;
+
+    std::uniform_int_distribution<int32_t> tok{0, cfg.card - 1};
+    std::vector<int32_t> codes(T * cfg.n_q);
+    for (auto& c : codes) c = tok(rng);
+    std::vector<float> cond(n_cond * cfg.d_model);
+    std::uniform_real_distribution<float> dist{-1.f, 1.f};
+    for (auto& c : cond) c = dist(rng);
+
+    // reference: conditional and unconditional passes one after the other
+    KVCache c_cache = lm.make_cache(T, 1, n_cond, GGML_TYPE_F32);
+    KVCache u_cache = lm.make_cache(T, 1, n_cond, GGML_TYPE_F32);
+    std::vector<LMSeq> seq{{0, T, codes.data()}};
+    ExecState s{std::max(lm.arena_size(c_cache, seq, 1), lm.condition_arena_size(c_cache, n_cond, 1))};
+    assert(lm.set_condition(s, c_cache, 0, cond.data(), n_cond, 1));
+    s.reset();
+    ggml_tensor* lc = lm.forward(s, c_cache, seq, 1);
+    std::vector<float> ref((float*)lc->data, (float*)lc->data + n);
+    s.reset();
+    ggml_tensor* lu = lm.forward(s, u_cache, seq, 1);
+    for (size_t i = 0; i < n; ++i) {
+        const float u = ((float*)lu->data)[i];
+        ref[i] = u + coef * (ref[i] - u);
+    }
+
+    // guided: slot 0 conditional, slot 1 null condition, one pass
+    KVCache cache = lm.make_cache(T, 2, n_cond, GGML_TYPE_F32);
+    std::vector<LMGuidedSeq> guided{{0, 1, T, codes.data()}};
+    s.reset();
+    s.reserve(lm.arena_size(cache, guided, 1));
+    assert(lm.set_condition(s, cache, 0, cond.data(), n_cond, 1));
+    s.reset();
+    ggml_tensor* out = lm.forward_guided(s, cache, guided, coef, 1);
+    assert(out && out->ne[2] == T && cache.n_past(0) == T && cache.n_past(1) == T);
+
+    const float err = max_abs_diff((float*)out->data, ref.data(), n);
+    printf("%s: max |guided - mixed| = %g\n", __func__, err);
+    assert(err < 1e-3f);
+}
+
+// Codebook k lags k steps; unknown frames read as the special token.
+static void test_delay_pattern() {
+    const int n_q = 4, card = 16, T = 3;
+    DelayPattern p{n_q, card, T};
+    assert(p.n_steps() == T + n_q - 1);
+
+    std::vector<int32_t> ids(n_q), sampled(n_q);
+    for (int s = 0; s < p.n_steps(); ++s) {
+        p.input(s, ids.data());
+        for (int k = 0; k < n_q; ++k) {
+            const int t = s - 1 - k;
+            assert(ids[k] == (t >= 0 && t < T ? 10 * t + k : card));
+            sampled[k] = 10 * (s - k) + k; // frame s - k, codebook k
+        }
+        p.commit(s, sampled.data());
+        assert(p.frames_done(s) == std::min(std::max(s - n_q + 2, 0), T));
+    }
+    for (int t = 0; t < T; ++t) {
+        for (int k = 0; k < n_q; ++k) assert(p.code(t, k) == 10 * t + k);
+    }
+    printf("%s: ok\n", __func__);
+}
+
+// Requests joining a running batch at different steps get the same codes as
+// when generated alone (greedy: every row of the batch runs the same kernels
+// as it would alone, so the codes are identical), and a prompt code outside
+// the codebook is turned away.
+static void test_scheduler(std::shared_ptr<const LMStore> store, std::mt19937& rng) {
+    const LMConfig& cfg = store->config();
+    std::uniform_int_distribution<int32_t> tok{0, cfg.card - 1};
+    std::uniform_real_distribution<float>  dist{-1.f, 1.f};
+
+    std::vector<GenRequest> reqs(3);
+    const int frames[3] = {5, 8, 3};
+    for (int r = 0; r < 3; ++r) {
+        reqs[r].n_frames             = frames[r];
+        reqs[r].seed                 = r;
+        reqs[r].sampling.temperature = 0.0f;
+        reqs[r].cond.resize((r + 1) * cfg.d_model);
+        for (auto& c : reqs[r].cond) c = dist(rng);
+    }
+    reqs[1].prompt.resize(2 * cfg.n_q);
+    for (auto& c : reqs[1].prompt) c = tok(rng);
+
+    SchedulerConfig sc;
+    sc.n_ctx     = 16;
+    sc.n_cond    = 4;
+    sc.n_threads = 1;
+
+    auto drain = [](Scheduler& s, std::future<GenResult>& f) {
+        while (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready) s.step();
+        return f.get();
+    };
+
+    // on_frames sees every frame once, in order, before the result is ready
+    std::vector<GenResult> alone;
+    for (GenRequest r : reqs) {
+        sc.max_seqs = 1;
+        Scheduler s{store, sc};
+        std::vector<int32_t> streamed;
+        r.on_frames = [&](const int32_t* codes, int n) { streamed.insert(streamed.end(), codes, codes + n * cfg.n_q); };
+        auto f = s.submit(r);
+        alone.push_back(drain(s, f));
+        assert(alone.back().ok && alone.back().n_frames == r.n_frames);
+        assert(streamed == alone.back().codes);
+    }
+
+    // Three slots, but a pool of 12 blocks: the requests take 4, 6 and 4
+    // (guided, 4 steps per block), so the third waits for the first to end.
+    sc.max_seqs   = 3;
+    sc.block_size = 4;
+    sc.n_blocks   = 12;
+    // The first request's consumer blocks until the others are done. They
+    // finish regardless, and its result waits for its last delivery.
+    Scheduler s{store, sc};
+    std::promise<void> gate;
+    std::shared_future<void> open = gate.get_future().share();
+    GenRequest first = reqs[0];
+    first.on_frames = [open](const int32_t*, int) { open.wait(); };
+    std::vector<std::future<GenResult>> futs;
+    futs.push_back(s.submit(first));
+    s.step();
+    s.step();
+    futs.push_back(s.submit(reqs[1]));
+    futs.push_back(s.submit(reqs[2]));
+    assert(s.submit(GenRequest{}).get().ok == false);
+    GenRequest bad = reqs[1];
+    bad.prompt[0] = cfg.card; // the start token, not an audio code
+    assert(s.submit(bad).get().ok == false);
+
+    std::vector<GenResult> batched(3);
+    batched[1] = drain(s, futs[1]);
+    batched[2] = drain(s, futs[2]);
+    assert(futs[0].wait_for(std::chrono::seconds(0)) != std::future_status::ready);
+    gate.set_value();
+    batched[0] = drain(s, futs[0]);
+
+    int same = 0, total = 0;
+    for (int r = 0; r < 3; ++r) {
+        const GenResult& g = batched[r];
+        assert(g.ok && (int)g.codes.size() == frames[r] * cfg.n_q);
+        for (size_t i = 0; i < g.codes.size(); ++i) {
+            assert(g.codes[i] >= 0 && g.codes[i] < cfg.card);
+            same += g.codes[i] == alone[r].codes[i];
+            ++total;
+        }
+        // the audio prompt comes back untouched
+        assert(std::equal(reqs[r].prompt.begin(), reqs[r].prompt.end(), g.codes.begin()));
+    }
+
+    const auto st = s.stats();
+    printf("%s: %d / %d tokens match, %llu steps for %llu requests\n", __func__, same, total,
+           (unsigned long long)st.n_batches, (unsigned long long)st.n_requests);
+    assert(same == total);
+}
+
+// A repeated audio prompt resumes from the cached prefill and gets the
+// same codes; other conditioning is a different prefix.
+static void test_prompt_prefix_cache(std::shared_ptr<const LMStore> store, std::mt19937& rng) {
+    const LMConfig& cfg = store->config();
+    std::uniform_int_distribution<int32_t> tok{0, cfg.card - 1};
+    std::uniform_real_distribution<float>  dist{-1.f, 1.f};
+
+    GenRequest req;
+    req.n_frames             = 7;
+    req.sampling.temperature = 0.0f;
+    req.cond.resize(2 * cfg.d_model);
+    for (auto& c : req.cond) c = dist(rng);
+    req.prompt.resize(3 * cfg.n_q);
+    for (auto& c : req.prompt) c = tok(rng);
+
+    SchedulerConfig sc;
+    sc.max_seqs           = 2;
+    sc.n_ctx              = 16;
+    sc.n_cond             = 4;
+    sc.n_threads          = 1;
+    sc.block_size         = 2; // the 3-position prefix ends mid-block
+    sc.prefix_cache_bytes = 1 << 20;
+    Scheduler s{store, sc};
+    auto run = [&](const GenRequest& r, int& n_steps) {
+        auto f = s.submit(r);
+        for (n_steps = 0; f.wait_for(std::chrono::seconds(0)) != std::future_status::ready; ++n_steps) s.step();
+        return f.get();
+    };
+
+    int cold_steps = 0, warm_steps = 0, other_steps = 0;
+    const GenResult cold = run(req, cold_steps);
+    const GenResult warm = run(req, warm_steps);
+    GenRequest other = req;
+    other.cond[0] += 1.0f;
+    const GenResult moved = run(other, other_steps);
+
+    // prefill covers steps 0 .. 3 at once either way, so the step counts
+    // match; the warm run only skips the prefill compute and resumes from
+    // the very KV entries the cold run wrote, so it picks the same tokens
+    assert(cold.ok && warm.ok && moved.ok && cold_steps == warm_steps);
+    assert(cold.codes == warm.codes);
+
+    const auto st = s.prefix_stats();
+    assert(st.hits == 1 && st.misses == 2 && st.entries == 2);
+    printf("%s: %zu tokens match, %zu bytes cached\n", __func__, cold.codes.size(), st.cost);
+}
+
+// Long-form generation: windows re-prime from the tail, cost per window
+// stays flat, and the first window is an ordinary generation.
+static void test_long_form(std::shared_ptr<const LMStore> store, std::mt19937& rng) {
+    const LMConfig& cfg = store->config();
+    std::uniform_real_distribution<float> dist{-1.f, 1.f};
+
+    GenRequest req;
+    req.n_frames             = 20;
+    req.seed                 = 7;
+    req.sampling.temperature = 0.0f;
+    req.cond.resize(2 * cfg.d_model);
+    for (auto& c : req.cond) c = dist(rng);
+
+    LongFormConfig lc;
+    lc.window          = 6;
+    lc.overlap         = 2;
+    lc.sched.n_cond    = 2;
+    lc.sched.n_threads = 1;
+    LongFormGenerator gen{store, lc};
+
+    int streamed = 0;
+    GenResult r = gen.generate(req, [&](const int32_t*, int n) { streamed += n; });
+    assert(r.ok && r.n_frames == req.n_frames && (int)r.codes.size() == req.n_frames * cfg.n_q);
+    assert(streamed == req.n_frames);
+
+    // 6 + 4 + 4 + 4 + 2 frames; every full window after the first runs the
+    // same number of steps: one prefill, then one per new frame
+    const auto& w = gen.windows();
+    assert(w.size() == 5 && w[0].n_new == 6 && w[1].n_new == 4);
+    assert(w[1].n_steps == w[2].n_steps && w[2].n_steps == w[3].n_steps);
+
+    GenRequest first = req;
+    first.n_frames   = lc.window;
+    SchedulerConfig sc = gen.config().sched;
+    Scheduler s{store, sc};
+    auto f = s.submit(first);
+    while (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready) s.step();
+    GenResult alone = f.get();
+    int same = 0;
+    for (size_t i = 0; i < alone.codes.size(); ++i) same += alone.codes[i] == r.codes[i];
+    printf("%s: %zu windows, %d / %zu first-window tokens match\n", __func__, w.size(), same, alone.codes.size());
+    assert(same == (int)alone.codes.size());
+}
+
+// Profiles resolve to a type per class and layer, later rules winning, and
+// a quantized copy of the weights gives logits close to the original's.
+static void test_lm_quantized(const std::shared_ptr<const LMStore>& store, std::mt19937& rng) {
+    LMQuantProfile p;
+    assert(lm_quant_parse_profile("mixed,ffn@1=q8_0", p));
+    assert(p.type_for(LM_CLASS_EMB, -1, GGML_TYPE_F32) == GGML_TYPE_F16);
+    assert(p.type_for(LM_CLASS_SELF_ATTN, 0, GGML_TYPE_F32) == GGML_TYPE_Q8_0);
+    assert(p.type_for(LM_CLASS_FFN, 0, GGML_TYPE_F32) == GGML_TYPE_Q4_0);
+    assert(p.type_for(LM_CLASS_FFN, 1, GGML_TYPE_F32) == GGML_TYPE_Q8_0);
+    assert(lm_quant_parse_profile("source", p) && p.type_for(LM_CLASS_FFN, 0, GGML_TYPE_F32) == GGML_TYPE_F32);
+    assert(!lm_quant_parse_profile("q3", p));
+    assert(!lm_quant_parse_profile("ffn@2-1=q4_0", p));
+    assert(!lm_quant_parse_profile("norms=q8_0", p));
+
+    const LMConfig& cfg = store->config();
+    const int T = 4;
+    const size_t step = (size_t)cfg.card * cfg.n_q;
+    std::uniform_int_distribution<int32_t> tok{0, cfg.card};
+    std::vector<int32_t> codes(T * cfg.n_q);
+    for (auto& c : codes) c = tok(rng);
+
+    auto logits = [&](const std::shared_ptr<const LMStore>& s) {
+        const LM lm{s};
+        KVCache cache = lm.make_cache(T, 1, 0, GGML_TYPE_F32);
+        std::vector<LMSeq> batch{{0, T, codes.data()}};
+        ExecState state{lm.arena_size(cache, batch, 1)};
+        ggml_tensor* out = lm.forward(state, cache, batch, 1);
+        assert(out);
+        return std::vector<float>((float*)out->data, (float*)out->data + T * step);
+    };
+    const std::vector<float> ref = logits(store);
+    float scale = 0.0f;
+    for (float v : ref) scale = std::fmax(scale, std::fabs(v));
+
+    for (const char* spec : {"q8_0", "mixed", "all=q4_0"}) {
+        assert(lm_quant_parse_profile(spec, p));
+        auto q = lm_quantize(*store, p);
+        assert(q && lm_step_bytes(*q) < lm_step_bytes(*store));
+        const LMLayerWeights& L = q->weights().layers[0];
+        assert(L.linear1->type == p.type_for(LM_CLASS_FFN, 0, GGML_TYPE_F32));
+        assert(L.norm1_w->type == GGML_TYPE_F32);
+        const std::vector<float> out = logits(q);
+        const float err = max_abs_diff(out.data(), ref.data(), ref.size()) / scale;
+        printf("%s: %-8s max |quantized - f32| / max |f32| = %g\n", __func__, spec, err);
+        assert(err < (std::string(spec) == "q8_0" ? 0.05f : 0.3f));
+    }
+}
+
+int main() {
+    std::mt19937 rng{42};
+    const LMConfig cfg = tiny_config();
+    auto store = make_random_lm(cfg, rng);
+    const LM lm{store};
+
+    test_layer_norm(rng);
+    test_flash_attention(rng);
+    test_lm_incremental_matches_prefill(lm, rng);
+    test_lm_batched_slots(lm, rng);
+    test_lm_guided(lm, rng);
+    test_lm_fork(lm, rng);
+    test_lm_quantized(store, rng);
+    test_delay_pattern();
+    test_scheduler(store, rng);
+    test_prompt_prefix_cache(store, rng);
+    test_long_form(store, rng);
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "ggml.h"
+#include "loader.h"
+
+using namespace encodec;
+
+struct TestTensor {
+    std::string           name;
+    std::vector<uint64_t> shape; // PyTorch order
+};
+
+// Write a checkpoint of F32 tensors whose element i holds `tag + i`, tag
+// being the tensor's position in the file.
+static std::string write_checkpoint(const char* name, const std::vector<TestTensor>& tensors) {
+    const std::string path = std::string(P_tmpdir) + "/" + name;
+    FILE* f = fopen(path.c_str(), "wb");
+    assert(f);
+    auto u32 = [&](uint32_t v) { fwrite(&v, sizeof(v), 1, f); };
+    auto u64 = [&](uint64_t v) { fwrite(&v, sizeof(v), 1, f); };
+    auto str = [&](const std::string& s) { u32((uint32_t)s.size()); fwrite(s.data(), 1, s.size(), f); };
+
+    fwrite("GGUF", 1, 4, f);
+    u32(3);
+    u64(tensors.size());
+    u64(1);
+    str("n_heads");
+    str("2");
+
+    uint64_t header = 4 + 4 + 8 + 8 + (4 + 7) + (4 + 1);
+    for (const auto& t : tensors) header += 4 + t.name.size() + 4 + 8 * t.shape.size() + 4 + 8;
+    uint64_t offset = header;
+    std::vector<uint64_t> n_elems;
+    for (const auto& t : tensors) {
+        uint64_t n = 1;
+        for (uint64_t d : t.shape) n *= d;
+        str(t.name);
+        u32((uint32_t)t.shape.size());
+        for (uint64_t d : t.shape) u64(d);
+        u32(0);
+        u64(offset);
+        offset += n * sizeof(float);
+        n_elems.push_back(n);
+    }
+    for (std::size_t k = 0; k < tensors.size(); ++k) {
+        for (uint64_t i = 0; i < n_elems[k]; ++i) {
+            const float x = 100.0f * k + i;
+            fwrite(&x, sizeof(x), 1, f);
+        }
+    }
+    fclose(f);
+    return path;
+}
+
+static const std::vector<TestTensor> kTensors = {
+    {"encoder.model.0.conv.conv.weight_v",       {4, 1, 3}},
+    {"quantizer.vq.layers.0._codebook.embed",    {8, 4}},
+    {"quantizer.vq.layers.1._codebook.embed",    {8, 4}},
+    {"decoder.model.0.conv.conv.weight_v",       {1, 4, 3}},
+    {"transformer.layers.0.norm1.weight",        {16}},
+};
+
+// Tensors are grouped by prefix, and a partial load reads exactly the
+// tensors of the subsystems asked for.
+static void test_partial_load() {
+    const std::string path = write_checkpoint("test_loader_partial.gguf", kTensors);
+    encodec_model_index index;
+    assert(encodec_model_read_index(path, index));
+    assert(index.tensors.size() == kTensors.size() && index.metadata.at("n_heads") == "2");
+    assert(index.subsystems() == (ENCODEC_SUB_ENCODER | ENCODEC_SUB_QUANTIZER | ENCODEC_SUB_DECODER | ENCODEC_SUB_LM));
+    assert(index.bytes(ENCODEC_SUB_QUANTIZER) == 2 * 8 * 4 * sizeof(float));
+    assert(encodec_tensor_subsystem("t5.shared.weight") == ENCODEC_SUB_TEXT);
+    assert(encodec_tensor_subsystem("emb.0.weight") == ENCODEC_SUB_LM);
+    assert(encodec_tensor_subsystem("other") == ENCODEC_SUB_OTHER);
+
+    encodec_model model{};
+    assert(encodec_model_load(index, model, ENCODEC_SUB_QUANTIZER));
+    assert(model.tensors.size() == 2 && model.metadata.size() == 1);
+    ggml_tensor* cb = model.tensors.at("quantizer.vq.layers.1._codebook.embed");
+    assert(cb->ne[0] == 4 && cb->ne[1] == 8);
+    for (int i = 0; i < 32; ++i) assert(((const float*)cb->data)[i] == 200.0f + i);
+    ggml_free(model.ctx);
+
+    encodec_model all{};
+    assert(encodec_model_load(path, all));
+    assert(all.tensors.size() == kTensors.size());
+    ggml_free(all.ctx);
+    remove(path.c_str());
+    printf("%s: ok\n", __func__);
+}
+
+// The loader materializes a store on first request and hands the same one
+// out afterwards; stores whose tensors are missing fail without retrying.
+static void test_lazy_loader() {
+    const std::string path = write_checkpoint("test_loader_lazy.gguf", kTensors);
+    auto loader = ModelLoader::open(path);
+    assert(loader && loader->loaded_bytes() == 0);
+
+    auto quant = loader->quantizer();
+    assert(quant && quant->codebooks().size() == 2 && quant->quant().blocks.size() == 2);
+    assert(((const float*)quant->codebooks()[0].embed->data)[5] == 105.0f);
+    assert(loader->quantizer() == quant);
+    assert(loader->loaded_bytes() == loader->index().bytes(ENCODEC_SUB_QUANTIZER));
+
+    assert(!loader->encoder()); // the checkpoint has no full encoder
+    assert(!loader->encoder());
+    assert(loader->loaded_bytes() == loader->index().bytes(ENCODEC_SUB_QUANTIZER));
+
+    assert(!ModelLoader::open(std::string(P_tmpdir) + "/test_loader_missing.gguf"));
+    remove(path.c_str());
+    printf("%s: ok\n", __func__);
+}
+
+int main() {
+    test_partial_load();
+    test_lazy_loader();
+    return 0;
+}
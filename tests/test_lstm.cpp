@@ -2,8 +2,10 @@
 
 #include "ggml.h"
 #include "lstm.h" // your LSTM implementation header
+#include "lstm_stream.h"
 #include "utils.h" // create_{1d,2d}_tensor, compute_graph_from_tensor, print_ggml_1d_tensor
 
+#include <cmath>
 #include <cstdlib>
 #include <ctime>
 #include <vector>
@@ -65,7 +67,77 @@ void test_lstm_step() {
     free(ctx_data);
 }
 
+// Steps several sessions through MultiStreamLSTM and checks every session
+// against running lstm_step on it alone.
+void test_lstm_multistream() {
+    const size_t ctx_size = 4 * 1024 * 1024;
+    struct ggml_context *ctx = ggml_init({.mem_size = ctx_size, .mem_buffer = NULL});
+
+    const int D = 10, H = 20, G = 4 * H;
+    const int n_sessions = 3, n_steps = 4;
+
+    auto rand_vec = [](size_t n) {
+        std::vector<float> v(n);
+        for (auto &x : v) x = (float(std::rand()) / RAND_MAX) * 2.f - 1.f;
+        return v;
+    };
+    auto w_ih = rand_vec(G * D), w_hh = rand_vec(G * H), b_ih = rand_vec(G), b_hh = rand_vec(G);
+
+    encodec::LSTMWeights w{
+        create_2d_tensor(ctx, w_ih.data(), G, D),
+        create_2d_tensor(ctx, w_hh.data(), G, H),
+        create_1d_tensor(ctx, b_ih.data(), G),
+        create_1d_tensor(ctx, b_hh.data(), G),
+    };
+
+    encodec::MultiStreamLSTM lstm{w};
+    encodec::ExecState state{ctx_size};
+
+    std::vector<encodec::MultiStreamLSTM::SessionId> ids;
+    std::vector<std::vector<float>> ref_h(n_sessions, std::vector<float>(H, 0.f));
+    std::vector<std::vector<float>> ref_c(n_sessions, std::vector<float>(H, 0.f));
+    for (int s = 0; s < n_sessions; ++s) ids.push_back(lstm.open());
+
+    float max_err = 0.f;
+    for (int t = 0; t < n_steps; ++t) {
+        for (int s = 0; s < n_sessions; ++s) {
+            auto x = rand_vec(D);
+            lstm.push(ids[s], x.data());
+
+            // reference: the same session stepped on its own
+            encodec::ExecState ref{ctx_size};
+            struct lstm_state st = lstm_step(ref.ctx(),
+                create_1d_tensor(ref.ctx(), x.data(), D),
+                create_1d_tensor(ref.ctx(), ref_h[s].data(), H),
+                create_1d_tensor(ref.ctx(), ref_c[s].data(), H),
+                w.weight_ih, w.weight_hh, w.bias_ih, w.bias_hh);
+            ggml_cgraph *gf = ref.new_graph();
+            ggml_build_forward_expand(gf, st.c_t);
+            ggml_build_forward_expand(gf, st.h_t);
+            ref.compute(1);
+            memcpy(ref_h[s].data(), st.h_t->data, H * sizeof(float));
+            memcpy(ref_c[s].data(), st.c_t->data, H * sizeof(float));
+        }
+
+        const int n = lstm.step(state, 1);
+        assert(n == n_sessions);
+        (void)n;
+
+        std::vector<float> h(H);
+        for (int s = 0; s < n_sessions; ++s) {
+            lstm.hidden(ids[s], h.data());
+            for (int i = 0; i < H; ++i) max_err = std::fmax(max_err, std::fabs(h[i] - ref_h[s][i]));
+        }
+    }
+
+    printf("multistream: %d sessions x %d steps, max |h - ref| = %g\n", n_sessions, n_steps, max_err);
+    assert(max_err < 1e-4f);
+
+    ggml_free(ctx);
+}
+
 int main() {
     test_lstm_step();
+    test_lstm_multistream();
     return 0;
 }
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <cassert>
+#include <memory>
+#include <set>
+#include <vector>
+#include "numa.h"
+
+using namespace encodec;
+
+static void test_cpulist() {
+    assert((parse_cpulist("0-3,8,10-11\n") == std::vector<int>{0, 1, 2, 3, 8, 10, 11}));
+    assert((parse_cpulist("5") == std::vector<int>{5}));
+    assert(parse_cpulist("").empty());
+    printf("%s: ok\n", __func__);
+}
+
+// Simulated nodes split the CPUs into disjoint groups covering all of them,
+// and the real topology always has at least one node with CPUs.
+static void test_topology() {
+    const NumaTopology topo = NumaTopology::simulated(2);
+    const int n_cpus = (int)NumaTopology::allowed_cpus().size();
+    assert(topo.simulated() && topo.n_nodes() == std::min(2, n_cpus));
+    std::set<int> seen;
+    for (int i = 0; i < topo.n_nodes(); ++i) {
+        assert(!topo.node(i).cpus.empty());
+        for (int c : topo.node(i).cpus) assert(seen.insert(c).second);
+    }
+    assert((int)seen.size() == n_cpus);
+
+    const NumaTopology host = NumaTopology::detect();
+    assert(host.n_nodes() >= 1 && !host.node(0).cpus.empty());
+    printf("%s: %d node(s) on this host\n", __func__, host.n_nodes());
+}
+
+// Replicate builds one store per node, on a thread pinned to that node;
+// the other modes share one store.
+static void test_place_stores() {
+    const NumaTopology topo = NumaTopology::simulated(2);
+    std::vector<std::set<int>> affinity;
+    auto load = [&] {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        sched_getaffinity(0, sizeof(set), &set);
+        std::set<int> cpus;
+        for (int c = 0; c < CPU_SETSIZE; ++c) {
+            if (CPU_ISSET(c, &set)) cpus.insert(c);
+        }
+        affinity.push_back(cpus);
+        return std::make_shared<const int>((int)affinity.size());
+    };
+
+    auto replicas = numa_place_stores<int>(topo, NumaMode::Replicate, load);
+    assert((int)replicas.size() == topo.n_nodes() && (int)affinity.size() == topo.n_nodes());
+    for (int i = 0; i < topo.n_nodes(); ++i) {
+        assert(*replicas[i] == i + 1);
+        const std::vector<int>& cpus = topo.node(i).cpus;
+        assert(affinity[i] == std::set<int>(cpus.begin(), cpus.end()));
+    }
+
+    affinity.clear();
+    auto shared = numa_place_stores<int>(topo, NumaMode::Interleave, load);
+    assert((int)shared.size() == topo.n_nodes() && affinity.size() == 1);
+    for (const auto& s : shared) assert(s == shared[0]);
+
+    auto failed = numa_place_stores<int>(topo, NumaMode::Replicate, [] { return std::shared_ptr<const int>{}; });
+    assert(failed.empty());
+    printf("%s: ok\n", __func__);
+}
+
+int main() {
+    test_cpulist();
+    test_topology();
+    test_place_stores();
+    return 0;
+}
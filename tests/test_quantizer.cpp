@@ -1,4 +1,5 @@
 #include "quantizer.h"
+#include "exec_state.h"
 #include "utils.h"
 
 #include <cstdlib>
@@ -7,19 +8,31 @@
 #include <cstdio>
 
 void test_quantizer_encode() {
-    // --- GGML setup ---
-    const size_t ctx_size = 200 * 100000;
-    void *ctx_data = malloc(ctx_size);
-    struct ggml_context *ctx = ggml_init({ .mem_size = ctx_size, .mem_buffer = ctx_data });
-
-    std::srand(std::time(nullptr));
-
     // --- dimensions ---
     const int seq_length   = 10;    // e.g. 10 time steps
     const int hidden_dim   = 16;   // D
     const int num_stages   = 2;     // n_q
     const int codebook_size = 8; // K
 
+    // --- measure the context this test needs ---
+    size_t ctx_size;
+    {
+        encodec::ExecState m = encodec::ExecState::measuring();
+        quantizer quant;
+        for (int i = 0; i < num_stages; ++i) {
+            quant.blocks.push_back({ggml_new_tensor_2d(m.ctx(), GGML_TYPE_F32, hidden_dim, codebook_size)});
+        }
+        struct ggml_tensor *inp = ggml_new_tensor_2d(m.ctx(), GGML_TYPE_F32, hidden_dim, seq_length);
+        ggml_build_forward_expand(m.new_graph(), quantizer_encode(&quant, m.ctx(), inp));
+        ctx_size = m.required_size(/*n_threads=*/1);
+    }
+
+    // --- GGML setup ---
+    void *ctx_data = malloc(ctx_size);
+    struct ggml_context *ctx = ggml_init({ .mem_size = ctx_size, .mem_buffer = ctx_data });
+
+    std::srand(std::time(nullptr));
+
     // --- random input ---
     std::vector<float> input_data(seq_length * hidden_dim);
     for (auto &x : input_data) {
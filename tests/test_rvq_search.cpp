@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <cassert>
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "rvq_search.h"
+
+using namespace encodec;
+
+// Codebooks shaped like trained ones: codewords gather around a few dozen
+// centers, and later stages are smaller (they quantize a residual). Frames
+// are a sum of one codeword per stage plus noise.
+struct Synthetic {
+    int64_t D, K, n_q;
+    std::vector<std::vector<float>> codebooks; // n_q x [K, D]
+    std::vector<float>              frames;    // T x D
+
+    Synthetic(int64_t D, int64_t K, int n_q, int T, uint32_t seed) : D{D}, K{K}, n_q{n_q} {
+        std::mt19937 rng{seed};
+        std::normal_distribution<float> g{0.0f, 1.0f};
+        for (int i = 0; i < n_q; ++i) {
+            const float scale = 1.0f / (float)(1 << i);
+            std::vector<float> centers(32 * D);
+            for (auto& v : centers) v = 4.0f * scale * g(rng);
+            std::vector<float> cb(K * D);
+            for (int64_t k = 0; k < K; ++k) {
+                const float* c = &centers[(rng() % 32) * D];
+                for (int64_t d = 0; d < D; ++d) cb[k * D + d] = c[d] + scale * g(rng);
+            }
+            codebooks.push_back(std::move(cb));
+        }
+        frames.assign((std::size_t)(T * D), 0.0f);
+        for (int t = 0; t < T; ++t) {
+            for (int i = 0; i < n_q; ++i) {
+                const float* e = &codebooks[i][(rng() % K) * D];
+                for (int64_t d = 0; d < D; ++d) frames[t * D + d] += e[d];
+            }
+            for (int64_t d = 0; d < D; ++d) frames[t * D + d] += 0.05f * g(rng);
+        }
+    }
+
+    RvqIndex index(const RvqSearchConfig& cfg) const {
+        std::vector<CodebookIndex> stages;
+        for (const auto& cb : codebooks) stages.emplace_back(cb.data(), D, K, cfg);
+        return RvqIndex{std::move(stages)};
+    }
+};
+
+// The index keeps every codeword under its own number, and the full search
+// finds each codeword as its own nearest.
+static void test_index_layout() {
+    const Synthetic s{16, 256, 1, 0, 1};
+    const RvqIndex  rvq = s.index({});
+    const CodebookIndex& cb = rvq.stage(0);
+    assert(cb.n_clusters() == 16);
+    for (int32_t k = 0; k < s.K; ++k) {
+        const float* e = cb.codeword(k);
+        for (int64_t d = 0; d < s.D; ++d) assert(e[d] == s.codebooks[0][k * s.D + d]);
+        assert(cb.search_exact(e) == k);
+    }
+    printf("%s: ok\n", __func__);
+}
+
+// With margin = 1 no group that could win is skipped, so the codes are
+// exactly those of the full search.
+static void test_exact_margin() {
+    const int T = 300;
+    const Synthetic s{32, 512, 4, T, 2};
+    RvqSearchConfig cfg;
+    cfg.n_probe = 1;
+    cfg.margin  = 1.0f;
+    const RvqIndex rvq = s.index(cfg);
+    std::vector<int32_t> exact(s.n_q), approx(s.n_q);
+    for (int t = 0; t < T; ++t) {
+        rvq.encode(&s.frames[t * s.D], exact.data(), 1, false);
+        rvq.encode(&s.frames[t * s.D], approx.data(), 1, true);
+        assert(exact == approx);
+    }
+    printf("%s: ok\n", __func__);
+}
+
+// The default settings agree with the full search on almost every code
+// while comparing far fewer codewords.
+static void test_approx_agreement() {
+    const int T = 500;
+    const Synthetic s{64, 1024, 4, T, 3};
+    const RvqIndex  rvq = s.index({});
+    std::vector<int32_t> exact(s.n_q), approx(s.n_q);
+    int agree = 0;
+    for (int t = 0; t < T; ++t) {
+        rvq.encode(&s.frames[t * s.D], exact.data(), 1, false);
+        const RvqSearchStats before = rvq.stats();
+        rvq.encode(&s.frames[t * s.D], approx.data(), 1, true);
+        const RvqSearchStats after = rvq.stats();
+        assert(after.n_searches - before.n_searches == (uint64_t)s.n_q);
+        for (int i = 0; i < s.n_q; ++i) agree += exact[i] == approx[i];
+    }
+    const RvqSearchStats st = rvq.stats();
+    const double agreement = (double)agree / (T * s.n_q);
+    // half the work was the full search: the approximate half scanned the rest
+    const double scanned = (double)(st.n_scanned - st.n_total / 2) / (st.n_total / 2);
+    printf("%s: agreement %.4f, %.3f of codewords scanned, %.3f fallback\n", __func__,
+           agreement, scanned, (double)st.n_fallback / (st.n_searches / 2));
+    assert(agreement > 0.95 && scanned < 0.6);
+}
+
+int main() {
+    test_index_layout();
+    test_exact_margin();
+    test_approx_agreement();
+    return 0;
+}
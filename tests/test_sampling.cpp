@@ -0,0 +1,104 @@
+#include "sampling.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+using namespace musicgen;
+
+static std::vector<float> random_logits(int n, StreamRng& rng) {
+    std::vector<float> l(n);
+    for (auto& x : l) x = (float)(rng.uniform() * 8.0 - 4.0);
+    return l;
+}
+
+static int argmax(const std::vector<float>& l) {
+    int best = 0;
+    for (int i = 1; i < (int)l.size(); ++i) if (l[i] > l[best]) best = i;
+    return best;
+}
+
+// Greedy, top_k = 1 and a tiny top_p all pick the argmax.
+void test_sampling_degenerate() {
+    StreamRng rng{1};
+    std::vector<std::pair<float, int32_t>> scratch;
+    const int card = 2048;
+    for (int trial = 0; trial < 20; ++trial) {
+        const auto l = random_logits(card, rng);
+        const int  a = argmax(l);
+        assert(sample_head(l.data(), nullptr, card, {0.0f, 250, 0.0f}, rng.uniform(), scratch) == a);
+        assert(sample_head(l.data(), nullptr, card, {1.0f, 1, 0.0f}, rng.uniform(), scratch) == a);
+        assert(sample_head(l.data(), nullptr, card, {1.0f, 0, 1e-6f}, rng.uniform(), scratch) == a);
+    }
+    printf("%s: ok\n", __func__);
+}
+
+// Draws stay inside the top k, and follow the softmax of those k.
+void test_sampling_top_k() {
+    StreamRng rng{2};
+    std::vector<std::pair<float, int32_t>> scratch;
+    const int card = 64, k = 4, n = 40000;
+    std::vector<float> l(card, -1.0f);
+    l[3] = 2.0f; l[10] = 1.5f; l[20] = 1.0f; l[40] = 0.5f; l[50] = 0.4f;
+
+    std::vector<int> hist(card, 0);
+    for (int i = 0; i < n; ++i) ++hist[sample_head(l.data(), nullptr, card, {1.0f, k, 0.0f}, rng.uniform(), scratch)];
+
+    assert(hist[50] == 0);
+    const int   top[k] = {3, 10, 20, 40};
+    double      z      = 0.0;
+    for (int t : top) z += std::exp(l[t]);
+    for (int t : top) {
+        const double expect = std::exp(l[t]) / z;
+        const double got    = (double)hist[t] / n;
+        printf("%s: token %d p=%.3f got %.3f\n", __func__, t, expect, got);
+        assert(std::fabs(got - expect) < 0.02);
+    }
+}
+
+// The CFG mix of the sampler matches mixing by hand.
+void test_sampling_cfg() {
+    StreamRng rng{3};
+    std::vector<std::pair<float, int32_t>> scratch;
+    const int card = 256;
+    const auto c = random_logits(card, rng);
+    const auto u = random_logits(card, rng);
+    std::vector<float> mixed(card);
+    for (int i = 0; i < card; ++i) mixed[i] = u[i] + 3.0f * (c[i] - u[i]);
+
+    const SamplingParams p{0.0f, 0, 0.0f, 3.0f};
+    assert(sample_head(c.data(), u.data(), card, p, 0.5, scratch) == argmax(mixed));
+    printf("%s: ok\n", __func__);
+}
+
+// Same seeds, same tokens, whatever the thread count.
+void test_sampling_batch_reproducible() {
+    const int card = 2048, n_q = 4, n_rows = 16;
+    StreamRng gen{4};
+    const auto logits = random_logits(card * n_q * n_rows, gen);
+
+    auto run = [&](Sampler* sampler) {
+        std::vector<StreamRng> rngs;
+        for (int i = 0; i < n_rows; ++i) rngs.emplace_back(1234, i);
+        std::vector<int32_t> out(n_rows * n_q);
+        for (int step = 0; step < 5; ++step) {
+            sample_tokens(logits.data(), nullptr, card, n_q, n_rows, {1.0f, 250, 0.9f}, rngs, out.data(), sampler);
+        }
+        return out;
+    };
+    Sampler pool{4};
+    const auto a = run(nullptr);
+    const auto b = run(&pool);
+    assert(a == b);
+    for (int32_t t : a) assert(t >= 0 && t < card);
+    printf("%s: ok\n", __func__);
+}
+
+int main() {
+    test_sampling_degenerate();
+    test_sampling_top_k();
+    test_sampling_cfg();
+    test_sampling_batch_reproducible();
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include "shm_ring.h"
+
+using namespace encodec;
+
+static const char* kName = "/test_shm_ring";
+
+// A reader in another process sees every chunk in order, in place, while
+// the writer reuses the few slots of the ring.
+static void test_cross_process() {
+    const uint32_t n_slots = 4, n_chunks = 1000, dim = 8;
+    auto ring = ShmRingWriter::create(kName, SHM_RING_CODES, n_slots, dim * 3 * sizeof(int32_t));
+    assert(ring && ring->n_slots() == n_slots);
+
+    const pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        auto reader = ShmRingReader::attach(kName);
+        if (!reader || reader->kind() != SHM_RING_CODES) _exit(2);
+        uint64_t seq = 0, frame = 0;
+        while (auto chunk = reader->next()) {
+            const int32_t* codes = (const int32_t*)chunk->data;
+            if (chunk->info.seq != seq || chunk->info.frame0 != frame || chunk->info.dim != dim) _exit(3);
+            for (uint32_t i = 0; i < chunk->info.n_frames * dim; ++i) {
+                if (codes[i] != (int32_t)(frame * dim + i)) _exit(4);
+            }
+            frame += chunk->info.n_frames;
+            ++seq;
+            reader->release();
+        }
+        _exit(reader->finished() && seq == n_chunks ? 0 : 5);
+    }
+
+    uint64_t frame = 0;
+    for (uint64_t seq = 0; seq < n_chunks; ++seq) {
+        const uint32_t n_frames = 1 + seq % 3;
+        int32_t* slot = (int32_t*)ring->slot(seq);
+        assert(slot);
+        for (uint32_t i = 0; i < n_frames * dim; ++i) slot[i] = (int32_t)(frame * dim + i);
+        ring->publish(seq, frame, n_frames, dim, n_frames * dim * sizeof(int32_t));
+        frame += n_frames;
+    }
+    ring->close();
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    printf("%s: ok\n", __func__);
+}
+
+// The writer blocks on a full ring, stops waiting once the reader detaches,
+// and the reader times out on an empty one.
+static void test_full_and_detach() {
+    auto ring   = ShmRingWriter::create(kName, SHM_RING_PCM, 2, 64);
+    auto reader = ShmRingReader::attach(kName);
+    assert(ring && reader);
+    assert(!reader->next(std::chrono::milliseconds(1)) && !reader->finished());
+
+    for (uint64_t seq = 0; seq < 2; ++seq) {
+        assert(ring->slot(seq));
+        ring->publish(seq, seq, 1, 1, 4);
+    }
+    auto chunk = reader->next(std::chrono::milliseconds(0));
+    assert(chunk && chunk->info.seq == 0);
+    reader->release();
+    assert(ring->slot(2));       // slot 0 is free again
+    reader.reset();
+    assert(ring->reader_gone() && !ring->slot(4)); // would wait for slot 2 forever otherwise
+
+    assert(!ShmRingReader::attach("/test_shm_ring_missing"));
+    printf("%s: ok\n", __func__);
+}
+
+int main() {
+    test_cross_process();
+    test_full_and_detach();
+    return 0;
+}
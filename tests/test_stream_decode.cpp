@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <future>
+#include <random>
+#include <thread>
+#include <vector>
+#include "stream_decode.h"
+
+using namespace musicgen;
+
+// Stand-in for the codec: frame t decodes to its n_q codes as floats, after
+// a random delay so that workers finish out of order.
+static FrameDecoder fake_decoder(int max_delay_us) {
+    return [max_delay_us](encodec::ExecState&, const int32_t* codes, int n_frames, int n_q, float* out) {
+        thread_local std::mt19937 rng{std::random_device{}()};
+        std::this_thread::sleep_for(std::chrono::microseconds(rng() % (max_delay_us + 1)));
+        std::copy(codes, codes + n_frames * n_q, out);
+    };
+}
+
+// Chunks come out whole and in frame order whatever order workers finish in,
+// and the tail shorter than a chunk is flushed by finish().
+static void test_order() {
+    const int n_q = 4, n_frames = 103;
+    StreamDecoderConfig cfg;
+    cfg.n_workers    = 3;
+    cfg.chunk_frames = 5;
+    StreamDecoder sd{fake_decoder(2000), n_q, n_q, cfg};
+
+    std::thread producer([&] {
+        std::vector<int32_t> frame(n_q);
+        for (int t = 0; t < n_frames; ++t) {
+            for (int k = 0; k < n_q; ++k) frame[k] = t * n_q + k;
+            sd.push(frame.data(), 1);
+        }
+        sd.finish();
+    });
+
+    int next = 0;
+    while (auto chunk = sd.pop()) {
+        assert(chunk->frame0 == next && chunk->dim == n_q);
+        assert((int)chunk->data.size() == chunk->n_frames * n_q);
+        for (int i = 0; i < chunk->n_frames * n_q; ++i) assert(chunk->data[i] == (float)(next * n_q + i));
+        next += chunk->n_frames;
+    }
+    producer.join();
+    assert(next == n_frames);
+    printf("%s: ok\n", __func__);
+}
+
+// A consumer that does not pop stalls the producer after a few chunks.
+static void test_backpressure() {
+    const int n_q = 2;
+    StreamDecoderConfig cfg;
+    cfg.n_workers    = 1;
+    cfg.chunk_frames = 1;
+    cfg.max_inflight = 1;
+    cfg.max_output   = 1;
+    StreamDecoder sd{fake_decoder(0), n_q, n_q, cfg};
+
+    std::atomic<int> pushed{0};
+    std::thread producer([&] {
+        const int32_t frame[n_q] = {1, 2};
+        for (int t = 0; t < 100; ++t) {
+            sd.push(frame, 1);
+            ++pushed;
+        }
+        sd.finish();
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    const int stalled_at = pushed.load();
+    assert(stalled_at < 10);
+
+    int n = 0;
+    while (sd.pop()) ++n;
+    producer.join();
+    assert(n == 100);
+    printf("%s: stalled after %d pushes\n", __func__, stalled_at);
+}
+
+// Destroying the decoder does not wait for a consumer that stopped
+// popping, even with every worker blocked and a tail still to flush.
+static void test_teardown_stalled_consumer() {
+    const int n_q = 2;
+    StreamDecoderConfig cfg;
+    cfg.n_workers    = 2;
+    cfg.chunk_frames = 2;
+    cfg.max_inflight = 1;
+    cfg.max_output   = 1;
+
+    auto done = std::async(std::launch::async, [&] {
+        StreamDecoder sd{fake_decoder(0), n_q, n_q, cfg};
+        const int32_t frame[n_q] = {1, 2};
+        // one chunk in the output, one worker blocked on it, one waiting to
+        // emit, one chunk queued: as much as fits without blocking push()
+        for (int t = 0; t < 4 * cfg.chunk_frames + 1; ++t) sd.push(frame, 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    });
+    assert(done.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+    printf("%s: ok\n", __func__);
+}
+
+// With an output ring, chunks are decoded into its slots and published in
+// frame order; a ring smaller than the stream is reused as the reader goes.
+static void test_ring_output() {
+    const int n_q = 3, n_frames = 61;
+    StreamDecoderConfig cfg;
+    cfg.n_workers    = 3;
+    cfg.chunk_frames = 4;
+    auto ring = encodec::ShmRingWriter::create("/test_stream_decode_ring", encodec::SHM_RING_LATENTS, 3,
+                                               cfg.chunk_frames * n_q * sizeof(float));
+    assert(ring);
+    cfg.ring = ring.get();
+    auto reader = encodec::ShmRingReader::attach("/test_stream_decode_ring");
+    assert(reader && reader->n_slots() == 3);
+
+    StreamDecoder sd{fake_decoder(2000), n_q, n_q, cfg};
+    std::thread producer([&] {
+        std::vector<int32_t> frame(n_q);
+        for (int t = 0; t < n_frames; ++t) {
+            for (int k = 0; k < n_q; ++k) frame[k] = t * n_q + k;
+            sd.push(frame.data(), 1);
+        }
+        sd.finish();
+    });
+
+    uint64_t next = 0;
+    while (auto chunk = reader->next()) {
+        assert(chunk->info.frame0 == next && chunk->info.dim == n_q);
+        assert(chunk->info.n_bytes == chunk->info.n_frames * n_q * sizeof(float));
+        const float* x = (const float*)chunk->data;
+        for (uint32_t i = 0; i < chunk->info.n_frames * n_q; ++i) assert(x[i] == (float)(next * n_q + i));
+        next += chunk->info.n_frames;
+        reader->release();
+    }
+    producer.join();
+    assert(reader->finished() && next == (uint64_t)n_frames && !sd.pop());
+    printf("%s: ok\n", __func__);
+}
+
+int main() {
+    test_order();
+    test_backpressure();
+    test_teardown_stalled_consumer();
+    test_ring_output();
+    return 0;
+}
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <cassert>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "ggml.h"
+#include "lru_cache.h"
+#include "t5.h"
+
+using namespace musicgen;
+
+static const char* kSp = "\xE2\x96\x81";
+
+static T5Tokenizer tiny_tokenizer() {
+    // <pad> </s> <unk>, then pieces with unigram log-probs
+    std::vector<std::string> pieces = {"<pad>", "</s>", "<unk>",
+                                       std::string(kSp), std::string(kSp) + "lo", "fi",
+                                       std::string(kSp) + "lofi", "beat", std::string(kSp) + "beat",
+                                       "l", "o", "f", "i", "b", "e", "a", "t"};
+    std::vector<float> scores = {0, 0, 0, -2, -4, -4, -5, -4, -3, -6, -6, -6, -6, -6, -6, -6, -6};
+    return T5Tokenizer{pieces, scores};
+}
+
+static void test_tokenizer() {
+    const T5Tokenizer tok = tiny_tokenizer();
+    assert(T5Tokenizer::normalize("  lofi \t\n beat ") == "lofi beat");
+
+    // "▁lofi" (-5) beats "▁lo" + "fi" (-8); "▁beat" (-3) beats "▁" + "beat" (-6)
+    std::vector<int32_t> ids = tok.encode("lofi  beat");
+    assert((ids == std::vector<int32_t>{6, 8, T5Tokenizer::kEos}));
+
+    // uncovered characters become <unk>; the limit keeps room for </s>
+    ids = tok.encode("lo\xC3\xA9");
+    assert((ids == std::vector<int32_t>{4, T5Tokenizer::kUnk, T5Tokenizer::kEos}));
+    assert(tok.encode("lofi beat", 2).size() == 2 && tok.encode("").size() == 1);
+    printf("%s: ok\n", __func__);
+}
+
+// Reference values from HF T5 (32 buckets, max distance 128, bidirectional).
+static void test_relative_bucket() {
+    const int rel[]    = {0, 1, -1, 7, -7, 8, -8, 20, 200, -200};
+    const int bucket[] = {0, 17, 1, 23, 7, 24, 8, 26, 31, 15};
+    for (int i = 0; i < 10; ++i) assert(T5Encoder::relative_bucket(rel[i], 32, 128) == bucket[i]);
+    printf("%s: ok\n", __func__);
+}
+
+static void test_lru_cache() {
+    LruCache<std::string, int> cache{10};
+    cache.put("a", std::make_shared<const int>(1), 4);
+    cache.put("b", std::make_shared<const int>(2), 4);
+    assert(*cache.get("a") == 1);                        // a is now the most recent
+    cache.put("c", std::make_shared<const int>(3), 4);   // evicts b
+    assert(!cache.get("b") && cache.get("a") && cache.get("c"));
+    cache.put("huge", std::make_shared<const int>(4), 11);
+    assert(!cache.get("huge"));
+
+    const auto st = cache.stats();
+    assert(st.entries == 2 && st.cost == 8 && st.evictions == 1 && st.hits == 3 && st.misses == 2);
+    printf("%s: ok\n", __func__);
+}
+
+// A tiny random T5 + output_proj against a direct float implementation.
+static void test_encoder(std::mt19937& rng) {
+    T5Config cfg;
+    cfg.n_vocab = 17;
+    cfg.d_model = 16;
+    cfg.n_head  = 2;
+    cfg.d_kv    = 4;
+    cfg.d_ff    = 24;
+    cfg.n_layer = 2;
+    cfg.d_out   = 12;
+    const int64_t D = cfg.d_model, I = cfg.n_head * cfg.d_kv;
+
+    ggml_init_params params{
+        .mem_size   = 4 * 1024 * 1024,
+        .mem_buffer = nullptr,
+        .no_alloc   = false
+    };
+    ggml_context* ctx = ggml_init(params);
+    std::uniform_real_distribution<float> dist{-0.5f, 0.5f};
+    auto rnd = [&](int64_t ne0, int64_t ne1) {
+        ggml_tensor* t = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) ((float*)t->data)[i] = dist(rng);
+        return t;
+    };
+    auto norm = [&](int64_t n) {
+        ggml_tensor* t = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n);
+        for (int64_t i = 0; i < n; ++i) ((float*)t->data)[i] = 1.0f + dist(rng);
+        return t;
+    };
+
+    T5Weights w;
+    w.shared   = rnd(D, cfg.n_vocab);
+    w.rel_bias = rnd(cfg.n_head, cfg.n_buckets);
+    for (int il = 0; il < cfg.n_layer; ++il) {
+        T5LayerWeights L;
+        L.attn_norm = norm(D);
+        L.q = rnd(D, I);
+        L.k = rnd(D, I);
+        L.v = rnd(D, I);
+        L.o = rnd(I, D);
+        L.ff_norm = norm(D);
+        L.wi = rnd(D, cfg.d_ff);
+        L.wo = rnd(cfg.d_ff, D);
+        w.layers.push_back(L);
+    }
+    w.final_norm = norm(D);
+    w.proj_w     = rnd(D, cfg.d_out);
+    w.proj_b     = norm(cfg.d_out);
+    const T5Weights ref_w = w;
+    auto store = std::make_shared<const T5Store>(ctx, cfg, std::move(w), tiny_tokenizer());
+
+    // reference, x[i][d] row-major
+    const std::vector<int32_t> ids = store->tokenizer().encode("lofi beat");
+    const int n = (int)ids.size();
+    auto at = [](const ggml_tensor* t, int64_t r, int64_t c) { return ((const float*)t->data)[r * t->ne[0] + c]; };
+    auto linear = [&](const ggml_tensor* W, const std::vector<float>& x, int64_t in) {
+        const int64_t out = W->ne[1];
+        std::vector<float> y(n * out, 0.0f);
+        for (int i = 0; i < n; ++i)
+            for (int64_t o = 0; o < out; ++o)
+                for (int64_t k = 0; k < in; ++k) y[i * out + o] += at(W, o, k) * x[i * in + k];
+        return y;
+    };
+    auto rms = [&](const std::vector<float>& x, const ggml_tensor* g) {
+        std::vector<float> y(x.size());
+        for (int i = 0; i < n; ++i) {
+            double ss = 0.0;
+            for (int64_t d = 0; d < D; ++d) ss += x[i * D + d] * x[i * D + d];
+            const float r = 1.0f / std::sqrt((float)(ss / D) + cfg.norm_eps);
+            for (int64_t d = 0; d < D; ++d) y[i * D + d] = x[i * D + d] * r * ((const float*)g->data)[d];
+        }
+        return y;
+    };
+
+    std::vector<float> x(n * D);
+    for (int i = 0; i < n; ++i)
+        for (int64_t d = 0; d < D; ++d) x[i * D + d] = at(ref_w.shared, ids[i], d);
+    for (const T5LayerWeights& L : ref_w.layers) {
+        std::vector<float> h = rms(x, L.attn_norm);
+        std::vector<float> q = linear(L.q, h, D), k = linear(L.k, h, D), v = linear(L.v, h, D);
+        std::vector<float> a(n * I, 0.0f);
+        for (int hh = 0; hh < cfg.n_head; ++hh) {
+            for (int i = 0; i < n; ++i) {
+                std::vector<float> s(n);
+                float mx = -1e30f, sum = 0.0f;
+                for (int j = 0; j < n; ++j) {
+                    float dot = at(ref_w.rel_bias, T5Encoder::relative_bucket(j - i, cfg.n_buckets, cfg.max_distance), hh);
+                    for (int64_t d = 0; d < cfg.d_kv; ++d) dot += q[i * I + hh * cfg.d_kv + d] * k[j * I + hh * cfg.d_kv + d];
+                    s[j] = dot;
+                    mx   = std::fmax(mx, dot);
+                }
+                for (auto& e : s) sum += (e = std::exp(e - mx));
+                for (int j = 0; j < n; ++j)
+                    for (int64_t d = 0; d < cfg.d_kv; ++d) a[i * I + hh * cfg.d_kv + d] += s[j] / sum * v[j * I + hh * cfg.d_kv + d];
+            }
+        }
+        std::vector<float> o = linear(L.o, a, I);
+        for (size_t e = 0; e < x.size(); ++e) x[e] += o[e];
+        std::vector<float> f = linear(L.wi, rms(x, L.ff_norm), D);
+        for (auto& e : f) e = std::fmax(e, 0.0f);
+        std::vector<float> y = linear(L.wo, f, cfg.d_ff);
+        for (size_t e = 0; e < x.size(); ++e) x[e] += y[e];
+    }
+    std::vector<float> ref = linear(ref_w.proj_w, rms(x, ref_w.final_norm), D);
+    for (int i = 0; i < n; ++i)
+        for (int64_t o = 0; o < cfg.d_out; ++o) ref[i * cfg.d_out + o] += ((const float*)ref_w.proj_b->data)[o];
+
+    T5Conditioner cond{store, 1 << 20, 1};
+    auto c1 = cond.condition("lofi beat");
+    assert((int64_t)c1->size() == n * cfg.d_out);
+    float err = 0.0f;
+    for (size_t e = 0; e < ref.size(); ++e) err = std::fmax(err, std::fabs(ref[e] - (*c1)[e]));
+    printf("%s: max |ggml - reference| = %g\n", __func__, err);
+    assert(err < 1e-3f);
+
+    // the same prompt, spelled differently, comes from the cache
+    auto c2 = cond.condition("  lofi   beat\n");
+    assert(c2 == c1);
+    const auto st = cond.cache_stats();
+    assert(st.hits == 1 && st.misses == 1 && st.entries == 1);
+
+    // no description conditions as nothing, not as a lone </s>
+    assert(cond.condition("")->empty() && cond.condition(" \t\n")->empty());
+    assert(cond.cache_stats().entries == 1);
+}
+
+int main() {
+    std::mt19937 rng{42};
+    test_tokenizer();
+    test_relative_bucket();
+    test_lru_cache();
+    test_encoder(rng);
+    return 0;
+}
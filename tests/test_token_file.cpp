@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <cassert>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+#include "ggml.h"
+#include "token_file.h"
+
+using namespace encodec;
+
+static void test_code_bits() {
+    assert(code_bits(1) == 1 && code_bits(2) == 1 && code_bits(3) == 2);
+    assert(code_bits(1024) == 10 && code_bits(1025) == 11 && code_bits(2048) == 11);
+    printf("%s: ok\n", __func__);
+}
+
+// Clips written frame-major and from an encoder-style tensor read back
+// exactly, from any frame, in both layouts, at 11 bits a code.
+static void test_round_trip(std::mt19937& rng) {
+    const std::string path = std::string(P_tmpdir) + "/test_token_file.ectk";
+    TokenFileMeta meta;
+    meta.n_q         = 4;
+    meta.card        = 2048;
+    meta.sample_rate = 32000;
+    meta.frame_rate  = 50.0f;
+    meta.model_hash  = 0x0123456789ABCDEFull;
+    std::uniform_int_distribution<int32_t> tok{0, meta.card - 1};
+
+    ggml_init_params params{
+        .mem_size   = 1024 * 1024,
+        .mem_buffer = nullptr,
+        .no_alloc   = false
+    };
+    ggml_context* ctx = ggml_init(params);
+
+    const int lengths[3] = {250, 1, 777};
+    std::vector<int32_t> all; // frame-major over the whole file
+    {
+        TokenWriter w{path, meta};
+        assert(w.ok());
+        for (int c = 0; c < 3; ++c) {
+            std::vector<int32_t> clip((size_t)lengths[c] * meta.n_q);
+            for (auto& x : clip) x = tok(rng);
+            clip[0] = meta.card - 1; // all bits set
+            all.insert(all.end(), clip.begin(), clip.end());
+            if (c == 1) {
+                w.add(clip.data(), lengths[c]);
+                continue;
+            }
+            ggml_tensor* t = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, lengths[c], meta.n_q);
+            for (int f = 0; f < lengths[c]; ++f)
+                for (int k = 0; k < meta.n_q; ++k) ((int32_t*)t->data)[k * lengths[c] + f] = clip[f * meta.n_q + k];
+            w.add(t);
+        }
+        assert(w.close());
+    }
+
+    auto tf = TokenFile::open(path);
+    assert(tf && tf->n_items() == 3 && tf->n_frames() == all.size() / meta.n_q && tf->bits() == 11);
+    const TokenFileMeta m = tf->meta();
+    assert(m.n_q == 4 && m.card == 2048 && m.frame_rate == 50.0f && m.model_hash == meta.model_hash);
+    assert(tf->item(1).first_frame == 250 && tf->item(1).n_frames == 1 && tf->item(2).first_frame == 251);
+
+    std::vector<int32_t> got;
+    for (int trial = 0; trial < 50; ++trial) {
+        const uint64_t f0 = rng() % tf->n_frames();
+        const int64_t  n  = 1 + rng() % (tf->n_frames() - f0);
+        got.assign(n * meta.n_q, -1);
+        tf->read(f0, n, got.data());
+        assert(std::equal(got.begin(), got.end(), all.begin() + f0 * meta.n_q));
+
+        ggml_tensor* t = tf->read_tensor(ctx, f0, n);
+        assert(t->ne[0] == n && t->ne[1] == meta.n_q);
+        for (int64_t f = 0; f < n; ++f)
+            for (int k = 0; k < meta.n_q; ++k) assert(((int32_t*)t->data)[k * n + f] == all[(f0 + f) * meta.n_q + k]);
+        ggml_free(ctx);
+        ctx = ggml_init(params);
+    }
+
+    FILE* f = fopen(path.c_str(), "rb");
+    fseek(f, 0, SEEK_END);
+    const long size = ftell(f);
+    fclose(f);
+    printf("%s: %zu codes in %ld bytes (%.2f bits / code)\n", __func__, all.size(), size, 8.0 * size / all.size());
+    assert(size < (long)(all.size() * 4 / 2.8));
+
+    ggml_free(ctx);
+    remove(path.c_str());
+    assert(!TokenFile::open(path));
+}
+
+// A header whose frame count makes n_frames * n_q * bits wrap around to a
+// tiny payload must not pass for a valid file.
+static void test_crafted_header() {
+    const std::string path = std::string(P_tmpdir) + "/test_token_file_crafted.ectk";
+    TokenFileHeader hdr;
+    hdr.n_q          = 4;
+    hdr.bits         = 11;
+    hdr.card         = 2048;
+    hdr.n_frames     = 1ull << 62; // x 4 x 11 wraps to 0
+    hdr.index_offset = sizeof(hdr) + 8;
+    const uint8_t slack[8] = {};
+
+    FILE* f = fopen(path.c_str(), "wb");
+    assert(f);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(slack, sizeof(slack), 1, f);
+    fclose(f);
+    assert(!TokenFile::open(path));
+
+    hdr.n_frames = 0;
+    hdr.n_items  = 1ull << 60; // index far past the end
+    f = fopen(path.c_str(), "wb");
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(slack, sizeof(slack), 1, f);
+    fclose(f);
+    assert(!TokenFile::open(path));
+    remove(path.c_str());
+    printf("%s: ok\n", __func__);
+}
+
+int main() {
+    std::mt19937 rng{42};
+    test_code_bits();
+    test_round_trip(rng);
+    test_crafted_header();
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "work_stealing.h"
+
+using namespace encodec;
+
+// Everything queued on one worker still spreads over all of them, and
+// each task runs exactly once.
+static void test_stealing() {
+    const int n_workers = 4, n_tasks = 200;
+    WorkStealingQueues<int> q{n_workers, 16};
+    std::vector<std::atomic<int>> runs(n_tasks);
+    std::vector<int> per_worker(n_workers, 0);
+
+    std::vector<std::thread> workers;
+    for (int w = 0; w < n_workers; ++w) {
+        workers.emplace_back([&, w] {
+            while (auto t = q.pop(w)) {
+                ++runs[*t];
+                ++per_worker[w];
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+        });
+    }
+    for (int t = 0; t < n_tasks; ++t) assert(q.push(0, t));
+    q.close();
+    for (auto& w : workers) w.join();
+
+    for (auto& r : runs) assert(r == 1);
+    for (int w = 1; w < n_workers; ++w) assert(per_worker[w] > 0);
+    assert(q.n_steals() == (uint64_t)(n_tasks - per_worker[0]));
+    assert(!q.push(0, 0));
+    printf("%s: %llu of %d tasks stolen\n", __func__, (unsigned long long)q.n_steals(), n_tasks);
+}
+
+// push() blocks at capacity until a worker takes something.
+static void test_capacity() {
+    WorkStealingQueues<int> q{2, 3};
+    std::atomic<int> pushed{0};
+    std::thread producer([&] {
+        for (int t = 0; t < 5; ++t) {
+            q.push(t, t);
+            ++pushed;
+        }
+        q.close();
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    assert(pushed == 3);
+
+    int n = 0;
+    while (q.pop(1)) ++n;
+    producer.join();
+    assert(n == 5);
+    printf("%s: ok\n", __func__);
+}
+
+// peek() shows the next own task but leaves it in place, stealable.
+static void test_peek() {
+    WorkStealingQueues<int> q{2, 8};
+    assert(!q.peek(0));
+    q.push(0, 10);
+    q.push(0, 11);
+    assert(q.peek(0) == 10 && q.peek(0) == 10 && !q.peek(1));
+    assert(q.pop(1) == 11); // stolen from the back despite the peek
+    assert(q.pop(0) == 10 && !q.peek(0));
+    assert(q.n_steals() == 1);
+    printf("%s: ok\n", __func__);
+}
+
+int main() {
+    test_stealing();
+    test_capacity();
+    test_peek();
+    return 0;
+}
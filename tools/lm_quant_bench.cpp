@@ -0,0 +1,167 @@
+// encodec-lm_quant_bench: compares LM weight profiles (include/lm_quant.h)
+// on batch-1 decode speed and on how often they pick the same tokens.
+//
+// Loads a MusicGen LM checkpoint (or, without -m, random weights of the
+// given size) and decodes --steps steps greedily with the checkpoint's own
+// weights, for reference. Each profile then re-quantizes those weights and
+// decodes the same steps teacher-forced on the reference tokens, so every
+// step sees the same history and agreement measures the weights alone.
+// One line per profile:
+//   profile  weights_MiB  step_MiB  steps/s  speedup  agreement
+
+#include "loader.h"
+#include "lm.h"
+#include "lm_quant.h"
+#include "lm_random.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace musicgen;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct bench_params {
+    std::string              model_path;
+    std::vector<std::string> profiles  = {"f16", "q8_0", "mixed", "q5_0", "q4_0"};
+    int                      n_steps   = 256;
+    int                      n_threads = 4;
+    uint64_t                 seed      = 0;
+    LMConfig                 random;   // used without -m: MusicGen-small sizes
+};
+
+void print_usage(const char* argv0) {
+    std::fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -m, --model PATH        LM checkpoint (default: random MusicGen-small weights)\n"
+        "  -P, --profiles LIST     profiles separated by ';' (default f16;q8_0;mixed;q5_0;q4_0),\n"
+        "                          each a preset or rules such as \"emb=f16,heads=f16,ffn=q4_0\"\n"
+        "  -n, --steps N           decode steps per profile (default 256)\n"
+        "  -t, --threads N         ggml threads (default 4)\n"
+        "  -s, --seed N            seed of the random weights (default 0)\n",
+        argv0);
+}
+
+bool parse_args(int argc, char** argv, bench_params& p) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char* { return i + 1 < argc ? argv[++i] : nullptr; };
+        const char* v = nullptr;
+        if      ((arg == "-m" || arg == "--model")    && (v = next())) p.model_path = v;
+        else if ((arg == "-n" || arg == "--steps")    && (v = next())) p.n_steps = std::atoi(v);
+        else if ((arg == "-t" || arg == "--threads")  && (v = next())) p.n_threads = std::atoi(v);
+        else if ((arg == "-s" || arg == "--seed")     && (v = next())) p.seed = std::strtoull(v, nullptr, 10);
+        else if ((arg == "-P" || arg == "--profiles") && (v = next())) {
+            p.profiles.clear();
+            const std::string list = v;
+            for (std::size_t pos = 0; pos <= list.size();) {
+                std::size_t end = list.find(';', pos);
+                if (end == std::string::npos) end = list.size();
+                if (end > pos) p.profiles.push_back(list.substr(pos, end - pos));
+                pos = end + 1;
+            }
+        }
+        else return false;
+    }
+    return p.n_steps > 1 && p.n_threads > 0;
+}
+
+
+struct Run {
+    std::vector<int32_t> tokens;  // n_steps x n_q greedy picks
+    double               seconds = 0.0;
+};
+
+// Greedy batch-1 decode. With `forced`, step t is fed forced[t - 1]
+// instead of the run's own pick.
+Run decode(const std::shared_ptr<const LMStore>& store, int n_steps, int n_threads,
+           const std::vector<int32_t>* forced) {
+    const LM        lm{store};
+    const LMConfig& cfg = lm.config();
+    KVCache cache = lm.make_cache(n_steps);
+    std::vector<int32_t> in(cfg.n_q, cfg.card); // the special start token
+    std::vector<LMSeq> one{{0, 1, in.data()}};
+    ExecState state{lm.arena_size(cache, one, n_threads)};
+
+    Run r;
+    r.tokens.resize((std::size_t)n_steps * cfg.n_q);
+    for (int t = 0; t < n_steps; ++t) {
+        if (t > 0) {
+            const int32_t* prev = (forced ? forced->data() : r.tokens.data()) + (std::size_t)(t - 1) * cfg.n_q;
+            std::copy(prev, prev + cfg.n_q, in.begin());
+        }
+        state.reset();
+        const auto t0 = Clock::now();
+        ggml_tensor* logits = lm.forward(state, cache, one, n_threads);
+        if (t > 0) r.seconds += std::chrono::duration<double>(Clock::now() - t0).count(); // step 0 warms up
+        for (int k = 0; k < cfg.n_q; ++k) {
+            const float* l = (const float*)((const char*)logits->data + k * logits->nb[1]);
+            r.tokens[(std::size_t)t * cfg.n_q + k] = (int32_t)(std::max_element(l, l + cfg.card) - l);
+        }
+    }
+    return r;
+}
+
+}
+
+int main(int argc, char** argv) {
+    bench_params params;
+    if (!parse_args(argc, argv, params)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::shared_ptr<const LMStore> base;
+    if (!params.model_path.empty()) {
+        encodec_model model{};
+        LMConfig      cfg;
+        LMWeights     weights;
+        if (!encodec_model_load(params.model_path, model, ENCODEC_SUB_LM) || !musicgen_lm_weights(model, cfg, weights)) {
+            return 1;
+        }
+        base = std::make_shared<const LMStore>(model.ctx, cfg, std::move(weights));
+    } else {
+        params.random.n_q     = 4;
+        params.random.card    = 2048;
+        params.random.d_model = 1024;
+        params.random.n_head  = 16;
+        params.random.n_layer = 24;
+        params.random.d_ff    = 4096;
+        if (!(base = random_lm_weights(params.random, params.seed))) return 1;
+    }
+
+    const Run ref = decode(base, params.n_steps, params.n_threads, nullptr);
+    const double ref_rate = (params.n_steps - 1) / ref.seconds;
+
+    const double MiB = 1024.0 * 1024.0;
+    std::printf("%-40s %11s %8s %8s %7s %9s\n", "profile", "weights_MiB", "step_MiB", "steps/s", "speedup", "agreement");
+    std::printf("%-40s %11.1f %8.1f %8.2f %6.2fx %9.4f\n", "(checkpoint)",
+                base->usage().used / MiB, lm_step_bytes(*base) / MiB, ref_rate, 1.0, 1.0);
+
+    for (const std::string& spec : params.profiles) {
+        LMQuantProfile profile;
+        if (!lm_quant_parse_profile(spec, profile)) return 1;
+        auto store = lm_quantize(*base, profile);
+        if (!store) {
+            std::fprintf(stderr, "%s: profile '%s': quantization failed\n", __func__, spec.c_str());
+            return 1;
+        }
+        const Run run = decode(store, params.n_steps, params.n_threads, &ref.tokens);
+        std::size_t same = 0;
+        for (std::size_t i = 0; i < ref.tokens.size(); ++i) same += run.tokens[i] == ref.tokens[i];
+        const double rate = (params.n_steps - 1) / run.seconds;
+        std::printf("%-40s %11.1f %8.1f %8.2f %6.2fx %9.4f\n", spec.c_str(),
+                    store->usage().used / MiB, lm_step_bytes(*store) / MiB, rate, rate / ref_rate,
+                    (double)same / ref.tokens.size());
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+// encodec-longform_bench: times long-form LM generation window by window,
+// to check that decode speed stays flat however long the output gets.
+//
+// Loads a MusicGen LM checkpoint (or, without -m, random weights of the
+// given size), generates --seconds of codes with an empty conditioning and
+// prints one line per window plus the overall rate:
+//   window  frames  steps  seconds  steps/s
+
+#include "loader.h"
+#include "lm.h"
+#include "lm_quant.h"
+#include "lm_random.h"
+#include "long_form.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
+
+using namespace musicgen;
+
+namespace {
+
+struct bench_params {
+    std::string model_path;
+    float       seconds    = 300.0f;
+    float       frame_rate = 50.0f;
+    float       window_s   = 30.0f;
+    float       overlap_s  = 12.0f;
+    bool        guided     = true;
+    int         n_threads  = 4;
+    uint64_t    seed       = 0;
+    std::string profile;   // lm_quant.h; empty: weights as loaded
+    LMConfig    random;    // used without -m: MusicGen-small sizes
+};
+
+void print_usage(const char* argv0) {
+    std::fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -m, --model PATH        LM checkpoint (default: random MusicGen-small weights)\n"
+        "  -d, --seconds S         audio to generate (default 300)\n"
+        "  -r, --frame-rate HZ     code frames per second (default 50)\n"
+        "  -W, --window S          LM window (default 30)\n"
+        "  -O, --overlap S         tail re-primed into each window (default 12)\n"
+        "  -t, --threads N         ggml threads (default 4)\n"
+        "  -s, --seed N            sampling seed (default 0)\n"
+        "  -P, --profile SPEC      quantize the weights first, e.g. mixed (see lm_quant.h)\n"
+        "      --no-cfg            skip classifier-free guidance\n",
+        argv0);
+}
+
+bool parse_args(int argc, char** argv, bench_params& p) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char* { return i + 1 < argc ? argv[++i] : nullptr; };
+        const char* v = nullptr;
+        if      ((arg == "-m" || arg == "--model")      && (v = next())) p.model_path = v;
+        else if ((arg == "-d" || arg == "--seconds")    && (v = next())) p.seconds = std::atof(v);
+        else if ((arg == "-r" || arg == "--frame-rate") && (v = next())) p.frame_rate = std::atof(v);
+        else if ((arg == "-W" || arg == "--window")     && (v = next())) p.window_s = std::atof(v);
+        else if ((arg == "-O" || arg == "--overlap")    && (v = next())) p.overlap_s = std::atof(v);
+        else if ((arg == "-t" || arg == "--threads")    && (v = next())) p.n_threads = std::atoi(v);
+        else if ((arg == "-s" || arg == "--seed")       && (v = next())) p.seed = std::strtoull(v, nullptr, 10);
+        else if ((arg == "-P" || arg == "--profile")    && (v = next())) p.profile = v;
+        else if (arg == "--no-cfg") p.guided = false;
+        else return false;
+    }
+    return p.seconds > 0 && p.frame_rate > 0 && p.window_s > 0 && p.overlap_s < p.window_s;
+}
+
+
+}
+
+int main(int argc, char** argv) {
+    bench_params params;
+    if (!parse_args(argc, argv, params)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::shared_ptr<const LMStore> store;
+    if (!params.model_path.empty()) {
+        encodec_model model{};
+        LMConfig      cfg;
+        LMWeights     weights;
+        if (!encodec_model_load(params.model_path, model, ENCODEC_SUB_LM) || !musicgen_lm_weights(model, cfg, weights)) {
+            return 1;
+        }
+        store = std::make_shared<const LMStore>(model.ctx, cfg, std::move(weights));
+    } else {
+        params.random.n_q     = 4;
+        params.random.card    = 2048;
+        params.random.d_model = 1024;
+        params.random.n_head  = 16;
+        params.random.n_layer = 24;
+        params.random.d_ff    = 4096;
+        if (!(store = random_lm_weights(params.random, params.seed))) return 1;
+    }
+    if (!params.profile.empty()) {
+        LMQuantProfile profile;
+        if (!lm_quant_parse_profile(params.profile, profile) || !(store = lm_quantize(*store, profile))) return 1;
+        std::fprintf(stderr, "profile %s: %.1f MiB of weights read per step\n", params.profile.c_str(),
+                     lm_step_bytes(*store) / (1024.0 * 1024.0));
+    }
+
+    LongFormConfig lc;
+    lc.window          = (int)(params.window_s * params.frame_rate);
+    lc.overlap         = (int)(params.overlap_s * params.frame_rate);
+    lc.sched.n_cond    = 1;
+    lc.sched.guided    = params.guided;
+    lc.sched.n_threads = params.n_threads;
+    LongFormGenerator gen{store, lc};
+
+    GenRequest req;
+    req.n_frames = (int)(params.seconds * params.frame_rate);
+    req.seed     = params.seed;
+
+    const auto t0 = encodec::Clock::now();
+    GenResult r = gen.generate(req);
+    const double total = std::chrono::duration<double>(encodec::Clock::now() - t0).count();
+    if (!r.ok) {
+        std::fprintf(stderr, "%s: generation failed\n", __func__);
+        return 1;
+    }
+
+    std::printf("%6s %7s %6s %8s %8s\n", "window", "frames", "steps", "seconds", "steps/s");
+    int n_steps = 0;
+    for (std::size_t w = 0; w < gen.windows().size(); ++w) {
+        const LongFormWindow& win = gen.windows()[w];
+        std::printf("%6zu %7d %6d %8.2f %8.2f\n", w, win.n_new, win.n_steps, win.seconds,
+                    win.n_steps / win.seconds);
+        n_steps += win.n_steps;
+    }
+    std::printf("total: %d frames (%.1f s of audio) in %.2f s, %.2f steps/s, %.2fx real time\n",
+                r.n_frames, r.n_frames / params.frame_rate, total, n_steps / total,
+                (r.n_frames / params.frame_rate) / total);
+    return 0;
+}
@@ -0,0 +1,206 @@
+// encodec-rvq_bench: measures the approximate codebook search of
+// rvq_search.h against the path it replaces, over a grid of --probe and
+// --margin settings.
+//
+// Encodes --seconds of a WAV file with a checkpoint's encoder. The hidden
+// states the LSTM produces are quantized once by quantizer_encode (the ggml
+// GEMM + argmax the encoder runs without an index), which gives the
+// reference codes, and then by the search at each setting, on the same
+// --threads. The whole encoder is timed with and without the index too,
+// since that is what tokenization sees. One line per setting:
+//   probe  margin  code_agree  frame_agree  scanned  fallback  vq_ms  vq_speedup  encode_ms  encode_speedup
+
+#include "audio_io.h"
+#include "encoder.h"
+#include "exec_state.h"
+#include "loader.h"
+#include "rvq_search.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace encodec;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct bench_params {
+    std::string        model_path;
+    std::string        wav_path;
+    int                sample_rate = 32000;
+    float              seconds     = 30.0f;
+    int                n_threads   = 4;
+    int                n_repeat    = 3; // timed runs per measurement, best kept
+    std::vector<int>   probes      = {1, 2, 4, 8};
+    std::vector<float> margins     = {0.0f, 0.25f, 0.5f, 0.75f, 1.0f};
+};
+
+void print_usage(const char* argv0) {
+    std::fprintf(stderr,
+        "usage: %s -m MODEL -i WAV [options]\n"
+        "  -m, --model PATH        checkpoint with the encoder and quantizer\n"
+        "  -i, --input PATH        audio to encode\n"
+        "  -r, --sample-rate HZ    model sample rate (default 32000)\n"
+        "  -d, --seconds S         audio used from the start of the file (default 30)\n"
+        "  -t, --threads N         ggml threads (default 4)\n"
+        "  -n, --repeat N          timed runs per measurement, best kept (default 3)\n"
+        "  -p, --probe LIST        clusters always searched, e.g. 1,2,4,8\n"
+        "  -M, --margin LIST       fallback margins, e.g. 0,0.5,1\n",
+        argv0);
+}
+
+template <typename T>
+std::vector<T> parse_list(const char* s) {
+    std::vector<T> out;
+    std::stringstream ss(s);
+    for (std::string item; std::getline(ss, item, ',');) {
+        if (!item.empty()) out.push_back((T)std::atof(item.c_str()));
+    }
+    return out;
+}
+
+bool parse_args(int argc, char** argv, bench_params& p) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char* { return i + 1 < argc ? argv[++i] : nullptr; };
+        const char* v = nullptr;
+        if      ((arg == "-m" || arg == "--model")       && (v = next())) p.model_path = v;
+        else if ((arg == "-i" || arg == "--input")       && (v = next())) p.wav_path = v;
+        else if ((arg == "-r" || arg == "--sample-rate") && (v = next())) p.sample_rate = std::atoi(v);
+        else if ((arg == "-d" || arg == "--seconds")     && (v = next())) p.seconds = std::atof(v);
+        else if ((arg == "-t" || arg == "--threads")     && (v = next())) p.n_threads = std::atoi(v);
+        else if ((arg == "-n" || arg == "--repeat")      && (v = next())) p.n_repeat = std::atoi(v);
+        else if ((arg == "-p" || arg == "--probe")       && (v = next())) p.probes = parse_list<int>(v);
+        else if ((arg == "-M" || arg == "--margin")      && (v = next())) p.margins = parse_list<float>(v);
+        else return false;
+    }
+    return !p.model_path.empty() && !p.wav_path.empty() && p.sample_rate > 0 && p.seconds > 0.0f &&
+           p.n_threads > 0 && p.n_repeat > 0 && !p.probes.empty() && !p.margins.empty();
+}
+
+// Up to n samples of the file at `sample_rate`, mono.
+std::vector<float> read_audio(const WavFile& wav, int sample_rate, int64_t n) {
+    AudioReader reader{wav, sample_rate};
+    std::vector<float> out;
+    std::vector<float> chunk((std::size_t)reader.max_chunk());
+    for (int64_t got; (int64_t)out.size() < n && (got = reader.read(chunk.data())) > 0;) {
+        out.insert(out.end(), chunk.begin(), chunk.begin() + std::min(got, n - (int64_t)out.size()));
+    }
+    return out;
+}
+
+// Best of n_repeat runs of `run`, in milliseconds.
+template <typename Run>
+double best_ms(int n_repeat, Run run) {
+    double best = 1e300;
+    for (int i = 0; i < n_repeat; ++i) {
+        const auto t0 = Clock::now();
+        run();
+        best = std::min(best, std::chrono::duration<double, std::milli>(Clock::now() - t0).count());
+    }
+    return best;
+}
+
+}
+
+int main(int argc, char** argv) {
+    bench_params params;
+    if (!parse_args(argc, argv, params)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    auto loader = ModelLoader::open(params.model_path);
+    auto store  = loader ? loader->encoder() : nullptr;
+    auto wav    = WavFile::open(params.wav_path);
+    if (!store || !wav) return 1;
+
+    const std::vector<float> audio = read_audio(*wav, params.sample_rate, (int64_t)(params.seconds * params.sample_rate));
+    const int64_t n = (int64_t)audio.size();
+    if (n == 0) {
+        std::fprintf(stderr, "%s: '%s' has no samples\n", __func__, params.wav_path.c_str());
+        return 1;
+    }
+    const int nt = params.n_threads;
+
+    const Encoder gemm{store};
+    const std::size_t arena = gemm.arena_size(n, 1, nt);
+    ExecState state{arena};
+    auto encode = [&](const Encoder& enc) {
+        state.reset();
+        Tensor* input = ggml_new_tensor_3d(state.ctx(), GGML_TYPE_F32, n, 1, 1);
+        std::memcpy(input->data, audio.data(), audio.size() * sizeof(float));
+        return enc(state, input, nt);
+    };
+
+    // hidden states, kept in their own state for every quantize() below
+    ExecState hs_state{arena};
+    Tensor* hs_in = ggml_new_tensor_3d(hs_state.ctx(), GGML_TYPE_F32, n, 1, 1);
+    std::memcpy(hs_in->data, audio.data(), audio.size() * sizeof(float));
+    Tensor* hs = gemm.hidden_states(hs_state, hs_in, nt);
+    const int64_t T = hs->ne[1];
+    const int     n_q = (int)store->weights().codebooks.size();
+
+    // reference: the GEMM search the encoder runs without an index
+    std::vector<int32_t> ref((std::size_t)T * n_q);
+    const double gemm_vq_ms = best_ms(params.n_repeat, [&] {
+        state.reset();
+        Tensor* codes = gemm.quantize(state, hs, nt); // [T, n_q, 1]
+        std::memcpy(ref.data(), codes->data, ref.size() * sizeof(int32_t));
+    });
+    const double gemm_enc_ms = best_ms(params.n_repeat, [&] { (void)encode(gemm); });
+
+    std::fprintf(stderr, "%.1f s of audio: %lld frames x %lld dims, %d stages x %lld codewords, %d threads\n",
+                 (double)n / params.sample_rate, (long long)T, (long long)hs->ne[0], n_q,
+                 (long long)store->weights().codebooks[0].embed->ne[1], nt);
+    std::printf("probe  margin  code_agree  frame_agree  scanned  fallback     vq_ms  vq_speedup  encode_ms  encode_speedup\n");
+    std::printf(" gemm       -      1.0000       1.0000    1.000     0.000  %8.2f       1.00x  %9.1f           1.00x\n",
+                gemm_vq_ms, gemm_enc_ms);
+
+    quantizer quant;
+    for (const auto& cb : store->weights().codebooks) quant.blocks.push_back({cb.embed});
+    std::vector<int32_t> codes((std::size_t)T * n_q);
+    for (int probe : params.probes) {
+        for (float margin : params.margins) {
+            RvqSearchConfig cfg;
+            cfg.n_probe = probe;
+            cfg.margin  = margin;
+            auto rvq = RvqIndex::build(quant, cfg);
+            const Encoder approx{store, rvq};
+            state.reserve(approx.arena_size(n, 1, nt));
+
+            const double vq_ms = best_ms(params.n_repeat, [&] {
+                state.reset();
+                Tensor* c = approx.quantize(state, hs, nt);
+                std::memcpy(codes.data(), c->data, codes.size() * sizeof(int32_t));
+            });
+            const RvqSearchStats st = rvq->stats(); // before the full encodes add to it
+            const double enc_ms = best_ms(params.n_repeat, [&] { (void)encode(approx); });
+
+            int64_t code_agree = 0, frame_agree = 0;
+            for (int64_t t = 0; t < T; ++t) {
+                int same = 0;
+                for (int k = 0; k < n_q; ++k) same += codes[(std::size_t)k * T + t] == ref[(std::size_t)k * T + t];
+                code_agree  += same;
+                frame_agree += same == n_q;
+            }
+            std::printf("%5d  %6.2f  %10.4f  %11.4f  %7.3f  %8.3f  %8.2f  %9.2fx  %9.1f  %13.2fx\n",
+                        probe, margin,
+                        (double)code_agree / ((double)T * n_q), (double)frame_agree / T,
+                        (double)st.n_scanned / (double)st.n_total,
+                        (double)st.n_fallback / (double)st.n_searches,
+                        vq_ms, gemm_vq_ms / vq_ms, enc_ms, gemm_enc_ms / enc_ms);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,553 @@
+// encodec-server: loads the model once and serves encode/decode requests over
+// a Unix socket, grouping concurrent requests into dynamic batches.
+//
+// Wire format (little-endian, one request/response pair at a time per
+// connection):
+//   request : u32 magic 'ECRQ' | u32 op | u32 n0 | u32 n1 | payload
+//     op 1 encode : n0 = samples, payload = n0 f32 (mono, model rate)
+//     op 2 decode : n0 = frames T, n1 = n_q, payload = n_q x T i32 codes
+//     op 3 stats  : no payload
+//   response: u32 status (0 = ok) | u32 n0 | u32 n1 | payload
+//     encode : n0 = frames T, n1 = n_q, payload = n_q x T i32 codes
+//     decode : n0 = frames T, n1 = D,   payload = T x D f32 latents
+//     stats  : n0 = bytes,              payload = text counters
+// A request over --max-samples / --max-frames, or with n1 != n_q, gets
+// status 1 and the connection is closed (its payload is not read); one with
+// a code outside its codebook gets status 1 and the connection stays open.
+
+#include "batcher.h"
+#include "encoder.h"
+#include "exec_state.h"
+#include "loader.h"
+#include "numa.h"
+#include "quantizer.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace encodec;
+
+namespace {
+
+constexpr uint32_t kMagic = 0x51524345; // "ECRQ"
+
+enum Op : uint32_t { OP_ENCODE = 1, OP_DECODE = 2, OP_STATS = 3 };
+
+// What a server instance serves; a decode-only server loads the quantizer
+// codebooks and nothing else.
+enum Role { ROLE_ALL, ROLE_ENCODE, ROLE_DECODE };
+
+struct server_params {
+    std::string model_path;
+    std::string socket_path = "/tmp/encodec.sock";
+    int         n_workers   = 2;
+    int         n_threads   = 4;
+    Role        role        = ROLE_ALL;
+    NumaMode    numa        = NumaMode::Off;
+    int         numa_nodes  = 0; // > 0: simulate this many nodes
+    uint32_t    max_samples = 24000 * 600; // per encode request: 10 min at 24 kHz
+    uint32_t    max_frames  = 75 * 600;    // per decode request
+    BatcherConfig batching;
+};
+
+struct Reply {
+    uint32_t             status = 0;
+    uint32_t             n0     = 0;
+    uint32_t             n1     = 0;
+    std::vector<uint8_t> payload;
+};
+
+struct Job {
+    Op                   op;
+    uint32_t             n0, n1;
+    std::vector<uint8_t> payload;
+    Clock::time_point    t0;
+    std::promise<Reply>  done;
+};
+
+using JobPtr = std::unique_ptr<Job>;
+
+std::atomic<bool> g_stop{false};
+int               g_listen_fd = -1;
+
+bool read_full(int fd, void* buf, std::size_t n) {
+    auto* p = static_cast<uint8_t*>(buf);
+    while (n > 0) {
+        const ssize_t r = ::read(fd, p, n);
+        if (r <= 0) return false;
+        p += r;
+        n -= (std::size_t)r;
+    }
+    return true;
+}
+
+bool write_full(int fd, const void* buf, std::size_t n) {
+    auto* p = static_cast<const uint8_t*>(buf);
+    while (n > 0) {
+        const ssize_t r = ::write(fd, p, n);
+        if (r <= 0) return false;
+        p += r;
+        n -= (std::size_t)r;
+    }
+    return true;
+}
+
+// Requests only share a batch when they have the same op and shape.
+DynamicBatcher<JobPtr>::Key batch_key(const Job& job) {
+    return ((uint64_t)job.op << 56) | ((uint64_t)job.n1 << 32) | (job.op == OP_ENCODE ? job.n0 : 0);
+}
+
+// The workers of one NUMA node, with their own queue and the weights they
+// read. Without NUMA mode there is a single pool.
+struct NodePool {
+    NodePool(int node, const BatcherConfig& batching, std::shared_ptr<const WeightStore> store,
+             std::shared_ptr<const QuantizerStore> codebooks)
+        : node{node}, store{store}, codebooks{codebooks}, encoder{store}, batcher{batching} {
+        for (const auto& cb : store ? store->weights().codebooks : codebooks->codebooks()) {
+            quant.blocks.push_back({cb.embed});
+        }
+    }
+
+    int                                   node;
+    std::shared_ptr<const WeightStore>    store;     // null when decode-only
+    std::shared_ptr<const QuantizerStore> codebooks; // only needed without `store`
+    Encoder                               encoder;
+    quantizer                             quant;
+    DynamicBatcher<JobPtr>                batcher;
+};
+
+class Server {
+public:
+    // One pool per entry of `stores` / `codebooks` (indexed by node).
+    Server(const server_params& params, const NumaTopology& topo,
+           const std::vector<std::shared_ptr<const WeightStore>>& stores,
+           const std::vector<std::shared_ptr<const QuantizerStore>>& codebooks)
+        : params_{params}, topo_{topo}, stats_{params.batching.max_batch} {
+        for (std::size_t i = 0; i < std::max(stores.size(), codebooks.size()); ++i) {
+            pools_.push_back(std::make_unique<NodePool>(
+                (int)i, params.batching, i < stores.size() ? stores[i] : nullptr,
+                i < codebooks.size() ? codebooks[i] : nullptr));
+        }
+    }
+
+    // Workers are spread over the pools, at least one each; in NUMA mode a
+    // worker and its ggml threads run on its node's CPUs.
+    void start() {
+        const int n_pools = (int)pools_.size();
+        for (int p = 0; p < n_pools; ++p) {
+            const int n = std::max(params_.n_workers / n_pools + (p < params_.n_workers % n_pools), 1);
+            for (int i = 0; i < n; ++i) {
+                workers_.emplace_back([this, p] {
+                    if (params_.numa != NumaMode::Off) numa_pin_thread(topo_.node(pools_[p]->node));
+                    worker_loop(*pools_[p]);
+                });
+            }
+        }
+    }
+
+    // Connections are shut down first, so the requests they have in flight
+    // still find the workers running, then the workers stop.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock{conn_mu_};
+            for (auto& c : conns_) {
+                if (c.fd >= 0) ::shutdown(c.fd, SHUT_RDWR);
+            }
+        }
+        for (auto& c : conns_) c.thread.join();
+        conns_.clear();
+
+        for (auto& pool : pools_) pool->batcher.close();
+        for (auto& t : workers_) t.join();
+        workers_.clear();
+    }
+
+    // Serves `fd` on its own thread until the client hangs up or stop().
+    void accept_connection(int fd) {
+        std::lock_guard<std::mutex> lock{conn_mu_};
+        for (auto it = conns_.begin(); it != conns_.end();) {
+            if (!it->done) {
+                ++it;
+                continue;
+            }
+            it->thread.join();
+            it = conns_.erase(it);
+        }
+        Connection& c = conns_.emplace_back();
+        c.fd = fd;
+        c.thread = std::thread([this, &c] {
+            serve_connection(c.fd);
+            std::lock_guard<std::mutex> lock{conn_mu_};
+            ::close(c.fd);
+            c.fd   = -1;
+            c.done = true;
+        });
+    }
+
+private:
+    struct Connection {
+        int         fd   = -1;
+        bool        done = false; // guarded by conn_mu_
+        std::thread thread;
+    };
+
+    void serve_connection(int fd) {
+        for (;;) {
+            uint32_t hdr[4];
+            if (!read_full(fd, hdr, sizeof(hdr)) || hdr[0] != kMagic) break;
+
+            Reply reply;
+            bool  drop = false;
+            if (hdr[1] == OP_STATS) {
+                reply = stats_reply();
+            } else if (hdr[1] == OP_ENCODE || hdr[1] == OP_DECODE) {
+                auto job = std::make_unique<Job>();
+                job->op = (Op)hdr[1];
+                job->n0 = hdr[2];
+                job->n1 = hdr[3];
+                if (!shape_ok(*job)) {
+                    // the payload size is not to be trusted: answer and hang up
+                    reply.status = 1;
+                    drop = true;
+                } else {
+                    const std::size_t n = job->op == OP_ENCODE
+                        ? (std::size_t)job->n0 * sizeof(float)
+                        : (std::size_t)job->n0 * job->n1 * sizeof(int32_t);
+                    job->payload.resize(n);
+                    if (!read_full(fd, job->payload.data(), n)) break;
+                }
+
+                if (drop || !serves(job->op) || (job->op == OP_DECODE && !codes_ok(*job))) {
+                    reply.status = 1;
+                } else {
+                    job->t0 = Clock::now();
+                    auto fut = job->done.get_future();
+                    const auto key = batch_key(*job);
+                    pick_pool().batcher.push(std::move(job), key);
+                    reply = fut.get();
+                }
+            } else {
+                break;
+            }
+
+            const uint32_t rhdr[3] = {reply.status, reply.n0, reply.n1};
+            if (!write_full(fd, rhdr, sizeof(rhdr)) ||
+                !write_full(fd, reply.payload.data(), reply.payload.size()) || drop) {
+                break;
+            }
+        }
+    }
+
+    bool serves(Op op) const {
+        return params_.role == ROLE_ALL || params_.role == (op == OP_ENCODE ? ROLE_ENCODE : ROLE_DECODE);
+    }
+
+    // Bounds the payload, and with it the arena a batch of such requests
+    // needs.
+    bool shape_ok(const Job& job) const {
+        if (job.n0 == 0) return false;
+        if (job.op == OP_ENCODE) return job.n0 <= params_.max_samples;
+        return job.n0 <= params_.max_frames && job.n1 == pools_[0]->quant.blocks.size();
+    }
+
+    // Every code must index a row of its codebook for quantizer_decode.
+    bool codes_ok(const Job& job) const {
+        const auto* codes = (const int32_t*)job.payload.data();
+        for (uint32_t q = 0; q < job.n1; ++q) {
+            const int64_t K = pools_[0]->quant.blocks[q].embed->ne[1];
+            for (uint32_t t = 0; t < job.n0; ++t) {
+                const int32_t c = codes[(std::size_t)q * job.n0 + t];
+                if (c < 0 || c >= K) return false;
+            }
+        }
+        return true;
+    }
+
+    // The pool with the shortest queue; a busy node sheds work to the others.
+    NodePool& pick_pool() {
+        NodePool*   best  = nullptr;
+        std::size_t depth = 0;
+        const std::size_t start = next_pool_++;
+        for (std::size_t i = 0; i < pools_.size(); ++i) {
+            NodePool& pool = *pools_[(start + i) % pools_.size()];
+            const std::size_t d = pool.batcher.depth();
+            if (!best || d < depth) {
+                best  = &pool;
+                depth = d;
+            }
+        }
+        return *best;
+    }
+
+    void worker_loop(NodePool& pool) {
+        // Arenas start small and grow to the measured size of the largest
+        // batch this worker has seen.
+        ExecState state{1024 * 1024};
+        std::size_t seen_arena = 0;
+        for (;;) {
+            auto batch = pool.batcher.next_batch();
+            if (batch.empty()) return;
+
+            stats_.record_batch(batch.size());
+            state.reset();
+            if (batch[0]->op == OP_ENCODE) {
+                run_encode(pool, state, batch);
+            } else {
+                run_decode(pool, state, batch);
+            }
+            for (auto& job : batch) {
+                stats_.record_latency(Clock::now() - job->t0);
+            }
+
+            const std::size_t arena = state.arena_size();
+            if (arena > seen_arena) {
+                arena_bytes_ += arena - seen_arena;
+                seen_arena = arena;
+            }
+        }
+    }
+
+    // Same-length requests stacked along the batch dim: (T, 1, B).
+    void run_encode(NodePool& pool, ExecState& state, std::vector<JobPtr>& batch) {
+        const int64_t B = (int64_t)batch.size();
+        const int64_t T = batch[0]->n0;
+
+        state.reserve(pool.encoder.arena_size(T, B, params_.n_threads));
+        Tensor* input = ggml_new_tensor_3d(state.ctx(), GGML_TYPE_F32, T, 1, B);
+        for (int64_t b = 0; b < B; ++b) {
+            std::memcpy((char*)input->data + b * input->nb[2], batch[b]->payload.data(), T * sizeof(float));
+        }
+
+        Tensor* codes = pool.encoder(state, input, params_.n_threads); // [T', n_q, B]
+        for (int64_t b = 0; b < B; ++b) {
+            Reply r;
+            r.n0 = (uint32_t)codes->ne[0];
+            r.n1 = (uint32_t)codes->ne[1];
+            r.payload.resize(codes->nb[2]);
+            std::memcpy(r.payload.data(), (char*)codes->data + b * codes->nb[2], codes->nb[2]);
+            batch[b]->done.set_value(std::move(r));
+        }
+    }
+
+    // Decoding is frame-wise, so requests are concatenated along time and
+    // looked up in one pass, whatever their lengths.
+    void run_decode(NodePool& pool, ExecState& state, std::vector<JobPtr>& batch) {
+        const int64_t n_q = batch[0]->n1;
+        int64_t total = 0;
+        for (auto& job : batch) total += job->n0;
+
+        {
+            ExecState m = ExecState::measuring();
+            Tensor* c = ggml_new_tensor_2d(m.ctx(), GGML_TYPE_I32, total, n_q);
+            ggml_build_forward_expand(m.new_graph(), quantizer_decode(&pool.quant, m.ctx(), c));
+            state.reserve(m.required_size(params_.n_threads));
+        }
+
+        Tensor* codes = ggml_new_tensor_2d(state.ctx(), GGML_TYPE_I32, total, n_q);
+        for (int64_t q = 0, off = 0; q < n_q; ++q, off = 0) {
+            for (auto& job : batch) {
+                std::memcpy((char*)codes->data + q * codes->nb[1] + off * sizeof(int32_t),
+                            job->payload.data() + q * job->n0 * sizeof(int32_t),
+                            job->n0 * sizeof(int32_t));
+                off += job->n0;
+            }
+        }
+
+        Tensor* latents = quantizer_decode(&pool.quant, state.ctx(), codes); // [D, total]
+        ggml_build_forward_expand(state.new_graph(), latents);
+        state.compute(params_.n_threads);
+
+        int64_t off = 0;
+        for (auto& job : batch) {
+            Reply r;
+            r.n0 = job->n0;
+            r.n1 = (uint32_t)latents->ne[0];
+            r.payload.resize(job->n0 * latents->nb[1]);
+            std::memcpy(r.payload.data(), (char*)latents->data + off * latents->nb[1], r.payload.size());
+            off += job->n0;
+            job->done.set_value(std::move(r));
+        }
+    }
+
+    Reply stats_reply() const {
+        const auto s = stats_.snapshot();
+        std::string text;
+        std::size_t depth = 0;
+        std::string node_depths;
+        for (const auto& pool : pools_) {
+            depth += pool->batcher.depth();
+            node_depths += " " + std::to_string(pool->batcher.depth());
+        }
+        text += "queue_depth " + std::to_string(depth) + "\n";
+        text += "node_queue_depth" + node_depths + "\n";
+        text += "requests "    + std::to_string(s.n_requests) + "\n";
+        text += "batches "     + std::to_string(s.n_batches) + "\n";
+        text += "latency_p50_ms " + std::to_string(s.p50_ms) + "\n";
+        text += "latency_p99_ms " + std::to_string(s.p99_ms) + "\n";
+        // replicas count once per node, a shared store once
+        std::size_t weights = 0;
+        const void* last    = nullptr;
+        for (const auto& pool : pools_) {
+            const void* w = pool->store ? (const void*)pool->store.get() : (const void*)pool->codebooks.get();
+            if (w == last) continue;
+            weights += pool->store ? pool->store->usage().used : pool->codebooks->usage().used;
+            last = w;
+        }
+        text += "weights_bytes " + std::to_string(weights) + "\n";
+        text += "arena_bytes "   + std::to_string(arena_bytes_.load()) + "\n";
+        text += "batch_size_hist";
+        for (std::size_t n = 1; n < s.batch_hist.size(); ++n) {
+            text += " " + std::to_string(n) + ":" + std::to_string(s.batch_hist[n]);
+        }
+        text += "\n";
+
+        Reply r;
+        r.n0 = (uint32_t)text.size();
+        r.payload.assign(text.begin(), text.end());
+        return r;
+    }
+
+    server_params                          params_;
+    NumaTopology                           topo_;
+    std::vector<std::unique_ptr<NodePool>> pools_;
+    std::atomic<std::size_t>               next_pool_{0};
+    BatchStats                             stats_;
+    std::vector<std::thread>               workers_;
+    std::atomic<std::size_t>               arena_bytes_{0}; // sum over workers
+    std::mutex                             conn_mu_;
+    std::list<Connection>                  conns_;          // stable addresses for their threads
+};
+
+void print_usage(const char* argv0) {
+    std::fprintf(stderr,
+        "usage: %s -m MODEL [options]\n"
+        "  -m, --model PATH        checkpoint from scripts/convert_state_dict_to_gguf.py\n"
+        "  -s, --socket PATH       Unix socket to listen on (default /tmp/encodec.sock)\n"
+        "  -w, --workers N         concurrent batch workers (default 2)\n"
+        "  -t, --threads N         ggml threads per worker (default 4)\n"
+        "  -b, --max-batch N       max requests per batch (default 8)\n"
+        "  -W, --max-wait-ms MS    max time a request waits for a batch (default 2)\n"
+        "      --max-samples N     longest encode request, in samples (default 14400000)\n"
+        "      --max-frames N      longest decode request, in frames (default 45000)\n"
+        "  -r, --role ROLE         all, encode or decode; loads only what ROLE runs (default all)\n"
+        "      --numa MODE         off, replicate (weights per node) or interleave (default off);\n"
+        "                          on, each node gets its own pinned workers and queue\n"
+        "      --numa-nodes N      simulate N nodes by splitting the CPUs (testing)\n",
+        argv0);
+}
+
+bool parse_args(int argc, char** argv, server_params& p) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char* { return i + 1 < argc ? argv[++i] : nullptr; };
+        const char* v = nullptr;
+        if      ((arg == "-m" || arg == "--model")       && (v = next())) p.model_path = v;
+        else if ((arg == "-s" || arg == "--socket")      && (v = next())) p.socket_path = v;
+        else if ((arg == "-w" || arg == "--workers")     && (v = next())) p.n_workers = std::atoi(v);
+        else if ((arg == "-t" || arg == "--threads")     && (v = next())) p.n_threads = std::atoi(v);
+        else if ((arg == "-b" || arg == "--max-batch")   && (v = next())) p.batching.max_batch = std::strtoul(v, nullptr, 10);
+        else if ((arg == "-W" || arg == "--max-wait-ms") && (v = next())) p.batching.max_wait = std::chrono::microseconds((int64_t)(std::atof(v) * 1000));
+        else if ((arg == "-r" || arg == "--role")        && (v = next())) {
+            const std::string role = v;
+            if      (role == "all")    p.role = ROLE_ALL;
+            else if (role == "encode") p.role = ROLE_ENCODE;
+            else if (role == "decode") p.role = ROLE_DECODE;
+            else return false;
+        }
+        else if (arg == "--numa" && (v = next())) {
+            const std::string mode = v;
+            if      (mode == "off")        p.numa = NumaMode::Off;
+            else if (mode == "replicate")  p.numa = NumaMode::Replicate;
+            else if (mode == "interleave") p.numa = NumaMode::Interleave;
+            else return false;
+        }
+        else if (arg == "--numa-nodes" && (v = next())) p.numa_nodes = std::atoi(v);
+        else if (arg == "--max-samples" && (v = next())) p.max_samples = (uint32_t)std::strtoul(v, nullptr, 10);
+        else if (arg == "--max-frames"  && (v = next())) p.max_frames  = (uint32_t)std::strtoul(v, nullptr, 10);
+        else return false;
+    }
+    return !p.model_path.empty() && p.n_workers > 0 && p.batching.max_batch > 0 &&
+           p.max_samples > 0 && p.max_frames > 0;
+}
+
+void on_signal(int) {
+    g_stop = true;
+    if (g_listen_fd >= 0) ::shutdown(g_listen_fd, SHUT_RDWR);
+}
+
+}
+
+int main(int argc, char** argv) {
+    server_params params;
+    if (!parse_args(argc, argv, params)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    auto loader = ModelLoader::open(params.model_path);
+    if (!loader) return 1;
+    NumaTopology topo = params.numa == NumaMode::Off ? NumaTopology::simulated(1)
+                      : params.numa_nodes > 0       ? NumaTopology::simulated(params.numa_nodes)
+                                                    : NumaTopology::detect();
+    std::vector<std::shared_ptr<const WeightStore>>    stores;
+    std::vector<std::shared_ptr<const QuantizerStore>> codebooks;
+    if (params.role != ROLE_DECODE) {
+        stores = numa_place_stores<WeightStore>(topo, params.numa, [&] { return loader->load_encoder(); });
+        if (stores.empty()) return 1;
+    } else {
+        codebooks = numa_place_stores<QuantizerStore>(topo, params.numa, [&] { return loader->load_quantizer(); });
+        if (codebooks.empty()) return 1;
+    }
+    std::fprintf(stderr, "encodec-server: loaded %.1f of %.1f MiB of weights\n",
+                 loader->loaded_bytes() / 1048576.0, loader->index().bytes(ENCODEC_SUB_ALL) / 1048576.0);
+
+    Server server{params, topo, stores, codebooks};
+    server.start();
+
+    g_listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, params.socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    ::unlink(params.socket_path.c_str());
+    if (g_listen_fd < 0 ||
+        ::bind(g_listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+        ::listen(g_listen_fd, 64) != 0) {
+        std::perror("encodec-server: socket");
+        server.stop();
+        return 1;
+    }
+
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+    std::signal(SIGPIPE, SIG_IGN);
+    std::fprintf(stderr, "encodec-server: listening on %s (%d workers over %d node(s), max batch %zu, max wait %lld us)\n",
+                 params.socket_path.c_str(), params.n_workers, topo.n_nodes(), params.batching.max_batch,
+                 (long long)params.batching.max_wait.count());
+
+    while (!g_stop) {
+        const int fd = ::accept(g_listen_fd, nullptr, nullptr);
+        if (fd < 0) continue;
+        server.accept_connection(fd);
+    }
+
+    ::close(g_listen_fd);
+    ::unlink(params.socket_path.c_str());
+    server.stop();
+    return 0;
+}
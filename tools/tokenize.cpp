@@ -0,0 +1,438 @@
+// encodec-tokenize: encodes a directory tree of WAV files into bit-packed
+// token shards (include/token_file.h), as a pipeline of stages joined by
+// bounded queues:
+//
+//   scan ──> work-stealing deques ──> N workers ──> writer
+//            (one per worker)         mmap, prefetch,    shards +
+//                                     resample, encode   manifest
+//
+// Workers take their own files first and steal from the busiest other
+// worker when idle, so a few long tracks do not leave the rest waiting.
+// Before encoding a file, a worker starts the kernel reading the next one
+// in its deque; it only peeks, so that file can still be stolen.
+//
+// Files are cut into --segment clips and streamed through the encoder a
+// batch at a time, so memory does not grow with track length. With -S 0
+// each file is one clip, encoded in one go; files longer than
+// --max-seconds are then skipped.
+//
+// Output, in --out:
+//   shard-NNNNN.ectk   one clip per segment (or file), up to
+//                      --shard-items clips per shard
+//   manifest.tsv       path  shard  first_item  n_items  n_frames  seconds
+//
+// Manifest lines are appended only once their shard is closed, so after an
+// interruption a rerun skips exactly the files that are safely written.
+
+#include "audio_io.h"
+#include "batcher.h"
+#include "bounded_queue.h"
+#include "encoder.h"
+#include "exec_state.h"
+#include "loader.h"
+#include "lru_cache.h"
+#include "mapped_file.h"
+#include "token_file.h"
+#include "work_stealing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace encodec;
+namespace fs = std::filesystem;
+
+namespace {
+
+struct tokenize_params {
+    std::string model_path;
+    std::string in_dir;
+    std::string out_dir;
+    int         n_workers   = 4;
+    int         n_threads   = 1;     // ggml threads per worker
+    int         sample_rate = 32000;
+    float       segment_s   = 30.0f; // 0: one clip per file
+    float       max_file_s  = 600.0f; // whole-file mode: longer files are skipped
+    int         batch       = 8;     // segments per encoder call
+    int         shard_items = 4096;
+    bool        approx_rvq  = false; // clustered codebook search (rvq_search.h)
+    int         rvq_probe   = 4;
+    float       rvq_margin  = 0.5f;
+};
+
+struct Task {
+    std::string rel;  // path under in_dir, the manifest key
+    std::string path;
+};
+
+struct Result {
+    std::string                       rel;
+    std::vector<std::vector<int32_t>> clips;   // n_frames x n_q each
+    double                            seconds = 0.0;
+};
+
+void print_usage(const char* argv0) {
+    std::fprintf(stderr,
+        "usage: %s -m MODEL -i DIR -o DIR [options]\n"
+        "  -m, --model PATH        checkpoint from scripts/convert_state_dict_to_gguf.py\n"
+        "  -i, --in DIR            directory searched recursively for .wav files\n"
+        "  -o, --out DIR           shards and manifest (created; reruns resume)\n"
+        "  -w, --workers N         concurrent encode workers (default 4)\n"
+        "  -t, --threads N         ggml threads per worker (default 1)\n"
+        "  -r, --sample-rate HZ    model sample rate (default 32000)\n"
+        "  -S, --segment S         split files into S-second clips, batched (default 30; 0: whole files)\n"
+        "      --max-seconds S     with -S 0, skip files longer than S seconds (default 600)\n"
+        "  -b, --batch N           segments per encoder call (default 8)\n"
+        "      --shard-items N     clips per shard (default 4096)\n"
+        "      --approx-rvq        approximate codebook search (clustered codebooks)\n"
+        "      --rvq-probe N       clusters always searched per stage (default 4)\n"
+        "      --rvq-margin F      0..1, 1 = always exact codes (default 0.5)\n",
+        argv0);
+}
+
+bool parse_args(int argc, char** argv, tokenize_params& p) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char* { return i + 1 < argc ? argv[++i] : nullptr; };
+        const char* v = nullptr;
+        if      ((arg == "-m" || arg == "--model")       && (v = next())) p.model_path = v;
+        else if ((arg == "-i" || arg == "--in")          && (v = next())) p.in_dir = v;
+        else if ((arg == "-o" || arg == "--out")         && (v = next())) p.out_dir = v;
+        else if ((arg == "-w" || arg == "--workers")     && (v = next())) p.n_workers = std::atoi(v);
+        else if ((arg == "-t" || arg == "--threads")     && (v = next())) p.n_threads = std::atoi(v);
+        else if ((arg == "-r" || arg == "--sample-rate") && (v = next())) p.sample_rate = std::atoi(v);
+        else if ((arg == "-S" || arg == "--segment")     && (v = next())) p.segment_s = std::atof(v);
+        else if ((arg == "-b" || arg == "--batch")       && (v = next())) p.batch = std::atoi(v);
+        else if (arg == "--max-seconds"                  && (v = next())) p.max_file_s = std::atof(v);
+        else if (arg == "--shard-items"                  && (v = next())) p.shard_items = std::atoi(v);
+        else if (arg == "--approx-rvq")                                   p.approx_rvq = true;
+        else if (arg == "--rvq-probe"                    && (v = next())) p.rvq_probe = std::atoi(v);
+        else if (arg == "--rvq-margin"                   && (v = next())) p.rvq_margin = std::atof(v);
+        else return false;
+    }
+    return !p.model_path.empty() && !p.in_dir.empty() && !p.out_dir.empty() &&
+           p.n_workers > 0 && p.n_threads > 0 && p.sample_rate > 0 &&
+           p.segment_s >= 0.0f && p.max_file_s > 0.0f && p.batch > 0 && p.shard_items > 0 &&
+           p.rvq_probe > 0 && p.rvq_margin >= 0.0f && p.rvq_margin <= 1.0f;
+}
+
+// Files already in the manifest, and the first unused shard number.
+std::set<std::string> read_manifest(const fs::path& out_dir, int& next_shard) {
+    std::set<std::string> done;
+    next_shard = 0;
+    std::ifstream f(out_dir / "manifest.tsv");
+    for (std::string line; std::getline(f, line);) {
+        const auto tab = line.find('\t');
+        if (tab != std::string::npos) done.insert(line.substr(0, tab));
+    }
+    // shards of an interrupted run are not in the manifest; never reuse them
+    for (const auto& e : fs::directory_iterator(out_dir)) {
+        const std::string name = e.path().filename().string();
+        int n = 0;
+        if (std::sscanf(name.c_str(), "shard-%d.ectk", &n) == 1) next_shard = std::max(next_shard, n + 1);
+    }
+    return done;
+}
+
+bool is_wav(const fs::path& p) {
+    std::string ext = p.extension().string();
+    for (auto& c : ext) c = (char)std::tolower((unsigned char)c);
+    return ext == ".wav";
+}
+
+class Tokenizer {
+public:
+    Tokenizer(const tokenize_params& params, std::shared_ptr<const WeightStore> store,
+              std::shared_ptr<const RvqIndex> rvq, uint64_t model_hash)
+        : params_{params}, store_{store}, rvq_{rvq}, encoder_{store, rvq},
+          tasks_{params.n_workers, 4 * (std::size_t)params.n_workers},
+          results_{2 * (std::size_t)params.n_workers} {
+        const Weights& w = store->weights();
+        meta_.n_q         = (int)w.codebooks.size();
+        meta_.card        = (int)w.codebooks[0].embed->ne[1];
+        meta_.sample_rate = params.sample_rate;
+        meta_.frame_rate  = (float)params.sample_rate / (float)(1 << w.downsample.size());
+        meta_.model_hash  = model_hash;
+    }
+
+    int run() {
+        const fs::path out_dir = params_.out_dir;
+        std::error_code ec;
+        fs::create_directories(out_dir, ec);
+        if (ec) {
+            std::fprintf(stderr, "%s: cannot create '%s': %s\n", __func__, params_.out_dir.c_str(), ec.message().c_str());
+            return 1;
+        }
+        int shard = 0;
+        const std::set<std::string> done = read_manifest(out_dir, shard);
+        if (!done.empty()) std::fprintf(stderr, "resuming: %zu files already in the manifest\n", done.size());
+
+        t0_ = Clock::now();
+        std::thread scanner([&] { scan(done); });
+        std::vector<std::thread> workers;
+        for (int i = 0; i < params_.n_workers; ++i) workers.emplace_back([this, i] { work(i); });
+        std::thread writer([&] { write(out_dir, shard); });
+
+        scanner.join();
+        for (auto& t : workers) t.join();
+        results_.close();
+        writer.join();
+
+        const double wall = std::chrono::duration<double>(Clock::now() - t0_).count();
+        std::fprintf(stderr,
+                     "done: %llu files (%llu failed), %.2f audio hours in %.1f s: %.1f audio-hours per wall-hour, %llu steals\n",
+                     (unsigned long long)n_files_.load(), (unsigned long long)n_failed_.load(),
+                     audio_s_ / 3600.0, wall, audio_s_ / std::max(wall, 1e-9),
+                     (unsigned long long)tasks_.n_steals());
+        if (rvq_) {
+            const RvqSearchStats st = rvq_->stats();
+            std::fprintf(stderr, "approximate rvq: %.1f%% of codewords scanned, %.1f%% of searches fell back\n",
+                         100.0 * st.n_scanned / std::max<uint64_t>(st.n_total, 1),
+                         100.0 * st.n_fallback / std::max<uint64_t>(st.n_searches, 1));
+        }
+        return write_failed_ ? 1 : 0;
+    }
+
+private:
+    void scan(const std::set<std::string>& done) {
+        std::error_code ec;
+        int n = 0;
+        for (fs::recursive_directory_iterator it(params_.in_dir, ec), end; !ec && it != end; it.increment(ec)) {
+            if (!it->is_regular_file() || !is_wav(it->path())) continue;
+            std::string rel = fs::relative(it->path(), params_.in_dir).generic_string();
+            if (done.count(rel)) continue;
+            tasks_.push(n++ % params_.n_workers, Task{std::move(rel), it->path().string()});
+        }
+        if (ec) std::fprintf(stderr, "%s: '%s': %s\n", __func__, params_.in_dir.c_str(), ec.message().c_str());
+        tasks_.close();
+    }
+
+    void work(int id) {
+        ExecState state{1 << 20};
+        std::string              ahead_path; // peeked and prefetched, not claimed
+        std::unique_ptr<WavFile> ahead;
+
+        while (auto cur = tasks_.pop(id)) {
+            std::unique_ptr<WavFile> wav;
+            if (ahead && ahead_path == cur->path) {
+                wav = std::move(ahead);
+            } else if ((wav = WavFile::open(cur->path))) {
+                wav->prefetch();
+            }
+            ahead.reset();
+            if (auto next = tasks_.peek(id)) {
+                ahead_path = next->path;
+                if ((ahead = WavFile::open(ahead_path))) ahead->prefetch();
+            }
+
+            const double seconds = wav ? (double)wav->info().n_frames / wav->info().sample_rate : 0.0;
+            if (!wav) {
+                ++n_failed_;
+            } else if (params_.segment_s <= 0.0f && seconds > params_.max_file_s) {
+                std::fprintf(stderr, "%s: '%s': %.0f s is over --max-seconds, skipped\n", __func__,
+                             cur->path.c_str(), seconds);
+                ++n_failed_;
+            } else {
+                Result r;
+                r.rel     = cur->rel;
+                r.seconds = seconds;
+                if (params_.segment_s > 0.0f) encode_segments(state, *wav, r);
+                else                          encode_file(state, *wav, r);
+                results_.push(std::move(r));
+            }
+        }
+    }
+
+    // One clip: resampled straight into the encoder's input tensor.
+    void encode_file(ExecState& state, const WavFile& wav, Result& r) {
+        const int64_t n = wav_samples(wav, params_.sample_rate);
+        state.reset();
+        state.reserve(encoder_.arena_size(n, 1, params_.n_threads));
+        Tensor* input = load_wav(state.ctx(), wav, params_.sample_rate);
+        Tensor* codes = encoder_(state, input, params_.n_threads); // [T', n_q]
+        r.clips.push_back(frame_major(codes, 0, codes->ne[0]));
+    }
+
+    // Fixed-length clips, batch at a time; the last one is zero-padded
+    // for encoding and cut back to its own frames. Audio is read only a
+    // batch ahead, so a long track costs no more memory than a short one.
+    void encode_segments(ExecState& state, const WavFile& wav, Result& r) {
+        const int64_t seg = (int64_t)(params_.segment_s * params_.sample_rate);
+        AudioReader reader{wav, params_.sample_rate};
+        const int64_t total = reader.n_samples();
+        std::vector<float> chunk((std::size_t)reader.max_chunk());
+        std::vector<float> audio; // read, not yet encoded
+
+        const int64_t n_seg = (total + seg - 1) / seg;
+        for (int64_t s0 = 0; s0 < n_seg; s0 += params_.batch) {
+            const int64_t B    = std::min<int64_t>(params_.batch, n_seg - s0);
+            const int64_t want = std::min(B * seg, total - s0 * seg);
+            for (int64_t got; (int64_t)audio.size() < want && (got = reader.read(chunk.data())) > 0;) {
+                audio.insert(audio.end(), chunk.begin(), chunk.begin() + got);
+            }
+            const int64_t have = std::min<int64_t>(want, (int64_t)audio.size());
+
+            state.reset();
+            state.reserve(arena_size(seg, B));
+            Tensor* input = ggml_new_tensor_3d(state.ctx(), GGML_TYPE_F32, seg, 1, B);
+            for (int64_t b = 0; b < B; ++b) {
+                const int64_t from = b * seg, n = std::clamp<int64_t>(have - from, 0, seg);
+                float* dst = (float*)((char*)input->data + b * input->nb[2]);
+                std::copy(audio.begin() + from, audio.begin() + from + n, dst);
+                std::fill(dst + n, dst + seg, 0.0f);
+            }
+            Tensor* codes = encoder_(state, input, params_.n_threads); // [T', n_q, B]
+            for (int64_t b = 0; b < B; ++b) {
+                const int64_t n = std::clamp<int64_t>(have - b * seg, 0, seg);
+                const int64_t T = (n * codes->ne[0] + seg - 1) / seg;
+                if (T > 0) r.clips.push_back(frame_major(codes, b, T));
+            }
+            audio.erase(audio.begin(), audio.begin() + have);
+        }
+    }
+
+    std::size_t arena_size(int64_t n_samples, int64_t batch) {
+        std::lock_guard<std::mutex> lk(arena_mu_);
+        auto it = arena_sizes_.find({n_samples, batch});
+        if (it == arena_sizes_.end()) {
+            it = arena_sizes_.emplace(std::make_pair(n_samples, batch), encoder_.arena_size(n_samples, batch, params_.n_threads)).first;
+        }
+        return it->second;
+    }
+
+    // The first T frames of batch item b of a [T', n_q, B] codes tensor.
+    static std::vector<int32_t> frame_major(const Tensor* codes, int64_t b, int64_t T) {
+        const int64_t n_q = codes->ne[1];
+        std::vector<int32_t> out((std::size_t)(T * n_q));
+        const char* base = (const char*)codes->data + b * codes->nb[2];
+        for (int64_t k = 0; k < n_q; ++k) {
+            const int32_t* row = (const int32_t*)(base + k * codes->nb[1]);
+            for (int64_t t = 0; t < T; ++t) out[t * n_q + k] = row[t];
+        }
+        return out;
+    }
+
+    void write(const fs::path& out_dir, int shard) {
+        std::FILE* manifest = std::fopen((out_dir / "manifest.tsv").string().c_str(), "a");
+        if (!manifest) {
+            std::fprintf(stderr, "%s: cannot append to the manifest\n", __func__);
+            write_failed_ = true;
+        }
+
+        std::unique_ptr<TokenWriter> tw;
+        std::string pending;     // manifest lines of the open shard
+        int         n_items = 0; // clips in the open shard
+        auto close_shard = [&] {
+            if (!tw) return;
+            if (tw->close() && manifest) {
+                std::fputs(pending.c_str(), manifest);
+                std::fflush(manifest);
+            } else {
+                write_failed_ = true;
+            }
+            tw.reset();
+            pending.clear();
+            n_items = 0;
+            ++shard;
+        };
+
+        auto last_report = Clock::now();
+        while (auto r = results_.pop()) {
+            if (!tw) {
+                char name[32];
+                std::snprintf(name, sizeof(name), "shard-%05d.ectk", shard);
+                tw = std::make_unique<TokenWriter>((out_dir / name).string(), meta_);
+            }
+            int64_t n_frames = 0;
+            for (const auto& clip : r->clips) {
+                tw->add(clip.data(), (int64_t)(clip.size() / meta_.n_q));
+                n_frames += (int64_t)(clip.size() / meta_.n_q);
+            }
+            std::ostringstream line;
+            line << r->rel << '\t' << shard << '\t' << n_items << '\t' << r->clips.size() << '\t'
+                 << n_frames << '\t' << r->seconds << '\n';
+            pending += line.str();
+            n_items += (int)r->clips.size();
+            audio_s_ += r->seconds;
+            ++n_files_;
+            if (n_items >= params_.shard_items) close_shard();
+
+            if (Clock::now() - last_report > std::chrono::seconds(10)) {
+                last_report = Clock::now();
+                const double wall = std::chrono::duration<double>(last_report - t0_).count();
+                std::fprintf(stderr, "%llu files, %.2f audio hours, %.1f audio-hours per wall-hour\n",
+                             (unsigned long long)n_files_.load(), audio_s_ / 3600.0, audio_s_ / wall);
+            }
+        }
+        close_shard();
+        if (manifest) std::fclose(manifest);
+    }
+
+    tokenize_params                    params_;
+    std::shared_ptr<const WeightStore> store_;
+    std::shared_ptr<const RvqIndex>    rvq_;
+    Encoder                            encoder_;
+    TokenFileMeta                      meta_;
+    WorkStealingQueues<Task>           tasks_;
+    BoundedQueue<Result>               results_;
+
+    std::mutex                                        arena_mu_;
+    std::map<std::pair<int64_t, int64_t>, std::size_t> arena_sizes_;
+
+    Clock::time_point     t0_;
+    std::atomic<uint64_t> n_files_{0};
+    std::atomic<uint64_t> n_failed_{0};
+    double                audio_s_      = 0.0;   // writer thread
+    bool                  write_failed_ = false; // writer thread, read after join
+};
+
+}
+
+int main(int argc, char** argv) {
+    tokenize_params params;
+    if (!parse_args(argc, argv, params)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    encodec_model model{};
+    Weights       weights;
+    if (!encodec_model_load(params.model_path, model, ENCODEC_SUB_ENCODER | ENCODEC_SUB_QUANTIZER) || !encodec_encoder_weights(model, weights)) {
+        return 1;
+    }
+    uint64_t model_hash = 0;
+    if (auto file = MappedFile::open(params.model_path)) {
+        model_hash = musicgen::hash_bytes(file->data(), file->size());
+    }
+    auto store = std::make_shared<const WeightStore>(model.ctx, std::move(weights));
+
+    std::shared_ptr<const RvqIndex> rvq;
+    if (params.approx_rvq) {
+        quantizer q;
+        for (const auto& cb : store->weights().codebooks) q.blocks.push_back({cb.embed});
+        RvqSearchConfig cfg;
+        cfg.n_probe = params.rvq_probe;
+        cfg.margin  = params.rvq_margin;
+        rvq = RvqIndex::build(q, cfg);
+    }
+
+    Tokenizer tok{params, store, rvq, model_hash};
+    return tok.run();
+}